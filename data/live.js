@@ -0,0 +1,67 @@
+// Live view for index.html. Counts and raw distances from the counter's
+// WebSocket at /live. See lib/digameLive/digameLive.h for the messages.
+
+const plotSeconds = 10;   // Width of the plot.
+const plotMaxCm   = 1200; // Top of the plot.
+
+let socket  = null;
+let samples = []; // [ms, dist1, dist2, state]
+
+function connect() {
+  socket = new WebSocket("ws://" + location.host + "/live");
+
+  socket.onopen = () => {
+    document.getElementById("status").textContent = "";
+    socket.send("rate " + document.getElementById("rate").value);
+  };
+
+  socket.onclose = () => {
+    document.getElementById("status").textContent = "Disconnected. Retrying...";
+    setTimeout(connect, 2000);
+  };
+
+  socket.onmessage = (event) => {
+    const msg = JSON.parse(event.data);
+    if (msg.type === "counts") {
+      document.getElementById("in").textContent  = msg.in;
+      document.getElementById("out").textContent = msg.out;
+    } else if (msg.type === "raw") {
+      samples = samples.concat(msg.samples);
+      const newest = samples[samples.length - 1][0];
+      samples = samples.filter((s) => newest - s[0] <= plotSeconds * 1000);
+      document.getElementById("status").textContent = msg.dropped ? "Slow link: some data skipped." : "";
+      draw();
+    }
+  };
+}
+
+function draw() {
+  const canvas = document.getElementById("plot");
+  const ctx    = canvas.getContext("2d");
+  const w = canvas.width, h = canvas.height;
+
+  ctx.clearRect(0, 0, w, h);
+  if (samples.length === 0) return;
+
+  const newest = samples[samples.length - 1][0];
+  const x = (ms) => w - (newest - ms) * w / (plotSeconds * 1000);
+  const y = (cm) => h - Math.min(Math.max(cm, 0), plotMaxCm) * h / plotMaxCm;
+
+  // Shade the frames where someone was seen.
+  ctx.fillStyle = "#f4d4d8";
+  samples.forEach((s) => { if (s[3]) ctx.fillRect(x(s[0]) - 1, 0, 2, h); });
+
+  [[1, "#ac0014"], [2, "#333333"]].forEach(([column, colour]) => {
+    ctx.strokeStyle = colour;
+    ctx.beginPath();
+    samples.forEach((s, i) => (i ? ctx.lineTo : ctx.moveTo).call(ctx, x(s[0]), y(s[column])));
+    ctx.stroke();
+  });
+}
+
+document.getElementById("rate").onchange = (event) => {
+  samples = [];
+  if (socket && socket.readyState === WebSocket.OPEN) socket.send("rate " + event.target.value);
+};
+
+connect();
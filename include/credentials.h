@@ -3,3 +3,5 @@ String netPassword="billgates";
 String serverURL = "http://199.21.201.53/trailwaze/zion/lidar_sensor_import.php";
 String testServerURL = "http://192.168.4.1/post";
 String testNetPassword;
+String mqttBroker = "";  // MQTT broker host name or IP. Leave empty for no MQTT.
+String ntpServer = "pool.ntp.org"; // SNTP server for event timestamps. Empty for none.
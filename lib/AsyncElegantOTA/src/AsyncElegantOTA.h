@@ -24,16 +24,37 @@
 #include "FS.h"
 
 #include "elegantWebpage.h"
+#include "MD5Builder.h"
+#include <new>
+#include <digameInflate.h> // .bin.gz uploads, from tools/compress_firmware.py.
+#include <digameDelta.h>   // Patches, from tools/make_delta.py.
+#include <digameSha256.h>  // On the ESP32's SHA engine.
+#if defined(ESP32)
+    #include <digameFlashScheduler.h> // Flash writes from the loop, between LIDAR frames.
+#endif
 
 
 class AsyncElegantOtaClass{
 
     public:
 
+        #if defined(ESP32)
+            // The loop has to call flash.service() after each LIDAR read,
+            // or uploads are written from the web task as they arrive.
+            OtaFlashWriter flash;
+        #endif
+
         void setID(const char* id){
             _id = id;
         }
 
+        // Called from the web task before a filesystem upload is written. It
+        // has to stop everything writing the file system and unmount it, and
+        // returns false if it couldn't. The counter restarts after the upload.
+        void onFilesystemUpload(bool (*release)()){
+            _releaseFilesystem = release;
+        }
+
         void begin(AsyncWebServer *server, const char* username = "", const char* password = ""){
             _server = server;
 
@@ -66,8 +87,28 @@ class AsyncElegantOtaClass{
                         return request->requestAuthentication();
                     }
                 }
-                AsyncWebServerResponse *response = request->beginResponse_P(200, "text/html", ELEGANT_HTML, ELEGANT_HTML_SIZE);
-                response->addHeader("Content-Encoding", "gzip");
+                // The page is a fixed part of the firmware, so its ETag only
+                // needs working out once. Revalidation then costs a 304.
+                static String etag;
+                if(etag.length() == 0){
+                    uint32_t hash = 2166136261UL; // FNV-1a
+                    for(uint32_t i = 0; i < ELEGANT_HTML_SIZE; i++){
+                        hash = (hash ^ pgm_read_byte(ELEGANT_HTML + i)) * 16777619UL;
+                    }
+                    char text[24];
+                    snprintf(text, sizeof(text), "\"%08x-%x\"", (unsigned)hash, (unsigned)ELEGANT_HTML_SIZE);
+                    etag = text;
+                }
+
+                AsyncWebServerResponse *response;
+                if(request->hasHeader("If-None-Match") && request->header("If-None-Match") == etag){
+                    response = request->beginResponse(304);
+                }else{
+                    response = request->beginResponse_P(200, "text/html", ELEGANT_HTML, ELEGANT_HTML_SIZE);
+                    response->addHeader("Content-Encoding", "gzip");
+                }
+                response->addHeader("ETag", etag);
+                response->addHeader("Cache-Control", "no-cache");
                 request->send(response);
             });
 
@@ -79,9 +120,12 @@ class AsyncElegantOtaClass{
                 }
                 // the request handler is triggered after the upload has finished... 
                 // create the response, add header, and send response
-                AsyncWebServerResponse *response = request->beginResponse((Update.hasError())?500:200, "text/plain", (Update.hasError())?"FAIL":"OK");
+                AsyncWebServerResponse *response = request->beginResponse((updateFailed())?500:200, "text/plain", (updateFailed())?"FAIL":"OK");
                 response->addHeader("Connection", "close");
                 response->addHeader("Access-Control-Allow-Origin", "*");
+                #if defined(ESP32)
+                    response->addHeader("X-Frames-Missed", String(flash.scheduler.lastUpdateMissed()));
+                #endif
                 request->send(response);
                 restart();
             }, [&](AsyncWebServerRequest *request, String filename, size_t index, uint8_t *data, size_t len, bool final) {
@@ -93,11 +137,38 @@ class AsyncElegantOtaClass{
                 }
 
                 if (!index) {
-                    if(!request->hasParam("MD5", true)) {
+                    endUpload();
+                    _uploadFailed = false;
+                    _flashed = false;
+                    // The page sends an MD5. tools/ send a SHA-256 too, which
+                    // is used instead: it's stronger, and quicker on the engine.
+                    _expectedSHA256 = request->hasParam("SHA256", true) ? request->getParam("SHA256", true)->value() : String();
+                    if(!request->hasParam("MD5", true) && (_expectedSHA256.length() == 0)) {
                         return request->send(400, "text/plain", "MD5 parameter missing");
                     }
 
-                    if(!Update.setMD5(request->getParam("MD5", true)->value().c_str())) {
+                    // The hash is of the file sent. For a compressed image or
+                    // a patch that isn't what lands in flash, so we check it
+                    // against what arrives, and what we write by the gzip CRC
+                    // and the SHA-256s that come with it.
+                    _toFirmware = (filename != "filesystem");
+                    #if defined(ESP32)
+                        _checkUpload = true; // Update isn't writing it, so we check it all.
+                    #else
+                        _checkUpload = GzipInflater::isGzip(data, len) || DeltaPatcher::isDelta(data, len) ||
+                                       (_expectedSHA256.length() > 0);
+                    #endif
+                    if(_checkUpload){
+                        if(_expectedSHA256.length()){
+                            _uploadSha.begin(); // First, so it gets the engine.
+                        }else{
+                            _expectedMD5 = request->getParam("MD5", true)->value();
+                            _uploadMD5.begin();
+                        }
+                        if(GzipInflater::isGzip(data, len) && !beginGzip()){
+                            return request->send(500, "text/plain", "Not enough memory to decompress");
+                        }
+                    }else if(!Update.setMD5(request->getParam("MD5", true)->value().c_str())) {
                         return request->send(400, "text/plain", "MD5 parameter invalid");
                     }
 
@@ -107,30 +178,54 @@ class AsyncElegantOtaClass{
                         size_t fsSize = ((size_t) &_FS_end - (size_t) &_FS_start);
                         uint32_t maxSketchSpace = (ESP.getFreeSketchSpace() - 0x1000) & 0xFFFFF000;
                         if (!Update.begin((cmd == U_FS)?fsSize:maxSketchSpace, cmd)){ // Start with max available size
+                            Update.printError(Serial);
+                            return request->send(400, "text/plain", "OTA could not begin");
+                        }
                     #elif defined(ESP32)
-                        int cmd = (filename == "filesystem") ? U_SPIFFS : U_FLASH;
-                        if (!Update.begin(UPDATE_SIZE_UNKNOWN, cmd)) { // Start with max available size
+                        if(!_toFirmware && _releaseFilesystem && !_releaseFilesystem()){
+                            _uploadFailed = true; // Still mounted and in use: don't write under it.
+                            endUpload();
+                            return request->send(503, "text/plain", "File system is busy");
+                        }
+                        // The loop writes it to flash, between LIDAR frames.
+                        const char *problem = flash.begin(_toFirmware);
+                        if(problem){
+                            _uploadFailed = true;
+                            endUpload();
+                            return request->send(400, "text/plain", problem);
+                        }
+                        request->onDisconnect([this](){ flash.abort(); }); // Once it's written, this does nothing.
                     #endif
-                        Update.printError(Serial);
-                        return request->send(400, "text/plain", "OTA could not begin");
-                    }
+                }
+
+                if(_uploadFailed){
+                    return; // Already answered. Let the rest go by.
                 }
 
                 // Write chunked data to the free sketch space
-                if(len){
+                if(_checkUpload){
+                    const char *problem = writeUpload(data, len, final);
+                    if(problem){
+                        _uploadFailed = true;
+                        #if defined(ESP32)
+                            flash.abort();
+                        #endif
+                        return request->send(400, "text/plain", problem);
+                    }
+                }else if(len){
                     if (Update.write(data, len) != len) {
                         return request->send(400, "text/plain", "OTA could not begin");
                     }
                 }
                     
-                if (final) { // if the final flag is set then this is the last frame of data
-                    if (!Update.end(true)) { //true to set the size to the current progress
-                        Update.printError(Serial);
-                        return request->send(400, "text/plain", "Could not end OTA");
+                #if defined(ESP8266) // The ESP32 finished in writeUpload().
+                    if (final) { // if the final flag is set then this is the last frame of data
+                        if (!Update.end(true)) { //true to set the size to the current progress
+                            Update.printError(Serial);
+                            return request->send(400, "text/plain", "Could not end OTA");
+                        }
                     }
-                }else{
-                    return;
-                }
+                #endif
             });
         }
 
@@ -148,6 +243,187 @@ class AsyncElegantOtaClass{
     private:
         AsyncWebServer *_server;
 
+        // A compressed upload or a patch in progress.
+        bool _checkUpload = false;
+        bool _toFirmware = true;
+        bool _uploadFailed = false;
+        bool _flashed = false; // Written, checked and ready to boot.
+        bool (*_releaseFilesystem)() = nullptr;
+        MD5Builder _uploadMD5;
+        String _expectedMD5;
+        Sha256 _uploadSha;
+        String _expectedSHA256; // Checked instead of the MD5 when there is one.
+        Sha256 _imageSha;       // What comes out of the inflater.
+        const char *_problem = nullptr;
+        GzipInflater *_inflater = nullptr;
+        uint32_t _imageBytes = 0; // Out of the inflater, if there is one.
+        #if defined(ESP32)
+            DeltaPatcher *_patcher = nullptr;
+            OtaDeltaTarget _deltaTarget{writePatched, this};
+        #endif
+
+        bool updateFailed(){
+            #if defined(ESP32)
+                return _uploadFailed || !_flashed;
+            #else
+                return Update.hasError();
+            #endif
+        }
+
+        bool beginGzip(){
+            _inflater = new (std::nothrow) GzipInflater(writeDecompressed, this);
+            if(!_inflater){
+                return false;
+            }
+            _imageSha.begin();
+            return true;
+        }
+
+        void endUpload(){
+            if(_inflater){
+                delete _inflater;
+                _inflater = nullptr;
+            }
+            _uploadSha.begin(); // Lets go of the SHA engine, if it was left unfinished.
+            _imageSha.begin();
+            #if defined(ESP32)
+                delete _patcher;
+                _patcher = nullptr;
+            #endif
+            _problem = nullptr;
+            _imageBytes = 0;
+        }
+
+        static bool writeDecompressed(void *context, const uint8_t *data, size_t length){
+            AsyncElegantOtaClass *self = (AsyncElegantOtaClass *)context;
+            self->_imageSha.update(data, length);
+            return self->writeImage(data, length);
+        }
+
+        // An image, or a patch to make one, on its way to flash.
+        bool writeImage(const uint8_t *data, size_t length){
+            #if defined(ESP32)
+                if((_imageBytes == 0) && DeltaPatcher::isDelta(data, length)){
+                    if(!_toFirmware){
+                        _problem = "Patches are for firmware only";
+                        return false;
+                    }
+                    _patcher = new (std::nothrow) DeltaPatcher(_deltaTarget);
+                    if(!_patcher){
+                        _problem = "Not enough memory to patch";
+                        return false;
+                    }
+                }
+                if(_patcher){
+                    _imageBytes += length;
+                    // A COPY comes out a slice per write(). Flash takes it as fast as
+                    // the loop can write it, so tell the network task's watchdog we're
+                    // still getting on between slices.
+                    while(length || _patcher->copying()){
+                        if(_patcher->write(data, length) == PATCH_ERROR){
+                            _problem = _problem ? _problem : _patcher->error(); // Flash's reason first.
+                            return false;
+                        }
+                        data += _patcher->used();
+                        length -= _patcher->used();
+                        esp_task_wdt_reset();
+                    }
+                    return true;
+                }
+            #endif
+            _imageBytes += length;
+            return writeFlash(data, length);
+        }
+
+        bool writeFlash(const uint8_t *data, size_t length){
+            #if defined(ESP32)
+                _problem = flash.push(data, length);
+                return _problem == nullptr;
+            #else
+                if(Update.write((uint8_t *)data, length) != length){
+                    _problem = "Couldn't write to flash";
+                    return false;
+                }
+                return true;
+            #endif
+        }
+
+        #if defined(ESP32)
+            static bool writePatched(void *context, const uint8_t *data, size_t length){
+                return ((AsyncElegantOtaClass *)context)->writeFlash(data, length);
+            }
+        #endif
+
+        // Returns what's wrong, or nullptr. The messages are all literals, so
+        // they outlive the inflater and patcher.
+        const char *writeUpload(uint8_t *data, size_t len, bool final){
+            if(_expectedSHA256.length()){
+                _uploadSha.update(data, len);
+            }else{
+                _uploadMD5.add(data, len);
+            }
+            if(_inflater){
+                if((_inflater->write(data, len) == INFLATE_ERROR) || (final && (_inflater->finish() != INFLATE_DONE))){
+                    return failUpload(_problem ? _problem : _inflater->error()); // The sink's reason first.
+                }
+            }else if(len && !writeImage(data, len)){
+                return failUpload(_problem);
+            }
+            if(!final){
+                return nullptr;
+            }
+
+            uint8_t digest[SHA256_LENGTH];
+            if(_expectedSHA256.length()){
+                _uploadSha.finish(digest);
+                if(!sha256MatchesHex(digest, _expectedSHA256.c_str())){
+                    return failUpload("SHA-256 of upload doesn't match");
+                }
+            }else{
+                _uploadMD5.calculate();
+                if(!_expectedMD5.equalsIgnoreCase(_uploadMD5.toString())){
+                    return failUpload("MD5 of upload doesn't match");
+                }
+            }
+            // "sha256=<hex>" if compress_firmware.py made it.
+            const char *expected = _inflater ? strstr(_inflater->comment(), "sha256=") : nullptr;
+            if(expected){
+                _imageSha.finish(digest);
+                if(!sha256MatchesHex(digest, expected + 7)){
+                    return failUpload("SHA-256 of decompressed upload doesn't match");
+                }
+            }
+            #if defined(ESP32)
+                if(_patcher){
+                    if(_patcher->finish() != PATCH_DONE){
+                        return failUpload(_patcher->error());
+                    }
+                    if(!_deltaTarget.verify()){
+                        return failUpload("SHA-256 of patched image doesn't match");
+                    }
+                    Serial.printf("OTA: patched %u bytes, %u from the running image\n",
+                                  (unsigned)_patcher->outputLength(), (unsigned)_patcher->copiedLength());
+                }
+                const char *flashProblem = flash.end();
+                if(flashProblem){
+                    return failUpload(flashProblem);
+                }
+                _flashed = true;
+            #endif
+            if(_inflater){
+                Serial.printf("OTA: %u bytes decompressed to %u\n", (unsigned)_inflater->inputLength(),
+                              (unsigned)_inflater->outputLength());
+            }
+            endUpload();
+            return nullptr;
+        }
+
+        const char *failUpload(const char *problem){
+            Serial.printf("OTA: %s\n", problem);
+            endUpload();
+            return problem;
+        }
+
         String getID(){
             String id = "";
             #if defined(ESP8266)
@@ -3,12 +3,24 @@
                           // https://github.com/budryerson/TFMini-Plus
 
 #include <DualLIDAR.h> 
+#include <math.h>
 
 
 #define tfMiniUART_1 Serial1
 #define tfMiniUART_2 Serial2
 
-DualLIDAR::DualLIDAR(){}
+DualLIDAR::DualLIDAR()
+{
+  for (int i = 0; i < 2; i++) {
+    frames[i]         = 0;
+    checksumErrors[i] = 0;
+    readErrors[i]     = 0;
+    framesMissed[i]   = 0;
+  }
+  rateChanges     = 0;
+  rateRetries     = 0;
+  rateChangesLost = 0;
+}
 DualLIDAR::~DualLIDAR(){}
 
 
@@ -53,21 +65,41 @@ bool DualLIDAR::getRanges( int16_t &dist1, int16_t &dist2)
 {
   int16_t tfDist = 0;    // Distance to object in centimeters
   int16_t tfFlux = 0;    // Strength or quality of return signal
-  int16_t tfTemp = 0;    // Internal temperature of Lidar sensor chip
   
-  // Read the LIDAR Sensor
-  if( tfmP_1.getData( tfDist, tfFlux, tfTemp)) { 
+  // Read both LIDAR Sensors, even if the first fails, so each one's counts are right
+  // and neither falls behind on its serial buffer.
+  bool good1 = (readFrame(tfMiniUART_1, 0, tfDist, tfFlux) == LIDAR_OK);
+  if (good1) { 
     dist1 = tfDist;
-  } else { return false; }
+    rawDist1 = tfDist;
+    rawFlux1 = tfFlux;
+  }
  
-  if( tfmP_2.getData( tfDist, tfFlux, tfTemp)) { 
+  bool good2 = (readFrame(tfMiniUART_2, 1, tfDist, tfFlux) == LIDAR_OK);
+  if (good2) { 
     dist2 = tfDist;
-  } else { return false; }
+    rawDist2 = tfDist;
+    rawFlux2 = tfFlux;
+  }
+
+  // Replies come in among the frames just read. Still none: send the rate again.
+  if (frameRatePending() && (millis() - rateSentMs > LIDAR_REPLY_TIMEOUT_MS)) {
+    if (rateTries < LIDAR_REPLY_TRIES) {
+      rateRetries = rateRetries + 1;
+      sendFrameRate();
+    } else {
+      rateChangesLost = rateChangesLost + 1;
+      DEBUG_PRINTLN("  LIDAR frame rate not acknowledged.");
+      for (int i = 0; i < 2; i++) replyWanted[i] = false;
+    }
+  }
+
+  if (!(good1 && good2)) return false;
 
-  smoothedDist1 = smoothedDist1 * smoothingFactor + (float)dist1 * (1-smoothingFactor);
+  smoothedDist1 = smoothedDist1 * frameSmoothing + (float)dist1 * (1-frameSmoothing);
   dist1 = smoothedDist1;
 
-  smoothedDist2 = smoothedDist2 * smoothingFactor + (float)dist2 * (1-smoothingFactor);
+  smoothedDist2 = smoothedDist2 * frameSmoothing + (float)dist2 * (1-frameSmoothing);
   dist2 = smoothedDist2;
 
   visibility = 0; 
@@ -100,6 +132,7 @@ void DualLIDAR::getZone(int &zMin, int &zMax)
 void DualLIDAR::setSmoothingFactor(float newSmoothingFactor)
 {
   smoothingFactor = newSmoothingFactor;
+  frameSmoothing  = powf(smoothingFactor, (float)LIDAR_FULL_RATE / frameRate);
 }
 
 float DualLIDAR::getSmoothingFactor()
@@ -112,6 +145,155 @@ int DualLIDAR::getVisibility()
   return visibility;
 }
 
+int DualLIDAR::getRawVisibility()
+{
+  return (((rawDist1 >= zoneMin) && (rawDist1 <= zoneMax)) ? SENSOR1 : 0) +
+         (((rawDist2 >= zoneMin) && (rawDist2 <= zoneMax)) ? SENSOR2 : 0);
+}
+
+
+//****************************************************************************************
+void DualLIDAR::setFrameRate(uint16_t hz)
+//****************************************************************************************
+{
+  if ((hz == 0) || (hz == frameRate)) return; // 0 is trigger mode. Not for us.
+
+  for (int i = 0; i < 2; i++) gapRate[i] = (hz < frameRate) ? hz : frameRate;
+  frameRate = hz;
+  rateTries = 0;
+  sendFrameRate();
+  setSmoothingFactor(smoothingFactor);
+}
+
+uint16_t DualLIDAR::getFrameRate()
+{
+  return frameRate;
+}
+
+bool DualLIDAR::frameRatePending()
+{
+  return replyWanted[0] || replyWanted[1];
+}
+
+//****************************************************************************************
+// TFMini-Plus SET_FRAME_RATE, written without waiting. Not saved to the sensors' flash:
+// they wake up at 100 Hz, as initLIDAR() expects.
+void DualLIDAR::sendFrameRate()
+//****************************************************************************************
+{
+  uint8_t command[LIDAR_REPLY_BYTES] = { 0x5A, 0x06, 0x03, (uint8_t)frameRate, (uint8_t)(frameRate >> 8), 0 };
+  for (int i = 0; i < LIDAR_REPLY_BYTES - 1; i++) command[LIDAR_REPLY_BYTES - 1] += command[i];
+
+  tfMiniUART_1.write(command, sizeof(command));
+  tfMiniUART_2.write(command, sizeof(command));
+  for (int i = 0; i < 2; i++) {
+    replyWanted[i]  = true;
+    replyMatched[i] = 0;
+  }
+  rateSentMs = millis();
+  rateTries++;
+}
+
+//****************************************************************************************
+// Every byte read goes past here. The reply echoes the command, checksum aside.
+void DualLIDAR::watchReply(int sensor, uint8_t b)
+//****************************************************************************************
+{
+  if (!replyWanted[sensor]) return;
+
+  const uint8_t expected[LIDAR_REPLY_BYTES - 1] = { 0x5A, 0x06, 0x03, (uint8_t)frameRate, (uint8_t)(frameRate >> 8) };
+  if (b == expected[replyMatched[sensor]]) {
+    replyMatched[sensor]++;
+  } else {
+    replyMatched[sensor] = (b == expected[0]) ? 1 : 0;
+  }
+  if (replyMatched[sensor] < sizeof(expected)) return;
+
+  replyWanted[sensor] = false;
+  if (!frameRatePending()) rateChanges = rateChanges + 1;
+}
+
+//****************************************************************************************
+// The newest data frame from a sensor, as TFMPlus::getData() reads them: anything older
+// is dropped, and bytes are shifted in until the frame starts with its header. Any
+// reply to a command goes by on the way, and watchReply() sees it.
+int DualLIDAR::readFrame(Stream &port, int sensor, int16_t &dist, int16_t &flux)
+//****************************************************************************************
+{
+  uint8_t  frame[LIDAR_FRAME_BYTES] = {0};
+  uint32_t started = millis();
+  int      result  = LIDAR_OK;
+
+  while (port.available() > LIDAR_FRAME_BYTES) watchReply(sensor, port.read());
+
+  while ((frame[0] != 0x59) || (frame[1] != 0x59)) {
+    if (port.available()) {
+      memmove(frame, frame + 1, LIDAR_FRAME_BYTES - 1);
+      frame[LIDAR_FRAME_BYTES - 1] = port.read();
+      watchReply(sensor, frame[LIDAR_FRAME_BYTES - 1]);
+    } else if (millis() - started > LIDAR_READ_TIMEOUT_MS) {
+      countRead(sensor, LIDAR_NO_FRAME);
+      return LIDAR_NO_FRAME;
+    }
+  }
+
+  uint8_t sum = 0;
+  for (int i = 0; i < LIDAR_FRAME_BYTES - 1; i++) sum += frame[i];
+  dist = (int16_t)(frame[2] | (frame[3] << 8));
+  flux = (int16_t)(frame[4] | (frame[5] << 8));
+
+  if (sum != frame[LIDAR_FRAME_BYTES - 1]) {
+    result = LIDAR_CHECKSUM;
+  } else if ((dist == -1) || (flux == -1) || (dist == -4)) {
+    result = LIDAR_ABNORMAL;
+  }
+  countRead(sensor, result);
+  return result;
+}
+
+bool DualLIDAR::framesReady()
+{
+  return (tfMiniUART_1.available() >= LIDAR_FRAME_BYTES) && (tfMiniUART_2.available() >= LIDAR_FRAME_BYTES);
+}
+
+void DualLIDAR::getRawFrame(int16_t &dist1, int16_t &flux1, int16_t &dist2, int16_t &flux2)
+{
+  dist1 = rawDist1;
+  flux1 = rawFlux1;
+  dist2 = rawDist2;
+  flux2 = rawFlux2;
+}
+
+
+//****************************************************************************************
+void DualLIDAR::countRead(int sensor, int result)
+//****************************************************************************************
+{
+  if (result == LIDAR_NO_FRAME) {
+    readErrors[sensor] = readErrors[sensor] + 1;
+    return;
+  }
+
+  // A frame came in, good or not. Any gap longer than a frame and a half is frames that
+  // went by unread: the loop was busy, or a sensor skipped some.
+  uint32_t now    = micros();
+  uint32_t period = 1000000UL / gapRate[sensor];
+  uint32_t gap    = now - lastFrameUs[sensor];
+  if (lastFrameUs[sensor] && (gap > period + period / 2)) {
+    framesMissed[sensor] = framesMissed[sensor] + (gap + period / 2) / period - 1;
+  }
+  lastFrameUs[sensor] = now;
+  if (!replyWanted[sensor]) gapRate[sensor] = frameRate; // The change is done.
+
+  if (result == LIDAR_OK) {
+    frames[sensor] = frames[sensor] + 1;
+  } else if (result == LIDAR_CHECKSUM) {
+    checksumErrors[sensor] = checksumErrors[sensor] + 1;
+  } else {
+    readErrors[sensor] = readErrors[sensor] + 1;
+  }
+}
+
 
 //**************************************************************************************** 
 void DualLIDAR::initLIDAR(TFMPlus &tfmP, int port) // Initialize a LIDAR sensor on a 
@@ -3,6 +3,7 @@
 
 
 #include <digameDebug.h>  // debug defines
+#include <digameMetrics.h> // Lock-free counters for /metrics
 #include <TFMPlus.h>      // Include TFMini Plus LIDAR Library v1.5.0
                           // https://github.com/budryerson/TFMini-Plus
 
@@ -11,6 +12,18 @@
 #define SENSOR2 2 
 #define BOTH    3
 
+#define LIDAR_FULL_RATE   100 // Frames per second. The smoothing factor is per frame at this rate.
+#define LIDAR_FRAME_BYTES 9
+#define LIDAR_REPLY_BYTES 6    // The sensors' reply to a frame rate command.
+#define LIDAR_READ_TIMEOUT_MS  1000
+#define LIDAR_REPLY_TIMEOUT_MS 100 // Send the frame rate again if it isn't answered by then...
+#define LIDAR_REPLY_TRIES      3   // ...this many times in all.
+
+#define LIDAR_OK       0 // readFrame() results.
+#define LIDAR_NO_FRAME 1
+#define LIDAR_CHECKSUM 2
+#define LIDAR_ABNORMAL 3 // Too weak, saturated or flooded with light.
+
 class DualLIDAR{
 
   public: 
@@ -20,6 +33,16 @@ class DualLIDAR{
     uint8_t version[3]; // FW version
     uint8_t status;     // Error status
 
+    // Per sensor: [0] is sensor 1. Written by getRanges() only, so other
+    // tasks can read them without a lock.
+    MetricCounter frames[2];         // Good frames.
+    MetricCounter checksumErrors[2]; // Frames that failed their checksum...
+    MetricCounter readErrors[2];     // ...and other failed reads (no header, timeout).
+    MetricCounter framesMissed[2];   // Frames never read, from the gaps between those that were.
+    MetricCounter rateChanges;       // Frame rate changes both sensors acknowledged...
+    MetricCounter rateRetries;       // ...commands sent again for want of a reply...
+    MetricCounter rateChangesLost;   // ...and changes a sensor never answered.
+
     bool begin(int t1, int r1, int t2, int r2); // Specify Pins
     bool begin();                               // Use Default Pins 
     
@@ -31,23 +54,53 @@ class DualLIDAR{
     void  setSmoothingFactor(float newSmoothingFactor);
     float getSmoothingFactor();
 
+    // Frames per second from both sensors. The smoothing is scaled to match,
+    // so a change in range takes as long to show at any rate. The command is
+    // only sent: getRanges() picks the replies out from among the frames, so
+    // none are lost waiting for them.
+    void     setFrameRate(uint16_t hz);
+    uint16_t getFrameRate();
+    bool     frameRatePending(); // Not yet acknowledged by both sensors.
+    bool     framesReady(); // A whole frame waiting from each sensor.
 
     int  getVisibility();
+    int  getRawVisibility(); // From the unsmoothed ranges: a frame sooner.
+
+    // Unsmoothed distance (cm) and signal strength from the last good read.
+    void getRawFrame(int16_t &dist1, int16_t &flux1, int16_t &dist2, int16_t &flux2);
 
   private: 
     TFMPlus tfmP_1;
     TFMPlus tfmP_2;
 
     float smoothingFactor = 0.95;
+    float frameSmoothing  = 0.95; // smoothingFactor at frameRate.
+    uint16_t frameRate    = LIDAR_FULL_RATE;
     float smoothedDist1 = 0;
     float smoothedDist2 = 0;
 
+    int16_t rawDist1 = 0, rawFlux1 = 0;
+    int16_t rawDist2 = 0, rawFlux2 = 0;
+
     int tx1=25, rx1=33, tx2=27, rx2=26; // Default pins for tx and rx
     int zoneMin = 0; 
     int zoneMax = 100;
     int visibility = NEITHER;
+
+    // A frame rate change on its way, per sensor.
+    bool     replyWanted[2]  = {false, false};
+    uint8_t  replyMatched[2] = {0, 0};  // Bytes of the expected reply seen so far.
+    uint16_t gapRate[2]      = {LIDAR_FULL_RATE, LIDAR_FULL_RATE}; // For framesMissed. The slower
+                                        // rate until a change is done.
+    uint32_t lastFrameUs[2]  = {0, 0};
+    uint32_t rateSentMs      = 0;
+    uint8_t  rateTries       = 0;
   
     void initLIDAR(TFMPlus &tfmP, int port=1);
+    int  readFrame(Stream &port, int sensor, int16_t &dist, int16_t &flux);
+    void watchReply(int sensor, uint8_t b);
+    void sendFrameRate();
+    void countRead(int sensor, int result);
 
 
 };
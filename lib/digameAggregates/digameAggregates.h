@@ -0,0 +1,399 @@
+/* digameAggregates.h
+ *
+ *  Per-minute, per-hour and per-day in/out counts in fixed memory.
+ *
+ *  Each level is a ring of buckets tagged with the period it holds (minute,
+ *  hour or day number). An event adds to the current bucket at all three
+ *  levels, so the hour and day totals are always rolled up and an update
+ *  is O(1). A bucket whose tag doesn't match the period asked for is stale
+ *  and reads as zero, so nothing has to be cleared when time moves on.
+ *
+ *  Retention: AGGREGATE_MINUTES minutes, AGGREGATE_HOURS hours and
+ *  AGGREGATE_DAYS days back from the newest minute seen. query() covers a
+ *  range with the coarsest buckets that fit, dropping to finer ones at the
+ *  ragged ends, and says whether the range fell entirely within retention.
+ *
+ *  Times are minute numbers. Until the clock is set these count from an
+ *  arbitrary origin carried across reboots; see AGGREGATE_FLAG_UTC. When
+ *  it is, rebase() moves what the minute buckets hold over to UTC. Once
+ *  they're in UTC, events after a reboot can't be placed until the clock
+ *  is set again. hold() keeps them, by minute of the millisecond counter,
+ *  and placeHeld() adds them in when it is -- to within a minute.
+ *
+ *  The whole structure persists as one CRC-checked snapshot in one of two
+ *  slots of /aggregates.bin, alternating like the config record.
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#ifndef __DIGAME_AGGREGATES_H__
+#define __DIGAME_AGGREGATES_H__
+
+#include <digameDebug.h>
+#include <digameCRC.h>
+#include <FS.h>
+
+#define AGGREGATE_MAGIC     0x47474144 // "DAGG"
+#define AGGREGATE_VERSION   1
+#define AGGREGATE_FILE      "/aggregates.bin"
+#define AGGREGATE_SLOT_SIZE 2048
+
+#define AGGREGATE_MINUTES   120 // Two hours of minutes...
+#define AGGREGATE_HOURS     48  // ...two days of hours...
+#define AGGREGATE_DAYS      35  // ...and five weeks of days.
+#define AGGREGATE_HELD      120 // Minutes of events held for the clock.
+
+#define MINUTES_PER_HOUR    60
+#define MINUTES_PER_DAY     1440
+
+#define AGGREGATE_FLAG_UTC  0x01 // Minute numbers are minutes since 1970 UTC.
+
+struct __attribute__((packed)) MinuteBucket
+{
+    uint32_t period;
+    uint16_t in;
+    uint16_t out;
+};
+
+struct __attribute__((packed)) PeriodBucket
+{
+    uint32_t period;
+    uint32_t in;
+    uint32_t out;
+};
+
+struct __attribute__((packed)) AggregateSnapshot
+{
+    uint32_t     magic;
+    uint16_t     version;
+    uint8_t      flags;
+    uint8_t      reserved;
+    uint32_t     generation;
+    uint32_t     newestMinute;
+    MinuteBucket minutes[AGGREGATE_MINUTES];
+    PeriodBucket hours[AGGREGATE_HOURS];
+    PeriodBucket days[AGGREGATE_DAYS];
+    uint32_t     crc;      // CRC-32 over everything above.
+};
+
+static_assert(sizeof(AggregateSnapshot) <= AGGREGATE_SLOT_SIZE, "AggregateSnapshot has outgrown its slot");
+
+struct HeldMinute
+{
+    uint32_t localMinute; // millis() / 60000.
+    uint16_t in;
+    uint16_t out;
+};
+
+struct AggregateTotals
+{
+    uint32_t in  = 0;
+    uint32_t out = 0;
+};
+
+class CountAggregates
+{
+  public:
+    uint32_t saveIntervalMs = 300000; // Counts at risk from a brownout vs. flash writes.
+    uint32_t saves          = 0;
+    uint32_t writeErrors    = 0;
+    uint32_t heldDropped    = 0; // Events waiting for the clock that didn't fit.
+
+    //*************************************************************************
+    // Start empty, with minute numbers in the given clock basis.
+    void reset(uint8_t flags)
+    {
+        memset(&s, 0, sizeof(s));
+        for (auto &b : s.minutes) b.period = UINT32_MAX;
+        for (auto &b : s.hours)   b.period = UINT32_MAX;
+        for (auto &b : s.days)    b.period = UINT32_MAX;
+        s.flags = flags;
+        dirty   = true;
+    }
+
+    //*************************************************************************
+    // Load the newest good snapshot. Returns false (and starts empty) if
+    // there isn't one.
+    bool restore(fs::FS &fileSystem)
+    {
+        fs = &fileSystem;
+        reset(0);
+        dirty = false;
+
+        File file = fs->open(AGGREGATE_FILE, FILE_READ);
+        if (!file) return false;
+
+        bool found = false;
+        for (int i = 0; i < 2; i++) {
+            AggregateSnapshot *candidate = new AggregateSnapshot; // Too big for the stack.
+            if (file.seek(i * AGGREGATE_SLOT_SIZE) &&
+                (file.read((uint8_t *)candidate, sizeof(AggregateSnapshot)) == sizeof(AggregateSnapshot)) &&
+                snapshotValid(*candidate) && (!found || (candidate->generation > s.generation))) {
+                s          = *candidate;
+                activeSlot = i;
+                found      = true;
+            }
+            delete candidate;
+        }
+        file.close();
+        return found;
+    }
+
+    //*************************************************************************
+    // Count one event. O(1): one bucket at each level.
+    void add(uint8_t type, uint32_t minute)
+    {
+        if (minute > s.newestMinute) s.newestMinute = minute;
+        if (!haveMinute(minute)) return; // Too old to place. (Clock went backwards.)
+
+        MinuteBucket &m = s.minutes[minute % AGGREGATE_MINUTES];
+        PeriodBucket &h = bucket(s.hours, AGGREGATE_HOURS, minute / MINUTES_PER_HOUR);
+        PeriodBucket &d = bucket(s.days, AGGREGATE_DAYS, minute / MINUTES_PER_DAY);
+
+        if (m.period != minute) {
+            m.period = minute;
+            m.in     = 0;
+            m.out    = 0;
+        }
+
+        if (type == 0) { // INBOUND
+            if (m.in < UINT16_MAX) m.in++;
+            h.in++;
+            d.in++;
+        } else {
+            if (m.out < UINT16_MAX) m.out++;
+            h.out++;
+            d.out++;
+        }
+        dirty = true;
+    }
+
+    //*************************************************************************
+    // Renumber the minutes, e.g. when the clock is first set. Each minute
+    // bucket still held is counted again at minute + shift, which rebuilds
+    // the hours and days too. Anything only in hours or days -- older than
+    // AGGREGATE_MINUTES -- can't be placed exactly and is dropped.
+    void rebase(int64_t shift, uint8_t flags)
+    {
+        MinuteBucket *held  = new MinuteBucket[AGGREGATE_MINUTES]; // Too big for the stack.
+        size_t        count = 0;
+        for (auto &m : s.minutes) {
+            if ((m.period != UINT32_MAX) && haveMinute(m.period) && ((int64_t)m.period + shift >= 0)) held[count++] = m;
+        }
+        uint32_t newest = s.newestMinute;
+
+        uint32_t generation = s.generation; // Keep the save order going.
+        reset(flags);
+        s.generation = generation;
+        if ((int64_t)newest + shift >= 0) s.newestMinute = (uint32_t)(newest + shift);
+
+        for (size_t i = 0; i < count; i++) {
+            uint32_t minute = (uint32_t)(held[i].period + shift);
+            for (uint16_t n = 0; n < held[i].in; n++)  add(0, minute);
+            for (uint16_t n = 0; n < held[i].out; n++) add(1, minute);
+        }
+        delete[] held;
+    }
+
+    //*************************************************************************
+    // Keep an event for placeHeld(). nowMs is from millis().
+    void hold(uint8_t type, uint32_t nowMs)
+    {
+        uint32_t minute = nowMs / 60000;
+
+        if ((heldCount == 0) || (held[heldCount - 1].localMinute != minute)) {
+            if (heldCount == AGGREGATE_HELD) { // Lose the oldest minute.
+                heldDropped += held[0].in + held[0].out;
+                memmove(held, held + 1, (AGGREGATE_HELD - 1) * sizeof(HeldMinute));
+                heldCount--;
+            }
+            held[heldCount++] = { minute, 0, 0 };
+        }
+        HeldMinute &m = held[heldCount - 1];
+        if (type == 0) {
+            if (m.in < UINT16_MAX) m.in++; else heldDropped++;
+        } else {
+            if (m.out < UINT16_MAX) m.out++; else heldDropped++;
+        }
+    }
+
+    // The clock is set: utcMs is UTC at nowMs. Each held minute is counted
+    // at the UTC minute its middle falls in.
+    void placeHeld(uint64_t utcMs, uint32_t nowMs)
+    {
+        for (size_t i = 0; i < heldCount; i++) {
+            int64_t  ago    = (int64_t)nowMs - ((int64_t)held[i].localMinute * 60000 + 30000); // < 0 for this minute.
+            uint32_t minute = (uint32_t)(((int64_t)utcMs - ago) / 60000);
+            for (uint16_t n = 0; n < held[i].in; n++)  add(0, minute);
+            for (uint16_t n = 0; n < held[i].out; n++) add(1, minute);
+        }
+        heldCount = 0;
+    }
+
+    size_t heldMinutes() const { return heldCount; }
+
+    // Let the structure know time has moved on, even with nothing counted.
+    // Not worth a flash write on its own.
+    void advance(uint32_t minute)
+    {
+        if (minute > s.newestMinute) s.newestMinute = minute;
+    }
+
+    //*************************************************************************
+    // Totals for minutes [fromMinute, toMinute). Returns false if part of
+    // the range is older than anything still held; that part counts as zero.
+    bool query(uint32_t fromMinute, uint32_t toMinute, AggregateTotals &totals)
+    {
+        bool     complete = true;
+        uint32_t t        = fromMinute;
+
+        totals = AggregateTotals();
+
+        while (t < toMinute) {
+            uint32_t left = toMinute - t;
+
+            if ((t % MINUTES_PER_DAY == 0) && (left >= MINUTES_PER_DAY) && haveDay(t / MINUTES_PER_DAY)) {
+                addPeriod(s.days, AGGREGATE_DAYS, t / MINUTES_PER_DAY, totals);
+                t += MINUTES_PER_DAY;
+            } else if ((t % MINUTES_PER_HOUR == 0) && (left >= MINUTES_PER_HOUR) && haveHour(t / MINUTES_PER_HOUR)) {
+                addPeriod(s.hours, AGGREGATE_HOURS, t / MINUTES_PER_HOUR, totals);
+                t += MINUTES_PER_HOUR;
+            } else if (haveMinute(t)) {
+                const MinuteBucket &m = s.minutes[t % AGGREGATE_MINUTES];
+                if (m.period == t) {
+                    totals.in  += m.in;
+                    totals.out += m.out;
+                }
+                t++;
+            } else {
+                // Nothing fine enough is left for this stretch. Skip to the
+                // next point some level can answer from.
+                complete = false;
+                uint32_t next = firstHeld(t, 1, AGGREGATE_MINUTES);
+                next = min32(next, firstHeld(t, MINUTES_PER_HOUR, AGGREGATE_HOURS));
+                next = min32(next, firstHeld(t, MINUTES_PER_DAY, AGGREGATE_DAYS));
+                t    = min32(next, toMinute);
+            }
+        }
+        return complete;
+    }
+
+    //*************************************************************************
+    // Call from the main loop. Saves at most every saveIntervalMs while
+    // counting.
+    void service(uint32_t nowMs)
+    {
+        if (dirty && (nowMs - lastSaveMs >= saveIntervalMs)) {
+            save();
+            lastSaveMs = nowMs; // Don't hammer the flash if it's failing.
+        }
+    }
+
+    void flush() { if (dirty) save(); }
+
+    // Write what's pending and stop, e.g. before the file system is unmounted.
+    void end()
+    {
+        flush();
+        fs = nullptr;
+    }
+
+    bool save()
+    {
+        if (!fs) return false;
+
+        s.magic   = AGGREGATE_MAGIC;
+        s.version = AGGREGATE_VERSION;
+        s.generation++;
+        s.crc     = snapshotCRC(s);
+
+        int target = (activeSlot == 0) ? 1 : 0;
+
+        if (!fs->exists(AGGREGATE_FILE)) {
+            File create = fs->open(AGGREGATE_FILE, FILE_WRITE);
+            if (!create) { writeErrors++; return false; }
+            uint8_t blank[64];
+            memset(blank, 0xFF, sizeof(blank));
+            for (size_t i = 0; i < 2 * AGGREGATE_SLOT_SIZE; i += sizeof(blank)) create.write(blank, sizeof(blank));
+            create.close();
+        }
+
+        File file = fs->open(AGGREGATE_FILE, "r+");
+        bool ok   = file && file.seek(target * AGGREGATE_SLOT_SIZE) &&
+                    (file.write((const uint8_t *)&s, sizeof(s)) == sizeof(s));
+        if (file) file.close();
+
+        if (!ok) {
+            writeErrors++;
+            return false;
+        }
+        activeSlot = target;
+        dirty      = false;
+        saves++;
+        return true;
+    }
+
+    uint32_t newestMinute() { return s.newestMinute; }
+    uint8_t  flags()        { return s.flags; }
+
+  private:
+    fs::FS           *fs         = nullptr;
+    AggregateSnapshot s;
+    int               activeSlot = -1;
+    bool              dirty      = false;
+    uint32_t          lastSaveMs = 0;
+    HeldMinute        held[AGGREGATE_HELD];
+    size_t            heldCount  = 0;
+
+    // A period is held if it's within retention of the newest minute.
+    // Anything newer simply hasn't happened yet and is zero.
+    bool haveMinute(uint32_t minute) { return minute + AGGREGATE_MINUTES > s.newestMinute; }
+    bool haveHour(uint32_t hour)     { return hour + AGGREGATE_HOURS > s.newestMinute / MINUTES_PER_HOUR; }
+    bool haveDay(uint32_t day)       { return day + AGGREGATE_DAYS > s.newestMinute / MINUTES_PER_DAY; }
+
+    static uint32_t min32(uint32_t a, uint32_t b) { return (a < b) ? a : b; }
+
+    // The first minute after t where a level with periods of the given
+    // length, holding `retained` of them, can answer.
+    uint32_t firstHeld(uint32_t t, uint32_t length, uint32_t retained)
+    {
+        uint32_t newest = s.newestMinute / length;
+        uint32_t oldest = (newest >= retained - 1) ? newest - (retained - 1) : 0;
+        uint32_t start  = (t / length + 1) * length;
+        return (oldest * length > start) ? oldest * length : start;
+    }
+
+    // The bucket for a period, claimed and zeroed if it held an older one.
+    static PeriodBucket &bucket(PeriodBucket *ring, size_t size, uint32_t period)
+    {
+        PeriodBucket &b = ring[period % size];
+        if (b.period != period) {
+            b.period = period;
+            b.in     = 0;
+            b.out    = 0;
+        }
+        return b;
+    }
+
+    static void addPeriod(const PeriodBucket *ring, size_t size, uint32_t period, AggregateTotals &totals)
+    {
+        const PeriodBucket &b = ring[period % size];
+        if (b.period == period) {
+            totals.in  += b.in;
+            totals.out += b.out;
+        }
+    }
+
+    static uint32_t snapshotCRC(const AggregateSnapshot &snap)
+    {
+        return crc32((const uint8_t *)&snap, sizeof(snap) - sizeof(snap.crc));
+    }
+
+    static bool snapshotValid(const AggregateSnapshot &snap)
+    {
+        return (snap.magic == AGGREGATE_MAGIC) && (snap.version == AGGREGATE_VERSION) &&
+               (snap.crc == snapshotCRC(snap));
+    }
+};
+
+#endif //__DIGAME_AGGREGATES_H__
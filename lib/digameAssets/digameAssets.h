@@ -0,0 +1,197 @@
+/* digameAssets.h
+ *
+ *  Serves the web UI's static files pre-compressed, with strong ETags.
+ *
+ *  tools/build_web_assets.py runs before the file system image is built.
+ *  It gzips the text assets from data/ and hashes every asset's original
+ *  content. Then it writes the results and a manifest, /assets.txt, one
+ *  line per asset:
+ *
+ *    /index.html 3f1c9a0b52d7e6a1 1      path, ETag, 1 if stored as path.gz
+ *
+ *  WebAssetHandler answers requests for those paths. It sends the .gz
+ *  as-is with Content-Encoding: gzip (every browser accepts it), plus the
+ *  ETag and Cache-Control. It answers 304 Not Modified when the browser
+ *  already has that ETag. HTML revalidates on every load. Everything else
+ *  is cached for ASSET_MAX_AGE_S before the browser asks again.
+ *
+ *  Anything not in the manifest falls through to the next handler.
+ *  Without a manifest, e.g. if data/ was uploaded by hand, this handler
+ *  does nothing.
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#ifndef __DIGAME_ASSETS_H__
+#define __DIGAME_ASSETS_H__
+
+#include <digameDebug.h>
+#include <FS.h>
+
+#define ASSET_MANIFEST      "/assets.txt"
+#define ASSET_MAX_COUNT     16
+#define ASSET_PATH_LENGTH   32  // SPIFFS's name limit.
+#define ASSET_ETAG_LENGTH   20
+#define ASSET_MAX_AGE_S     3600
+
+struct WebAsset
+{
+    char path[ASSET_PATH_LENGTH];
+    char etag[ASSET_ETAG_LENGTH]; // Quoted, ready for the header.
+    bool gzipped;
+};
+
+//*****************************************************************************
+// Does an If-None-Match header match our ETag? The header may be a list,
+// may carry W/ prefixes (If-None-Match compares weakly) or be "*".
+inline bool etagMatches(const char *ifNoneMatch, const char *etag)
+{
+    size_t length = strlen(etag);
+    const char *p = ifNoneMatch;
+
+    while (*p) {
+        while ((*p == ' ') || (*p == ',')) p++;
+        if (*p == '*') return true;
+        if ((p[0] == 'W') && (p[1] == '/')) p += 2;
+        if ((strncmp(p, etag, length) == 0) && ((p[length] == 0) || (p[length] == ',') || (p[length] == ' '))) {
+            return true;
+        }
+        while (*p && (*p != ',')) p++;
+    }
+    return false;
+}
+
+inline const char *assetContentType(const char *path)
+{
+    const char *dot = strrchr(path, '.');
+    if (!dot)                      return "application/octet-stream";
+    if (!strcmp(dot, ".html"))     return "text/html";
+    if (!strcmp(dot, ".css"))      return "text/css";
+    if (!strcmp(dot, ".js"))       return "application/javascript";
+    if (!strcmp(dot, ".json"))     return "application/json";
+    if (!strcmp(dot, ".png"))      return "image/png";
+    if (!strcmp(dot, ".ico"))      return "image/x-icon";
+    if (!strcmp(dot, ".svg"))      return "image/svg+xml";
+    return "application/octet-stream";
+}
+
+class AssetTable
+{
+  public:
+    //*************************************************************************
+    // Read the manifest. Returns the number of assets found.
+    size_t load(fs::FS &fileSystem)
+    {
+        count = 0;
+
+        File file = fileSystem.open(ASSET_MANIFEST, FILE_READ);
+        if (!file) return 0;
+
+        char   line[96];
+        size_t length = 0;
+        int    c;
+        do {
+            c = file.read();
+            if ((c < 0) || (c == '\n')) {
+                line[length] = 0;
+                parseLine(line);
+                length = 0;
+            } else if (length + 1 < sizeof(line)) {
+                line[length++] = c;
+            }
+        } while (c >= 0);
+        file.close();
+
+        DEBUG_PRINT("    Web assets: ");
+        DEBUG_PRINTLN(count);
+        return count;
+    }
+
+    const WebAsset *find(const char *path) const
+    {
+        for (size_t i = 0; i < count; i++) {
+            if (!strcmp(assets[i].path, path)) return &assets[i];
+        }
+        return nullptr;
+    }
+
+    size_t size() const { return count; }
+
+  private:
+    WebAsset assets[ASSET_MAX_COUNT];
+    size_t   count = 0;
+
+    void parseLine(const char *line)
+    {
+        char path[ASSET_PATH_LENGTH], etag[ASSET_ETAG_LENGTH - 2];
+        int  gzipped;
+
+        if (count == ASSET_MAX_COUNT) return;
+        if (sscanf(line, "%31s %17s %d", path, etag, &gzipped) != 3) return; // Blank or a comment.
+        if (path[0] != '/') return;
+
+        WebAsset &a = assets[count++];
+        strcpy(a.path, path);
+        snprintf(a.etag, sizeof(a.etag), "\"%s\"", etag);
+        a.gzipped = (gzipped != 0);
+    }
+};
+
+#if defined(ESP32)
+#include <ESPAsyncWebServer.h>
+
+//*****************************************************************************
+class WebAssetHandler : public AsyncWebHandler
+{
+  public:
+    // HTML pages ask for a login when a user name is given.
+    WebAssetHandler(fs::FS &fileSystem, const char *user = "", const char *password = "")
+        : fs(fileSystem), userName(user), pass(password) {}
+
+    size_t begin() { return table.load(fs); }
+
+    bool canHandle(AsyncWebServerRequest *request) override
+    {
+        if ((request->method() != HTTP_GET) && (request->method() != HTTP_HEAD)) return false;
+        return lookup(request) != nullptr;
+    }
+
+    void handleRequest(AsyncWebServerRequest *request) override
+    {
+        const WebAsset *asset = lookup(request);
+        bool            html  = !strcmp(assetContentType(asset->path), "text/html");
+
+        if (html && userName[0] && !request->authenticate(userName, pass)) {
+            return request->requestAuthentication();
+        }
+
+        AsyncWebServerResponse *response;
+        if (request->hasHeader("If-None-Match") &&
+            etagMatches(request->header("If-None-Match").c_str(), asset->etag)) {
+            response = request->beginResponse(304);
+        } else {
+            String path = asset->path;
+            if (asset->gzipped) path += ".gz";
+            response = request->beginResponse(fs, path, assetContentType(asset->path));
+            if (asset->gzipped) response->addHeader("Content-Encoding", "gzip");
+        }
+        response->addHeader("ETag", asset->etag);
+        response->addHeader("Cache-Control", html ? "no-cache" : "max-age=" + String(ASSET_MAX_AGE_S));
+        request->send(response);
+    }
+
+  private:
+    fs::FS     &fs;
+    const char *userName;
+    const char *pass;
+    AssetTable  table;
+
+    const WebAsset *lookup(AsyncWebServerRequest *request)
+    {
+        const String &url = request->url();
+        return table.find((url == "/") ? "/index.html" : url.c_str());
+    }
+};
+#endif // ESP32
+
+#endif //__DIGAME_ASSETS_H__
@@ -0,0 +1,43 @@
+/* digameCRC.h
+ *
+ *  Small, table-free CRC routines for framing and for records stored in
+ *  flash. Pass a previous result back in to continue over several buffers.
+ *  No Arduino dependencies -- builds on a Linux host as-is.
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#ifndef __DIGAME_CRC_H__
+#define __DIGAME_CRC_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+//*****************************************************************************
+// CRC-16/CCITT-FALSE (poly 0x1021, init 0xFFFF).
+uint16_t crc16(const uint8_t *data, size_t len, uint16_t crc = 0xFFFF)
+{
+    while (len--) {
+        crc ^= (uint16_t)(*data++) << 8;
+        for (int i = 0; i < 8; i++) {
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+        }
+    }
+    return crc;
+}
+
+//*****************************************************************************
+// CRC-32 as used by zlib / gzip (reflected poly 0xEDB88320). Start with 0.
+uint32_t crc32(const uint8_t *data, size_t len, uint32_t crc = 0)
+{
+    crc = ~crc;
+    while (len--) {
+        crc ^= *data++;
+        for (int i = 0; i < 8; i++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : (crc >> 1);
+        }
+    }
+    return ~crc;
+}
+
+#endif //__DIGAME_CRC_H__
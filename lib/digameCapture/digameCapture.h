@@ -0,0 +1,352 @@
+/* digameCapture.h
+ *
+ *  Full-rate capture of raw LIDAR frames to flash for field diagnostics.
+ *
+ *  /capture.bin is allocated once at its full size and then used as a
+ *  circular buffer of fixed-size blocks. The main loop only copies each
+ *  frame into a RAM block; full blocks are handed to a low-priority writer
+ *  task through a queue. If the writer falls behind, frames are dropped
+ *  and counted rather than waited for.
+ *
+ *  A flash write turns the caches off on both cores, so the writer doesn't
+ *  write when it likes. It waits for service(), which the loop calls after
+ *  each frame, so the write lands in the gap before the next one. That's
+ *  once nobody has been in view for CAPTURE_QUIET_FRAMES frames, or
+ *  sooner if the RAM blocks are about to run out. While a firmware update
+ *  is writing flash, capture writes wait for it, and frames are dropped.
+ *
+ *  Modes:
+ *    CAPTURE_OFF        Nothing recorded.
+ *    CAPTURE_CONTINUOUS Always recording, oldest blocks overwritten.
+ *    CAPTURE_FREEZE     Recording until trigger() is called, then for
+ *                       setAfterSeconds() more before freezing. The file
+ *                       then holds the time around the trigger and is left
+ *                       alone until the mode is set again. The seconds are
+ *                       timed from the frames themselves, so they stay
+ *                       right whatever the frame rate. At most three
+ *                       quarters of the buffer goes after the trigger.
+ *
+ *  File layout (little-endian). tools/decode_capture.py reads it:
+ *    CaptureFileHeader, then CAPTURE_BLOCK_COUNT blocks of
+ *    CAPTURE_BLOCK_SIZE bytes: CaptureBlockHeader + CaptureFrame[].
+ *
+ *  Frames carry millis(). Each block also records the difference between
+ *  UTC and millis() when it was started, if the clock was set then (see
+ *  setClock()), so every frame's UTC time can be worked out.
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#ifndef __DIGAME_CAPTURE_H__
+#define __DIGAME_CAPTURE_H__
+
+#include <digameDebug.h>
+#include <digameCRC.h>
+#include <FS.h>
+
+#define CAPTURE_FILE         "/capture.bin"
+#define CAPTURE_MAGIC        0x50414344 // "DCAP"
+#define CAPTURE_BLOCK_MAGIC  0xB10C
+#define CAPTURE_VERSION      2    // 2: blocks carry utcOffsetMs.
+#define CAPTURE_BLOCK_SIZE   512
+#define CAPTURE_BLOCK_COUNT  96   // 48 KB: ~33 s of history at 100 Hz.
+#define CAPTURE_RAM_BLOCKS   4    // Blocks in flight between the loop and the writer.
+#define CAPTURE_AFTER_SECONDS 10  // Default time kept after a trigger.
+#define CAPTURE_MAX_AFTER_BLOCKS (CAPTURE_BLOCK_COUNT * 3 / 4) // The rest is from before it.
+#define CAPTURE_QUIET_FRAMES 5    // Frames with nobody in view before a block is written.
+
+#define CAPTURE_OFF          0
+#define CAPTURE_CONTINUOUS   1
+#define CAPTURE_FREEZE       2
+
+#define CAPTURE_FLAG_TRIGGER 0x01 // This frame is where the trigger fired.
+
+struct __attribute__((packed)) CaptureFileHeader
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t headerSize;
+    uint16_t blockSize;
+    uint16_t blockCount;
+    uint16_t frameSize;
+    uint16_t reserved;
+    uint32_t crc;        // CRC-32 over everything above.
+};
+
+struct __attribute__((packed)) CaptureBlockHeader
+{
+    uint16_t magic;
+    uint16_t frames;     // Frames used in this block.
+    uint32_t blockSeq;   // Increases by one per block written. Orders the ring.
+    uint32_t crc;        // CRC-32 over the frames.
+    int64_t  utcOffsetMs; // UTC = timeMs + this. 0 if the clock wasn't set.
+};
+
+struct __attribute__((packed)) CaptureFrame
+{
+    uint32_t timeMs;     // millis()
+    int16_t  dist1;      // Raw (unsmoothed) distance, cm.
+    int16_t  flux1;      // Signal strength.
+    int16_t  dist2;
+    int16_t  flux2;
+    uint8_t  state;      // Visibility: NEITHER / SENSOR1 / SENSOR2 / BOTH
+    uint8_t  flags;
+};
+
+#define CAPTURE_FRAMES_PER_BLOCK ((CAPTURE_BLOCK_SIZE - sizeof(CaptureBlockHeader)) / sizeof(CaptureFrame))
+
+typedef int64_t (*CaptureClock)(uint32_t timeMs); // UTC - timeMs, or 0 if unknown.
+
+struct CaptureBlock
+{
+    CaptureBlockHeader header;
+    CaptureFrame       frames[CAPTURE_FRAMES_PER_BLOCK];
+};
+
+static_assert(sizeof(CaptureBlock) <= CAPTURE_BLOCK_SIZE, "CaptureBlock must fit a block");
+
+class FrameCapture
+{
+  public:
+    volatile uint32_t framesCaptured = 0;
+    volatile uint32_t framesDropped  = 0; // Writer couldn't keep up.
+    volatile uint32_t blocksWritten  = 0;
+    volatile uint32_t writeErrors    = 0;
+
+    //*************************************************************************
+    // Make sure the capture file exists at full size and start the writer.
+    // Until that has worked, record() and service() do nothing.
+    bool begin(fs::FS &fileSystem)
+    {
+        size_t fileSize = sizeof(CaptureFileHeader) + (size_t)CAPTURE_BLOCK_SIZE * CAPTURE_BLOCK_COUNT;
+        File   file     = fileSystem.open(CAPTURE_FILE, FILE_READ);
+        bool   ready    = file && (file.size() == fileSize);
+        CaptureFileHeader existing;
+        if (ready) {
+            ready = (file.read((uint8_t *)&existing, sizeof(existing)) == sizeof(existing)) &&
+                    (existing.version == CAPTURE_VERSION); // An older layout is started afresh.
+        }
+        if (file) file.close();
+
+        if (!ready) {
+            DEBUG_PRINTLN("    Allocating capture file...");
+            file = fileSystem.open(CAPTURE_FILE, FILE_WRITE);
+            if (!file) return false;
+
+            CaptureFileHeader h;
+            h.magic      = CAPTURE_MAGIC;
+            h.version    = CAPTURE_VERSION;
+            h.headerSize = sizeof(CaptureFileHeader);
+            h.blockSize  = CAPTURE_BLOCK_SIZE;
+            h.blockCount = CAPTURE_BLOCK_COUNT;
+            h.frameSize  = sizeof(CaptureFrame);
+            h.reserved   = 0;
+            h.crc        = crc32((const uint8_t *)&h, sizeof(h) - sizeof(h.crc));
+            file.write((const uint8_t *)&h, sizeof(h));
+
+            uint8_t blank[64];
+            memset(blank, 0xFF, sizeof(blank));
+            for (size_t i = 0; i < (size_t)CAPTURE_BLOCK_SIZE * CAPTURE_BLOCK_COUNT; i += sizeof(blank)) {
+                if (file.write(blank, sizeof(blank)) != sizeof(blank)) {
+                    file.close();
+                    return false;
+                }
+            }
+            file.close();
+        } else {
+            // Carry on the block numbering so old and new blocks still sort correctly.
+            file = fileSystem.open(CAPTURE_FILE, FILE_READ);
+            for (size_t i = 0; file && (i < CAPTURE_BLOCK_COUNT); i++) {
+                CaptureBlockHeader h;
+                file.seek(sizeof(CaptureFileHeader) + i * CAPTURE_BLOCK_SIZE);
+                if ((file.read((uint8_t *)&h, sizeof(h)) == sizeof(h)) && (h.magic == CAPTURE_BLOCK_MAGIC) &&
+                    (h.blockSeq >= nextBlockSeq)) {
+                    nextBlockSeq = h.blockSeq + 1;
+                }
+            }
+            if (file) file.close();
+        }
+
+        fullQueue = xQueueCreate(CAPTURE_RAM_BLOCKS, sizeof(uint8_t));
+        freeQueue = xQueueCreate(CAPTURE_RAM_BLOCKS, sizeof(uint8_t));
+        writeGo   = xSemaphoreCreateBinary();
+        if (!fullQueue || !freeQueue || !writeGo) return false;
+        for (uint8_t i = 1; i < CAPTURE_RAM_BLOCKS; i++) xQueueSend(freeQueue, &i, 0);
+        fillIndex = 0;
+        blocks[0].header.frames = 0;
+
+        // Core 0, below the loop task: flash writes wait for counting, not the other way round.
+        fs = &fileSystem;
+        if (xTaskCreatePinnedToCore(writerTask, "captureWriter", 3072, this, 0, nullptr, 0) != pdPASS) {
+            fs = nullptr;
+            return false;
+        }
+        return true;
+    }
+
+    bool available() const { return fs != nullptr; }
+
+    //*************************************************************************
+    // From the loop, after each frame. busy: someone is in view. flashBusy:
+    // something else is writing flash (a firmware update). Lets the writer
+    // write one block now, if one is waiting and it's a good time.
+    void service(bool busy, bool flashBusy)
+    {
+        if (!fs) return;
+        quiet = busy ? 0 : ((quiet < CAPTURE_QUIET_FRAMES) ? quiet + 1 : quiet);
+        if (!writerWaiting || flashBusy) return;
+
+        bool runningOut = (uxQueueMessagesWaiting(freeQueue) == 0); // The block being filled is the last.
+        if ((quiet < CAPTURE_QUIET_FRAMES) && !runningOut) return;
+        writerWaiting = false;
+        writing       = true;
+        xSemaphoreGive(writeGo);
+    }
+
+    // Stop writing, e.g. before the file system is unmounted. Frames after
+    // this aren't kept. False while a block is being written: try again.
+    bool end()
+    {
+        if (writing) return false;
+        fs = nullptr;
+        return true;
+    }
+
+    //*************************************************************************
+    // Called for every frame from the main loop. No flash access here.
+    void record(uint32_t timeMs, int16_t dist1, int16_t flux1, int16_t dist2, int16_t flux2, uint8_t state)
+    {
+        if ((mode == CAPTURE_OFF) || frozen || !fs) return;
+
+        if (fillIndex < 0) { // Waiting on the writer for an empty block.
+            uint8_t i;
+            if (xQueueReceive(freeQueue, &i, 0) != pdTRUE) {
+                framesDropped++;
+                return;
+            }
+            fillIndex = i;
+            blocks[i].header.frames = 0;
+        }
+
+        CaptureBlock &b = blocks[fillIndex];
+        if (b.header.frames == 0) b.header.utcOffsetMs = utcOffset ? utcOffset(timeMs) : 0;
+        CaptureFrame &f = b.frames[b.header.frames++];
+        f.timeMs = timeMs;
+        f.dist1  = dist1;
+        f.flux1  = flux1;
+        f.dist2  = dist2;
+        f.flux2  = flux2;
+        f.state  = state;
+        f.flags  = triggerPending ? CAPTURE_FLAG_TRIGGER : 0;
+        if (triggerPending) {
+            freezeAtMs     = timeMs + afterSeconds * 1000UL;
+            freezeAfterSeq = nextBlockSeq + CAPTURE_MAX_AFTER_BLOCKS;
+            triggerPending = false;
+        }
+        framesCaptured++;
+
+        bool due = triggered && ((int32_t)(timeMs - freezeAtMs) >= 0);
+        if ((b.header.frames == CAPTURE_FRAMES_PER_BLOCK) || due) handOff(due);
+    }
+
+    //*************************************************************************
+    // Something suspicious just happened. In freeze mode, keep recording for
+    // afterSeconds and then stop, so the file holds both sides of it.
+    void trigger()
+    {
+        if ((mode != CAPTURE_FREEZE) || frozen || triggered) return;
+        triggered      = true;
+        triggerPending = true;
+    }
+
+    // From the loop, like record(). Turning capture off writes out the
+    // frames recorded so far rather than dropping them.
+    void setMode(uint8_t newMode)
+    {
+        if (fs && (newMode == CAPTURE_OFF) && (fillIndex >= 0) && (blocks[fillIndex].header.frames > 0) && !frozen) {
+            handOff(false);
+        }
+        mode           = newMode;
+        frozen         = false;
+        triggered      = false;
+        triggerPending = false;
+    }
+
+    void     setAfterSeconds(uint16_t seconds) { afterSeconds = seconds; }
+    uint16_t getAfterSeconds() { return afterSeconds; }
+
+    // Where blocks get their UTC offset from.
+    void setClock(CaptureClock offset) { utcOffset = offset; }
+
+    uint8_t getMode()   { return mode; }
+    bool    isFrozen()  { return frozen; }
+
+  private:
+    fs::FS        *fs             = nullptr;
+    CaptureBlock   blocks[CAPTURE_RAM_BLOCKS];
+    int            fillIndex      = -1;
+    QueueHandle_t  fullQueue      = nullptr;
+    QueueHandle_t  freeQueue      = nullptr;
+    SemaphoreHandle_t writeGo     = nullptr; // One block write, from service().
+    volatile bool  writerWaiting  = false;   // The writer has a block and wants to write it.
+    volatile bool  writing        = false;   // ...and has been told to go ahead.
+    uint32_t       quiet          = 0;       // Frames since someone was in view.
+    uint32_t       nextBlockSeq   = 1;
+    uint32_t       freezeAfterSeq = 0;
+    uint32_t       freezeAtMs     = 0;
+    uint16_t       afterSeconds   = CAPTURE_AFTER_SECONDS;
+    volatile uint8_t mode         = CAPTURE_OFF;
+    volatile bool  frozen         = false;
+    bool           triggered      = false;
+    bool           triggerPending = false;
+    CaptureClock   utcOffset      = nullptr;
+
+    // Pass the block to the writer and start on a fresh one. due: the time
+    // after the trigger is up, so freeze even if the block isn't full.
+    void handOff(bool due)
+    {
+        CaptureBlock &b   = blocks[fillIndex];
+        b.header.magic    = CAPTURE_BLOCK_MAGIC;
+        b.header.blockSeq = nextBlockSeq++;
+
+        uint8_t i = (uint8_t)fillIndex;
+        xQueueSend(fullQueue, &i, 0); // Can't fail: there are only CAPTURE_RAM_BLOCKS indices.
+        fillIndex = -1;
+
+        if (triggered && (due || (b.header.blockSeq >= freezeAfterSeq))) {
+            frozen = true;
+            DEBUG_PRINTLN("Frame capture frozen.");
+        }
+    }
+
+    static void writerTask(void *param)
+    {
+        FrameCapture *self = (FrameCapture *)param;
+        uint8_t       i;
+
+        while (true) {
+            if (xQueueReceive(self->fullQueue, &i, portMAX_DELAY) != pdTRUE) continue;
+            self->writerWaiting = true;
+            xSemaphoreTake(self->writeGo, portMAX_DELAY); // Right after a frame.
+
+            CaptureBlock &b = self->blocks[i];
+            b.header.crc = crc32((const uint8_t *)b.frames, b.header.frames * sizeof(CaptureFrame));
+
+            size_t offset = sizeof(CaptureFileHeader) +
+                            (size_t)((b.header.blockSeq - 1) % CAPTURE_BLOCK_COUNT) * CAPTURE_BLOCK_SIZE;
+            File file = self->fs->open(CAPTURE_FILE, "r+");
+            if (file && file.seek(offset) &&
+                (file.write((const uint8_t *)&b, sizeof(CaptureBlock)) == sizeof(CaptureBlock))) {
+                self->blocksWritten++;
+            } else {
+                self->writeErrors++;
+            }
+            if (file) file.close();
+            self->writing = false;
+
+            xQueueSend(self->freeQueue, &i, 0);
+        }
+    }
+};
+
+#endif //__DIGAME_CAPTURE_H__
@@ -0,0 +1,171 @@
+/* digameCheckpoint.h
+ *
+ *  Periodic checkpoints of the in/out counts so they survive brownouts and
+ *  reboots.
+ *
+ *  /counts.jnl is a small journal of CHECKPOINT_SLOTS fixed-size slots.
+ *  Each checkpoint goes into the next slot round-robin with a higher
+ *  generation number, which spreads the wear and means a write torn by
+ *  power loss only ever damages the newest copy. Restoring reads the whole
+ *  journal in one go and takes the valid slot with the highest generation,
+ *  so boot time doesn't depend on how long the device has been running.
+ *
+ *  How often to checkpoint is a trade between flash wear and how many
+ *  counts can be lost: a checkpoint is due once the counts have changed
+ *  and either intervalMs has passed or maxEvents events have happened.
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#ifndef __DIGAME_CHECKPOINT_H__
+#define __DIGAME_CHECKPOINT_H__
+
+#include <digameDebug.h>
+#include <digameCRC.h>
+#include <FS.h>
+
+#define CHECKPOINT_MAGIC     0x4B504344 // "DCPK"
+#define CHECKPOINT_FILE      "/counts.jnl"
+#define CHECKPOINT_SLOTS     8
+#define CHECKPOINT_SLOT_SIZE 32
+
+struct __attribute__((packed)) CheckpointRecord
+{
+    uint32_t magic;
+    uint32_t generation;
+    uint32_t inCount;
+    uint32_t outCount;
+    uint32_t lastSeq;    // Sequence number of the last event counted.
+    uint32_t crc;        // CRC-32 over everything above.
+};
+
+static_assert(sizeof(CheckpointRecord) <= CHECKPOINT_SLOT_SIZE, "CheckpointRecord has outgrown its slot");
+
+class CountCheckpoint
+{
+  public:
+    uint32_t intervalMs = 60000; // Checkpoint at least this often while counting...
+    uint32_t maxEvents  = 20;    // ...or after this many events, whichever comes first.
+    uint32_t writes     = 0;
+    uint32_t writeErrors = 0;
+
+    //*************************************************************************
+    // Find the newest good checkpoint. Returns false if there isn't one.
+    bool restore(fs::FS &fileSystem, CheckpointRecord &out)
+    {
+        fs = &fileSystem;
+
+        uint8_t journal[CHECKPOINT_SLOTS * CHECKPOINT_SLOT_SIZE];
+        size_t  got  = 0;
+        File    file = fs->open(CHECKPOINT_FILE, FILE_READ);
+        if (file) {
+            got = file.read(journal, sizeof(journal));
+            file.close();
+        }
+
+        bool found = false;
+        for (size_t i = 0; (i + 1) * CHECKPOINT_SLOT_SIZE <= got; i++) {
+            CheckpointRecord r;
+            memcpy(&r, journal + i * CHECKPOINT_SLOT_SIZE, sizeof(r));
+            if (!recordValid(r)) continue;
+            if (!found || (r.generation > out.generation)) {
+                out   = r;
+                found = true;
+            }
+        }
+
+        if (found) {
+            last            = out;
+            nextGeneration  = out.generation + 1;
+        }
+        return found;
+    }
+
+    //*************************************************************************
+    // Note that an event was counted.
+    void eventCounted() { eventsSince++; }
+
+    // Call from the main loop. Writes a checkpoint when one is due.
+    void service(uint32_t inCount, uint32_t outCount, uint32_t lastSeq, uint32_t nowMs)
+    {
+        bool changed = (inCount != last.inCount) || (outCount != last.outCount) || (lastSeq != last.lastSeq);
+        if (!changed) {
+            lastWriteMs = nowMs; // Nothing to lose while idle. Restart the clock.
+            return;
+        }
+        if ((nowMs - lastWriteMs >= intervalMs) || (eventsSince >= maxEvents)) {
+            write(inCount, outCount, lastSeq, nowMs);
+        }
+    }
+
+    // No more writes, e.g. before the file system is unmounted. Write one
+    // first if the counts matter.
+    void end() { fs = nullptr; }
+
+    //*************************************************************************
+    // Write a checkpoint now, e.g. after the counts are cleared or before a
+    // reboot.
+    bool write(uint32_t inCount, uint32_t outCount, uint32_t lastSeq, uint32_t nowMs)
+    {
+        if (!fs) return false;
+
+        CheckpointRecord r;
+        r.magic      = CHECKPOINT_MAGIC;
+        r.generation = nextGeneration;
+        r.inCount    = inCount;
+        r.outCount   = outCount;
+        r.lastSeq    = lastSeq;
+        r.crc        = recordCRC(r);
+
+        uint8_t slot[CHECKPOINT_SLOT_SIZE];
+        memset(slot, 0xFF, sizeof(slot));
+        memcpy(slot, &r, sizeof(r));
+
+        if (!fs->exists(CHECKPOINT_FILE)) {
+            File create = fs->open(CHECKPOINT_FILE, FILE_WRITE);
+            if (!create) { writeErrors++; return false; }
+            uint8_t blank[CHECKPOINT_SLOT_SIZE];
+            memset(blank, 0xFF, sizeof(blank));
+            for (int i = 0; i < CHECKPOINT_SLOTS; i++) create.write(blank, sizeof(blank));
+            create.close();
+        }
+
+        File file = fs->open(CHECKPOINT_FILE, "r+");
+        bool ok   = file && file.seek((r.generation % CHECKPOINT_SLOTS) * CHECKPOINT_SLOT_SIZE) &&
+                    (file.write(slot, sizeof(slot)) == sizeof(slot));
+        if (file) file.close();
+
+        lastWriteMs = nowMs;
+        if (!ok) {
+            writeErrors++;
+            return false;
+        }
+
+        last        = r;
+        eventsSince = 0;
+        nextGeneration++;
+        writes++;
+        return true;
+    }
+
+    const CheckpointRecord &lastWritten() { return last; }
+
+  private:
+    fs::FS          *fs             = nullptr;
+    CheckpointRecord last           = {};
+    uint32_t         nextGeneration = 1;
+    uint32_t         eventsSince    = 0;
+    uint32_t         lastWriteMs    = 0;
+
+    static uint32_t recordCRC(const CheckpointRecord &r)
+    {
+        return crc32((const uint8_t *)&r, sizeof(r) - sizeof(r.crc));
+    }
+
+    static bool recordValid(const CheckpointRecord &r)
+    {
+        return (r.magic == CHECKPOINT_MAGIC) && (r.crc == recordCRC(r));
+    }
+};
+
+#endif //__DIGAME_CHECKPOINT_H__
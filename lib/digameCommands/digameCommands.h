@@ -0,0 +1,109 @@
+/* digameCommands.h
+ *
+ *  A table-driven console command dispatcher. Each command is declared once
+ *  in a constant table (name, help text, optional value prompt and parser,
+ *  handler) that is checked for sort order at compile time and searched with
+ *  a binary search against the fixed input buffer. The same table drives the
+ *  menu. No Arduino dependencies -- builds on a Linux host as-is.
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#ifndef __DIGAME_COMMANDS_H__
+#define __DIGAME_COMMANDS_H__
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Command flags
+#define COMMAND_QUIET 0x01 // Don't redraw the menu after this command runs.
+
+struct CommandArg
+{
+    const char *text   = "";  // The raw value as typed.
+    float       number = 0;   // Filled in by the numeric parsers.
+};
+
+typedef bool (*CommandParser)(const char *text, CommandArg &arg);
+typedef void (*CommandHandler)(const CommandArg &arg);
+typedef void (*CommandDescriber)(char *buffer, size_t bufferSize); // Current value, for the menu.
+
+struct Command
+{
+    const char      *name;     // What the user types. Table must be sorted on this.
+    const char      *help;     // Menu text, e.g. "[n]ame".
+    const char      *prompt;   // Asks for a value on the next line. nullptr if none needed.
+    CommandParser    parse;    // Validates the value. nullptr if no value.
+    CommandHandler   handler;
+    CommandDescriber describe; // nullptr if there is nothing to show.
+    unsigned char    flags;
+};
+
+//*****************************************************************************
+// Compile-time helpers so a table can be checked with static_assert.
+// (Single-return constexpr to stay within C++11.)
+constexpr int commandNameCompare(const char *a, const char *b)
+{
+    return ((*a != *b) || (*a == 0)) ? (int)(unsigned char)*a - (int)(unsigned char)*b
+                                     : commandNameCompare(a + 1, b + 1);
+}
+
+constexpr bool commandTableSorted(const Command *table, size_t count)
+{
+    return (count < 2) ? true
+                       : (commandNameCompare(table[0].name, table[1].name) < 0) &&
+                         commandTableSorted(table + 1, count - 1);
+}
+
+//*****************************************************************************
+// Look up a command by name. Returns nullptr if there's no such command.
+const Command *findCommand(const Command *table, size_t count, const char *name)
+{
+    size_t lo = 0;
+    size_t hi = count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int    cmp = strcmp(name, table[mid].name);
+        if (cmp == 0) return &table[mid];
+        if (cmp < 0) hi = mid;
+        else lo = mid + 1;
+    }
+    return nullptr;
+}
+
+//*****************************************************************************
+// Format one menu line: help text padded to a column, then the current value.
+void formatCommandHelp(const Command &cmd, char *buffer, size_t bufferSize)
+{
+    const int HELP_COLUMN = 21;
+    char      value[40];
+
+    if (cmd.describe) {
+        cmd.describe(value, sizeof(value));
+        snprintf(buffer, bufferSize, "  %-*s(%s)", HELP_COLUMN, cmd.help, value);
+    } else {
+        snprintf(buffer, bufferSize, "  %s", cmd.help);
+    }
+}
+
+//*****************************************************************************
+// Standard value parsers.
+bool parseTextArg(const char *text, CommandArg &arg)
+{
+    arg.text = text;
+    return (strlen(text) > 0);
+}
+
+bool parseNumberArg(const char *text, CommandArg &arg)
+{
+    char *end;
+
+    arg.text   = text;
+    arg.number = strtof(text, &end);
+    return (end != text) && (*end == 0);
+}
+
+#endif //__DIGAME_COMMANDS_H__
@@ -0,0 +1,269 @@
+/* digameConfig.h
+ *
+ *  Device settings kept as one versioned, CRC-checked binary record.
+ *
+ *  /config.bin holds two slots. Saves alternate between them with an
+ *  increasing generation number, so the slot being overwritten is never
+ *  the only good copy. At boot both slots come in with a single read and
+ *  the valid one with the higher generation wins.
+ *
+ *  Schema changes: add fields to the end of ConfigRecord and bump
+ *  CONFIG_VERSION. A record written by older firmware is shorter. Its CRC
+ *  covers its own length, the fields it has are kept and the new ones
+ *  take their defaults. If there's no valid record at all, the settings
+ *  are migrated from the old per-setting text files.
+ *
+ *  Changes are coalesced: markDirty() just notes the time and service()
+ *  writes once things have been quiet for CONFIG_SAVE_DELAY_MS.
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#ifndef __DIGAME_CONFIG_H__
+#define __DIGAME_CONFIG_H__
+
+#include <digameDebug.h>
+#include <digameCRC.h>
+#include <digameFile.h>
+#include <FS.h>
+
+#define CONFIG_MAGIC         0x47464344 // "DCFG"
+#define CONFIG_VERSION       2
+#define CONFIG_FILE          "/config.bin"
+#define CONFIG_SLOT_SIZE     128        // Room for the record to grow.
+#define CONFIG_SAVE_DELAY_MS 2000
+#define CONFIG_NAME_LENGTH   32
+
+struct __attribute__((packed)) ConfigRecord
+{
+    // Header -- never changes between versions.
+    uint32_t magic;
+    uint16_t version;
+    uint16_t length;      // Bytes in the record as written, CRC included.
+    uint32_t generation;  // Higher is newer.
+
+    // Version 1
+    char     deviceName[CONFIG_NAME_LENGTH];
+    float    distanceThreshold;
+    float    smoothingFactor;
+
+    // Version 2
+    uint16_t checkpointSeconds; // Max time counts go unsaved while counting.
+    uint16_t checkpointEvents;  // Max events between count checkpoints.
+
+    // New fields go here.
+
+    uint32_t crc;         // CRC-32 over the first length - 4 bytes. Always last.
+};
+
+static_assert(sizeof(ConfigRecord) <= CONFIG_SLOT_SIZE, "ConfigRecord has outgrown its slot");
+
+#define CONFIG_HEADER_SIZE 12
+
+enum ConfigSource {
+    CONFIG_FROM_RECORD,   // Loaded a valid binary record.
+    CONFIG_FROM_TEXT,     // Migrated from the old text files.
+    CONFIG_FROM_DEFAULTS  // Nothing usable on flash.
+};
+
+class ConfigStore
+{
+  public:
+    ConfigRecord data;        // The live settings.
+    uint32_t     saves = 0;   // Flash writes since boot.
+
+    //*************************************************************************
+    // Load the settings. data must already hold the defaults.
+    ConfigSource begin(fs::FS &fileSystem)
+    {
+        fs = &fileSystem;
+
+        uint8_t slots[2 * CONFIG_SLOT_SIZE];
+        size_t  got  = 0;
+        File    file = fs->open(CONFIG_FILE, FILE_READ);
+        if (file) {
+            got = file.read(slots, sizeof(slots)); // The one read at boot.
+            file.close();
+        }
+
+        int best = -1;
+        uint32_t bestGeneration = 0;
+        for (int i = 0; i < 2; i++) {
+            if (got < (size_t)(i + 1) * CONFIG_SLOT_SIZE) break;
+            const uint8_t *slot = slots + i * CONFIG_SLOT_SIZE;
+            if (slotValid(slot) && ((best < 0) || (generationOf(slot) > bestGeneration))) {
+                best           = i;
+                bestGeneration = generationOf(slot);
+            }
+        }
+
+        if (best >= 0) {
+            const uint8_t *slot = slots + best * CONFIG_SLOT_SIZE;
+            size_t len = lengthOf(slot) - sizeof(data.crc);
+            memcpy(&data, slot, len); // Fields newer than the record keep their defaults.
+            activeSlot = best;
+            upgradeToCurrent();
+            if (lengthOf(slot) != sizeof(ConfigRecord)) save(); // Rewrite in the new layout.
+            return CONFIG_FROM_RECORD;
+        }
+
+        if (migrateTextFiles()) {
+            save();
+            removeTextFiles();
+            return CONFIG_FROM_TEXT;
+        }
+
+        upgradeToCurrent();
+        return CONFIG_FROM_DEFAULTS;
+    }
+
+    //*************************************************************************
+    // Note a change. The write happens later in service().
+    void markDirty(uint32_t nowMs)
+    {
+        dirty         = true;
+        lastChangeMs  = nowMs;
+    }
+
+    void service(uint32_t nowMs)
+    {
+        if (dirty && (nowMs - lastChangeMs >= CONFIG_SAVE_DELAY_MS)) save();
+    }
+
+    // Write now if anything is pending. Call before a deliberate reboot.
+    void flush() { if (dirty) save(); }
+
+    // Write what's pending and stop, e.g. before the file system is unmounted.
+    void end()
+    {
+        flush();
+        fs = nullptr;
+    }
+
+    //*************************************************************************
+    // Write the record into the slot that doesn't hold the current copy.
+    bool save()
+    {
+        if (!fs) return false;
+
+        upgradeToCurrent();
+        data.generation++;
+        data.crc = crc32((const uint8_t *)&data, sizeof(ConfigRecord) - sizeof(data.crc));
+
+        uint8_t slot[CONFIG_SLOT_SIZE];
+        memset(slot, 0xFF, sizeof(slot));
+        memcpy(slot, &data, sizeof(ConfigRecord));
+
+        int target = (activeSlot == 0) ? 1 : 0;
+
+        if (!fs->exists(CONFIG_FILE)) {
+            // First save: lay out both slots so the offsets exist.
+            File create = fs->open(CONFIG_FILE, FILE_WRITE);
+            if (!create) return false;
+            uint8_t blank[CONFIG_SLOT_SIZE];
+            memset(blank, 0xFF, sizeof(blank));
+            create.write(blank, sizeof(blank));
+            create.write(blank, sizeof(blank));
+            create.close();
+        }
+
+        File file = fs->open(CONFIG_FILE, "r+");
+        bool ok   = file && file.seek(target * CONFIG_SLOT_SIZE) &&
+                    (file.write(slot, sizeof(slot)) == sizeof(slot));
+        if (file) file.close();
+
+        if (!ok) {
+            DEBUG_PRINTLN("- config write failed");
+            return false;
+        }
+
+        activeSlot = target;
+        dirty      = false;
+        saves++;
+        DEBUG_PRINTLN("  Saved.");
+        return true;
+    }
+
+    bool pending() { return dirty; }
+
+  private:
+    fs::FS  *fs           = nullptr;
+    int      activeSlot   = -1; // Slot holding the newest good copy.
+    bool     dirty        = false;
+    uint32_t lastChangeMs = 0;
+
+    static uint16_t lengthOf(const uint8_t *slot)     { uint16_t v; memcpy(&v, slot + 6, 2); return v; }
+    static uint32_t generationOf(const uint8_t *slot) { uint32_t v; memcpy(&v, slot + 8, 4); return v; }
+
+    static bool slotValid(const uint8_t *slot)
+    {
+        uint32_t magic;
+        uint16_t version;
+        memcpy(&magic, slot, 4);
+        memcpy(&version, slot + 4, 2);
+        uint16_t len = lengthOf(slot);
+
+        if ((magic != CONFIG_MAGIC) || (version == 0) || (version > CONFIG_VERSION)) return false;
+        if ((len < CONFIG_HEADER_SIZE + sizeof(uint32_t)) || (len > sizeof(ConfigRecord))) return false;
+
+        uint32_t crc;
+        memcpy(&crc, slot + len - sizeof(crc), sizeof(crc));
+        return crc == crc32(slot, len - sizeof(crc));
+    }
+
+    void upgradeToCurrent()
+    {
+        data.magic   = CONFIG_MAGIC;
+        data.version = CONFIG_VERSION;
+        data.length  = sizeof(ConfigRecord);
+        data.deviceName[CONFIG_NAME_LENGTH - 1] = 0;
+    }
+
+    // Schema version 0: one text file per setting. Only the first line of
+    // each counts, so that's all we read.
+    bool migrateTextFiles()
+    {
+        bool found = false;
+        char line[CONFIG_NAME_LENGTH + 16];
+
+        if (firstLine("/name.txt", line, sizeof(line))) {
+            String temp(line);
+            temp.trim();
+            if (temp.length() > 0) {
+                strncpy(data.deviceName, temp.c_str(), CONFIG_NAME_LENGTH - 1);
+                data.deviceName[CONFIG_NAME_LENGTH - 1] = 0;
+                found = true;
+            }
+        }
+        if (firstLine("/smooth.txt", line, sizeof(line))) {
+            data.smoothingFactor = String(line).toFloat();
+            found = true;
+        }
+        if (firstLine("/threshold.txt", line, sizeof(line))) {
+            data.distanceThreshold = String(line).toFloat();
+            found = true;
+        }
+        return found;
+    }
+
+    // False if the file isn't there or its first line is empty.
+    bool firstLine(const char *path, char *line, size_t size)
+    {
+        if (!fs->exists(path)) return false;
+
+        FileLineReader<> reader;
+        if (!reader.open(*fs, path)) return false;
+        bool got = reader.nextLine(line, size);
+        reader.close();
+        return got && (line[0] != 0);
+    }
+
+    void removeTextFiles()
+    {
+        fs->remove("/name.txt");
+        fs->remove("/smooth.txt");
+        fs->remove("/threshold.txt");
+    }
+};
+
+#endif //__DIGAME_CONFIG_H__
@@ -0,0 +1,274 @@
+/* digameControl.h
+ *
+ *  A framed, binary request/response protocol for machine clients. It runs
+ *  on the same Serial and Bluetooth links as the text menu: frames start
+ *  with a non-ASCII sync byte, so anything else is left to the line
+ *  assembler. Every request carries a request ID that the response echoes,
+ *  so a client can pipeline many requests without waiting on each answer.
+ *
+ *  Frame layout (multi-byte fields are little-endian):
+ *
+ *    0xA5 0x5A | length (2) | request ID (2) | opcode (1) | payload (length) | CRC16 (2)
+ *
+ *  The CRC is CRC-16/CCITT-FALSE over everything from the length field to
+ *  the end of the payload. A response uses the request's opcode with the
+ *  high bit set and starts its payload with a status byte.
+ *
+ *  No Arduino dependencies -- builds on a Linux host as-is.
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#ifndef __DIGAME_CONTROL_H__
+#define __DIGAME_CONTROL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <digameCRC.h>
+
+#define CONTROL_SYNC1            0xA5
+#define CONTROL_SYNC2            0x5A
+#define CONTROL_MAX_PAYLOAD      240
+#define CONTROL_HEADER_SIZE      7   // Sync, length, request ID and opcode.
+#define CONTROL_FRAME_OVERHEAD   (CONTROL_HEADER_SIZE + 2)
+#define CONTROL_MAX_FRAME        (CONTROL_MAX_PAYLOAD + CONTROL_FRAME_OVERHEAD)
+#define CONTROL_RESPONSE_FLAG    0x80
+#define CONTROL_FRAME_TIMEOUT_MS 500 // Max gap between bytes inside a frame.
+
+// Opcodes
+#define CONTROL_PING             0x01
+#define CONTROL_GET_CONFIG       0x02 // key                 -> status, key, value
+#define CONTROL_SET_CONFIG       0x03 // key, value          -> status
+#define CONTROL_GET_COUNTS       0x04 //                     -> status, inbound, outbound
+#define CONTROL_READ_EVENTS      0x05 // first seq, max      -> status, oldest, newest, count, records...
+#define CONTROL_GET_HEALTH       0x06 //                     -> status, health stats
+#define CONTROL_GET_TOTALS       0x07 // from min, to min    -> status, complete, in, out, newest min, flags
+#define CONTROL_SET_TIME         0x08 // utc ms (8), +/- ms (2) -> status, accepted, error ms (i32)
+#define CONTROL_GET_TIME         0x09 //                     -> status, valid, source, utc ms (8), drift ppb (i32), syncs, sync age s
+
+// Reliable event delivery. After a subscribe, the device pushes EVENT_BATCH
+// frames (request ID 0) holding up to CONTROL_EVENTS_PER_BATCH records of
+// seq (4), time ms (8), flags (1), type (1), count (4). With flags bit 0
+// set the time is UTC; without, it is uptime from before the clock was set.
+// READ_EVENTS uses the same records. The client acknowledges the highest
+// sequence number it holds contiguously; anything unacknowledged is sent
+// again after CONTROL_ACK_TIMEOUT_MS or on reconnect.
+#define CONTROL_SUBSCRIBE_EVENTS 0x10 // resume seq (0=oldest) -> status, oldest seq, next seq
+#define CONTROL_ACK_EVENTS       0x11 // seq                 -> status
+#define CONTROL_UNSUBSCRIBE      0x12 //                     -> status
+#define CONTROL_EVENT_BATCH      0x90 // Device push. count (1), records...
+
+#define CONTROL_EVENT_RECORD_SIZE 18
+#define CONTROL_EVENTS_PER_BATCH  ((CONTROL_MAX_PAYLOAD - 1) / CONTROL_EVENT_RECORD_SIZE)
+#define CONTROL_EVENTS_PER_READ   ((CONTROL_MAX_PAYLOAD - 10) / CONTROL_EVENT_RECORD_SIZE)
+#define CONTROL_ACK_TIMEOUT_MS    2000
+
+// Status codes
+#define CONTROL_OK               0
+#define CONTROL_UNKNOWN_OPCODE   1
+#define CONTROL_BAD_REQUEST      2
+#define CONTROL_UNSUPPORTED      3
+#define CONTROL_BAD_KEY          4
+#define CONTROL_FAILED           5
+
+// Configuration keys for GET/SET_CONFIG. Strings are sent as raw bytes,
+// numbers as little-endian IEEE-754 floats.
+#define CONFIG_KEY_DEVICE_NAME       1
+#define CONFIG_KEY_THRESHOLD         2
+#define CONFIG_KEY_SMOOTHING         3
+#define CONFIG_KEY_CHECKPOINT        4 // Seconds between count checkpoints.
+#define CONFIG_KEY_CHECKPOINT_EVENTS 5 // Events between count checkpoints.
+
+//*****************************************************************************
+// Little-endian packing into / out of a fixed buffer. Writes past the end
+// and reads past the end are caught and flagged rather than overrunning.
+class PayloadWriter
+{
+  public:
+    PayloadWriter(uint8_t *buf, size_t size) : buffer(buf), capacity(size) {}
+
+    void putU8(uint8_t v)   { put(&v, 1); }
+    void putU16(uint16_t v) { uint8_t b[2] = {(uint8_t)v, (uint8_t)(v >> 8)}; put(b, 2); }
+    void putU32(uint32_t v)
+    {
+        uint8_t b[4] = {(uint8_t)v, (uint8_t)(v >> 8), (uint8_t)(v >> 16), (uint8_t)(v >> 24)};
+        put(b, 4);
+    }
+    void putFloat(float f)  { uint32_t v; memcpy(&v, &f, 4); putU32(v); }
+    void put(const void *data, size_t n)
+    {
+        if (len + n > capacity) { overflow = true; return; }
+        memcpy(buffer + len, data, n);
+        len += n;
+    }
+
+    size_t   length()     { return len; }
+    size_t   remaining()  { return capacity - len; }
+    bool     overflowed() { return overflow; }
+
+  private:
+    uint8_t *buffer;
+    size_t   capacity;
+    size_t   len      = 0;
+    bool     overflow = false;
+};
+
+class PayloadReader
+{
+  public:
+    PayloadReader(const uint8_t *buf, size_t size) : buffer(buf), len(size) {}
+
+    uint8_t  getU8()  { uint8_t b = 0; get(&b, 1); return b; }
+    uint16_t getU16() { uint8_t b[2] = {0}; get(b, 2); return (uint16_t)(b[0] | (b[1] << 8)); }
+    uint32_t getU32()
+    {
+        uint8_t b[4] = {0};
+        get(b, 4);
+        return (uint32_t)b[0] | ((uint32_t)b[1] << 8) | ((uint32_t)b[2] << 16) | ((uint32_t)b[3] << 24);
+    }
+    float    getFloat() { uint32_t v = getU32(); float f; memcpy(&f, &v, 4); return f; }
+    void get(void *data, size_t n)
+    {
+        if (pos + n > len) { underflow = true; pos = len; return; }
+        memcpy(data, buffer + pos, n);
+        pos += n;
+    }
+
+    const uint8_t *rest()         { return buffer + pos; }
+    size_t         remaining()    { return len - pos; }
+    bool           underflowed()  { return underflow; }
+
+  private:
+    const uint8_t *buffer;
+    size_t         len;
+    size_t         pos       = 0;
+    bool           underflow = false;
+};
+
+//*****************************************************************************
+// Build a complete frame in out[]. Returns the frame length, or 0 if the
+// payload is too big or out[] is too small.
+size_t encodeControlFrame(uint8_t *out, size_t outSize, uint16_t requestId, uint8_t opcode,
+                          const uint8_t *payload, size_t payloadLen)
+{
+    if ((payloadLen > CONTROL_MAX_PAYLOAD) || (outSize < payloadLen + CONTROL_FRAME_OVERHEAD)) return 0;
+
+    out[0] = CONTROL_SYNC1;
+    out[1] = CONTROL_SYNC2;
+    out[2] = (uint8_t)payloadLen;
+    out[3] = (uint8_t)(payloadLen >> 8);
+    out[4] = (uint8_t)requestId;
+    out[5] = (uint8_t)(requestId >> 8);
+    out[6] = opcode;
+    if (payloadLen) memcpy(out + CONTROL_HEADER_SIZE, payload, payloadLen);
+
+    uint16_t crc = crc16(out + 2, payloadLen + CONTROL_HEADER_SIZE - 2);
+    out[CONTROL_HEADER_SIZE + payloadLen]     = (uint8_t)crc;
+    out[CONTROL_HEADER_SIZE + payloadLen + 1] = (uint8_t)(crc >> 8);
+
+    return payloadLen + CONTROL_FRAME_OVERHEAD;
+}
+
+//*****************************************************************************
+// Incremental frame decoder. Feed it every byte from a link; bytes that are
+// not part of a frame are handed back so the text console can have them.
+enum ControlFeedResult {
+    CONTROL_NOT_MINE,    // Not part of a frame. Pass it on.
+    CONTROL_CONSUMED,    // Part of a frame still being received.
+    CONTROL_FRAME_READY  // A frame with a good CRC is ready.
+};
+
+class ControlDecoder
+{
+  public:
+    uint16_t requestId  = 0;
+    uint8_t  opcode     = 0;
+    uint8_t  payload[CONTROL_MAX_PAYLOAD];
+    uint16_t payloadLen = 0;
+
+    uint32_t framesReceived = 0;
+    uint32_t crcErrors      = 0;
+    uint32_t oversizeFrames = 0;
+    uint32_t timeouts       = 0;
+
+    // nowMs is any millisecond clock. A frame that stalls part way through
+    // is dropped, so a half-sent frame can't swallow later console input.
+    ControlFeedResult feed(uint8_t b, uint32_t nowMs)
+    {
+        if ((state != WAIT_SYNC1) && (nowMs - lastByteMs > CONTROL_FRAME_TIMEOUT_MS)) {
+            timeouts++;
+            state = WAIT_SYNC1;
+        }
+        lastByteMs = nowMs;
+
+        switch (state) {
+            case WAIT_SYNC1:
+                if (b != CONTROL_SYNC1) return CONTROL_NOT_MINE;
+                state = WAIT_SYNC2;
+                return CONTROL_CONSUMED;
+
+            case WAIT_SYNC2:
+                if (b == CONTROL_SYNC2) {
+                    state = HEADER;
+                    pos   = 0;
+                } else if (b != CONTROL_SYNC1) {
+                    state = WAIT_SYNC1;
+                    return CONTROL_NOT_MINE;
+                }
+                return CONTROL_CONSUMED;
+
+            case HEADER:
+                header[pos++] = b;
+                if (pos == sizeof(header)) {
+                    payloadLen = (uint16_t)(header[0] | (header[1] << 8));
+                    requestId  = (uint16_t)(header[2] | (header[3] << 8));
+                    opcode     = header[4];
+                    if (payloadLen > CONTROL_MAX_PAYLOAD) {
+                        oversizeFrames++;
+                        state = WAIT_SYNC1;
+                        return CONTROL_CONSUMED;
+                    }
+                    pos   = 0;
+                    state = (payloadLen > 0) ? PAYLOAD : CRC;
+                }
+                return CONTROL_CONSUMED;
+
+            case PAYLOAD:
+                payload[pos++] = b;
+                if (pos == payloadLen) {
+                    pos   = 0;
+                    state = CRC;
+                }
+                return CONTROL_CONSUMED;
+
+            case CRC:
+                crcBytes[pos++] = b;
+                if (pos < 2) return CONTROL_CONSUMED;
+
+                state = WAIT_SYNC1;
+                if ((uint16_t)(crcBytes[0] | (crcBytes[1] << 8)) !=
+                    crc16(payload, payloadLen, crc16(header, sizeof(header)))) {
+                    crcErrors++;
+                    return CONTROL_CONSUMED;
+                }
+                framesReceived++;
+                return CONTROL_FRAME_READY;
+        }
+        return CONTROL_NOT_MINE;
+    }
+
+    bool inFrame() { return state != WAIT_SYNC1; }
+
+  private:
+    enum State { WAIT_SYNC1, WAIT_SYNC2, HEADER, PAYLOAD, CRC };
+
+    State    state = WAIT_SYNC1;
+    uint8_t  header[5];  // Length, request ID, opcode.
+    uint8_t  crcBytes[2];
+    uint16_t pos        = 0;
+    uint32_t lastByteMs = 0;
+};
+
+#endif //__DIGAME_CONTROL_H__
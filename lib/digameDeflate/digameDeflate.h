@@ -0,0 +1,177 @@
+/* digameDeflate.h
+ *
+ *  Small in-memory gzip compression, for pages rendered on the device.
+ *
+ *  The input is compressed whole, in one call, into a growing buffer.
+ *  Matches are found through a hash of the next three bytes and a short
+ *  chain of earlier positions with the same hash. The output is a single
+ *  deflate block with the fixed Huffman codes. That's a little bigger than
+ *  what gzip -9 makes, but it needs no tables to be built or sent. The
+ *  1556-byte index.html comes to 927 bytes (gzip -9: 782).
+ *
+ *  Back-references reach at most DEFLATE_WINDOW_SIZE bytes. That matches
+ *  digameInflate, so the two can check each other on a host. The work
+ *  buffers come to about 20 KB, and are freed before it returns.
+ *
+ *  No Arduino dependencies -- builds on a Linux host as-is.
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#ifndef __DIGAME_DEFLATE_H__
+#define __DIGAME_DEFLATE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include <digameCRC.h>
+
+#define DEFLATE_WINDOW_BITS 13 // 8 KB, as digameInflate.
+#define DEFLATE_WINDOW_SIZE (1UL << DEFLATE_WINDOW_BITS)
+#define DEFLATE_HASH_BITS   11
+#define DEFLATE_MAX_CHAIN   32     // Earlier positions tried for each match.
+#define DEFLATE_MAX_INPUT   65534  // Positions are kept in 16 bits.
+
+//*****************************************************************************
+class GzipDeflater
+{
+  public:
+    // Appends data, gzipped, to out. False if it's too big to take.
+    static bool compress(const uint8_t *data, size_t length, std::vector<uint8_t> &out)
+    {
+        if (length > DEFLATE_MAX_INPUT) return false;
+
+        static const uint8_t header[10] = { 0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 0xFF }; // No name, no time.
+        out.insert(out.end(), header, header + sizeof(header));
+
+        GzipDeflater d(out);
+        d.put(1, 1); // The last block...
+        d.put(1, 2); // ...with fixed codes.
+        d.matchAll(data, length);
+        d.symbol(256);
+        d.align();
+
+        uint32_t crc = crc32(data, length);
+        for (int i = 0; i < 4; i++) out.push_back((uint8_t)(crc >> (8 * i)));
+        for (int i = 0; i < 4; i++) out.push_back((uint8_t)(length >> (8 * i)));
+        return true;
+    }
+
+  private:
+    std::vector<uint8_t> &out;
+    uint32_t              bits     = 0; // Not yet written, low bit first.
+    unsigned              bitCount = 0;
+
+    explicit GzipDeflater(std::vector<uint8_t> &output) : out(output) {}
+
+    //*************************************************************************
+    // Greedy matching. head[] and prev[] hold position + 1, 0 for none.
+    void matchAll(const uint8_t *data, size_t length)
+    {
+        std::vector<uint16_t> head(1UL << DEFLATE_HASH_BITS, 0);
+        std::vector<uint16_t> prev(DEFLATE_WINDOW_SIZE, 0);
+        size_t i = 0;
+
+        while (i < length) {
+            size_t bestLength = 0, bestDistance = 0;
+
+            if (i + 3 <= length) {
+                unsigned h     = hash(data + i);
+                unsigned chain = DEFLATE_MAX_CHAIN;
+                size_t   limit = (length - i < 258) ? length - i : 258;
+
+                for (uint16_t p = head[h]; p && chain--; p = prev[(p - 1) & (DEFLATE_WINDOW_SIZE - 1)]) {
+                    size_t from = p - 1;
+                    if (i - from > DEFLATE_WINDOW_SIZE) break;
+                    size_t n = 0;
+                    while ((n < limit) && (data[from + n] == data[i + n])) n++;
+                    if (n > bestLength) {
+                        bestLength   = n;
+                        bestDistance = i - from;
+                        if (n == limit) break;
+                    }
+                }
+            }
+
+            size_t step = (bestLength >= 3) ? bestLength : 1;
+            if (step == 1) {
+                symbol(data[i]);
+            } else {
+                pair(bestLength, bestDistance);
+            }
+            for (size_t end = i + step; i < end; i++) { // Every position goes into the chains.
+                if (i + 3 > length) continue;
+                unsigned h = hash(data + i);
+                prev[i & (DEFLATE_WINDOW_SIZE - 1)] = head[h];
+                head[h] = (uint16_t)(i + 1);
+            }
+        }
+    }
+
+    static unsigned hash(const uint8_t *p)
+    {
+        uint32_t v = ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+        return (uint32_t)(v * 2654435761UL) >> (32 - DEFLATE_HASH_BITS);
+    }
+
+    //*************************************************************************
+    // RFC 1951 3.2.6: the fixed literal/length code.
+    void symbol(unsigned s)
+    {
+        if (s < 144)      code(0x30 + s, 8);
+        else if (s < 256) code(0x190 + (s - 144), 9);
+        else if (s < 280) code(s - 256, 7);
+        else              code(0xC0 + (s - 280), 8);
+    }
+
+    void pair(size_t length, size_t distance)
+    {
+        static const uint16_t lengthBase[29] = { 3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+                                                 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+        static const uint8_t lengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                                                 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+        static const uint16_t distBase[30] = { 1,   2,   3,   4,   5,   7,    9,    13,   17,   25,
+                                               33,  49,  65,  97,  129, 193,  257,  385,  513,  769,
+                                               1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+        static const uint8_t distExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2,  3,  3,  4,  4,  5,  5,  6,
+                                               6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+        int l = 28;
+        while (lengthBase[l] > length) l--;
+        symbol(257 + l);
+        put(length - lengthBase[l], lengthExtra[l]);
+
+        int d = 29;
+        while (distBase[d] > distance) d--;
+        code(d, 5);
+        put(distance - distBase[d], distExtra[d]);
+    }
+
+    //*************************************************************************
+    // Huffman codes go most significant bit first; everything else least.
+    void code(unsigned value, unsigned n)
+    {
+        unsigned reversed = 0;
+        for (unsigned i = 0; i < n; i++) reversed |= ((value >> i) & 1) << (n - 1 - i);
+        put(reversed, n);
+    }
+
+    void put(uint32_t value, unsigned n)
+    {
+        bits |= value << bitCount;
+        bitCount += n;
+        while (bitCount >= 8) {
+            out.push_back((uint8_t)bits);
+            bits >>= 8;
+            bitCount -= 8;
+        }
+    }
+
+    void align()
+    {
+        if (bitCount) put(0, 8 - bitCount);
+    }
+};
+
+#endif //__DIGAME_DEFLATE_H__
@@ -0,0 +1,371 @@
+/* digameDelta.h
+ *
+ *  Applies a binary patch from tools/make_delta.py to the running
+ *  firmware, as the patch arrives, to make the new image.
+ *
+ *  Most updates change a little code, but everything after the change
+ *  moves, so the addresses in calls and literal pools change all through
+ *  the image. A patch is a list of operations that build the new image
+ *  from the old one:
+ *
+ *    COPY offset, length          the old image's bytes as they are
+ *    DIFF offset, length, bytes   the old image's bytes plus these, byte by
+ *                                 byte -- mostly zeros where code moved
+ *    ADD  length, bytes           new bytes
+ *
+ *  DIFF is bsdiff's idea. Its bytes are mostly zero, so the patch
+ *  compresses very well, and make_delta.py always gzips it (the /update
+ *  handler decompresses it with digameInflate on the way in). A small
+ *  change to a 1 MB image is typically a 100 KB upload instead of 900 KB.
+ *
+ *  The patch header gives the old image's size and SHA-256. A patch made
+ *  against some other build is refused before anything is written. It also
+ *  gives the new image's size and SHA-256, to check the result.
+ *
+ *  RAM use is fixed: the patcher holds one operation header and reads the
+ *  old image DELTA_CHUNK bytes at a time. A COPY can be most of the image,
+ *  so one write() copies at most DELTA_COPY_SLICE bytes of it and stops,
+ *  leaving the rest of its input. The caller keeps calling write() with
+ *  what's left -- with nothing at all if copying() -- and can let other
+ *  work run in between. Where the old image comes from
+ *  and the new one goes is up to a DeltaTarget. On the ESP32 that's the
+ *  running app partition, and Update or whatever output is given.
+ *
+ *  No Arduino dependencies outside the ESP32 glue -- builds on a Linux
+ *  host as-is.
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#ifndef __DIGAME_DELTA_H__
+#define __DIGAME_DELTA_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define DELTA_MAGIC   0x4C444744 // "DGDL"
+#define DELTA_VERSION 1
+#define DELTA_CHUNK   256        // Bytes of the old image read at a time.
+#define DELTA_COPY_SLICE 4096    // Most bytes one write() copies from the old image.
+
+enum DeltaOp { DELTA_END = 0, DELTA_ADD = 1, DELTA_COPY = 2, DELTA_DIFF = 3 };
+
+enum PatchResult { PATCH_MORE, PATCH_DONE, PATCH_ERROR };
+
+// Little-endian, as it arrives. Then the operations: a DeltaOp byte, then
+// ADD: length, COPY and DIFF: offset, length, each 32 bits. ADD and DIFF
+// are followed by their length in bytes.
+struct __attribute__((packed)) DeltaHeader
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t headerSize; // sizeof(DeltaHeader), for later versions to grow.
+    uint32_t oldSize;
+    uint32_t newSize;
+    uint8_t  oldSha256[32];
+    uint8_t  newSha256[32];
+};
+
+//*****************************************************************************
+// Where the old image is read from and the new one written to.
+class DeltaTarget
+{
+  public:
+    virtual ~DeltaTarget() {}
+    // Is the patch for the image we have? Returns what's wrong, or nullptr.
+    virtual const char *begin(const DeltaHeader &header) = 0;
+    virtual bool        readOld(uint32_t offset, uint8_t *buffer, size_t length) = 0;
+    virtual bool        write(const uint8_t *data, size_t length) = 0;
+};
+
+//*****************************************************************************
+class DeltaPatcher
+{
+  public:
+    DeltaPatcher(DeltaTarget &target) : image(target) {}
+
+    static bool isDelta(const uint8_t *data, size_t length)
+    {
+        return (length >= 4) && (data[0] == 'D') && (data[1] == 'G') && (data[2] == 'D') && (data[3] == 'L');
+    }
+
+    //*************************************************************************
+    // Apply the next piece of the patch. Returns PATCH_MORE until the END
+    // operation. Anything after that is ignored. used() says how much of
+    // the input was taken: all of it, unless a COPY's slice ran out first.
+    PatchResult write(const uint8_t *data, size_t length)
+    {
+        const uint8_t *start  = data;
+        const uint8_t *end    = data + length;
+        uint32_t       budget = DELTA_COPY_SLICE;
+
+        while ((state != S_DONE) && (state != S_ERROR)) {
+            if (state == S_COPY) {
+                if (budget == 0) break;
+                budget -= copy(budget);
+                continue;
+            }
+            if (data == end) break;
+
+            switch (state) {
+            case S_HEADER:
+                if (collect(data, end, headerWanted)) header();
+                break;
+            case S_SKIP: {
+                size_t n = end - data;
+                if (n > skip) n = skip;
+                data += n;
+                skip -= n;
+                if (skip == 0) state = S_OP;
+                break;
+            }
+            case S_OP:
+                if (collect(data, end, 1)) {
+                    opWanted = (held[0] == DELTA_ADD) ? 5 : 9;
+                    if (held[0] == DELTA_END) {
+                        finishImage();
+                    } else if (held[0] > DELTA_DIFF) {
+                        fail("Bad patch operation");
+                    } else {
+                        heldLength = 1; // Keep the op. Its arguments follow it.
+                        state      = S_OP_ARGS;
+                    }
+                }
+                break;
+            case S_OP_ARGS:
+                if (collect(data, end, opWanted)) operation();
+                break;
+            case S_ADD:
+            case S_DIFF:
+                data += bytes(data, end - data);
+                break;
+            default:
+                break;
+            }
+        }
+
+        taken = (state == S_DONE) ? length : data - start; // What's after END is used up.
+        if (state == S_ERROR) return PATCH_ERROR;
+        return (state == S_DONE) ? PATCH_DONE : PATCH_MORE;
+    }
+
+    size_t used() const { return taken; }    // Of the last write()'s input.
+    bool   copying() const { return state == S_COPY; }
+
+    // No more patch is coming. PATCH_DONE only if it was whole.
+    PatchResult finish()
+    {
+        if (state == S_DONE) return PATCH_DONE;
+        if (state != S_ERROR) fail("Patch is truncated");
+        return PATCH_ERROR;
+    }
+
+    const char        *error() const { return problem; }
+    const DeltaHeader &patchHeader() const { return info; }
+    uint32_t           outputLength() const { return total; }
+    uint32_t           copiedLength() const { return copied; } // From the old image, by COPY or DIFF.
+
+  private:
+    enum State { S_HEADER, S_SKIP, S_OP, S_OP_ARGS, S_ADD, S_COPY, S_DIFF, S_DONE, S_ERROR };
+
+    DeltaTarget &image;
+    State        state = S_HEADER;
+    const char  *problem = nullptr;
+    DeltaHeader  info;
+
+    uint8_t      held[sizeof(DeltaHeader)]; // A header being put together.
+    size_t       heldLength   = 0;
+    size_t       headerWanted = 12;         // Up to headerSize first, to check it.
+    size_t       opWanted     = 0;
+    uint32_t     skip         = 0;
+
+    uint32_t     offset = 0;  // In the old image, for COPY and DIFF.
+    uint32_t     left   = 0;  // Bytes still to come for the operation.
+    uint32_t     total  = 0;  // Bytes of new image written.
+    uint32_t     copied = 0;
+    size_t       taken  = 0;
+    uint8_t      old[DELTA_CHUNK];
+
+    bool fail(const char *why)
+    {
+        if (state != S_ERROR) problem = why;
+        state = S_ERROR;
+        return false;
+    }
+
+    static uint32_t le32(const uint8_t *p)
+    {
+        return p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+    }
+
+    // Gather bytes into held until there are wanted of them. True once
+    // there are. The next call starts afresh.
+    bool collect(const uint8_t *&data, const uint8_t *end, size_t wanted)
+    {
+        while ((heldLength < wanted) && (data < end)) held[heldLength++] = *data++;
+        if (heldLength < wanted) return false;
+        heldLength = 0;
+        return true;
+    }
+
+    //*************************************************************************
+    void header()
+    {
+        if (headerWanted < sizeof(DeltaHeader)) { // The first few bytes.
+            memcpy(&info, held, headerWanted);
+            if (info.magic != DELTA_MAGIC) { fail("Not a patch"); return; }
+            if (info.version != DELTA_VERSION) { fail("Unsupported patch version"); return; }
+            if (info.headerSize < sizeof(DeltaHeader)) { fail("Bad patch header"); return; }
+            heldLength   = headerWanted; // Keep them, and read the rest.
+            headerWanted = sizeof(DeltaHeader);
+            return;
+        }
+
+        memcpy(&info, held, sizeof(info));
+        const char *why = image.begin(info);
+        if (why) { fail(why); return; }
+        skip  = info.headerSize - sizeof(DeltaHeader);
+        state = skip ? S_SKIP : S_OP;
+    }
+
+    void operation()
+    {
+        uint8_t  op     = held[0];
+        uint32_t length = le32(held + opWanted - 4);
+
+        if (length > info.newSize - total) { fail("Patch makes too big an image"); return; }
+        if (op != DELTA_ADD) {
+            offset = le32(held + 1);
+            if ((offset > info.oldSize) || (length > info.oldSize - offset)) {
+                fail("Patch reads past the old image");
+                return;
+            }
+        }
+
+        left = length;
+        if (!left) {
+            state = S_OP;
+        } else if (op == DELTA_ADD) {
+            state = S_ADD;
+        } else {
+            state = (op == DELTA_COPY) ? S_COPY : S_DIFF;
+        }
+    }
+
+    // Up to budget bytes more of a COPY. Returns how many were copied.
+    uint32_t copy(uint32_t budget)
+    {
+        uint32_t done = 0;
+        while (left && (done < budget)) {
+            uint32_t n = (left < DELTA_CHUNK) ? left : DELTA_CHUNK;
+            if (n > budget - done) n = budget - done;
+            if (!image.readOld(offset, old, n)) { fail("Couldn't read the old image"); return budget; }
+            if (!image.write(old, n)) { fail("Couldn't write the new image"); return budget; }
+            offset += n;
+            left   -= n;
+            total  += n;
+            copied += n;
+            done   += n;
+        }
+        if (left == 0) state = S_OP;
+        return done;
+    }
+
+    // ADD's or DIFF's bytes, as many as there are of them here. Returns how
+    // many were used.
+    size_t bytes(const uint8_t *data, size_t length)
+    {
+        if (length > left) length = left;
+        if (length > DELTA_CHUNK) length = DELTA_CHUNK;
+
+        if (state == S_DIFF) {
+            if (!image.readOld(offset, old, length)) { fail("Couldn't read the old image"); return length; }
+            for (size_t i = 0; i < length; i++) old[i] += data[i];
+            offset += length;
+            copied += length;
+            data = old;
+        }
+        if (!image.write(data, length)) { fail("Couldn't write the new image"); return length; }
+
+        total += length;
+        left  -= length;
+        if (left == 0) state = S_OP;
+        return length;
+    }
+
+    void finishImage()
+    {
+        if (total != info.newSize) { fail("Patch makes too small an image"); return; }
+        state = S_DONE;
+    }
+};
+
+#if defined(ESP32)
+//*****************************************************************************
+// The ESP32 side: patch the running app partition into the OTA partition,
+// through Update (which the caller has begun) or the given output.
+#include <Update.h>
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+#include <digameSha256.h>
+
+class OtaDeltaTarget : public DeltaTarget
+{
+  public:
+    typedef bool (*Output)(void *context, const uint8_t *data, size_t length);
+
+    OtaDeltaTarget(Output output = nullptr, void *context = nullptr) : out(output), outContext(context) {}
+
+    const char *begin(const DeltaHeader &header) override
+    {
+        running = esp_ota_get_running_partition();
+        if (!running || (header.oldSize > running->size)) return "Patch is for a bigger image than is running";
+
+        // Hash what's running, the size the patch says. About 0.1 s for 1 MB.
+        uint8_t digest[32];
+        uint8_t buffer[DELTA_CHUNK];
+        sha.begin();
+        for (uint32_t at = 0; at < header.oldSize; at += sizeof(buffer)) {
+            size_t n = (header.oldSize - at < sizeof(buffer)) ? header.oldSize - at : sizeof(buffer);
+            if (esp_partition_read(running, at, buffer, n) != ESP_OK) return "Couldn't read the running image";
+            sha.update(buffer, n);
+        }
+        sha.finish(digest);
+        if (memcmp(digest, header.oldSha256, sizeof(digest))) return "Patch is not for the firmware that's running";
+
+        memcpy(expected, header.newSha256, sizeof(expected));
+        sha.begin(); // Now for the new image.
+        return nullptr;
+    }
+
+    bool readOld(uint32_t offset, uint8_t *buffer, size_t length) override
+    {
+        return esp_partition_read(running, offset, buffer, length) == ESP_OK;
+    }
+
+    bool write(const uint8_t *data, size_t length) override
+    {
+        sha.update(data, length);
+        if (out) return out(outContext, data, length);
+        return Update.write((uint8_t *)data, length) == length;
+    }
+
+    // Once the patch is done: is the new image the one it meant to make?
+    bool verify()
+    {
+        uint8_t digest[32];
+        sha.finish(digest);
+        return memcmp(digest, expected, sizeof(digest)) == 0;
+    }
+
+  private:
+    const esp_partition_t *running = nullptr;
+    Output                 out;
+    void                  *outContext;
+    Sha256                 sha;
+    uint8_t                expected[32];
+};
+#endif // ESP32
+
+#endif //__DIGAME_DELTA_H__
@@ -0,0 +1,501 @@
+/* digameEventLog.h
+ *
+ *  A durable, append-only log of counting events on the flash file system.
+ *
+ *  The log is a chain of segment files (/evlog_00000000.bin, ...) each
+ *  holding at most EVENT_LOG_SEGMENT_RECORDS fixed-size binary records.
+ *  Records carry their own magic byte and CRC. New events are buffered in
+ *  RAM and written in one go when EVENT_LOG_BATCH_EVENTS have collected or
+ *  EVENT_LOG_FLUSH_MS has passed. When a segment is full the log rotates to
+ *  a new one and deletes the oldest once EVENT_LOG_MAX_SEGMENTS exist, so
+ *  the total size is bounded.
+ *
+ *  Power loss: a write cut short leaves a torn record at the end of the
+ *  newest segment. begin() finds the last record with a good CRC, resumes
+ *  numbering from it and starts a fresh segment, so nothing is ever
+ *  appended after a damaged record. Readers stop at the first bad record in
+ *  each segment.
+ *
+ *  On the ESP32 the log's state is behind a mutex, so the log can be read
+ *  from other tasks (the uploader, MQTT, the web API) while the main loop
+ *  appends. Readers only hold it long enough to copy the segment list and
+ *  the unflushed batch. Their file reads happen after they've let go, so
+ *  the loop never waits on another task's flash reads. A segment rotated
+ *  out while someone is reading it is deleted once they've finished.
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#ifndef __DIGAME_EVENT_LOG_H__
+#define __DIGAME_EVENT_LOG_H__
+
+#include <digameDebug.h>
+#include <digameCRC.h>
+#include <FS.h>
+
+#define EVENT_LOG_SEGMENT_RECORDS 170  // ~4 KB per segment.
+#define EVENT_LOG_MAX_SEGMENTS    16   // Oldest segment is deleted beyond this.
+#define EVENT_LOG_BATCH_EVENTS    16   // Flush when this many are buffered...
+#define EVENT_LOG_FLUSH_MS        5000 // ...or when the oldest has waited this long.
+
+#define EVENT_RECORD_MAGIC        0xE7
+#define EVENT_FLAG_UTC            0x01 // timeMs is UTC milliseconds, not uptime.
+#define EVENT_CURSOR_MAGIC        0x52435544 // "DUCR"
+
+struct __attribute__((packed)) EventRecord
+{
+    uint8_t  magic;
+    uint8_t  type;    // INBOUND / OUTBOUND
+    uint8_t  flags;
+    uint8_t  reserved;
+    uint32_t seq;
+    uint32_t count;   // Running count for that direction after this event.
+    uint64_t timeMs;
+    uint32_t crc;     // CRC-32 over everything above.
+};
+
+static_assert(sizeof(EventRecord) == 24, "EventRecord is a fixed on-flash format");
+
+//*****************************************************************************
+// An event as the JSON object the server, the broker and the web API all
+// get. Returns what snprintf does.
+inline int eventToJSON(const EventRecord &r, char *buffer, size_t size)
+{
+    return snprintf(buffer, size, "{\"seq\":%lu,\"time\":%llu,\"utc\":%d,\"eventType\":\"%s\",\"count\":%lu}",
+                    (unsigned long)r.seq, (unsigned long long)r.timeMs, (r.flags & EVENT_FLAG_UTC) ? 1 : 0,
+                    (r.type == 0) ? "inbound" : "outbound", (unsigned long)r.count);
+}
+
+#define EVENT_LOG_SEGMENT_SIZE (EVENT_LOG_SEGMENT_RECORDS * sizeof(EventRecord))
+
+class EventLog
+{
+  public:
+    uint32_t flushes      = 0; // Flash writes. (One per batch.)
+    uint32_t writeErrors  = 0;
+    uint32_t tornRecords  = 0; // Bad tail records found at begin().
+    uint32_t droppedRecords = 0; // Lost because the flash kept failing.
+
+    //*************************************************************************
+    // Scan the existing segments, recover from any torn write and get ready
+    // to append. Returns the sequence number the next event should use.
+    uint32_t begin(fs::FS &fileSystem)
+    {
+#if defined(ESP32)
+        if (!mutex) mutex = xSemaphoreCreateRecursiveMutex();
+#endif
+        Guard guard(*this);
+
+        fs = &fileSystem;
+        segmentCount = 0;
+        lastSeq      = 0;
+
+        // Collect segment numbers. The directory order isn't sorted.
+        uint32_t numbers[EVENT_LOG_MAX_SEGMENTS * 2];
+        size_t   found = 0;
+        File     root  = fs->open("/");
+        File     f     = root.openNextFile();
+        while (f) {
+            uint32_t number;
+            if (parseSegmentName(f.name(), number) && (found < sizeof(numbers) / sizeof(numbers[0]))) {
+                numbers[found++] = number;
+            }
+            f = root.openNextFile();
+        }
+        root.close();
+
+        // Oldest first.
+        for (size_t i = 1; i < found; i++) {
+            uint32_t n = numbers[i];
+            size_t   j = i;
+            while ((j > 0) && (numbers[j - 1] > n)) { numbers[j] = numbers[j - 1]; j--; }
+            numbers[j] = n;
+        }
+
+        // Drop any extras beyond the size bound (e.g. after a crash mid-rotation).
+        size_t first = (found > EVENT_LOG_MAX_SEGMENTS) ? found - EVENT_LOG_MAX_SEGMENTS : 0;
+        for (size_t i = 0; i < first; i++) removeSegment(numbers[i]);
+
+        for (size_t i = first; i < found; i++) {
+            Segment &s = segments[segmentCount++];
+            s.number   = numbers[i];
+            s.firstSeq = 0;
+            s.records  = 0;
+            scanSegment(s);
+            if (s.records > 0) lastSeq = s.lastSeq;
+        }
+
+        // Always start appending in a fresh segment unless the newest one is
+        // known good and has room.
+        if ((segmentCount == 0) || newest().torn || (newest().records >= EVENT_LOG_SEGMENT_RECORDS)) {
+            rotate();
+        }
+
+        DEBUG_PRINT("    Event log: ");
+        DEBUG_PRINT(segmentCount);
+        DEBUG_PRINT(" segments, last seq ");
+        DEBUG_PRINTLN(lastSeq);
+
+        return lastSeq + 1;
+    }
+
+    //*************************************************************************
+    // Queue one event. Cheap -- no flash access.
+    void append(uint32_t seq, uint8_t type, uint32_t count, uint64_t timeMs, uint8_t flags, uint32_t nowMs)
+    {
+        Guard guard(*this);
+
+        if (pending == EVENT_LOG_BATCH_EVENTS) flush(); // Shouldn't happen if service() runs.
+        if (pending == EVENT_LOG_BATCH_EVENTS) {        // Flash is failing. Nowhere to put it.
+            droppedRecords++;
+            return;
+        }
+        if (pending == 0) firstPendingMs = nowMs;
+
+        EventRecord &r = batch[pending++];
+        r.magic    = EVENT_RECORD_MAGIC;
+        r.type     = type;
+        r.flags    = flags;
+        r.reserved = 0;
+        r.seq      = seq;
+        r.count    = count;
+        r.timeMs   = timeMs;
+        r.crc      = recordCRC(r);
+        lastSeq    = seq;
+    }
+
+    //*************************************************************************
+    // Call from the main loop. Writes the batch when it's due.
+    void service(uint32_t nowMs)
+    {
+        Guard guard(*this);
+
+        if ((doomedCount > 0) && (readers == 0)) { // Rotated out while being read.
+            for (size_t i = 0; i < doomedCount; i++) removeSegment(doomed[i]);
+            doomedCount = 0;
+        }
+
+        if ((pending >= EVENT_LOG_BATCH_EVENTS) ||
+            ((pending > 0) && (nowMs - firstPendingMs >= EVENT_LOG_FLUSH_MS))) {
+            flush();
+            if (pending > 0) firstPendingMs = nowMs; // Write failed. Wait before retrying.
+        }
+    }
+
+    //*************************************************************************
+    // Write everything buffered. Call before a deliberate reboot.
+    void flush()
+    {
+        Guard  guard(*this);
+        size_t done = 0;
+
+        while ((done < pending) && fs) {
+            Segment &s = newest();
+            if (s.records >= EVENT_LOG_SEGMENT_RECORDS) {
+                rotate();
+                continue;
+            }
+
+            size_t n = pending - done;
+            if (n > EVENT_LOG_SEGMENT_RECORDS - s.records) n = EVENT_LOG_SEGMENT_RECORDS - s.records;
+
+            char name[24];
+            segmentName(s.number, name, sizeof(name));
+            File file = fs->open(name, FILE_APPEND);
+            size_t bytes = n * sizeof(EventRecord);
+            if (!file || (file.write((const uint8_t *)&batch[done], bytes) != bytes)) {
+                writeErrors++;
+                if (file) file.close();
+                // Don't append after a partial write. Retry in a new segment next time.
+                s.torn = true;
+                rotate();
+                break;
+            }
+            file.close();
+
+            if (s.records == 0) s.firstSeq = batch[done].seq;
+            s.records += n;
+            s.lastSeq  = batch[done + n - 1].seq;
+            done      += n;
+            flushes++;
+        }
+
+        // Keep anything we couldn't write for the next attempt.
+        if (done > 0) {
+            memmove(batch, batch + done, (pending - done) * sizeof(EventRecord));
+            pending -= done;
+        }
+    }
+
+    //*************************************************************************
+    // Write everything buffered and let go of the file system, e.g. before
+    // it's unmounted. Events appended after this are counted as dropped.
+    // False while another task is part way through a read(): try again.
+    bool end()
+    {
+        Guard guard(*this);
+        if (readers > 0) return false;
+        flush();
+        fs          = nullptr;
+        doomedCount = 0;
+        return true;
+    }
+
+    //*************************************************************************
+    // Copy up to maxRecords events with seq >= fromSeq into out[], oldest
+    // first. Includes events not yet flushed. Returns the number copied.
+    size_t read(uint32_t fromSeq, EventRecord *out, size_t maxRecords)
+    {
+        // The log as it is now. Anything flushed after this is still in our
+        // copy of the batch, so nothing falls between the two.
+        Segment     view[EVENT_LOG_MAX_SEGMENTS];
+        size_t      viewCount;
+        EventRecord held[EVENT_LOG_BATCH_EVENTS];
+        size_t      heldCount;
+        {
+            Guard guard(*this);
+            viewCount = segmentCount;
+            heldCount = pending;
+            memcpy(view, segments, viewCount * sizeof(Segment));
+            memcpy(held, batch, heldCount * sizeof(EventRecord));
+            readers++;
+        }
+
+        size_t n = 0;
+        for (size_t i = 0; fs && (i < viewCount) && (n < maxRecords); i++) {
+            Segment &s = view[i];
+            if ((s.records == 0) || (s.lastSeq < fromSeq)) continue;
+
+            char name[24];
+            segmentName(s.number, name, sizeof(name));
+            File file = fs->open(name, FILE_READ);
+            if (!file) continue;
+
+            // Records are normally consecutive, so jump straight to the one we want.
+            uint32_t skip = (fromSeq > s.firstSeq) ? fromSeq - s.firstSeq : 0;
+            if ((skip == 0) || (skip >= s.records) || !file.seek(skip * sizeof(EventRecord))) skip = 0;
+
+            // No further than the copy says: the loop may be appending to this one.
+            EventRecord r;
+            uint32_t    left = s.records - skip;
+            while ((n < maxRecords) && (left-- > 0) && (file.read((uint8_t *)&r, sizeof(r)) == sizeof(r))) {
+                if (!recordValid(r)) break;
+                if (r.seq >= fromSeq) {
+                    out[n++] = r;
+                    fromSeq  = r.seq + 1; // A retried write can repeat a record. Skip it.
+                }
+            }
+            file.close();
+        }
+
+        {
+            Guard guard(*this);
+            readers--;
+        }
+
+        for (size_t i = 0; (i < heldCount) && (n < maxRecords); i++) {
+            if (held[i].seq >= fromSeq) {
+                out[n++] = held[i];
+                fromSeq  = held[i].seq + 1;
+            }
+        }
+
+        return n;
+    }
+
+    uint32_t oldestSeq()
+    {
+        Guard guard(*this);
+        return ((segmentCount > 0) && segments[0].records) ? segments[0].firstSeq : lastSeq + 1;
+    }
+
+    uint32_t newestSeq()    { return lastSeq; }
+    size_t   pendingCount() { return pending; }
+    size_t   segmentsInUse() { return segmentCount; }
+
+    static bool recordValid(const EventRecord &r)
+    {
+        return (r.magic == EVENT_RECORD_MAGIC) && (r.crc == recordCRC(r));
+    }
+
+  private:
+    struct Segment
+    {
+        uint32_t number;
+        uint32_t firstSeq;
+        uint32_t lastSeq;
+        uint32_t records;  // Valid records.
+        bool     torn;     // File holds bytes past the last valid record.
+    };
+
+    // Holds the log's mutex for the life of a public call. Recursive, because
+    // append() and service() call flush().
+    class Guard
+    {
+      public:
+        Guard(EventLog &l) : log(l) { log.lock(); }
+        ~Guard() { log.unlock(); }
+      private:
+        EventLog &log;
+    };
+
+#if defined(ESP32)
+    SemaphoreHandle_t mutex = nullptr;
+    void lock()   { if (mutex) xSemaphoreTakeRecursive(mutex, portMAX_DELAY); }
+    void unlock() { if (mutex) xSemaphoreGiveRecursive(mutex); }
+#else
+    void lock()   {}
+    void unlock() {}
+#endif
+
+    fs::FS     *fs = nullptr;
+    Segment     segments[EVENT_LOG_MAX_SEGMENTS];
+    size_t      segmentCount = 0;
+    EventRecord batch[EVENT_LOG_BATCH_EVENTS];
+    size_t      pending        = 0;
+    uint32_t    firstPendingMs = 0;
+    uint32_t    lastSeq        = 0;
+    size_t      readers        = 0; // read() calls between their copy and their last file read.
+    uint32_t    doomed[EVENT_LOG_MAX_SEGMENTS]; // Segments to delete once readers is 0.
+    size_t      doomedCount    = 0;
+
+    Segment &newest() { return segments[segmentCount - 1]; }
+
+    static uint32_t recordCRC(const EventRecord &r)
+    {
+        return crc32((const uint8_t *)&r, sizeof(EventRecord) - sizeof(r.crc));
+    }
+
+    static void segmentName(uint32_t number, char *name, size_t size)
+    {
+        snprintf(name, size, "/evlog_%08lu.bin", (unsigned long)number);
+    }
+
+    // Accepts "/evlog_00000012.bin" or "evlog_00000012.bin".
+    static bool parseSegmentName(const char *name, uint32_t &number)
+    {
+        const char *p = strstr(name, "evlog_");
+        if (!p) return false;
+        char *end;
+        number = strtoul(p + 6, &end, 10);
+        return (end != p + 6) && (strcmp(end, ".bin") == 0);
+    }
+
+    void removeSegment(uint32_t number)
+    {
+        char name[24];
+        segmentName(number, name, sizeof(name));
+        fs->remove(name);
+    }
+
+    // Count the valid records in a segment and note whether anything follows them.
+    void scanSegment(Segment &s)
+    {
+        char name[24];
+        segmentName(s.number, name, sizeof(name));
+        File file = fs->open(name, FILE_READ);
+        s.torn = false;
+        if (!file) return;
+
+        EventRecord r;
+        size_t      got;
+        while ((got = file.read((uint8_t *)&r, sizeof(r))) == sizeof(r)) {
+            if (!recordValid(r)) break;
+            if (s.records == 0) s.firstSeq = r.seq;
+            s.lastSeq = r.seq;
+            s.records++;
+        }
+        if (file.size() != s.records * sizeof(EventRecord)) {
+            s.torn = true;
+            tornRecords++;
+        }
+        file.close();
+    }
+
+    // Start a new, empty segment and enforce the size bound.
+    void rotate()
+    {
+        uint32_t number = (segmentCount > 0) ? newest().number + 1 : 0;
+
+        if (segmentCount == EVENT_LOG_MAX_SEGMENTS) {
+            if ((readers > 0) && (doomedCount < EVENT_LOG_MAX_SEGMENTS)) {
+                doomed[doomedCount++] = segments[0].number; // service() deletes it later.
+            } else {
+                removeSegment(segments[0].number);
+            }
+            for (size_t i = 1; i < segmentCount; i++) segments[i - 1] = segments[i];
+            segmentCount--;
+        }
+
+        Segment &s = segments[segmentCount++];
+        s.number   = number;
+        s.firstSeq = 0;
+        s.lastSeq  = 0;
+        s.records  = 0;
+        s.torn     = false;
+    }
+};
+
+//*****************************************************************************
+// A reader's place in the log -- the next sequence number it wants --
+// kept in a small file of its own so it survives a reboot. Saves are
+// rate-limited by the caller, so after a crash a reader may see a few
+// events again.
+class EventCursor
+{
+  public:
+    uint32_t seq = 0;
+
+    // Load the saved position. If there isn't one, or it's from before the
+    // log was wiped, start from the oldest event still held.
+    void begin(fs::FS *fileSystem, const char *fileName, EventLog &log)
+    {
+        fs   = fileSystem;
+        path = fileName;
+        if (!load() || (seq > log.newestSeq() + 1)) seq = log.oldestSeq();
+        savedSeq = seq;
+    }
+
+    void save()
+    {
+        uint32_t current = seq;
+        if (!fs || (current == savedSeq)) return;
+
+        uint32_t record[3] = {EVENT_CURSOR_MAGIC, current, 0};
+        record[2] = crc32((const uint8_t *)record, 8);
+
+        File file = fs->open(path, FILE_WRITE);
+        if (file && (file.write((const uint8_t *)record, sizeof(record)) == sizeof(record))) savedSeq = current;
+        if (file) file.close();
+    }
+
+    // Save if it's moved and intervalMs has passed since the last save.
+    void service(uint32_t nowMs, uint32_t intervalMs)
+    {
+        if (nowMs - lastSaveMs >= intervalMs) {
+            save();
+            lastSaveMs = nowMs;
+        }
+    }
+
+  private:
+    fs::FS     *fs         = nullptr;
+    const char *path       = nullptr;
+    uint32_t    savedSeq   = 0;
+    uint32_t    lastSaveMs = 0;
+
+    bool load()
+    {
+        if (!fs) return false;
+        uint32_t record[3];
+        File     file = fs->open(path, FILE_READ);
+        if (!file) return false;
+        bool ok = (file.read((uint8_t *)record, sizeof(record)) == sizeof(record)) &&
+                  (record[0] == EVENT_CURSOR_MAGIC) && (record[2] == crc32((const uint8_t *)record, 8));
+        file.close();
+        if (ok) seq = record[1];
+        return ok;
+    }
+};
+
+#endif //__DIGAME_EVENT_LOG_H__
@@ -0,0 +1,111 @@
+/* digameEventQueue.h
+ *
+ *  Retains counting events until a client acknowledges them. Every event
+ *  gets a monotonically increasing sequence number. Events are sent in
+ *  batches from a send cursor; an acknowledgement frees everything up to
+ *  and including its sequence number, and rewind() backs the cursor up to
+ *  the oldest unacknowledged event so lost batches are sent again.
+ *
+ *  The queue is a fixed-size ring. If a client stays away long enough for
+ *  it to fill, the oldest unacknowledged events are overwritten and
+ *  counted in dropped. No Arduino dependencies -- builds on a Linux host.
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#ifndef __DIGAME_EVENT_QUEUE_H__
+#define __DIGAME_EVENT_QUEUE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define EVENT_QUEUE_SIZE 256 // Events held while waiting for acknowledgement.
+
+struct CountEvent
+{
+    uint32_t seq;    // 1, 2, 3... never reused.
+    uint64_t timeMs; // UTC milliseconds if flags says so, otherwise millis().
+    uint8_t  flags;  // EVENT_FLAG_UTC, as in the event log.
+    uint8_t  type;   // INBOUND / OUTBOUND
+    uint32_t count;  // Running count for that direction after this event.
+};
+
+class EventQueue
+{
+  public:
+    uint32_t dropped = 0; // Unacknowledged events lost to overflow.
+
+    //*************************************************************************
+    // Record a new event. Returns its sequence number.
+    uint32_t push(uint8_t type, uint32_t count, uint64_t timeMs, uint8_t flags = 0)
+    {
+        if (size() == EVENT_QUEUE_SIZE) { // Full: lose the oldest.
+            oldestSeq++;
+            dropped++;
+            if (cursorSeq < oldestSeq) cursorSeq = oldestSeq;
+        }
+
+        CountEvent &e = ring[nextSeq % EVENT_QUEUE_SIZE];
+        e.seq    = nextSeq;
+        e.timeMs = timeMs;
+        e.flags  = flags;
+        e.type   = type;
+        e.count  = count;
+
+        return nextSeq++;
+    }
+
+    //*************************************************************************
+    // Copy up to maxEvents unsent events into out[] and advance the cursor.
+    size_t nextBatch(CountEvent *out, size_t maxEvents)
+    {
+        size_t n = 0;
+        while ((n < maxEvents) && (cursorSeq < nextSeq)) {
+            out[n++] = ring[cursorSeq % EVENT_QUEUE_SIZE];
+            cursorSeq++;
+        }
+        return n;
+    }
+
+    //*************************************************************************
+    // The client has everything up to and including seq.
+    void ack(uint32_t seq)
+    {
+        if (seq >= nextSeq) seq = nextSeq - 1; // Can't ack the future.
+        if (seq >= oldestSeq) oldestSeq = seq + 1;
+        if (cursorSeq < oldestSeq) cursorSeq = oldestSeq;
+    }
+
+    //*************************************************************************
+    // Start sending again from seq (or the oldest event we still hold).
+    void resumeFrom(uint32_t seq)
+    {
+        if (seq < oldestSeq) seq = oldestSeq;
+        if (seq > nextSeq)   seq = nextSeq;
+        cursorSeq = seq;
+    }
+
+    void rewind() { cursorSeq = oldestSeq; }
+
+    // Continue numbering from a saved value, e.g. after a reboot. Only
+    // valid while the queue is empty.
+    void setNextSeq(uint32_t seq)
+    {
+        if ((size() == 0) && (seq > nextSeq)) oldestSeq = cursorSeq = nextSeq = seq;
+    }
+
+    uint32_t oldest()   { return oldestSeq; } // Oldest unacknowledged.
+    uint32_t next()     { return nextSeq; }   // Sequence number of the next event.
+    uint32_t unacked()  { return nextSeq - oldestSeq; }
+    uint32_t inFlight() { return cursorSeq - oldestSeq; } // Sent, not yet acknowledged.
+    uint32_t unsent()   { return nextSeq - cursorSeq; }
+    size_t   size()     { return nextSeq - oldestSeq; }
+
+  private:
+    CountEvent ring[EVENT_QUEUE_SIZE];
+    uint32_t   nextSeq   = 1;
+    uint32_t   oldestSeq = 1;
+    uint32_t   cursorSeq = 1;
+};
+
+#endif //__DIGAME_EVENT_QUEUE_H__
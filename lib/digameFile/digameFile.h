@@ -19,6 +19,83 @@ void deleteFile(fs::FS &fs, const char * path){
 
 
 
+//****************************************************************************************
+// Stream a file in fixed-size chunks into a caller's buffer. Nothing is allocated here, 
+// so files bigger than free RAM can be served or parsed a piece at a time.
+//****************************************************************************************
+class FileChunkReader
+{
+  public:
+    bool open(fs::FS &fs, const char * path){
+        file = fs.open(path, FILE_READ);
+        if(!file || file.isDirectory()){
+            if (file) file.close();
+            return false;
+        }
+        return true;
+    }
+
+    // Fill up to len bytes of buffer. Returns the number read; 0 at the end of the file.
+    size_t read(uint8_t *buffer, size_t len){
+        if (!file) return 0;
+        return file.read(buffer, len);
+    }
+
+    bool   seek(size_t pos) { return file && file.seek(pos); }
+    size_t position()       { return file ? file.position() : 0; }
+    size_t size()           { return file ? file.size() : 0; }
+    void   close()          { if (file) file.close(); }
+
+  private:
+    File file;
+};
+
+
+//****************************************************************************************
+// Walk a file a line at a time using a fixed internal chunk. Handles \n and \r\n. Lines 
+// longer than the caller's buffer are cut short (the rest of the line is skipped).
+//****************************************************************************************
+template <size_t CHUNK_SIZE = 64>
+class FileLineReader
+{
+  public:
+    bool open(fs::FS &fs, const char * path){
+        head = tail = 0;
+        return reader.open(fs, path);
+    }
+
+    // Copy the next line (without its terminator) into line. Returns false at the end.
+    bool nextLine(char *line, size_t lineSize){
+        size_t len   = 0;
+        bool   gotAny = false;
+
+        while (true) {
+            if (head == tail) {
+                tail = reader.read(chunk, CHUNK_SIZE);
+                head = 0;
+                if (tail == 0) break; // End of file.
+            }
+            gotAny = true;
+            char c = (char)chunk[head++];
+            if (c == '\n') break;
+            if (c == '\r') continue;
+            if (len + 1 < lineSize) line[len++] = c;
+        }
+
+        if (lineSize > 0) line[len] = 0;
+        return gotAny;
+    }
+
+    void close() { reader.close(); }
+
+  private:
+    FileChunkReader reader;
+    uint8_t         chunk[CHUNK_SIZE];
+    size_t          head = 0;
+    size_t          tail = 0;
+};
+
+
 //****************************************************************************************
 // Grab contents from a file
 //****************************************************************************************
@@ -26,18 +103,20 @@ String readFile(fs::FS &fs, const char * path){
     String retValue = "";
     //Serial.printf("Reading file: %s\r\n", path);
 
-    File file = fs.open(path);
-    if(!file || file.isDirectory()){
+    FileChunkReader file;
+    if(!file.open(fs, path)){
         DEBUG_PRINTLN("- failed to open file for reading");
         return retValue;
     }
 
-    //DEBUG_PRINTLN("- read from file:");
+    // Size the String once, then append fixed chunks. (The old loop re-built the String 
+    // for every readString() call.)
+    retValue.reserve(file.size());
 
-    //retValue = file.readStringUntil('\r');
-    
-    while(file.available()){
-        retValue = retValue + file.readString();
+    char   chunk[64];
+    size_t n;
+    while((n = file.read((uint8_t *)chunk, sizeof(chunk))) > 0){
+        retValue.concat(chunk, n); // By length: a NUL in the file mustn't end the copy.
     }
     file.close();
     
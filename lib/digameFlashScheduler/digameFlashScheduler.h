@@ -0,0 +1,435 @@
+/* digameFlashScheduler.h
+ *
+ *  Writes a firmware upload to flash from the counting loop, a little at
+ *  a time between LIDAR frames, so an update doesn't cost counts.
+ *
+ *  While the ESP32 erases or writes flash, the caches are off on both
+ *  cores and nothing runs from flash. Update did its erases and writes in
+ *  the web server's task whenever a piece of the upload arrived: a 4 KB
+ *  sector erase and write every 4 KB, about 60 ms each, back to back on a
+ *  quick link. The loop got little time in between, the LIDARs' serial
+ *  buffers overflowed, and frames (and people) went missing.
+ *
+ *  Now the web task only copies the upload into a FLASH_BUFFER ring. The
+ *  loop calls service() after each frame, and that does at most one
+ *  bounded piece of flash work:
+ *
+ *    - writes at most FLASH_WRITE_SLICE bytes, a few milliseconds, into
+ *      space already erased. There's time for that before the next frame.
+ *    - erases one sector, only once nobody has been in view for
+ *      FLASH_QUIET_FRAMES frames, and up to FLASH_ERASE_AHEAD sectors ahead
+ *      of the writes. While someone passes, the writes carry on into
+ *      sectors erased already.
+ *    - never takes more than FLASH_DUTY_PERCENT of the time, averaged over
+ *      a FLASH_CREDIT_CAP_US burst.
+ *
+ *  If someone stands in the doorway, an erase waits FLASH_MAX_DEFER_US at
+ *  most, so the update still finishes. When the ring is full the web task
+ *  waits, which slows the upload down through TCP. If the loop isn't
+ *  calling service(), the web task writes the flash itself.
+ *
+ *  Frames missed during the update are counted against the frame rate
+ *  measured over FLASH_CAL_FRAMES frames beforehand. Frames read late from
+ *  the serial buffer aren't missed.
+ *
+ *  Where the bytes go is up to a FlashDevice. The ESP32 glue at the end
+ *  writes the OTA (or SPIFFS) partition, or one chunk of it for a
+ *  resumable update. The rest builds on a Linux host, where a FlashDevice
+ *  can stand in with simulated erase and write times.
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#ifndef __DIGAME_FLASH_SCHEDULER_H__
+#define __DIGAME_FLASH_SCHEDULER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <digameMetrics.h> // MetricCounter
+
+#define FLASH_SECTOR          4096
+#define FLASH_BUFFER          16384    // Upload bytes held for the loop to write.
+#define FLASH_WRITE_SLICE     1024     // Most bytes written in one go, about 3 ms.
+#define FLASH_ERASE_AHEAD     4        // Sectors kept erased ahead of the writes.
+#define FLASH_DUTY_PERCENT    50       // Most of the time spent on flash.
+#define FLASH_CREDIT_CAP_US   50000    // Most flash time saved up for a burst.
+#define FLASH_QUIET_FRAMES    5        // Frames with nobody in view before an erase.
+#define FLASH_MAX_DEFER_US    250000   // Longest a write waits on an erase.
+#define FLASH_FRAME_PERIOD_US 10000    // The LIDARs' 100 Hz, until it's measured...
+#define FLASH_CAL_FRAMES      1024     // ...over this many frames.
+
+//*****************************************************************************
+// Where the upload is written. Offsets are from the start of the image.
+class FlashDevice
+{
+  public:
+    virtual ~FlashDevice() {}
+    virtual bool erase(uint32_t offset, uint32_t length) = 0;
+    virtual bool write(uint32_t offset, const uint8_t *data, size_t length) = 0;
+};
+
+//*****************************************************************************
+class FlashScheduler
+{
+  public:
+    typedef uint32_t (*Clock)(); // Microseconds.
+
+    FlashScheduler(Clock clock) : now(clock) {}
+
+    // One writer each: service() for these...
+    MetricCounter erases       = 0;
+    MetricCounter writes       = 0;
+    MetricCounter forcedErases = 0; // Erases with someone in view.
+    MetricCounter flashUs      = 0; // Time spent erasing and writing.
+    // ...and stop() for this.
+    MetricCounter framesMissed = 0; // Over all updates.
+
+    //*************************************************************************
+    // The web task's side.
+
+    void start(FlashDevice &device, uint32_t capacity)
+    {
+        flash      = &device;
+        size       = capacity;
+        head       = 0;
+        tail       = 0;
+        erasedTo   = 0;
+        closing    = false;
+        problem    = nullptr;
+        credit     = FLASH_CREDIT_CAP_US;
+        creditUs   = now();
+        blocked    = false;
+        startUs    = creditUs;
+        received   = 0;
+        calFrames  = 0;
+        running    = true;
+    }
+
+    // Copy in as much as there's room for. Returns how much that was.
+    size_t offer(const uint8_t *data, size_t length)
+    {
+        if (!running || problem || closing) return 0;
+        if (length > size - head) {
+            problem = "Image is bigger than the partition";
+            return 0;
+        }
+        uint32_t room = FLASH_BUFFER - (head - tail);
+        size_t   n    = (length < room) ? length : room;
+        size_t   at   = head % FLASH_BUFFER;
+        size_t   first = (n < FLASH_BUFFER - at) ? n : FLASH_BUFFER - at;
+        memcpy(ring + at, data, first);
+        memcpy(ring, data + first, n - first);
+        __sync_synchronize(); // The bytes before the count that says they're there.
+        head = head + n;
+        return n;
+    }
+
+    void close() { closing = true; } // That's the lot.
+
+    bool done() const { return running && closing && (tail == head) && !problem; }
+
+    // The update is over, written or not. Returns the frames missed during it.
+    uint32_t stop()
+    {
+        if (!running) return 0;
+        running = false;
+        uint32_t expected = (now() - startUs + period / 2) / period;
+        uint32_t missed   = (expected > received) ? expected - received : 0;
+        framesMissed      = framesMissed + missed;
+        lastMissed        = missed;
+        return missed;
+    }
+
+    const char *error() const { return problem; }
+    bool        active() const { return running; }
+    uint32_t    written() const { return tail; }
+    uint32_t    lastServiceUs() const { return serviced; }
+    uint32_t    framePeriodUs() const { return period; }
+    uint32_t    lastUpdateMissed() const { return lastMissed; }
+
+    //*************************************************************************
+    // The loop's side. Call after every read of the LIDARs. busy: someone is
+    // in view. Returns true if it did some flash work.
+    bool service(bool goodFrame, bool busy)
+    {
+        frame(goodFrame, busy);
+        return pump(false);
+    }
+
+    void setFramePeriod(uint32_t us)
+    {
+        if (us) period = us;
+        calFrames = 0;
+    }
+
+    void frame(bool goodFrame, bool busy)
+    {
+        uint32_t t = now();
+        serviced   = t;
+        if (!goodFrame) return;
+
+        quiet = busy ? 0 : ((quiet < FLASH_QUIET_FRAMES) ? quiet + 1 : quiet);
+        if (running) {
+            received++;
+            return;
+        }
+        if (calFrames == 0) calStartUs = t;
+        if (++calFrames > FLASH_CAL_FRAMES) { // Whatever the clocks make it.
+            period    = (t - calStartUs) / FLASH_CAL_FRAMES;
+            calFrames = 0;
+        }
+    }
+
+    // One piece of flash work, if it's time for one. unattended: nobody is
+    // calling service(), so write as fast as we can.
+    bool pump(bool unattended)
+    {
+        if (!running || problem) return false;
+
+        uint32_t t = now();
+        credit += (int32_t)((uint64_t)(t - creditUs) * FLASH_DUTY_PERCENT / 100);
+        if (credit > FLASH_CREDIT_CAP_US) credit = FLASH_CREDIT_CAP_US;
+        creditUs = t;
+        if (!unattended && (credit <= 0)) return false;
+
+        uint32_t pending = head - tail;
+        uint32_t erased  = erasedTo - tail;
+
+        // Writes first. They're short, and make room in the ring.
+        if (pending && erased) {
+            uint32_t n  = (pending < erased) ? pending : erased;
+            uint32_t at = tail % FLASH_BUFFER;
+            if (n > FLASH_WRITE_SLICE) n = FLASH_WRITE_SLICE;
+            if (n > FLASH_BUFFER - at) n = FLASH_BUFFER - at;
+            if ((n == FLASH_WRITE_SLICE) || closing || (n == erased) || (n == FLASH_BUFFER - at)) {
+                uint32_t began = now();
+                bool     ok    = flash->write(tail, ring + at, n);
+                spend(began);
+                writes = writes + 1;
+                if (!ok) {
+                    problem = "Couldn't write to flash";
+                    return true;
+                }
+                __sync_synchronize(); // Done with the bytes before giving their room back.
+                tail = tail + n;
+                return true;
+            }
+        }
+
+        if ((erasedTo >= size) || (erased >= FLASH_ERASE_AHEAD * FLASH_SECTOR)) return false;
+
+        bool starved = pending > erased; // Bytes waiting on this erase.
+        if (starved && !blocked) {
+            blocked   = true;
+            blockedUs = t;
+        }
+        bool overdue = starved && ((t - blockedUs) > FLASH_MAX_DEFER_US);
+        if (!unattended && (quiet < FLASH_QUIET_FRAMES) && !overdue && !closing) return false;
+
+        uint32_t n     = (size - erasedTo < FLASH_SECTOR) ? size - erasedTo : FLASH_SECTOR;
+        uint32_t began = now();
+        bool     ok    = flash->erase(erasedTo, n);
+        spend(began);
+        erases  = erases + 1;
+        blocked = false;
+        if (!unattended && (quiet < FLASH_QUIET_FRAMES)) forcedErases = forcedErases + 1;
+        if (!ok) {
+            problem = "Couldn't erase flash";
+            return true;
+        }
+        erasedTo += n;
+        return true;
+    }
+
+  private:
+    Clock         now;
+    FlashDevice  *flash = nullptr;
+    uint32_t      size  = 0;
+    uint8_t       ring[FLASH_BUFFER];
+
+    volatile uint32_t    head     = 0; // Bytes in, written by the web task...
+    volatile uint32_t    tail     = 0; // ...and out to flash, by the loop.
+    volatile bool        closing  = false;
+    volatile bool        running  = false;
+    const char *volatile problem  = nullptr;
+    uint32_t             erasedTo = 0;
+
+    int32_t  credit    = 0; // Flash time we may spend, in microseconds.
+    uint32_t creditUs  = 0;
+    bool     blocked   = false;
+    uint32_t blockedUs = 0;
+
+    volatile uint32_t serviced = 0;
+    uint32_t quiet      = 0;
+    uint32_t period     = FLASH_FRAME_PERIOD_US;
+    uint32_t calFrames  = 0;
+    uint32_t calStartUs = 0;
+    uint32_t startUs    = 0;
+    uint32_t received   = 0; // Good frames since start().
+    uint32_t lastMissed = 0;
+
+    void spend(uint32_t began)
+    {
+        uint32_t took = now() - began;
+        credit -= (int32_t)took;
+        flashUs = flashUs + took;
+    }
+};
+
+#if defined(ESP32)
+//*****************************************************************************
+// The ESP32 side: the upload goes to the next OTA partition, or the SPIFFS
+// one, and the loop calls service().
+#include <Arduino.h>
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#define FLASH_WAIT_MS       3000 // Longest the web task waits for room.
+#define FLASH_UNATTENDED_MS 500  // No service() for this long: write it ourselves.
+
+class PartitionFlash : public FlashDevice
+{
+  public:
+    const esp_partition_t *partition = nullptr;
+    uint32_t               base      = 0; // Where in the partition the upload starts.
+
+    bool erase(uint32_t offset, uint32_t length) override
+    {
+        return esp_partition_erase_range(partition, base + offset, length) == ESP_OK;
+    }
+
+    bool write(uint32_t offset, const uint8_t *data, size_t length) override
+    {
+        return esp_partition_write(partition, base + offset, data, length) == ESP_OK;
+    }
+};
+
+class OtaFlashWriter
+{
+  public:
+    OtaFlashWriter() : scheduler(clockUs) {}
+
+    FlashScheduler scheduler;
+
+    // Returns what's wrong, or nullptr.
+    const char *begin(bool firmware)
+    {
+        const esp_partition_t *partition =
+            firmware ? esp_ota_get_next_update_partition(nullptr)
+                     : esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, nullptr);
+        if (!partition) return "No partition to update";
+        return begin(partition, 0, partition->size, firmware);
+    }
+
+    // length bytes of the partition from offset, e.g. one chunk of a
+    // resumable update. bootable: make it the boot partition at the end.
+    const char *begin(const esp_partition_t *partition, uint32_t offset, uint32_t length, bool bootable)
+    {
+        if ((offset % FLASH_SECTOR) || (offset > partition->size) || (length > partition->size - offset)) {
+            return "Outside the partition";
+        }
+        if (!lock) lock = xSemaphoreCreateMutex();
+
+        xSemaphoreTake(lock, portMAX_DELAY);
+        scheduler.stop();
+        device.partition = partition;
+        device.base      = offset;
+        toFirmware       = bootable;
+        erasesBefore     = scheduler.erases;
+        forcedBefore     = scheduler.forcedErases;
+        flashUsBefore    = scheduler.flashUs;
+        scheduler.start(device, length);
+        xSemaphoreGive(lock);
+        return nullptr;
+    }
+
+    // From the web task. Waits while the ring is full.
+    const char *push(const uint8_t *data, size_t length)
+    {
+        uint32_t started = millis();
+        while (length) {
+            if (!scheduler.active()) return "Update was stopped";
+            size_t n = scheduler.offer(data, length);
+            if (scheduler.error()) return scheduler.error();
+            data   += n;
+            length -= n;
+            if (length && !wait(started)) return "Flash writes stalled";
+        }
+        return nullptr;
+    }
+
+    // All of it is here: write the rest, and boot it next time if it's
+    // firmware. Returns what's wrong, or nullptr.
+    const char *end()
+    {
+        scheduler.close();
+        uint32_t started = millis();
+        while (!scheduler.done() && !scheduler.error()) {
+            if (!scheduler.active()) return "Update was stopped";
+            if (!wait(started)) return stop("Flash writes stalled");
+        }
+        if (scheduler.error()) return stop(scheduler.error());
+        if (toFirmware && (esp_ota_set_boot_partition(device.partition) != ESP_OK)) {
+            return stop("Uploaded image doesn't check out");
+        }
+        return stop(nullptr);
+    }
+
+    void abort() { stop(nullptr); }
+
+    // From the loop, after each read of the LIDARs.
+    void service(bool goodFrame, bool busy)
+    {
+        if (!scheduler.active()) { // Nothing to write. Just time the frames.
+            scheduler.frame(goodFrame, busy);
+            return;
+        }
+        if (xSemaphoreTake(lock, 0) != pdTRUE) return; // The web task is writing.
+        scheduler.service(goodFrame, busy);
+        xSemaphoreGive(lock);
+    }
+
+  private:
+    PartitionFlash    device;
+    SemaphoreHandle_t lock          = nullptr;
+    bool              toFirmware    = true;
+    uint32_t          erasesBefore  = 0; // The counters when this update began.
+    uint32_t          forcedBefore  = 0;
+    uint32_t          flashUsBefore = 0;
+
+    static uint32_t clockUs() { return micros(); }
+
+    // Let the loop get on, or do its work if it isn't. False once we've
+    // waited too long.
+    bool wait(uint32_t started)
+    {
+        if ((micros() - scheduler.lastServiceUs()) > FLASH_UNATTENDED_MS * 1000UL) {
+            xSemaphoreTake(lock, portMAX_DELAY);
+            scheduler.pump(true);
+            xSemaphoreGive(lock);
+        } else {
+            vTaskDelay(1);
+        }
+        return (millis() - started) < FLASH_WAIT_MS;
+    }
+
+    const char *stop(const char *problem)
+    {
+        if (!scheduler.active()) return problem;
+        xSemaphoreTake(lock, portMAX_DELAY);
+        uint32_t missed = scheduler.stop();
+        xSemaphoreGive(lock);
+        Serial.printf("OTA: %u bytes written, %u erases (%u with someone in view), %u ms on flash, "
+                      "%u frames missed\n",
+                      (unsigned)scheduler.written(), (unsigned)(scheduler.erases - erasesBefore),
+                      (unsigned)(scheduler.forcedErases - forcedBefore),
+                      (unsigned)((scheduler.flashUs - flashUsBefore) / 1000), (unsigned)missed);
+        return problem;
+    }
+};
+#endif // ESP32
+
+#endif //__DIGAME_FLASH_SCHEDULER_H__
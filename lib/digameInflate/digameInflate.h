@@ -0,0 +1,512 @@
+/* digameInflate.h
+ *
+ *  Streaming gzip decompression with a small, fixed window, for firmware
+ *  updates that arrive compressed.
+ *
+ *  Compressed data goes in a piece at a time, in whatever sizes the web
+ *  server hands it over. Decompressed data comes out through a sink
+ *  callback in pieces of up to INFLATE_WINDOW_SIZE bytes. Nothing is held
+ *  whole in RAM. The only big buffer is the window of recent output that
+ *  deflate's back-references copy from.
+ *
+ *  gzip itself allows references up to 32 KB back. We keep 8 KB, so the
+ *  image has to be compressed with a window no bigger than that.
+ *  tools/compress_firmware.py does that. On firmware it costs about 2% in
+ *  size over a full window. A stream that reaches further back is rejected
+ *  with a message saying so, not decoded wrongly.
+ *
+ *  The gzip trailer's CRC-32 and length of the decompressed data are
+ *  checked at the end. The header's comment field is kept for the caller,
+ *  who may find more in there (compress_firmware.py puts the image's
+ *  SHA-256 there).
+ *
+ *  No Arduino dependencies -- builds on a Linux host as-is.
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#ifndef __DIGAME_INFLATE_H__
+#define __DIGAME_INFLATE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <digameCRC.h>
+
+#define INFLATE_WINDOW_BITS    13 // 8 KB. See above.
+#define INFLATE_WINDOW_SIZE    (1UL << INFLATE_WINDOW_BITS)
+#define INFLATE_COMMENT_LENGTH 96
+#define INFLATE_MAX_BITS       15 // Longest Huffman code.
+
+// Takes decompressed data. Return false to stop with an error.
+typedef bool (*InflateSink)(void *context, const uint8_t *data, size_t length);
+
+enum InflateResult { INFLATE_MORE, INFLATE_DONE, INFLATE_ERROR };
+
+//*****************************************************************************
+class GzipInflater
+{
+  public:
+    GzipInflater(InflateSink sink, void *context) : output(sink), outputContext(context) {}
+
+    static bool isGzip(const uint8_t *data, size_t length)
+    {
+        return (length >= 2) && (data[0] == 0x1F) && (data[1] == 0x8B);
+    }
+
+    //*************************************************************************
+    // Decompress the next piece of input. All of it is used. Returns
+    // INFLATE_MORE until the end of the stream is reached. Anything after
+    // the end is ignored.
+    InflateResult write(const uint8_t *data, size_t length)
+    {
+        in    = data;
+        inEnd = data + length;
+        inputBytes += length;
+
+        while ((state != S_DONE) && (state != S_ERROR) && step()) {
+        }
+        in = inEnd = nullptr;
+
+        if (state == S_ERROR) return INFLATE_ERROR;
+        return (state == S_DONE) ? INFLATE_DONE : INFLATE_MORE;
+    }
+
+    // No more input is coming. INFLATE_DONE only if the stream was whole
+    // and its CRC and length check out.
+    InflateResult finish()
+    {
+        if (state == S_DONE) return INFLATE_DONE;
+        if (state != S_ERROR) fail("Compressed image is truncated");
+        return INFLATE_ERROR;
+    }
+
+    const char *error() const { return problem; }
+    const char *comment() const { return headerComment; }
+    uint32_t    inputLength() const { return inputBytes; }
+    uint32_t    outputLength() const { return total; }
+
+  private:
+    // Canonical Huffman code: how many codes of each length, then the
+    // symbols in code order.
+    struct Huffman
+    {
+        int16_t count[INFLATE_MAX_BITS + 1];
+        int16_t symbol[288];
+    };
+
+    enum State {
+        S_HEADER, S_BLOCK, S_STORED_LENGTH, S_STORED, S_TABLE_SIZES, S_CODE_LENGTH_CODES, S_CODE_LENGTHS,
+        S_CODES, S_TRAILER, S_DONE, S_ERROR
+    };
+
+    InflateSink    output;
+    void          *outputContext;
+    State          state = S_HEADER;
+    int            subStep = 0;  // Within the header, trailer or a table.
+    const char    *problem = nullptr;
+
+    const uint8_t *in    = nullptr; // This write()'s input.
+    const uint8_t *inEnd = nullptr;
+    uint64_t       bits  = 0;       // Input not yet used, low bit first.
+    unsigned       bitCount = 0;
+    uint32_t       inputBytes = 0;
+
+    uint8_t        flags = 0;       // gzip header.
+    uint32_t       skip  = 0;
+    char           headerComment[INFLATE_COMMENT_LENGTH] = "";
+    size_t         commentLength = 0;
+
+    bool           lastBlock = false;
+    uint32_t       storedLeft = 0;
+    unsigned       lengthCount = 0, distCount = 0, codeCount = 0, index = 0;
+    uint8_t        lengths[286 + 30];
+    Huffman        lengthCode, distCode;
+
+    uint8_t        window[INFLATE_WINDOW_SIZE];
+    uint32_t       total   = 0; // Bytes decompressed...
+    uint32_t       flushed = 0; // ...and handed to the sink.
+    uint32_t       crc     = 0;
+
+    //*************************************************************************
+    bool fail(const char *why)
+    {
+        if (state != S_ERROR) problem = why;
+        state = S_ERROR;
+        return false;
+    }
+
+    // Make sure there are at least n (up to 56) bits to hand. False if the
+    // input ran out first -- then it has all been used.
+    bool need(unsigned n)
+    {
+        while ((bitCount <= 56) && (in < inEnd)) {
+            bits |= (uint64_t)(*in++) << bitCount;
+            bitCount += 8;
+        }
+        return bitCount >= n;
+    }
+
+    uint32_t take(unsigned n)
+    {
+        uint32_t v = (uint32_t)(bits & ((1ULL << n) - 1));
+        bits >>= n;
+        bitCount -= n;
+        return v;
+    }
+
+    //*************************************************************************
+    // One step of the stream. False when it needs more input or has failed.
+    // Every deflate element is followed by at least the 8-byte trailer, so
+    // waiting for a whole element's worth of bits never waits for input that
+    // isn't coming.
+    bool step()
+    {
+        switch (state) {
+        case S_HEADER:            return header();
+        case S_BLOCK:             return blockHeader();
+        case S_STORED_LENGTH:     return storedLength();
+        case S_STORED:            return stored();
+        case S_TABLE_SIZES:       return tableSizes();
+        case S_CODE_LENGTH_CODES: return codeLengthCodes();
+        case S_CODE_LENGTHS:      return codeLengths();
+        case S_CODES:             return codes();
+        case S_TRAILER:           return trailer();
+        default:                  return false;
+        }
+    }
+
+    //*************************************************************************
+    // RFC 1952: ID1 ID2 CM FLG, MTIME XFL OS, then optional fields.
+    bool header()
+    {
+        enum { FHCRC = 0x02, FEXTRA = 0x04, FNAME = 0x08, FCOMMENT = 0x10 };
+
+        switch (subStep) {
+        case 0:
+            if (!need(32)) return false;
+            if ((take(8) != 0x1F) || (take(8) != 0x8B)) return fail("Not a gzip file");
+            if (take(8) != 8) return fail("Not deflate compressed");
+            flags = take(8);
+            subStep = 1;
+            return true;
+        case 1:
+            if (!need(48)) return false;
+            take(32); take(16);
+            subStep = (flags & FEXTRA) ? 2 : 4;
+            return true;
+        case 2:
+            if (!need(16)) return false;
+            skip = take(16);
+            subStep = 3;
+            return true;
+        case 3:
+            while (skip) {
+                if (!need(8)) return false;
+                take(8);
+                skip--;
+            }
+            subStep = 4;
+            return true;
+        case 4:
+            while (flags & FNAME) {
+                if (!need(8)) return false;
+                if (take(8) == 0) break;
+            }
+            subStep = 5;
+            return true;
+        case 5:
+            while (flags & FCOMMENT) {
+                if (!need(8)) return false;
+                char c = (char)take(8);
+                if (c == 0) break;
+                if (commentLength < sizeof(headerComment) - 1) {
+                    headerComment[commentLength++] = c;
+                    headerComment[commentLength]   = 0;
+                }
+            }
+            subStep = 6;
+            return true;
+        default:
+            if (flags & FHCRC) {
+                if (!need(16)) return false;
+                take(16);
+            }
+            subStep = 0; // The trailer counts from here.
+            state   = S_BLOCK;
+            return true;
+        }
+    }
+
+    //*************************************************************************
+    bool blockHeader()
+    {
+        if (!need(3)) return false;
+        lastBlock = take(1);
+        switch (take(2)) {
+        case 0:
+            state = S_STORED_LENGTH;
+            return true;
+        case 1:
+            fixedTables();
+            state = S_CODES;
+            return true;
+        case 2:
+            state = S_TABLE_SIZES;
+            return true;
+        default:
+            return fail("Bad block type");
+        }
+    }
+
+    bool storedLength()
+    {
+        take(bitCount & 7); // To a byte boundary.
+        if (!need(32)) return false;
+        storedLeft = take(16);
+        if (take(16) != (~storedLeft & 0xFFFF)) return fail("Bad stored block length");
+        state = S_STORED;
+        return true;
+    }
+
+    bool stored()
+    {
+        while (storedLeft && bitCount) { // Whole bytes still in the bit buffer.
+            if (!put((uint8_t)take(8))) return false;
+            storedLeft--;
+        }
+        while (storedLeft && (in < inEnd)) {
+            size_t n = inEnd - in;
+            if (n > storedLeft) n = storedLeft;
+            if (!putBytes(in, n)) return false;
+            in += n;
+            storedLeft -= n;
+        }
+        if (storedLeft) return false;
+        state = lastBlock ? S_TRAILER : S_BLOCK;
+        return true;
+    }
+
+    //*************************************************************************
+    // Dynamic Huffman tables: their sizes, the code that the code lengths
+    // are in, then the code lengths, one symbol at a time.
+    bool tableSizes()
+    {
+        if (!need(14)) return false;
+        lengthCount = take(5) + 257;
+        distCount   = take(5) + 1;
+        codeCount   = take(4) + 4;
+        if ((lengthCount > 286) || (distCount > 30)) return fail("Bad table sizes");
+        memset(lengths, 0, sizeof(lengths));
+        index = 0;
+        state = S_CODE_LENGTH_CODES;
+        return true;
+    }
+
+    bool codeLengthCodes()
+    {
+        static const uint8_t order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+        while (index < codeCount) {
+            if (!need(3)) return false;
+            lengths[order[index++]] = take(3);
+        }
+        if (build(lengthCode, lengths, 19) != 0) return fail("Bad code length code");
+        memset(lengths, 0, 19);
+        index = 0;
+        state = S_CODE_LENGTHS;
+        return true;
+    }
+
+    bool codeLengths()
+    {
+        unsigned needed = lengthCount + distCount;
+
+        while (index < needed) {
+            if (!need(14)) return false; // A 7-bit code and up to 7 extra bits.
+            int symbol = decode(lengthCode);
+            if (symbol < 0) return fail("Bad code length");
+            if (symbol < 16) {
+                lengths[index++] = symbol;
+                continue;
+            }
+
+            uint8_t  length = 0;
+            unsigned repeat;
+            if (symbol == 16) {
+                if (index == 0) return fail("Repeat with no previous length");
+                length = lengths[index - 1];
+                repeat = 3 + take(2);
+            } else if (symbol == 17) {
+                repeat = 3 + take(3);
+            } else {
+                repeat = 11 + take(7);
+            }
+            if (index + repeat > needed) return fail("Too many code lengths");
+            while (repeat--) lengths[index++] = length;
+        }
+
+        if (lengths[256] == 0) return fail("No end-of-block code");
+        int left = build(lengthCode, lengths, lengthCount);
+        if ((left < 0) || ((left > 0) && (lengthCount - lengthCode.count[0] != 1))) {
+            return fail("Bad literal/length code");
+        }
+        left = build(distCode, lengths + lengthCount, distCount);
+        if ((left < 0) || ((left > 0) && (distCount - distCode.count[0] != 1))) {
+            return fail("Bad distance code");
+        }
+        state = S_CODES;
+        return true;
+    }
+
+    void fixedTables()
+    {
+        uint8_t fixed[288];
+        int     i = 0;
+        for (; i < 144; i++) fixed[i] = 8;
+        for (; i < 256; i++) fixed[i] = 9;
+        for (; i < 280; i++) fixed[i] = 7;
+        for (; i < 288; i++) fixed[i] = 8;
+        build(lengthCode, fixed, 288);
+        for (i = 0; i < 30; i++) fixed[i] = 5;
+        build(distCode, fixed, 30);
+    }
+
+    //*************************************************************************
+    // Literals and length/distance pairs, until the end of the block.
+    bool codes()
+    {
+        static const uint16_t lengthBase[29] = { 3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+                                                 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+        static const uint8_t lengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                                                 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+        static const uint16_t distBase[30] = { 1,   2,   3,   4,   5,   7,    9,    13,   17,   25,
+                                               33,  49,  65,  97,  129, 193,  257,  385,  513,  769,
+                                               1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+        static const uint8_t distExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2,  3,  3,  4,  4,  5,  5,  6,
+                                               6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+        for (;;) {
+            if (!need(48)) return false; // Longest pair: 15 + 5 + 15 + 13 bits.
+            int symbol = decode(lengthCode);
+            if (symbol < 0) return fail("Bad literal/length code");
+            if (symbol < 256) {
+                if (!put((uint8_t)symbol)) return false;
+                continue;
+            }
+            if (symbol == 256) {
+                state = lastBlock ? S_TRAILER : S_BLOCK;
+                return true;
+            }
+
+            symbol -= 257;
+            if (symbol >= 29) return fail("Bad length");
+            unsigned length = lengthBase[symbol] + take(lengthExtra[symbol]);
+
+            symbol = decode(distCode);
+            if ((symbol < 0) || (symbol >= 30)) return fail("Bad distance code");
+            uint32_t distance = distBase[symbol] + take(distExtra[symbol]);
+            if (distance > INFLATE_WINDOW_SIZE) return fail("Compressed with too big a window");
+            if (distance > total) return fail("Distance too far back");
+
+            while (length--) {
+                if (!put(window[(total - distance) & (INFLATE_WINDOW_SIZE - 1)])) return false;
+            }
+        }
+    }
+
+    //*************************************************************************
+    // CRC-32 and length of the decompressed data, each little-endian.
+    bool trailer()
+    {
+        take(bitCount & 7);
+        if (!need(32)) return false;
+        uint32_t value = take(32);
+
+        if (subStep == 0) {
+            if (!flush()) return false;
+            if (value != crc) return fail("CRC of decompressed image doesn't match");
+            subStep = 1;
+            return true;
+        }
+        if (value != total) return fail("Length of decompressed image doesn't match");
+        state = S_DONE;
+        return true;
+    }
+
+    //*************************************************************************
+    // Output goes into the window, and on to the sink when the window's full.
+    bool put(uint8_t b)
+    {
+        window[total & (INFLATE_WINDOW_SIZE - 1)] = b;
+        total++;
+        return (total - flushed < INFLATE_WINDOW_SIZE) || flush();
+    }
+
+    bool putBytes(const uint8_t *data, size_t length)
+    {
+        while (length--) {
+            if (!put(*data++)) return false;
+        }
+        return true;
+    }
+
+    bool flush()
+    {
+        while (flushed != total) {
+            uint32_t start = flushed & (INFLATE_WINDOW_SIZE - 1);
+            uint32_t n     = total - flushed;
+            if (n > INFLATE_WINDOW_SIZE - start) n = INFLATE_WINDOW_SIZE - start;
+            crc = crc32(window + start, n, crc);
+            if (!output(outputContext, window + start, n)) return fail("Couldn't write decompressed image");
+            flushed += n;
+        }
+        return true;
+    }
+
+    //*************************************************************************
+    // Canonical Huffman decoding, a bit at a time (after zlib's puff.c).
+    // The caller has already made sure the bits are there.
+    int decode(const Huffman &h)
+    {
+        int code = 0, first = 0, index = 0;
+
+        for (int length = 1; length <= INFLATE_MAX_BITS; length++) {
+            code |= (int)take(1);
+            int count = h.count[length];
+            if (code - count < first) return h.symbol[index + (code - first)];
+            index += count;
+            first += count;
+            first <<= 1;
+            code <<= 1;
+        }
+        return -1;
+    }
+
+    // Returns 0 for a complete code, > 0 for an incomplete one, < 0 if
+    // over-subscribed.
+    static int build(Huffman &h, const uint8_t *length, unsigned n)
+    {
+        int16_t offsets[INFLATE_MAX_BITS + 1];
+
+        memset(h.count, 0, sizeof(h.count));
+        for (unsigned symbol = 0; symbol < n; symbol++) h.count[length[symbol]]++;
+        if (h.count[0] == (int16_t)n) return 0; // No codes at all. Fine until one's used.
+
+        int left = 1;
+        for (int len = 1; len <= INFLATE_MAX_BITS; len++) {
+            left <<= 1;
+            left -= h.count[len];
+            if (left < 0) return left;
+        }
+
+        offsets[1] = 0;
+        for (int len = 1; len < INFLATE_MAX_BITS; len++) offsets[len + 1] = offsets[len] + h.count[len];
+        for (unsigned symbol = 0; symbol < n; symbol++) {
+            if (length[symbol] != 0) h.symbol[offsets[length[symbol]]++] = symbol;
+        }
+        return left;
+    }
+};
+
+#endif //__DIGAME_INFLATE_H__
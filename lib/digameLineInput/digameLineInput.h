@@ -0,0 +1,96 @@
+/* digameLineInput.h
+ *
+ *  Incremental, byte-at-a-time line assembly for the Serial and Bluetooth
+ *  consoles. Bytes are fed in as they arrive and a finished line is handed
+ *  back when its terminator shows up, so reading user input never waits on
+ *  a stream. No Arduino dependencies -- builds on a Linux host as-is.
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#ifndef __DIGAME_LINE_INPUT_H__
+#define __DIGAME_LINE_INPUT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LINE_INPUT_MAX_LENGTH 64 // Longest line we keep. Extra characters are dropped.
+
+class LineAssembler
+{
+  public:
+    LineAssembler() { reset(); }
+
+    //*************************************************************************
+    // Feed one byte from the stream. Returns true when a complete line is
+    // ready in line(). The line stays valid until the next call to feed().
+    bool feed(char c)
+    {
+        if (lineReady) reset(); // Previous line has been consumed.
+
+        if ((c == '\r') || (c == '\n')) {
+            // Treat CR, LF and CRLF alike: the second half of a CRLF pair
+            // must not produce an extra empty line.
+            bool pairedTerminator = (c == '\n') && (lastChar == '\r');
+            lastChar = c;
+            if (pairedTerminator) return false;
+            finishLine();
+            return true;
+        }
+
+        lastChar = c;
+
+        if ((c == '\b') || (c == 0x7f)) { // Backspace / Delete
+            if (len > 0) len--;
+            return false;
+        }
+
+        if ((uint8_t)c < ' ') return false; // Ignore other control characters.
+
+        if (len < LINE_INPUT_MAX_LENGTH - 1) {
+            buffer[len++] = c;
+        } else {
+            overflowed = true;
+        }
+        return false;
+    }
+
+    //*************************************************************************
+    // Throw away anything partially typed.
+    void reset()
+    {
+        len        = 0;
+        buffer[0]  = 0;
+        lineReady  = false;
+        overflowed = false;
+    }
+
+    const char *line()      { return buffer; }
+    size_t      length()    { return len; }
+    bool        truncated() { return overflowed; } // Line was longer than we could keep.
+    bool        pending()   { return (!lineReady) && (len > 0); }
+
+  private:
+    char   buffer[LINE_INPUT_MAX_LENGTH];
+    size_t len        = 0;
+    char   lastChar   = 0;
+    bool   lineReady  = false;
+    bool   overflowed = false;
+
+    // Terminate the buffer and strip leading/trailing white space.
+    void finishLine()
+    {
+        while ((len > 0) && (buffer[len - 1] == ' ' || buffer[len - 1] == '\t')) len--;
+        buffer[len] = 0;
+
+        size_t start = 0;
+        while ((start < len) && (buffer[start] == ' ' || buffer[start] == '\t')) start++;
+        if (start > 0) {
+            for (size_t i = start; i <= len; i++) buffer[i - start] = buffer[i];
+            len -= start;
+        }
+        lineReady = true;
+    }
+};
+
+#endif //__DIGAME_LINE_INPUT_H__
@@ -0,0 +1,374 @@
+/* digameLive.h
+ *
+ *  Live counts and raw distances for the web page, over a WebSocket.
+ *
+ *  Count changes go to every client at once. Raw distances go only to
+ *  clients that ask for them, each at the rate it asks for: a client sends
+ *  the text "rate <Hz>" (0 to stop, up to LIVE_MAX_RATE_HZ) and from then on
+ *  gets every frame that falls due at that rate, batched into one message
+ *  every LIVE_FLUSH_MS.
+ *
+ *  Messages to the client, all JSON text:
+ *    {"type":"hello","maxRate":50}
+ *    {"type":"counts","in":12,"out":9}
+ *    {"type":"raw","dropped":0,"samples":[[ms,dist1,dist2,state],...]}
+ *
+ *  A slow client must never hold up counting, so nothing here waits. Before
+ *  each send we ask whether the client's send queue has room. If not, raw
+ *  batches are dropped (and counted, so the page can say so) and count
+ *  updates are held back, latest wins. A client that stays blocked for
+ *  LIVE_STALL_MS is disconnected.
+ *
+ *  LivePush is plain C++ and reaches the clients through LiveSink. LiveServer
+ *  is the ESP32 glue onto an AsyncWebSocket. The socket's events arrive on
+ *  the network task; they're queued and handled in service(), from the main
+ *  loop, so LivePush itself is only ever touched by one task.
+ *
+ *  The socket's client list belongs to the network task, which adds and
+ *  frees clients with no lock of its own. LiveServer looks clients up by
+ *  id under its own mutex, and the network task takes the same mutex when
+ *  a client goes. That event comes after the client is off the list but
+ *  before it's freed, so the loop is never part way through one that's
+ *  being deleted.
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#ifndef __DIGAME_LIVE_H__
+#define __DIGAME_LIVE_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LIVE_MAX_CLIENTS     4
+#define LIVE_MAX_RATE_HZ     50
+#define LIVE_FLUSH_MS        100   // Raw samples go out in batches this often...
+#define LIVE_BATCH_SAMPLES   8     // ...or when this many are waiting.
+#define LIVE_STALL_MS        10000 // Blocked this long and the client is dropped.
+#define LIVE_MESSAGE_SIZE    (64 + LIVE_BATCH_SAMPLES * 32)
+
+//*****************************************************************************
+// The clients, as the transport sees them. None of these may block.
+class LiveSink
+{
+  public:
+    virtual ~LiveSink() {}
+    virtual bool canSend(uint32_t client) = 0; // Room in this client's send queue?
+    virtual bool send(uint32_t client, const char *text, size_t length) = 0;
+    virtual void close(uint32_t client) = 0;
+};
+
+struct LiveSample
+{
+    uint32_t ms;
+    int16_t  dist1;
+    int16_t  dist2;
+    uint8_t  state;
+};
+
+class LivePush
+{
+  public:
+    uint32_t messagesSent = 0;
+    uint32_t batchesDropped = 0;
+    uint32_t clientsDropped = 0; // Disconnected for stalling.
+
+    void begin(LiveSink &s) { sink = &s; }
+
+    //*************************************************************************
+    // Client comings and goings. addClient() returns false if we're full.
+    bool addClient(uint32_t id, uint32_t nowMs)
+    {
+        for (auto &c : clients) {
+            if (c.active) continue;
+            c               = Client();
+            c.active        = true;
+            c.id            = id;
+            c.countsPending = true; // Bring the new page up to date.
+            c.helloPending  = true;
+            c.lastSentMs    = nowMs;
+            return true;
+        }
+        return false;
+    }
+
+    void removeClient(uint32_t id)
+    {
+        Client *c = find(id);
+        if (c) c->active = false;
+    }
+
+    // A text message from a client. "rate <Hz>" is all we understand.
+    void onMessage(uint32_t id, const char *text, size_t length)
+    {
+        Client *c = find(id);
+        if (!c || (length < 5) || (strncmp(text, "rate ", 5) != 0)) return;
+
+        char number[8];
+        size_t n = length - 5;
+        if (n >= sizeof(number)) n = sizeof(number) - 1;
+        memcpy(number, text + 5, n);
+        number[n] = 0;
+        setRate(*c, atoi(number));
+    }
+
+    //*************************************************************************
+    // Call every pass of the main loop with the current counts.
+    void counts(uint32_t in, uint32_t out)
+    {
+        if ((in == lastIn) && (out == lastOut)) return;
+        lastIn  = in;
+        lastOut = out;
+        for (auto &c : clients) c.countsPending = true;
+    }
+
+    // Call with every good frame.
+    void frame(uint32_t nowMs, int16_t dist1, int16_t dist2, uint8_t state)
+    {
+        for (auto &c : clients) {
+            if (!c.active || (c.intervalMs == 0)) continue;
+            if ((int32_t)(nowMs - c.nextSampleMs) < 0) continue;
+
+            // Stay on the client's grid unless we've fallen well behind it.
+            c.nextSampleMs += c.intervalMs;
+            if ((int32_t)(nowMs - c.nextSampleMs) >= 0) c.nextSampleMs = nowMs + c.intervalMs;
+
+            if (c.samples == LIVE_BATCH_SAMPLES) flushRaw(c, nowMs);
+            c.batch[c.samples++] = {nowMs, dist1, dist2, state};
+        }
+    }
+
+    //*************************************************************************
+    // Send whatever's due. Call from the main loop.
+    void service(uint32_t nowMs)
+    {
+        for (auto &c : clients) {
+            if (!c.active) continue;
+
+            if (c.helloPending && trySend(c, nowMs, buffer,
+                    snprintf(buffer, sizeof(buffer), "{\"type\":\"hello\",\"maxRate\":%d}", LIVE_MAX_RATE_HZ))) {
+                c.helloPending = false;
+            }
+
+            if (c.countsPending && trySend(c, nowMs, buffer,
+                    snprintf(buffer, sizeof(buffer), "{\"type\":\"counts\",\"in\":%lu,\"out\":%lu}",
+                             (unsigned long)lastIn, (unsigned long)lastOut))) {
+                c.countsPending = false;
+            }
+
+            if ((c.samples > 0) && (nowMs - c.lastFlushMs >= LIVE_FLUSH_MS)) flushRaw(c, nowMs);
+
+            if (c.active && (nowMs - c.lastSentMs >= LIVE_STALL_MS) && (c.helloPending || c.countsPending || c.blocked)) {
+                c.active = false; // Hasn't taken anything for too long.
+                clientsDropped++;
+                sink->close(c.id);
+            }
+        }
+    }
+
+    size_t clientCount()
+    {
+        size_t n = 0;
+        for (auto &c : clients) n += c.active ? 1 : 0;
+        return n;
+    }
+
+  private:
+    struct Client
+    {
+        bool       active        = false;
+        uint32_t   id            = 0;
+        uint32_t   intervalMs    = 0;  // 0: no raw data.
+        uint32_t   nextSampleMs  = 0;
+        uint32_t   lastFlushMs   = 0;
+        uint32_t   lastSentMs    = 0;  // Last time the client took a message.
+        uint32_t   dropped       = 0;  // Raw batches it missed. Reported in the next one.
+        bool       countsPending = false;
+        bool       helloPending  = false;
+        bool       blocked       = false;
+        size_t     samples       = 0;
+        LiveSample batch[LIVE_BATCH_SAMPLES];
+    };
+
+    LiveSink *sink    = nullptr;
+    Client    clients[LIVE_MAX_CLIENTS];
+    uint32_t  lastIn  = 0;
+    uint32_t  lastOut = 0;
+    char      buffer[LIVE_MESSAGE_SIZE];
+
+    Client *find(uint32_t id)
+    {
+        for (auto &c : clients) {
+            if (c.active && (c.id == id)) return &c;
+        }
+        return nullptr;
+    }
+
+    static void setRate(Client &c, int hz)
+    {
+        if (hz < 0) hz = 0;
+        if (hz > LIVE_MAX_RATE_HZ) hz = LIVE_MAX_RATE_HZ;
+        c.intervalMs   = hz ? 1000 / hz : 0;
+        c.nextSampleMs = 0;
+        c.samples      = 0;
+    }
+
+    bool trySend(Client &c, uint32_t nowMs, const char *text, int length)
+    {
+        if ((length <= 0) || ((size_t)length >= sizeof(buffer))) return false;
+        if (!sink->canSend(c.id) || !sink->send(c.id, text, length)) {
+            c.blocked = true;
+            return false;
+        }
+        c.blocked    = false;
+        c.lastSentMs = nowMs;
+        messagesSent++;
+        return true;
+    }
+
+    void flushRaw(Client &c, uint32_t nowMs)
+    {
+        int n = snprintf(buffer, sizeof(buffer), "{\"type\":\"raw\",\"dropped\":%lu,\"samples\":[",
+                         (unsigned long)c.dropped);
+        for (size_t i = 0; i < c.samples; i++) {
+            const LiveSample &s = c.batch[i];
+            n += snprintf(buffer + n, sizeof(buffer) - n, "%s[%lu,%d,%d,%u]", i ? "," : "",
+                          (unsigned long)s.ms, s.dist1, s.dist2, s.state);
+        }
+        n += snprintf(buffer + n, sizeof(buffer) - n, "]}");
+
+        if (trySend(c, nowMs, buffer, n)) {
+            c.dropped = 0;
+        } else {
+            c.dropped++; // Stale by the next flush anyway. Let it go.
+            batchesDropped++;
+        }
+        c.samples     = 0;
+        c.lastFlushMs = nowMs;
+    }
+};
+
+#if defined(ESP32)
+#include <Arduino.h>
+#include <ESPAsyncWebServer.h>
+
+//*****************************************************************************
+// LivePush on an AsyncWebSocket at the given path.
+class LiveServer : public LiveSink
+{
+  public:
+    LivePush push;
+
+    LiveServer(const char *path) : ws(path) {}
+
+    void begin(AsyncWebServer &server)
+    {
+        clientsLock = xSemaphoreCreateRecursiveMutex(); // Closing a client can free it there and then.
+        events      = xQueueCreate(16, sizeof(Event));
+        push.begin(*this);
+        ws.onEvent([this](AsyncWebSocket *, AsyncWebSocketClient *client, AwsEventType type, void *arg,
+                          uint8_t *data, size_t length) { onEvent(client, type, arg, data, length); });
+        server.addHandler(&ws);
+    }
+
+    // From the main loop. Applies client events, then sends what's due.
+    void service(uint32_t nowMs)
+    {
+        if (!events) return; // Not started.
+
+        Event e;
+        while (xQueueReceive(events, &e, 0) == pdTRUE) {
+            switch (e.type) {
+            case Event::CONNECT:
+                if (!push.addClient(e.client, nowMs)) close(e.client); // Full up.
+                break;
+            case Event::DISCONNECT:
+                push.removeClient(e.client);
+                break;
+            case Event::MESSAGE:
+                push.onMessage(e.client, e.text, strlen(e.text));
+                break;
+            }
+        }
+
+        push.service(nowMs);
+
+        if (nowMs - lastCleanupMs >= 1000) {
+            Hold hold(clientsLock);
+            ws.cleanupClients(LIVE_MAX_CLIENTS);
+            lastCleanupMs = nowMs;
+        }
+    }
+
+    // Each looks the client up again, so one that's gone since is just missed.
+    bool canSend(uint32_t client) override
+    {
+        Hold                  hold(clientsLock);
+        AsyncWebSocketClient *c = ws.client(client);
+        return c && (c->status() == WS_CONNECTED) && !c->queueIsFull();
+    }
+
+    bool send(uint32_t client, const char *text, size_t length) override
+    {
+        Hold hold(clientsLock);
+        ws.text(client, text, length);
+        return true;
+    }
+
+    void close(uint32_t client) override
+    {
+        Hold hold(clientsLock);
+        ws.close(client);
+    }
+
+  private:
+    struct Event
+    {
+        enum { CONNECT, DISCONNECT, MESSAGE } type;
+        uint32_t client;
+        char     text[16];
+    };
+
+    // Holds the mutex for one call into the socket's client list.
+    class Hold
+    {
+      public:
+        Hold(SemaphoreHandle_t m) : mutex(m) { xSemaphoreTakeRecursive(mutex, portMAX_DELAY); }
+        ~Hold() { xSemaphoreGiveRecursive(mutex); }
+      private:
+        SemaphoreHandle_t mutex;
+    };
+
+    AsyncWebSocket    ws;
+    QueueHandle_t     events        = nullptr;
+    SemaphoreHandle_t clientsLock   = nullptr;
+    uint32_t          lastCleanupMs = 0;
+
+    // On the network task. Just pass it on.
+    void onEvent(AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t length)
+    {
+        Event e = {};
+        e.client = client->id();
+
+        if (type == WS_EVT_CONNECT) {
+            e.type = Event::CONNECT;
+        } else if (type == WS_EVT_DISCONNECT) {
+            e.type = Event::DISCONNECT;
+            Hold hold(clientsLock); // Wait out any call the loop is making. Then it can be freed.
+        } else if (type == WS_EVT_DATA) {
+            AwsFrameInfo *info = (AwsFrameInfo *)arg;
+            if (!info->final || (info->index != 0) || (info->opcode != WS_TEXT)) return; // Ours are short.
+            e.type = Event::MESSAGE;
+            size_t n = (length < sizeof(e.text) - 1) ? length : sizeof(e.text) - 1;
+            memcpy(e.text, data, n);
+        } else {
+            return;
+        }
+        xQueueSend(events, &e, 0); // If the queue's full, a page reload will sort it out.
+    }
+};
+#endif // ESP32
+
+#endif //__DIGAME_LIVE_H__
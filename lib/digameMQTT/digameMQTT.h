@@ -0,0 +1,829 @@
+/* digameMQTT.h
+ *
+ *  Publishes events, counts and health to an MQTT broker over one
+ *  persistent connection.
+ *
+ *  MqttClient is a minimal MQTT 3.1.1 publisher: CONNECT with a last will,
+ *  PUBLISH at QoS 0 or 1, keep-alive pings. QoS 1 messages wait in a small
+ *  queue until the broker's PUBACK; anything unacknowledged when the
+ *  connection drops is sent again, flagged DUP, once it's back. Brokers
+ *  acknowledge QoS 1 in order, so the queue is a FIFO.
+ *
+ *  MqttEngine feeds it from the event log, exactly like the HTTP uploader:
+ *  a cursor marks the first event the broker hasn't acknowledged, so the
+ *  log is the offline queue and nothing is lost while the broker is away.
+ *
+ *  Topics (name made topic-safe, MAC as from getMACAddress()):
+ *    digame/<deviceName>/<MAC>/event    One message per event, QoS 1.
+ *    digame/<deviceName>/<MAC>/counts   Running totals, QoS 1, retained.
+ *    digame/<deviceName>/<MAC>/health   Every MQTT_HEALTH_MS, QoS 0.
+ *    digame/<deviceName>/<MAC>/status   "online", or "offline" from the will.
+ *
+ *  Everything up to MqttPublisher is plain C++ and talks to the network
+ *  through MqttSocket. MqttPublisher runs the engine in its own task on
+ *  the ESP32 over a WiFiClient. Elsewhere, PosixMqttSocket connects it to
+ *  a broker over TCP, so a Linux host can run it against mosquitto.
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#ifndef __DIGAME_MQTT_H__
+#define __DIGAME_MQTT_H__
+
+#include <digameDebug.h>
+#include <digameEventLog.h>
+#include <FS.h>
+
+#define MQTT_KEEPALIVE_S        60
+#define MQTT_CONNACK_TIMEOUT_MS 5000
+#define MQTT_BACKOFF_MIN_MS     1000
+#define MQTT_BACKOFF_MAX_MS     60000
+#define MQTT_QUEUE_SIZE         8    // QoS 1 messages awaiting PUBACK.
+#define MQTT_TOPIC_SIZE         96
+#define MQTT_PAYLOAD_SIZE       192
+#define MQTT_MAX_PACKET         (MQTT_TOPIC_SIZE + MQTT_PAYLOAD_SIZE + 16)
+#define MQTT_MAX_INCOMING       8    // We only expect CONNACK, PUBACK and PINGRESP.
+
+#define MQTT_HEALTH_MS          60000
+#define MQTT_COUNTS_MIN_MS      1000  // Don't republish counts faster than this.
+#define MQTT_CURSOR_SAVE_MS     30000
+#define MQTT_CURSOR_FILE        "/mqtt.cur"
+
+// Packet types (upper nibble of the first byte).
+#define MQTT_CONNECT            0x10
+#define MQTT_CONNACK            0x20
+#define MQTT_PUBLISH            0x30
+#define MQTT_PUBACK             0x40
+#define MQTT_PINGREQ            0xC0
+#define MQTT_PINGRESP           0xD0
+#define MQTT_DISCONNECT         0xE0
+
+typedef uint32_t (*MqttClock)();
+
+//*****************************************************************************
+// The connection to the broker. read() must not wait: it returns 0 when
+// nothing has arrived and a negative number once the connection is gone.
+class MqttSocket
+{
+  public:
+    virtual ~MqttSocket() {}
+    virtual bool open(const char *host, uint16_t port) = 0;
+    virtual bool isOpen() = 0;
+    virtual int  write(const uint8_t *data, size_t length) = 0;
+    virtual int  read(uint8_t *data, size_t length) = 0;
+    virtual void close() = 0;
+};
+
+//*****************************************************************************
+// Packet building. Each returns the packet length, or 0 if it won't fit.
+//*****************************************************************************
+class MqttPacket
+{
+  public:
+    MqttPacket(uint8_t *buffer, size_t size) : buf(buffer), cap(size) {}
+
+    // Fixed header with room reserved for the remaining length, which
+    // finish() fills in once the body is written.
+    void start(uint8_t header) { len = 5; first = header; bad = false; }
+
+    void putU8(uint8_t v)      { if (len + 1 > cap) { bad = true; return; } buf[len++] = v; }
+    void putU16(uint16_t v)    { putU8(v >> 8); putU8(v & 0xFF); }
+    void putBytes(const void *data, size_t n)
+    {
+        if (len + n > cap) { bad = true; return; }
+        memcpy(buf + len, data, n);
+        len += n;
+    }
+    void putString(const char *s) { size_t n = strlen(s); putU16(n); putBytes(s, n); }
+
+    // Returns a pointer to the packet (which may start a few bytes into
+    // the buffer) and its length.
+    const uint8_t *finish(size_t &length)
+    {
+        size_t  remaining = len - 5;
+        uint8_t encoded[4];
+        size_t  n = 0;
+        do {
+            uint8_t digit = remaining % 128;
+            remaining /= 128;
+            encoded[n++] = digit | (remaining ? 0x80 : 0);
+        } while (remaining && (n < 4));
+
+        size_t begin = 5 - 1 - n;
+        buf[begin] = first;
+        memcpy(buf + begin + 1, encoded, n);
+        length = bad ? 0 : len - begin;
+        return buf + begin;
+    }
+
+  private:
+    uint8_t *buf;
+    size_t   cap;
+    size_t   len   = 0;
+    uint8_t  first = 0;
+    bool     bad   = false;
+};
+
+//*****************************************************************************
+struct MqttMessage
+{
+    uint32_t tag;      // Caller's reference, handed back on PUBACK. 0 for none.
+    uint16_t packetId;
+    uint16_t length;
+    bool     retain;
+    bool     sent;     // Sent at least once: resends carry DUP.
+    char     topic[MQTT_TOPIC_SIZE];
+    uint8_t  payload[MQTT_PAYLOAD_SIZE];
+};
+
+class MqttClient
+{
+  public:
+    typedef void (*AckHandler)(void *context, uint32_t tag);
+
+    uint32_t connects        = 0;
+    uint32_t connectFailures = 0;
+    uint32_t drops           = 0;
+    uint32_t acked           = 0;
+    uint32_t resent          = 0;
+
+    void begin(MqttSocket &s, MqttClock now)
+    {
+        socket = &s;
+        clock  = now;
+    }
+
+    void setServer(const char *h, uint16_t p) { strncpy(host, h, sizeof(host) - 1); port = p; }
+
+    void setIdentity(const char *id, const char *user, const char *password)
+    {
+        strncpy(clientId, id, sizeof(clientId) - 1);
+        strncpy(userName, user, sizeof(userName) - 1);
+        strncpy(pass, password, sizeof(pass) - 1);
+    }
+
+    // Retained QoS 1 message the broker publishes if we vanish.
+    void setWill(const char *topic, const char *message)
+    {
+        strncpy(willTopic, topic, sizeof(willTopic) - 1);
+        strncpy(willMessage, message, sizeof(willMessage) - 1);
+    }
+
+    void onAck(AckHandler handler, void *context) { ackHandler = handler; ackContext = context; }
+
+    bool   connected()  { return state == CONNECTED; }
+    size_t queueSpace() { return MQTT_QUEUE_SIZE - count; }
+    size_t queued()     { return count; }
+
+    // The lowest tag still waiting for its PUBACK. 0 if there isn't one.
+    uint32_t oldestTag()
+    {
+        uint32_t lowest = 0;
+        for (size_t i = 0; i < count; i++) {
+            uint32_t tag = queue[(head + i) % MQTT_QUEUE_SIZE].tag;
+            if (tag && (!lowest || (tag < lowest))) lowest = tag;
+        }
+        return lowest;
+    }
+
+    //*************************************************************************
+    // Queue a QoS 1 message. Returns false if the queue is full.
+    bool publish(const char *topic, const void *payload, size_t length, bool retain, uint32_t tag)
+    {
+        if ((count == MQTT_QUEUE_SIZE) || (length > MQTT_PAYLOAD_SIZE) || (strlen(topic) >= MQTT_TOPIC_SIZE)) {
+            return false;
+        }
+        MqttMessage &m = queue[(head + count) % MQTT_QUEUE_SIZE];
+        m.tag      = tag;
+        m.packetId = nextPacketId();
+        m.length   = length;
+        m.retain   = retain;
+        m.sent     = false;
+        strcpy(m.topic, topic);
+        memcpy(m.payload, payload, length);
+        count++;
+        return true;
+    }
+
+    // Send a QoS 0 message now, if connected. Nothing is kept.
+    bool publishNow(const char *topic, const void *payload, size_t length, bool retain)
+    {
+        if (state != CONNECTED) return false;
+        MqttPacket p(tx, sizeof(tx));
+        p.start(MQTT_PUBLISH | (retain ? 0x01 : 0));
+        p.putString(topic);
+        p.putBytes(payload, length);
+        return send(p);
+    }
+
+    //*************************************************************************
+    // Call regularly. Connects when the link is up, reads acknowledgements,
+    // sends what's queued and keeps the connection alive.
+    void service(bool linkUp)
+    {
+        uint32_t now = clock();
+
+        if (state == DISCONNECTED) {
+            if (!linkUp || (host[0] == 0) || ((int32_t)(now - retryAtMs) < 0)) return;
+            if (!socket->open(host, port)) {
+                connectFailures++;
+                fail();
+                return;
+            }
+            sendConnect();
+            state           = AWAIT_CONNACK;
+            connackDeadline = clock() + MQTT_CONNACK_TIMEOUT_MS;
+            return;
+        }
+
+        if (!socket->isOpen()) {
+            drop();
+            return;
+        }
+
+        uint8_t rx[64];
+        int     n;
+        while ((n = socket->read(rx, sizeof(rx))) > 0) {
+            for (int i = 0; i < n; i++) parse(rx[i]);
+            if (state == DISCONNECTED) return; // A packet ended the session.
+        }
+        if (n < 0) {
+            drop();
+            return;
+        }
+
+        now = clock();
+        if (state == AWAIT_CONNACK) {
+            if ((int32_t)(now - connackDeadline) >= 0) {
+                connectFailures++;
+                drop();
+            }
+            return;
+        }
+
+        // Anything queued that hasn't gone out on this connection.
+        while (unsent < count) {
+            MqttMessage &m = queue[(head + unsent) % MQTT_QUEUE_SIZE];
+            if (m.sent) resent++;
+            if (!sendPublish(m)) return;
+            m.sent = true;
+            unsent++;
+        }
+
+        if (pingOutstanding && (now - pingSentMs > MQTT_KEEPALIVE_S * 1000UL)) {
+            drop(); // Broker's gone quiet.
+            return;
+        }
+        if (!pingOutstanding && (now - lastSendMs >= MQTT_KEEPALIVE_S * 500UL)) {
+            uint8_t ping[2] = {MQTT_PINGREQ, 0};
+            if (!sendRaw(ping, 2)) return;
+            pingOutstanding = true;
+            pingSentMs      = now;
+        }
+    }
+
+    // Say goodbye properly, e.g. before a deliberate reboot.
+    void disconnect()
+    {
+        if (state == CONNECTED) {
+            uint8_t bye[2] = {MQTT_DISCONNECT, 0};
+            socket->write(bye, 2);
+        }
+        if (state != DISCONNECTED) socket->close();
+        state = DISCONNECTED;
+    }
+
+  private:
+    enum State { DISCONNECTED, AWAIT_CONNACK, CONNECTED };
+
+    MqttSocket *socket          = nullptr;
+    MqttClock   clock           = nullptr;
+    State       state           = DISCONNECTED;
+    char        host[64]        = {0};
+    uint16_t    port            = 1883;
+    char        clientId[32]    = {0};
+    char        userName[32]    = {0};
+    char        pass[48]        = {0};
+    char        willTopic[MQTT_TOPIC_SIZE] = {0};
+    char        willMessage[16] = {0};
+    AckHandler  ackHandler      = nullptr;
+    void       *ackContext      = nullptr;
+
+    MqttMessage queue[MQTT_QUEUE_SIZE];
+    size_t      head            = 0;
+    size_t      count           = 0;
+    size_t      unsent          = 0; // Index of the first queued message not yet sent this connection.
+    uint16_t    packetId        = 0;
+
+    uint32_t    retryAtMs       = 0;
+    uint32_t    backoffMs       = 0;
+    uint32_t    connackDeadline = 0;
+    uint32_t    lastSendMs      = 0;
+    uint32_t    pingSentMs      = 0;
+    bool        pingOutstanding = false;
+
+    uint8_t     tx[MQTT_MAX_PACKET];
+
+    // Incoming packet assembly.
+    uint8_t     rxType          = 0;
+    uint32_t    rxRemaining     = 0;
+    uint8_t     rxShift         = 0;
+    uint8_t     rxBody[MQTT_MAX_INCOMING];
+    size_t      rxLength        = 0;
+    enum { RX_TYPE, RX_LENGTH, RX_BODY } rxState = RX_TYPE;
+
+    uint16_t nextPacketId()
+    {
+        if (++packetId == 0) packetId = 1;
+        return packetId;
+    }
+
+    bool sendRaw(const uint8_t *data, size_t length)
+    {
+        if (socket->write(data, length) != (int)length) {
+            drop();
+            return false;
+        }
+        lastSendMs = clock();
+        return true;
+    }
+
+    bool send(MqttPacket &p)
+    {
+        size_t         length;
+        const uint8_t *data = p.finish(length);
+        return (length > 0) && sendRaw(data, length);
+    }
+
+    void sendConnect()
+    {
+        uint8_t flags = 0x02; // Clean session. We resend our own queue.
+        if (willTopic[0]) flags |= 0x04 | 0x08 | 0x20; // Will, QoS 1, retained.
+        if (userName[0])  flags |= 0x80;
+        if (pass[0])      flags |= 0x40;
+
+        MqttPacket p(tx, sizeof(tx));
+        p.start(MQTT_CONNECT);
+        p.putString("MQTT");
+        p.putU8(4); // 3.1.1
+        p.putU8(flags);
+        p.putU16(MQTT_KEEPALIVE_S);
+        p.putString(clientId);
+        if (willTopic[0]) {
+            p.putString(willTopic);
+            p.putString(willMessage);
+        }
+        if (userName[0]) p.putString(userName);
+        if (pass[0])     p.putString(pass);
+        send(p);
+    }
+
+    bool sendPublish(const MqttMessage &m)
+    {
+        MqttPacket p(tx, sizeof(tx));
+        p.start(MQTT_PUBLISH | (m.sent ? 0x08 : 0) | 0x02 | (m.retain ? 0x01 : 0));
+        p.putString(m.topic);
+        p.putU16(m.packetId);
+        p.putBytes(m.payload, m.length);
+        return send(p);
+    }
+
+    void parse(uint8_t b)
+    {
+        switch (rxState) {
+        case RX_TYPE:
+            rxType      = b;
+            rxRemaining = 0;
+            rxShift     = 0;
+            rxLength    = 0;
+            rxState     = RX_LENGTH;
+            break;
+        case RX_LENGTH:
+            rxRemaining |= (uint32_t)(b & 0x7F) << rxShift;
+            rxShift     += 7;
+            if (b & 0x80) break;
+            rxState = RX_BODY;
+            if (rxRemaining == 0) handlePacket();
+            break;
+        case RX_BODY:
+            if (rxLength < sizeof(rxBody)) rxBody[rxLength] = b;
+            rxLength++;
+            if (rxLength == rxRemaining) handlePacket();
+            break;
+        }
+    }
+
+    void handlePacket()
+    {
+        rxState = RX_TYPE;
+
+        switch (rxType & 0xF0) {
+        case MQTT_CONNACK:
+            if ((state == AWAIT_CONNACK) && (rxLength >= 2) && (rxBody[1] == 0)) {
+                state           = CONNECTED;
+                unsent          = 0; // Everything queued goes (again) on this connection.
+                backoffMs       = 0;
+                pingOutstanding = false;
+                connects++;
+            } else {
+                connectFailures++;
+                drop();
+            }
+            break;
+
+        case MQTT_PUBACK:
+            if (rxLength >= 2) acknowledge((rxBody[0] << 8) | rxBody[1]);
+            break;
+
+        case MQTT_PINGRESP:
+            pingOutstanding = false;
+            break;
+
+        default:
+            break; // Not subscribed to anything. Ignore.
+        }
+    }
+
+    void acknowledge(uint16_t id)
+    {
+        // Normally the oldest. Look further in case the broker is being odd.
+        for (size_t i = 0; i < unsent; i++) {
+            MqttMessage &m = queue[(head + i) % MQTT_QUEUE_SIZE];
+            if (m.packetId != id) continue;
+
+            uint32_t tag = m.tag;
+            for (size_t j = i; j > 0; j--) { // Close the gap, keeping the order.
+                queue[(head + j) % MQTT_QUEUE_SIZE] = queue[(head + j - 1) % MQTT_QUEUE_SIZE];
+            }
+            head = (head + 1) % MQTT_QUEUE_SIZE;
+            count--;
+            unsent--;
+            acked++;
+            if (ackHandler) ackHandler(ackContext, tag);
+            return;
+        }
+    }
+
+    void drop()
+    {
+        if (state == CONNECTED) drops++;
+        socket->close();
+        state   = DISCONNECTED;
+        rxState = RX_TYPE;
+        fail();
+    }
+
+    void fail()
+    {
+        backoffMs = (backoffMs == 0) ? MQTT_BACKOFF_MIN_MS : backoffMs * 2;
+        if (backoffMs > MQTT_BACKOFF_MAX_MS) backoffMs = MQTT_BACKOFF_MAX_MS;
+        retryAtMs = clock() + backoffMs;
+    }
+};
+
+//*****************************************************************************
+// Events from the log, counts and health, onto the broker.
+//*****************************************************************************
+class MqttEngine
+{
+  public:
+    // Builds a JSON document into buffer; returns its length.
+    typedef size_t (*Formatter)(char *buffer, size_t size);
+
+    MqttClient client;
+    uint32_t   eventsPublished = 0; // Acknowledged by the broker.
+    uint32_t   eventsSkipped   = 0; // Aged out of the log first.
+
+    void begin(EventLog &eventLog, MqttSocket &socket, fs::FS *fileSystem, MqttClock now,
+               Formatter countsFormatter, Formatter healthFormatter)
+    {
+        log    = &eventLog;
+        clock  = now;
+        counts = countsFormatter;
+        health = healthFormatter;
+
+        acked.begin(fileSystem, MQTT_CURSOR_FILE, eventLog);
+        nextToSend = acked.seq;
+
+        client.begin(socket, now);
+        client.onAck(onAck, this);
+    }
+
+    void setServer(const char *host, uint16_t port, const char *user, const char *password)
+    {
+        client.setServer(host, port);
+        strncpy(user_, user, sizeof(user_) - 1);
+        strncpy(password_, password, sizeof(password_) - 1);
+    }
+
+    //*************************************************************************
+    // Topics and client ID. Takes effect for the will at the next connect.
+    void setDevice(const char *deviceName, const char *deviceMAC)
+    {
+        char name[40], id[32];
+        topicSafe(deviceName, name, sizeof(name));
+        snprintf(base, sizeof(base), "digame/%s/%s/", name, deviceMAC);
+
+        size_t j = 0;
+        j += snprintf(id, sizeof(id), "digame-");
+        for (size_t i = 0; deviceMAC[i] && (j + 1 < sizeof(id)); i++) {
+            if (deviceMAC[i] != ':') id[j++] = deviceMAC[i];
+        }
+        id[j] = 0;
+
+        client.setIdentity(id, user_, password_);
+        client.setWill(topic("status"), "offline");
+        lastCounts[0] = 0; // Republish under the new name.
+    }
+
+    //*************************************************************************
+    // One pass: keep the connection going and hand it whatever's due.
+    // Returns how long to wait, in ms, before calling again.
+    uint32_t step(bool linkUp)
+    {
+        uint32_t now = clock();
+
+        if (base[0] == 0) return 250; // No topics until setDevice().
+
+        client.service(linkUp);
+        if (!client.connected()) {
+            acked.service(now, MQTT_CURSOR_SAVE_MS);
+            return 250;
+        }
+
+        if (client.connects != announced) { // New connection. Say so.
+            announced = client.connects;
+            client.publish(topic("status"), "online", 6, true, 0);
+            lastCounts[0] = 0;
+        }
+
+        char payload[MQTT_PAYLOAD_SIZE];
+
+        if ((now - lastCountsMs >= MQTT_COUNTS_MIN_MS) && (client.queueSpace() > 0)) {
+            size_t n = counts(payload, sizeof(payload));
+            if ((n > 0) && (strncmp(payload, lastCounts, sizeof(lastCounts)) != 0) &&
+                client.publish(topic("counts"), payload, n, true, 0)) {
+                strncpy(lastCounts, payload, sizeof(lastCounts) - 1);
+                lastCountsMs = now;
+            }
+        }
+
+        if (now - lastHealthMs >= MQTT_HEALTH_MS) {
+            size_t n = health(payload, sizeof(payload));
+            if (n > 0) client.publishNow(topic("health"), payload, n, false);
+            lastHealthMs = now;
+        }
+
+        // Keep one slot free so counts aren't starved by a backlog.
+        size_t space = client.queueSpace();
+        if (space > 1) {
+            EventRecord records[MQTT_QUEUE_SIZE];
+            size_t      n = log->read(nextToSend, records, space - 1);
+            if ((n > 0) && (records[0].seq > nextToSend)) eventsSkipped += records[0].seq - nextToSend;
+            for (size_t i = 0; i < n; i++) {
+                int length = eventToJSON(records[i], payload, sizeof(payload));
+                client.publish(topic("event"), payload, length, false, records[i].seq + 1);
+                nextToSend = records[i].seq + 1;
+            }
+        }
+
+        acked.service(now, MQTT_CURSOR_SAVE_MS);
+        client.service(linkUp); // Send what we just queued.
+        return (client.queued() > 0) ? 5 : 50;
+    }
+
+    // Events the broker hasn't acknowledged yet.
+    uint32_t backlog()
+    {
+        uint32_t newest = log ? log->newestSeq() : 0;
+        uint32_t next   = acked.seq;
+        return (newest >= next) ? newest - next + 1 : 0;
+    }
+
+    void saveCursor() { acked.save(); }
+
+  private:
+    EventLog   *log            = nullptr;
+    MqttClock   clock          = nullptr;
+    Formatter   counts         = nullptr;
+    Formatter   health         = nullptr;
+    EventCursor acked;                 // First event not yet acknowledged.
+    uint32_t    nextToSend     = 0;
+    uint32_t    announced      = 0;
+    uint32_t    lastCountsMs   = 0;
+    uint32_t    lastHealthMs   = 0;
+    char        lastCounts[64] = {0};
+    char        base[MQTT_TOPIC_SIZE - 8] = {0};
+    char        topicBuffer[MQTT_TOPIC_SIZE];
+    char        user_[32]      = {0};
+    char        password_[48]  = {0};
+
+    const char *topic(const char *leaf)
+    {
+        snprintf(topicBuffer, sizeof(topicBuffer), "%s%s", base, leaf);
+        return topicBuffer;
+    }
+
+    static void onAck(void *context, uint32_t tag)
+    {
+        MqttEngine *self = (MqttEngine *)context;
+        if (tag == 0) return; // Status or counts.
+        self->eventsPublished++;
+
+        // Events are tagged seq + 1. PUBACKs can come out of order, and one
+        // that's lost leaves its event queued to be sent again. So the
+        // cursor only moves up to the oldest event still waiting.
+        uint32_t waiting = self->client.oldestTag();
+        uint32_t next    = waiting ? waiting - 1 : self->nextToSend;
+        if (next > self->acked.seq) self->acked.seq = next;
+    }
+
+    // Topic levels can't hold '/', '+' or '#'; spaces are legal but awkward.
+    static void topicSafe(const char *in, char *out, size_t size)
+    {
+        size_t j = 0;
+        for (size_t i = 0; in[i] && (j + 1 < size); i++) {
+            char c = in[i];
+            if ((c == '/') || (c == '+') || (c == '#') || ((uint8_t)c < 0x20)) continue;
+            out[j++] = (c == ' ') ? '_' : c;
+        }
+        out[j] = 0;
+    }
+};
+
+#if defined(ESP32)
+#include <WiFi.h>
+#include <digameNetwork_v2.h>
+
+class WiFiMqttSocket : public MqttSocket
+{
+  public:
+    bool open(const char *host, uint16_t port) override
+    {
+        if (!client.connect(host, port)) return false;
+        client.setNoDelay(true); // Small packets; don't wait to coalesce them.
+        return true;
+    }
+
+    bool isOpen() override { return client.connected(); }
+
+    int write(const uint8_t *data, size_t length) override { return client.write(data, length); }
+
+    int read(uint8_t *data, size_t length) override
+    {
+        int available = client.available();
+        if (available <= 0) return client.connected() ? 0 : -1;
+        return client.read(data, ((size_t)available < length) ? available : length);
+    }
+
+    void close() override { client.stop(); }
+
+  private:
+    WiFiClient client;
+};
+
+//*****************************************************************************
+// Runs the engine in its own task so the broker never holds up counting.
+class MqttPublisher
+{
+  public:
+    MqttEngine engine;
+
+    void begin(EventLog &eventLog, fs::FS *fileSystem, NetworkConfig &config,
+               MqttEngine::Formatter counts, MqttEngine::Formatter health)
+    {
+        engine.begin(eventLog, socket, fileSystem, []() -> uint32_t { return millis(); }, counts, health);
+        engine.setServer(config.mqttBroker.c_str(), config.mqttPort, config.mqttUser.c_str(),
+                         config.mqttPassword.c_str());
+        xTaskCreatePinnedToCore(task, "mqtt", 6144, this, 1, nullptr, 0);
+        running = true;
+    }
+
+    // Save the place in the log and stop for good, e.g. before the file
+    // system is unmounted. stopped() says when it has.
+    void stop() { stopping = true; }
+    bool stopped() { return halted; }
+
+    // Safe to call from the main loop at any time.
+    void setDevice(const String &deviceName, const String &deviceMAC)
+    {
+        portENTER_CRITICAL(&mux);
+        strncpy(pendingName, deviceName.c_str(), sizeof(pendingName) - 1);
+        strncpy(pendingMAC, deviceMAC.c_str(), sizeof(pendingMAC) - 1);
+        deviceChanged = true;
+        portEXIT_CRITICAL(&mux);
+    }
+
+    bool isRunning() { return running; }
+
+  private:
+    WiFiMqttSocket socket;
+    portMUX_TYPE   mux = portMUX_INITIALIZER_UNLOCKED;
+    char           pendingName[48] = {0};
+    char           pendingMAC[24]  = {0};
+    bool           deviceChanged   = false;
+    volatile bool  stopping        = false;
+    volatile bool  halted          = false;
+    bool           running         = false;
+
+    static void task(void *param)
+    {
+        MqttPublisher *self = (MqttPublisher *)param;
+
+        while (true) {
+            if (self->stopping) { // Between steps, so nothing is half done.
+                self->engine.saveCursor();
+                self->halted = true;
+                vTaskDelete(nullptr);
+            }
+            if (self->deviceChanged) {
+                char name[48], mac[24];
+                portENTER_CRITICAL(&self->mux);
+                memcpy(name, self->pendingName, sizeof(name));
+                memcpy(mac, self->pendingMAC, sizeof(mac));
+                self->deviceChanged = false;
+                portEXIT_CRITICAL(&self->mux);
+                self->engine.setDevice(name, mac);
+            }
+
+            uint32_t wait = self->engine.step(WiFi.status() == WL_CONNECTED);
+            vTaskDelay(pdMS_TO_TICKS(wait > 0 ? wait : 1));
+        }
+    }
+};
+#else // ESP32
+//*****************************************************************************
+// A TCP connection through POSIX sockets, for running on a host.
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <unistd.h>
+
+class PosixMqttSocket : public MqttSocket
+{
+  public:
+    ~PosixMqttSocket() { close(); }
+
+    bool open(const char *host, uint16_t port) override
+    {
+        close();
+        char service[8];
+        snprintf(service, sizeof(service), "%u", port);
+        addrinfo hints = {}, *found = nullptr;
+        hints.ai_family   = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(host, service, &hints, &found) != 0) return false;
+
+        for (addrinfo *a = found; a && (fd < 0); a = a->ai_next) {
+            fd = ::socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+            if (fd < 0) continue;
+            if (::connect(fd, a->ai_addr, a->ai_addrlen) != 0) {
+                ::close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(found);
+        if (fd < 0) return false;
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // As WiFiMqttSocket.
+        return true;
+    }
+
+    bool isOpen() override { return fd >= 0; }
+
+    int write(const uint8_t *data, size_t length) override
+    {
+        if (fd < 0) return -1;
+        size_t done = 0;
+        while (done < length) {
+            ssize_t n = ::send(fd, data + done, length - done, MSG_NOSIGNAL);
+            if (n <= 0) return -1;
+            done += n;
+        }
+        return (int)done;
+    }
+
+    int read(uint8_t *data, size_t length) override
+    {
+        if (fd < 0) return -1;
+        ssize_t n = ::recv(fd, data, length, MSG_DONTWAIT);
+        if (n > 0) return (int)n;
+        if ((n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) return 0;
+        return -1; // Closed by the broker, or broken.
+    }
+
+    void close() override
+    {
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+    }
+
+  private:
+    int fd = -1;
+};
+#endif // ESP32
+
+#endif //__DIGAME_MQTT_H__
@@ -0,0 +1,233 @@
+/* digameMetrics.h
+ *
+ *  Counters for the hot path, and a /metrics page of them in Prometheus's
+ *  text format.
+ *
+ *  The counting loop owns its counters and is the only one writing them.
+ *  The web server task reads them when it's scraped. On the ESP32 an
+ *  aligned 32-bit load or store is atomic, so a single-writer counter
+ *  needs no lock on either side. An increment costs what it would as a
+ *  plain variable. The reader sees the value before or after it.
+ *
+ *  A histogram is several words, so the reader has to see them all from
+ *  the same moment, or the buckets won't add up to the count. It uses a
+ *  sequence number (a seqlock) for that. The writer makes it odd while it
+ *  updates and even again after. The reader copies everything out, and
+ *  copies again if the sequence moved while it did, up to
+ *  METRICS_READ_TRIES times. Neither side blocks.
+ *
+ *  MetricsStream writes the page a piece at a time, the same way as
+ *  RestEventStream, so it is never held whole in RAM. What goes on the
+ *  page comes from a table of Metric entries in main.cpp. Entries with
+ *  the same name, one after another, are one family with different
+ *  labels:
+ *
+ *    # HELP digame_lidar_frames_total Good frames read from each sensor.
+ *    # TYPE digame_lidar_frames_total counter
+ *    digame_lidar_frames_total{sensor="1"} 81236
+ *    digame_lidar_frames_total{sensor="2"} 81236
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#ifndef __DIGAME_METRICS_H__
+#define __DIGAME_METRICS_H__
+
+#include <digameDebug.h>
+
+#define METRICS_MAX_BUCKETS 12 // Histogram buckets, not counting +Inf.
+#define METRICS_READ_TRIES  8  // Histogram copies before taking what we've got.
+
+typedef volatile uint32_t MetricCounter; // One writer. See above.
+
+enum MetricType { METRIC_COUNTER, METRIC_GAUGE, METRIC_HISTOGRAM };
+
+//*****************************************************************************
+// Durations in microseconds, reported in seconds, as Prometheus likes.
+class MetricHistogram
+{
+  public:
+    // bounds: the buckets' upper limits, in microseconds, smallest first.
+    MetricHistogram(const uint32_t *bounds, size_t count) : limits(bounds)
+    {
+        bucketCount = (count < METRICS_MAX_BUCKETS) ? count : METRICS_MAX_BUCKETS;
+    }
+
+    struct Snapshot
+    {
+        uint32_t buckets[METRICS_MAX_BUCKETS + 1]; // Not cumulative. The last is +Inf.
+        uint32_t count;
+        uint64_t sumUs;
+    };
+
+    void observe(uint32_t us) // The writer's side.
+    {
+        size_t i = 0;
+        while ((i < bucketCount) && (us > limits[i])) i++;
+
+        sequence = sequence + 1;
+        __sync_synchronize();
+        buckets[i] = buckets[i] + 1;
+        count      = count + 1;
+        sumUs      = sumUs + us;
+        __sync_synchronize();
+        sequence = sequence + 1;
+    }
+
+    // Anyone else's. False if the writer kept moving through every try:
+    // then the buckets may be from slightly different moments, but count is
+    // made their total, so the page still adds up. Only the sum can be off.
+    bool read(Snapshot &s) const
+    {
+        for (int tries = 0; tries < METRICS_READ_TRIES; tries++) {
+            uint32_t before = sequence;
+            __sync_synchronize();
+            for (size_t i = 0; i <= bucketCount; i++) s.buckets[i] = buckets[i];
+            s.count = count;
+            s.sumUs = sumUs;
+            __sync_synchronize();
+            if (!(before & 1) && (sequence == before)) return true;
+        }
+        s.count = 0;
+        for (size_t i = 0; i <= bucketCount; i++) s.count += s.buckets[i];
+        return false;
+    }
+
+    size_t   size() const { return bucketCount; }
+    uint32_t bound(size_t i) const { return limits[i]; }
+
+  private:
+    const uint32_t   *limits;
+    size_t            bucketCount;
+    volatile uint32_t sequence = 0;
+    volatile uint32_t buckets[METRICS_MAX_BUCKETS + 1] = {};
+    volatile uint32_t count = 0;
+    volatile uint64_t sumUs = 0;
+};
+
+//*****************************************************************************
+// One line on the page. Give it one of value, read or histogram.
+struct Metric
+{
+    const char                *name;
+    const char                *help;      // Only the first of a family's is used.
+    MetricType                 type;
+    const char                *labels;    // E.g. "sensor=\"1\"", or nullptr.
+    const volatile uint32_t   *value;     // A counter or a stat held in a variable...
+    uint32_t                 (*read)();   // ...or worked out when scraped...
+    MetricHistogram           *histogram; // ...or a histogram.
+};
+
+//*****************************************************************************
+class MetricsStream
+{
+  public:
+    MetricsStream(const Metric *table, size_t count) : metrics(table), metricCount(count) {}
+
+    //*************************************************************************
+    // Write up to maxLength bytes of the page. Returns 0 once it's all been
+    // written.
+    size_t fill(uint8_t *buffer, size_t maxLength)
+    {
+        size_t written = 0;
+
+        while (written < maxLength) {
+            if (pendingPos == pendingLength) {
+                if (!produce()) break;
+            }
+            size_t n = pendingLength - pendingPos;
+            if (n > maxLength - written) n = maxLength - written;
+            memcpy(buffer + written, pending + pendingPos, n);
+            pendingPos += n;
+            written    += n;
+        }
+        return written;
+    }
+
+  private:
+    const Metric             *metrics;
+    size_t                    metricCount;
+    size_t                    index = 0; // The entry being written...
+    size_t                    step  = 0; // ...and how far into it we are.
+    MetricHistogram::Snapshot snapshot;
+    uint32_t                  cumulative = 0;
+    char                      pending[192];
+    size_t                    pendingLength = 0;
+    size_t                    pendingPos    = 0;
+
+    // Put the next piece of the page in pending. False when there's no more.
+    bool produce()
+    {
+        int n = 0;
+
+        while ((n == 0) && (index < metricCount)) {
+            const Metric &m     = metrics[index];
+            bool          first = (index == 0) || strcmp(metrics[index - 1].name, m.name);
+
+            if (step == 0) {
+                static const char *types[] = { "counter", "gauge", "histogram" };
+                if (first) {
+                    n = snprintf(pending, sizeof(pending), "# HELP %s %s\n# TYPE %s %s\n", m.name, m.help,
+                                 m.name, types[m.type]);
+                }
+            } else if (m.type == METRIC_HISTOGRAM) {
+                n = histogramLine(m, step - 1);
+            } else if (step == 1) {
+                uint32_t v = m.value ? *m.value : (m.read ? m.read() : 0);
+                n = m.labels ? snprintf(pending, sizeof(pending), "%s{%s} %lu\n", m.name, m.labels, (unsigned long)v)
+                             : snprintf(pending, sizeof(pending), "%s %lu\n", m.name, (unsigned long)v);
+            }
+
+            if (n < 0) n = 0;
+            if ((size_t)n >= sizeof(pending)) n = 0; // Doesn't fit. Leave it out.
+            if ((step > 0) && (n == 0)) {           // Finished with this entry.
+                index++;
+                step = 0;
+            } else {
+                step++;
+            }
+        }
+
+        pendingLength = n;
+        pendingPos    = 0;
+        return n > 0;
+    }
+
+    // Lines of a histogram, one per call: the buckets, +Inf, then the sum and
+    // count. Returns 0 after the last.
+    int histogramLine(const Metric &m, size_t line)
+    {
+        MetricHistogram &h       = *m.histogram;
+        size_t           buckets = h.size();
+        const char      *comma   = m.labels ? "," : "";
+        const char      *labels  = m.labels ? m.labels : "";
+
+        if (line == 0) {
+            h.read(snapshot); // Everything from one moment.
+            cumulative = 0;
+        }
+        if (line <= buckets) {
+            cumulative += snapshot.buckets[line];
+            if (line < buckets) {
+                return snprintf(pending, sizeof(pending), "%s_bucket{%s%sle=\"%g\"} %lu\n", m.name, labels, comma,
+                                h.bound(line) / 1e6, (unsigned long)cumulative);
+            }
+            return snprintf(pending, sizeof(pending), "%s_bucket{%s%sle=\"+Inf\"} %lu\n", m.name, labels, comma,
+                            (unsigned long)cumulative);
+        }
+
+        const char *open  = m.labels ? "{" : "";
+        const char *close = m.labels ? "}" : "";
+        if (line == buckets + 1) {
+            return snprintf(pending, sizeof(pending), "%s_sum%s%s%s %.6f\n", m.name, open, labels, close,
+                            snapshot.sumUs / 1e6);
+        }
+        if (line == buckets + 2) { // Same as +Inf, so they always agree.
+            return snprintf(pending, sizeof(pending), "%s_count%s%s%s %lu\n", m.name, open, labels, close,
+                            (unsigned long)cumulative);
+        }
+        return 0;
+    }
+};
+
+#endif //__DIGAME_METRICS_H__
@@ -20,6 +20,13 @@ struct NetworkConfig
     String password  = "YOUR_PASSSORD";
     // serverURL is the destination for the postJSON function below
     String serverURL = "YOUR_SERVER_URL";
+    // MQTT broker for events, counts and health. Empty to leave MQTT off.
+    String   mqttBroker   = "";
+    uint16_t mqttPort     = 1883;
+    String   mqttUser     = "";
+    String   mqttPassword = "";
+    // Time server for event timestamps. Empty to rely on the host setting the time.
+    String   ntpServer    = "pool.ntp.org";
 };
 
 // Globals
@@ -66,7 +73,9 @@ String getShortMACAddress()
 }
 
 //*****************************************************************************
-// Enable WiFi and log into the network
+// Enable WiFi and log into the network. Blocks for up to 10 seconds -- fine
+// at startup, but code that runs while counting should leave the link to
+// WiFiLink (digameWiFiLink.h) instead.
 bool enableWiFi(NetworkConfig config)
 {
     String ssid     = config.ssid;
@@ -145,8 +154,9 @@ void disableWiFi()
 }
 
 //*****************************************************************************
-// Save a single JSON message to the server. TODO: Deal with retries, etc.
-// in a smart way.
+// Save a single JSON message to the server. Returns false straight away if
+// the link is down; reconnecting is WiFiLink's job, not the caller's. For
+// batching and retries, see digameUploader.h.
 bool postJSON(String jsonPayload, NetworkConfig config)
 {
     //DEBUG_PRINT("postJSON Running on Core #: ");
@@ -158,10 +168,7 @@ bool postJSON(String jsonPayload, NetworkConfig config)
     if (WiFi.status() != WL_CONNECTED)
     {
         DEBUG_PRINTLN("WiFi Connection Lost.");
-        if (enableWiFi(config) == false)
-        {
-            return false;
-        };
+        return false;
     }
 
     unsigned long t1 = millis();
@@ -201,8 +208,6 @@ bool postJSON(String jsonPayload, NetworkConfig config)
     http.end();
    // WiFi.disconnect(true);
 
-    delay(500); // Give resources a bit to free... 
-
     if (
         (httpResponseCode == 200) || 
         (httpResponseCode == 303) 
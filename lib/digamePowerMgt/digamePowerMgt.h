@@ -1,9 +1,165 @@
-/*
-  Power management functions for the ESP32 platform
-*/
+/* digamePowerMgt.h
+ *
+ *  Power management for the counter.
+ *
+ *  PowerPolicy slows everything down while the doorway is empty. That's
+ *  most of the day on a parked bus. It steps down one level at a time, a
+ *  level's idleSeconds after the last beam break. Each level has a LIDAR
+ *  frame rate and a CPU clock. The first frame with anyone in view jumps
+ *  straight back to the top level. So the frame after that one already
+ *  comes at the full rate:
+ *
+ *    if (policy.frame(micros(), someoneInView)) apply(policy.level());
+ *
+ *  It keeps the figures the /metrics page shows: the seconds at each
+ *  level, energy used, the energy used over the last whole hour, and the
+ *  wake latency. That's the time from the frame that woke it to the first
+ *  frame at the full rate. The energy figures come from the watts in
+ *  POWER_LEVELS. Those are bench estimates, so change them to what your
+ *  counters draw. They change nothing else.
+ *
+ *  The policy is plain C++, so a Linux host can replay a day's frames
+ *  through it. The ESP32 power modes, setLowPowerMode() and the rest,
+ *  are at the end.
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
 #ifndef __DIGAME_POWER_MGT_H__
 #define __DIGAME_POWER_MGT_H__
 
+#include <stddef.h>
+#include <stdint.h>
+#include <digameMetrics.h> // MetricCounter, MetricHistogram
+
+#define POWER_MAX_LEVELS   4
+#define POWER_HOUR_US      3600000000ULL
+#define POWER_UJ_PER_MWH   3600000ULL // Microjoules.
+
+//*****************************************************************************
+struct PowerLevel
+{
+    const char *name;
+    uint16_t    frameRate;   // LIDAR frames per second.
+    uint16_t    cpuMHz;      // 80 at the least: WiFi stops below that.
+    uint32_t    idleSeconds; // Doorway empty this long before this level. The first level's is 0.
+    float       watts;       // The whole counter's draw here. Only the energy figures use it.
+};
+
+// Bench estimates for an ESP32 with WiFi up and two TFMini-Plus, from 5 V.
+const PowerLevel POWER_LEVELS[] = {
+//    name      Hz  MHz  idle s  watts
+    { "active", 100, 240,      0, 1.50 },
+    { "idle",    50, 160,     30, 1.30 },
+    { "parked",  10,  80,    600, 1.00 },
+};
+#define POWER_LEVEL_COUNT (sizeof(POWER_LEVELS) / sizeof(POWER_LEVELS[0]))
+
+const uint32_t POWER_WAKE_BOUNDS_US[] = { 5000, 10000, 20000, 50000, 100000, 150000, 200000, 500000 };
+
+//*****************************************************************************
+class PowerPolicy
+{
+  public:
+    PowerPolicy(const PowerLevel *table = POWER_LEVELS, size_t count = POWER_LEVEL_COUNT) : levels(table)
+    {
+        levelCount = (count < POWER_MAX_LEVELS) ? count : POWER_MAX_LEVELS;
+    }
+
+    // For /metrics. The policy is the only writer.
+    MetricCounter   wakes = 0;                            // Back to the top level from a lower one.
+    MetricCounter   levelSeconds[POWER_MAX_LEVELS] = {};
+    MetricCounter   joules = 0;
+    MetricCounter   lastHourMilliwattHours = 0;           // 0 until the first hour is up.
+    MetricHistogram wakeLatency{POWER_WAKE_BOUNDS_US, sizeof(POWER_WAKE_BOUNDS_US) / sizeof(POWER_WAKE_BOUNDS_US[0])};
+
+    // After each frame read. busy: anyone in view, or anything else that
+    // wants the full rate. True when the level has changed: apply level().
+    bool frame(uint32_t nowUs, bool busy)
+    {
+        uint32_t elapsed = started ? nowUs - lastUs : 0; // Wraps with micros(), so it's still right.
+        started = true;
+        lastUs  = nowUs;
+        account(elapsed);
+
+        if (waking) { // The first frame since we went back to the top.
+            wakeLatency.observe(nowUs - wokeUs);
+            waking = false;
+        }
+
+        if (busy || !enabled) {
+            idleUs = 0;
+            if (current == 0) return false;
+            current = 0;
+            wakes   = wakes + 1;
+            waking  = true;
+            wokeUs  = nowUs;
+            return true;
+        }
+
+        idleUs += elapsed;
+        if ((current + 1 < levelCount) && (idleUs >= (uint64_t)levels[current + 1].idleSeconds * 1000000)) {
+            current++;
+            return true;
+        }
+        return false;
+    }
+
+    // Off holds it at the top level. The next frame() goes back there.
+    void setEnabled(bool on) { enabled = on; }
+    bool isEnabled() const { return enabled; }
+
+    const PowerLevel &level() const { return levels[current]; }
+    size_t            levelIndex() const { return current; }
+    const PowerLevel &level(size_t i) const { return levels[i]; }
+    size_t            size() const { return levelCount; }
+
+  private:
+    const PowerLevel *levels;
+    size_t            levelCount;
+    size_t            current = 0;
+    bool              enabled = true;
+    bool              started = false;
+    bool              waking  = false;
+    uint32_t          lastUs  = 0;
+    uint32_t          wokeUs  = 0;
+    uint64_t          idleUs  = 0;
+
+    uint32_t levelUs[POWER_MAX_LEVELS] = {}; // Under a second, not yet in levelSeconds.
+    uint64_t microjoules = 0;                // Under a joule, not yet in joules.
+    uint64_t hourUs      = 0;
+    uint64_t hourMicrojoules = 0;
+
+    // The time since the last frame was spent at the current level.
+    void account(uint32_t elapsed)
+    {
+        uint64_t used = (uint64_t)(levels[current].watts * elapsed); // W x us = uJ.
+
+        levelUs[current] += elapsed;
+        while (levelUs[current] >= 1000000) {
+            levelUs[current] -= 1000000;
+            levelSeconds[current] = levelSeconds[current] + 1;
+        }
+
+        microjoules += used;
+        while (microjoules >= 1000000) {
+            microjoules -= 1000000;
+            joules = joules + 1;
+        }
+
+        hourUs          += elapsed;
+        hourMicrojoules += used;
+        if (hourUs >= POWER_HOUR_US) {
+            lastHourMilliwattHours = (uint32_t)(hourMicrojoules / POWER_UJ_PER_MWH);
+            hourUs                -= POWER_HOUR_US;
+            hourMicrojoules        = 0;
+        }
+    }
+};
+
+#if defined(ESP32)
+//*****************************************************************************
+// The ESP32 power modes.
 #include <digameDebug.h>  // DEBUG_PRINT functions
 #include <WiFi.h>         // WiFi stack
 #include "driver/adc.h"   // ADC functions. (Allows us to turn off to save power.)
@@ -78,6 +234,6 @@ void setFullPowerMode() {
     powerMode = FULL_POWER;
 }
 
+#endif // ESP32
 
-#endif 
-
+#endif //__DIGAME_POWER_MGT_H__
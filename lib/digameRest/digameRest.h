@@ -0,0 +1,121 @@
+/* digameRest.h
+ *
+ *  Pieces of the JSON web API that don't depend on the web server.
+ *
+ *  RestEventStream produces the /api/events document a piece at a time, so
+ *  a page of events is never held in RAM as one big String: the server
+ *  asks for up to maxLength bytes, we fill that from a few records read
+ *  from the event log, and carry any half-written event over to the next
+ *  call.
+ *
+ *    {"from":<seq>,"oldest":<seq>,"newest":<seq>,"events":[{...},...],"next":<seq>}
+ *
+ *  "next" is the seq to ask for to carry on from where this page stopped.
+ *  When it's past "newest" you have everything.
+ *
+ *  The routes themselves, with the counts, config and health handlers,
+ *  are in main.cpp's configureRestApi().
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#ifndef __DIGAME_REST_H__
+#define __DIGAME_REST_H__
+
+#include <digameEventLog.h>
+
+#define REST_EVENTS_MAX_LIMIT   1000 // Events per page, at most...
+#define REST_EVENTS_DEF_LIMIT   100  // ...and when the client doesn't say.
+#define REST_EVENTS_READ_BATCH  8    // Records read from the log at a time.
+
+class RestEventStream
+{
+  public:
+    RestEventStream(EventLog &eventLog, uint32_t fromSeq, uint32_t limit)
+        : log(eventLog), from(fromSeq), next(fromSeq), remaining(limit)
+    {
+        if (remaining > REST_EVENTS_MAX_LIMIT) remaining = REST_EVENTS_MAX_LIMIT;
+    }
+
+    //*************************************************************************
+    // Write up to maxLength bytes of the document. Returns 0 once it's all
+    // been written.
+    size_t fill(uint8_t *buffer, size_t maxLength)
+    {
+        size_t written = 0;
+
+        while (written < maxLength) {
+            if (pendingPos == pendingLength) {
+                if (!produce()) break;
+            }
+            size_t n = pendingLength - pendingPos;
+            if (n > maxLength - written) n = maxLength - written;
+            memcpy(buffer + written, pending + pendingPos, n);
+            pendingPos += n;
+            written    += n;
+        }
+        return written;
+    }
+
+  private:
+    enum Stage { HEAD, EVENTS, TAIL, DONE };
+
+    EventLog   &log;
+    uint32_t    from;
+    uint32_t    next;       // Next seq to look for.
+    uint32_t    remaining;  // Events still wanted on this page.
+    Stage       stage         = HEAD;
+    bool        first         = true;
+    EventRecord records[REST_EVENTS_READ_BATCH];
+    size_t      recordCount   = 0;
+    size_t      recordPos     = 0;
+    char        pending[128]; // The piece being copied out.
+    size_t      pendingLength = 0;
+    size_t      pendingPos    = 0;
+
+    // Put the next piece of the document in pending. False when there's no more.
+    bool produce()
+    {
+        int n = 0;
+
+        switch (stage) {
+        case HEAD:
+            n = snprintf(pending, sizeof(pending), "{\"from\":%lu,\"oldest\":%lu,\"newest\":%lu,\"events\":[",
+                         (unsigned long)from, (unsigned long)log.oldestSeq(), (unsigned long)log.newestSeq());
+            stage = EVENTS;
+            break;
+
+        case EVENTS:
+            if ((recordPos == recordCount) && (remaining > 0)) {
+                size_t want = (remaining < REST_EVENTS_READ_BATCH) ? remaining : REST_EVENTS_READ_BATCH;
+                recordCount = log.read(next, records, want);
+                recordPos   = 0;
+            }
+            if ((recordPos == recordCount) || (remaining == 0)) { // No more, or page full.
+                stage = TAIL;
+                return produce();
+            }
+            if (!first) pending[n++] = ',';
+            n += eventToJSON(records[recordPos], pending + n, sizeof(pending) - n);
+            next  = records[recordPos].seq + 1;
+            first = false;
+            recordPos++;
+            remaining--;
+            break;
+
+        case TAIL:
+            n = snprintf(pending, sizeof(pending), "],\"next\":%lu}", (unsigned long)next);
+            stage = DONE;
+            break;
+
+        case DONE:
+            return false;
+        }
+
+        pendingLength = ((n > 0) && ((size_t)n < sizeof(pending))) ? n : 0;
+        pendingPos    = 0;
+        return true;
+    }
+};
+
+#endif //__DIGAME_REST_H__
@@ -0,0 +1,494 @@
+/* digameResumableOTA.h
+ *
+ *  Firmware updates that survive the link dropping, or the counter
+ *  rebooting, part way through.
+ *
+ *  /update takes the image in one request. If the soft-AP link drops
+ *  halfway through, Update's begin/write/end fails and the whole image has
+ *  to be sent again. This takes it in numbered chunks instead:
+ *
+ *    POST /update/resume   size, chunk, sha256   start, or carry on with,
+ *                                                an update to that image
+ *    GET  /update/resume                         where it's up to
+ *    POST /update/chunk?offset=N&crc=X           the chunk at N, in the body
+ *    POST /update/finish                         check it, boot it
+ *
+ *  Each is answered with the state, e.g.
+ *
+ *    {"active":true,"size":1048576,"chunk":16384,"offset":491520,"sha256":"9f2c..."}
+ *
+ *  and a client carries on from offset. tools/ota_resume.py is one.
+ *
+ *  Each chunk comes with its CRC-32. It only counts once it has all
+ *  arrived, the CRC matches and it is in flash. Then the offset moves on
+ *  and is written to /ota.jnl, a small journal like the counts
+ *  checkpoint's. After a reboot the same image carries on from there.
+ *  Anything else starts over.
+ *
+ *  The image goes straight into the next OTA partition, at its offset,
+ *  written by the loop between LIDAR frames as /update's uploads are. It
+ *  doesn't go through Update, which can only go start to finish in one
+ *  boot. Chunks are whole flash sectors, so one that has to be sent again
+ *  just erases its sectors and is written again. At the end the whole
+ *  partition is read back and checked against the image's SHA-256 before
+ *  it is made the boot partition.
+ *
+ *  ResumableOta is portable. The partition is reached through an
+ *  OtaPartition, which on the ESP32 is EspOtaPartition. ResumableOtaServer
+ *  puts it on the web server.
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#ifndef __DIGAME_RESUMABLE_OTA_H__
+#define __DIGAME_RESUMABLE_OTA_H__
+
+#include <digameDebug.h>
+#include <digameCRC.h>
+#include <FS.h>
+
+#define RESUME_MAGIC       0x41544F44 // "DOTA"
+#define RESUME_FILE        "/ota.jnl"
+#define RESUME_SLOTS       4
+#define RESUME_SLOT_SIZE   64
+#define RESUME_SECTOR_SIZE 4096
+#define RESUME_MAX_CHUNK   65536
+
+struct __attribute__((packed)) ResumeRecord
+{
+    uint32_t magic;
+    uint32_t generation;
+    uint32_t partition;  // Which partition the image is going to.
+    uint32_t imageSize;  // 0 when there's no update under way.
+    uint32_t chunkSize;
+    uint32_t committed;  // Bytes written and checked, from the start.
+    uint8_t  sha256[32]; // Of the whole image.
+    uint32_t crc;        // CRC-32 over everything above.
+};
+
+static_assert(sizeof(ResumeRecord) <= RESUME_SLOT_SIZE, "ResumeRecord has outgrown its slot");
+
+//*****************************************************************************
+// Where the image goes.
+class OtaPartition
+{
+  public:
+    virtual ~OtaPartition() {}
+    virtual uint32_t id()   = 0; // Tells partitions apart.
+    virtual uint32_t size() = 0;
+    virtual bool     erase(uint32_t offset, uint32_t length) = 0; // Whole sectors.
+    virtual bool     write(uint32_t offset, const uint8_t *data, size_t length) = 0;
+    virtual bool     flush() { return true; } // Everything written is in flash.
+    // Check the image's SHA-256 and make it the one to boot. Returns what's
+    // wrong, or nullptr.
+    virtual const char *activate(uint32_t size, const uint8_t *sha256) = 0;
+};
+
+//*****************************************************************************
+class ResumableOta
+{
+  public:
+    uint32_t chunksWritten  = 0;
+    uint32_t chunksRejected = 0; // Bad CRC, wrong length or offset.
+    uint32_t journalErrors  = 0;
+
+    //*************************************************************************
+    // Pick up where the journal says, if it's for this partition.
+    void restore(fs::FS &fileSystem, OtaPartition &target)
+    {
+        fs        = &fileSystem;
+        partition = &target;
+
+        uint8_t journal[RESUME_SLOTS * RESUME_SLOT_SIZE];
+        size_t  got  = 0;
+        File    file = fs->open(RESUME_FILE, FILE_READ);
+        if (file) {
+            got = file.read(journal, sizeof(journal));
+            file.close();
+        }
+
+        bool found = false;
+        for (size_t i = 0; (i + 1) * RESUME_SLOT_SIZE <= got; i++) {
+            ResumeRecord r;
+            memcpy(&r, journal + i * RESUME_SLOT_SIZE, sizeof(r));
+            if ((r.magic != RESUME_MAGIC) || (r.crc != recordCRC(r))) continue;
+            if (!found || (r.generation > session.generation)) {
+                session = r;
+                found   = true;
+            }
+        }
+
+        if (found) nextGeneration = session.generation + 1;
+        if (!found || (session.partition != partition->id())) {
+            session.imageSize = 0; // Nothing, or the update was for where we're running now.
+        }
+        if (session.imageSize) {
+            DEBUG_PRINT("OTA: resuming at ");
+            DEBUG_PRINT(session.committed);
+            DEBUG_PRINT(" of ");
+            DEBUG_PRINTLN(session.imageSize);
+        }
+    }
+
+    //*************************************************************************
+    // Start an update to this image, or carry on with it. Returns what's
+    // wrong, or nullptr.
+    const char *start(uint32_t imageSize, uint32_t chunkSize, const uint8_t *sha256)
+    {
+        if (!partition) return "Not ready";
+        if ((imageSize == 0) || (imageSize > partition->size())) return "Image doesn't fit";
+        if ((chunkSize == 0) || (chunkSize % RESUME_SECTOR_SIZE) || (chunkSize > RESUME_MAX_CHUNK)) {
+            return "Chunk size must be a whole number of 4 KB sectors, up to 64 KB";
+        }
+
+        chunkActive = false;
+        if ((session.imageSize == imageSize) && (session.chunkSize == chunkSize) &&
+            (memcmp(session.sha256, sha256, 32) == 0) && (session.partition == partition->id())) {
+            return nullptr; // Carry on.
+        }
+
+        session.partition = partition->id();
+        session.imageSize = imageSize;
+        session.chunkSize = chunkSize;
+        session.committed = 0;
+        memcpy(session.sha256, sha256, 32);
+        return save() ? nullptr : "Couldn't save progress";
+    }
+
+    //*************************************************************************
+    // A chunk is arriving. It has to be the next one: at offset, chunkSize
+    // long (or whatever's left). Its sectors are erased ready for it.
+    const char *beginChunk(uint32_t offset, uint32_t length, uint32_t crc)
+    {
+        chunkActive = false;
+        if (!session.imageSize) return reject("No update under way");
+        if (offset != session.committed) return reject("Not the next chunk");
+
+        uint32_t expected = session.imageSize - offset;
+        if (expected > session.chunkSize) expected = session.chunkSize;
+        if ((length != expected) || (length == 0)) return reject("Wrong chunk length");
+
+        uint32_t sectors = (length + RESUME_SECTOR_SIZE - 1) / RESUME_SECTOR_SIZE;
+        if (!partition->erase(offset, sectors * RESUME_SECTOR_SIZE)) return reject("Couldn't erase flash");
+
+        chunkOffset   = offset;
+        chunkLength   = length;
+        chunkCRC      = crc;
+        chunkReceived = 0;
+        runningCRC    = 0;
+        chunkActive   = true;
+        return nullptr;
+    }
+
+    const char *writeChunk(const uint8_t *data, size_t length)
+    {
+        if (!chunkActive) return "No chunk under way";
+        if (length > chunkLength - chunkReceived) {
+            chunkActive = false;
+            return reject("Chunk is longer than it said");
+        }
+        if (!partition->write(chunkOffset + chunkReceived, data, length)) {
+            chunkActive = false;
+            return reject("Couldn't write flash");
+        }
+        runningCRC = crc32(data, length, runningCRC);
+        chunkReceived += length;
+        return nullptr;
+    }
+
+    // All of it has arrived. If it's good, the offset moves on.
+    const char *endChunk()
+    {
+        if (!chunkActive) return "No chunk under way";
+        chunkActive = false;
+        if (chunkReceived != chunkLength) return reject("Chunk is short");
+        if (runningCRC != chunkCRC) return reject("Chunk CRC doesn't match");
+        if (!partition->flush()) return reject("Couldn't write flash");
+
+        session.committed += chunkLength;
+        chunksWritten++;
+        return save() ? nullptr : "Couldn't save progress";
+    }
+
+    //*************************************************************************
+    // Once it has all arrived: check the image and switch to it. The caller
+    // restarts.
+    const char *finish()
+    {
+        if (!session.imageSize) return "No update under way";
+        if (session.committed != session.imageSize) return "The image isn't all here";
+
+        const char *problem = partition->activate(session.imageSize, session.sha256);
+        if (problem) {
+            session.committed = 0; // It has to be sent again.
+            save();
+            return problem;
+        }
+        session.imageSize = 0; // Done.
+        save();
+        return nullptr;
+    }
+
+    //*************************************************************************
+    bool     active() const { return session.imageSize != 0; }
+    uint32_t offset() const { return session.committed; }
+
+    // The state as JSON, for the web server.
+    int status(char *buffer, size_t length) const
+    {
+        if (!session.imageSize) return snprintf(buffer, length, "{\"active\":false}");
+
+        char sha[65];
+        for (int i = 0; i < 32; i++) snprintf(sha + 2 * i, 3, "%02x", session.sha256[i]);
+        return snprintf(buffer, length, "{\"active\":true,\"size\":%lu,\"chunk\":%lu,\"offset\":%lu,\"sha256\":\"%s\"}",
+                        (unsigned long)session.imageSize, (unsigned long)session.chunkSize,
+                        (unsigned long)session.committed, sha);
+    }
+
+  private:
+    fs::FS       *fs             = nullptr;
+    OtaPartition *partition      = nullptr;
+    ResumeRecord  session        = {};
+    uint32_t      nextGeneration = 1;
+
+    bool          chunkActive   = false;
+    uint32_t      chunkOffset   = 0;
+    uint32_t      chunkLength   = 0;
+    uint32_t      chunkCRC      = 0;
+    uint32_t      chunkReceived = 0;
+    uint32_t      runningCRC    = 0;
+
+    const char *reject(const char *why)
+    {
+        chunksRejected++;
+        return why;
+    }
+
+    static uint32_t recordCRC(const ResumeRecord &r)
+    {
+        return crc32((const uint8_t *)&r, sizeof(r) - sizeof(r.crc));
+    }
+
+    // Into the next slot round-robin, as digameCheckpoint does, so a write
+    // torn by power loss only damages the newest copy.
+    bool save()
+    {
+        session.magic      = RESUME_MAGIC;
+        session.generation = nextGeneration;
+        session.crc        = recordCRC(session);
+
+        uint8_t slot[RESUME_SLOT_SIZE];
+        memset(slot, 0xFF, sizeof(slot));
+        memcpy(slot, &session, sizeof(session));
+
+        if (!fs->exists(RESUME_FILE)) {
+            File create = fs->open(RESUME_FILE, FILE_WRITE);
+            if (!create) { journalErrors++; return false; }
+            uint8_t blank[RESUME_SLOT_SIZE];
+            memset(blank, 0xFF, sizeof(blank));
+            for (int i = 0; i < RESUME_SLOTS; i++) create.write(blank, sizeof(blank));
+            create.close();
+        }
+
+        File file = fs->open(RESUME_FILE, "r+");
+        bool ok   = file && file.seek((session.generation % RESUME_SLOTS) * RESUME_SLOT_SIZE) &&
+                    (file.write(slot, sizeof(slot)) == sizeof(slot));
+        if (file) file.close();
+
+        if (!ok) {
+            journalErrors++;
+            return false;
+        }
+        nextGeneration++;
+        return true;
+    }
+};
+
+#if defined(ESP32)
+#include <Arduino.h>
+#include <ESPAsyncWebServer.h>
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+#include <digameFlashScheduler.h>
+#include <digameSha256.h>
+
+//*****************************************************************************
+// The OTA partition we aren't running from. Each chunk is erased and
+// written through the OtaFlashWriter the loop services, between LIDAR
+// frames, the same as /update's uploads.
+class EspOtaPartition : public OtaPartition
+{
+  public:
+    bool begin(OtaFlashWriter &writer)
+    {
+        flash = &writer;
+        part  = esp_ota_get_next_update_partition(nullptr);
+        return part != nullptr;
+    }
+
+    uint32_t id() override { return part ? part->address : 0; }
+    uint32_t size() override { return part ? part->size : 0; }
+
+    // A chunk is starting. Its sectors are erased as it's written.
+    bool erase(uint32_t offset, uint32_t length) override
+    {
+        next = offset;
+        return flash->begin(part, offset, length, false) == nullptr;
+    }
+
+    bool write(uint32_t offset, const uint8_t *data, size_t length) override
+    {
+        if (offset != next) return false; // The writer only goes forwards.
+        next += length;
+        return flash->push(data, length) == nullptr;
+    }
+
+    bool flush() override { return flash->end() == nullptr; }
+
+    void abort() { flash->abort(); } // The link dropped part way through a chunk.
+
+    const char *activate(uint32_t size, const uint8_t *sha256) override
+    {
+        // Read it all back: chunks written before a reboot count too.
+        static uint8_t buffer[1024];
+        uint8_t        digest[32];
+        Sha256         sha;
+        sha.begin();
+        bool readOk = true;
+        for (uint32_t at = 0; readOk && (at < size); at += sizeof(buffer)) {
+            size_t n = (size - at < sizeof(buffer)) ? size - at : sizeof(buffer);
+            readOk = (esp_partition_read(part, at, buffer, n) == ESP_OK);
+            sha.update(buffer, n);
+        }
+        sha.finish(digest);
+
+        if (!readOk) return "Couldn't read the image back";
+        if (memcmp(digest, sha256, sizeof(digest))) return "SHA-256 of image doesn't match";
+        if (esp_ota_set_boot_partition(part) != ESP_OK) return "Not a valid firmware image";
+        return nullptr;
+    }
+
+  private:
+    OtaFlashWriter        *flash = nullptr;
+    const esp_partition_t *part  = nullptr;
+    uint32_t               next  = 0;
+};
+
+//*****************************************************************************
+// ResumableOta on the web server. The requests come in on the network task,
+// one client at a time.
+class ResumableOtaServer
+{
+  public:
+    ResumableOta ota;
+
+    // flash: the writer the loop services, which /update uses too. One
+    // update at a time.
+    void begin(AsyncWebServer &server, fs::FS &fileSystem, OtaFlashWriter &flash, const char *username,
+               const char *password)
+    {
+        user = username;
+        pass = password;
+        if (!partition.begin(flash)) {
+            DEBUG_PRINTLN("OTA: no partition to update");
+            return;
+        }
+        ota.restore(fileSystem, partition);
+
+        server.on("/update/resume", HTTP_GET, [this](AsyncWebServerRequest *request) {
+            if (!allowed(request)) return;
+            reply(request, nullptr);
+        });
+
+        // Form fields: size, chunk, sha256 (hex).
+        server.on("/update/resume", HTTP_POST, [this](AsyncWebServerRequest *request) {
+            if (!allowed(request)) return;
+            uint8_t sha[32];
+            if (!request->hasParam("size", true) || !request->hasParam("chunk", true) ||
+                !request->hasParam("sha256", true) || !parseHex(request->getParam("sha256", true)->value(), sha)) {
+                return reply(request, "Give size, chunk and sha256");
+            }
+            reply(request, ota.start(request->getParam("size", true)->value().toInt(),
+                                     request->getParam("chunk", true)->value().toInt(), sha));
+        });
+
+        // The chunk is the body, as application/octet-stream. If the link
+        // drops part way, the request never completes and the chunk doesn't
+        // count.
+        server.on(
+            "/update/chunk", HTTP_POST,
+            [this](AsyncWebServerRequest *request) {
+                if (!allowed(request)) return;
+                const char *problem = chunkProblem ? chunkProblem : ota.endChunk();
+                chunkProblem        = nullptr;
+                reply(request, problem);
+            },
+            nullptr,
+            [this](AsyncWebServerRequest *request, uint8_t *data, size_t length, size_t index, size_t total) {
+                if (index == 0) {
+                    chunkProblem = nullptr;
+                    if (!request->authenticate(user, pass)) {
+                        chunkProblem = "Not authorised"; // Answered when the request completes.
+                        return;
+                    }
+                    if (!request->hasParam("offset") || !request->hasParam("crc")) {
+                        chunkProblem = "Give offset and crc";
+                        return;
+                    }
+                    chunkProblem = ota.beginChunk(request->getParam("offset")->value().toInt(), total,
+                                                  strtoul(request->getParam("crc")->value().c_str(), nullptr, 16));
+                    uint32_t mine = ++chunksBegun; // Not a later chunk's, if this goes late.
+                    request->onDisconnect([this, mine]() {
+                        if (mine == chunksBegun) partition.abort(); // Once it's written, this does nothing.
+                    });
+                }
+                if (!chunkProblem) chunkProblem = ota.writeChunk(data, length);
+            });
+
+        server.on("/update/finish", HTTP_POST, [this](AsyncWebServerRequest *request) {
+            if (!allowed(request)) return;
+            const char *problem = ota.finish();
+            reply(request, problem);
+            if (!problem) request->onDisconnect([]() { ESP.restart(); });
+        });
+    }
+
+  private:
+    EspOtaPartition partition;
+    const char     *user;
+    const char     *pass;
+    const char     *chunkProblem = nullptr;
+    uint32_t        chunksBegun  = 0;
+
+    bool allowed(AsyncWebServerRequest *request)
+    {
+        if (request->authenticate(user, pass)) return true;
+        request->requestAuthentication();
+        return false;
+    }
+
+    void reply(AsyncWebServerRequest *request, const char *problem)
+    {
+        char text[192];
+        int  n = ota.status(text, sizeof(text));
+        if (problem && (n > 1) && ((size_t)n < sizeof(text))) { // Add the error to the state.
+            snprintf(text + n - 1, sizeof(text) - n + 1, ",\"error\":\"%s\"}", problem);
+        }
+        request->send(problem ? 400 : 200, "application/json", text);
+    }
+
+    static bool parseHex(const String &hex, uint8_t *out)
+    {
+        if (hex.length() != 64) return false;
+        for (int i = 0; i < 32; i++) {
+            char byte[3] = { hex[2 * i], hex[2 * i + 1], 0 };
+            char *end;
+            out[i] = (uint8_t)strtoul(byte, &end, 16);
+            if (*end) return false;
+        }
+        return true;
+    }
+};
+#endif // ESP32
+
+#endif //__DIGAME_RESUMABLE_OTA_H__
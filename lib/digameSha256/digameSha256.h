@@ -0,0 +1,197 @@
+/* digameSha256.h
+ *
+ *  SHA-256, a piece at a time, for checking firmware images as they
+ *  arrive.
+ *
+ *  On the ESP32, Sha256 is mbedtls, which runs on the chip's SHA engine.
+ *  That's several times quicker than hashing in software, and there's no
+ *  extra time per piece, so it keeps up with a 1 KB upload chunk as well
+ *  as a 4 KB one. The engine works on one hash at a time. While it's in
+ *  use, mbedtls does any other hash in software, so the hash that matters
+ *  most should be begun first.
+ *
+ *  Anywhere else, Sha256 is Sha256Soft, plain C++ after FIPS 180-4. That
+ *  one is always here, so a Linux host can build and check anything that
+ *  hashes, and the [h] command can compare the two on the ESP32. hashSpeed()
+ *  times either, at any chunk size.
+ *
+ *    Sha256 sha;
+ *    sha.begin();
+ *    sha.update(data, length);  // As often as need be.
+ *    sha.finish(digest);        // 32 bytes.
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#ifndef __DIGAME_SHA256_H__
+#define __DIGAME_SHA256_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#define SHA256_LENGTH 32 // Bytes in a digest.
+
+//*****************************************************************************
+class Sha256Soft
+{
+  public:
+    Sha256Soft() { begin(); }
+
+    void begin()
+    {
+        static const uint32_t initial[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                             0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+        memcpy(h, initial, sizeof(h));
+        total = 0;
+        used  = 0;
+    }
+
+    void update(const uint8_t *data, size_t length)
+    {
+        total += length;
+        if (used) { // Finish the block begun last time.
+            size_t n = (length < 64 - used) ? length : 64 - used;
+            memcpy(held + used, data, n);
+            used   += n;
+            data   += n;
+            length -= n;
+            if (used < 64) return;
+            block(held);
+            used = 0;
+        }
+        for (; length >= 64; data += 64, length -= 64) block(data);
+        memcpy(held, data, length);
+        used = length;
+    }
+
+    void finish(uint8_t *digest)
+    {
+        uint64_t bits = total * 8;
+        held[used++] = 0x80;
+        if (used > 56) {
+            memset(held + used, 0, 64 - used);
+            block(held);
+            used = 0;
+        }
+        memset(held + used, 0, 56 - used);
+        for (int i = 0; i < 8; i++) held[56 + i] = (uint8_t)(bits >> (56 - 8 * i));
+        block(held);
+        for (int i = 0; i < 8; i++) {
+            digest[4 * i]     = (uint8_t)(h[i] >> 24);
+            digest[4 * i + 1] = (uint8_t)(h[i] >> 16);
+            digest[4 * i + 2] = (uint8_t)(h[i] >> 8);
+            digest[4 * i + 3] = (uint8_t)h[i];
+        }
+    }
+
+  private:
+    uint32_t h[8];
+    uint64_t total;
+    uint8_t  held[64];
+    size_t   used;
+
+    static uint32_t ror(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+    void block(const uint8_t *p)
+    {
+        static const uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+        };
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = ((uint32_t)p[4 * i] << 24) | ((uint32_t)p[4 * i + 1] << 16) | ((uint32_t)p[4 * i + 2] << 8) | p[4 * i + 3];
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = ror(w[i - 15], 7) ^ ror(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = ror(w[i - 2], 17) ^ ror(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = hh + (ror(e, 6) ^ ror(e, 11) ^ ror(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            uint32_t t2 = (ror(a, 2) ^ ror(a, 13) ^ ror(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            hh = g;
+            g  = f;
+            f  = e;
+            e  = d + t1;
+            d  = c;
+            c  = b;
+            b  = a;
+            a  = t1 + t2;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+        h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+    }
+};
+
+//*****************************************************************************
+// Digests as text, lower case, as tools/ print them.
+inline void sha256ToHex(const uint8_t *digest, char *hex) // 65 bytes, with the terminator.
+{
+    for (int i = 0; i < SHA256_LENGTH; i++) snprintf(hex + 2 * i, 3, "%02x", digest[i]);
+}
+
+inline bool sha256MatchesHex(const uint8_t *digest, const char *hex) // Either case.
+{
+    char ours[2 * SHA256_LENGTH + 1];
+    sha256ToHex(digest, ours);
+    return (strlen(hex) >= 2 * SHA256_LENGTH) && (strncasecmp(hex, ours, 2 * SHA256_LENGTH) == 0);
+}
+
+#if defined(ESP32)
+//*****************************************************************************
+// The ESP32 side: mbedtls, on the SHA engine.
+#include <mbedtls/sha256.h>
+
+class Sha256
+{
+  public:
+    Sha256() { mbedtls_sha256_init(&context); }
+    ~Sha256() { mbedtls_sha256_free(&context); }
+
+    void begin() // Lets go of the engine if the last hash wasn't finished.
+    {
+        mbedtls_sha256_free(&context);
+        mbedtls_sha256_init(&context);
+        mbedtls_sha256_starts_ret(&context, 0);
+    }
+    void update(const uint8_t *data, size_t length) { mbedtls_sha256_update_ret(&context, data, length); }
+    void finish(uint8_t *digest) { mbedtls_sha256_finish_ret(&context, digest); }
+
+  private:
+    mbedtls_sha256_context context;
+
+    Sha256(const Sha256 &);            // The context can't be copied.
+    Sha256 &operator=(const Sha256 &);
+};
+#else
+typedef Sha256Soft Sha256;
+#endif // ESP32
+
+//*****************************************************************************
+// KB/s hashing total bytes, chunk bytes at a time, for comparing chunk sizes
+// and hashes. Anything with begin(), update() and finish() will do.
+template <class Hash>
+uint32_t hashSpeed(Hash &hash, const uint8_t *buffer, size_t chunk, size_t total, uint32_t (*clockUs)())
+{
+    uint8_t  digest[SHA256_LENGTH];
+    uint32_t started = clockUs();
+    hash.begin();
+    for (size_t done = 0; done < total; done += chunk) hash.update(buffer, chunk);
+    hash.finish(digest);
+    uint32_t took = clockUs() - started;
+    return (uint32_t)((uint64_t)total * 1000000 / 1024 / (took ? took : 1));
+}
+
+#endif //__DIGAME_SHA256_H__
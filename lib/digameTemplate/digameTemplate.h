@@ -0,0 +1,340 @@
+/* digameTemplate.h
+ *
+ *  Server-side templates for the web pages, parsed once and cached.
+ *
+ *  A page is read from flash once, at load(). It's split into literal
+ *  spans and variable slots (%name%, as AsyncWebServer's templates; %%
+ *  is a literal %). Each request evaluates just the variables the page
+ *  uses, into small buffers, and compares them with the values it last
+ *  rendered. If they match, it's served from the cached copy and nothing
+ *  else is done. Otherwise the page is built again from the spans.
+ *
+ *  Each rendering is gzipped once, the first time a browser that takes
+ *  gzip asks for it (lib/digameDeflate), and that copy is cached too.
+ *
+ *  Rendered pages are handed out through shared pointers. A response still
+ *  being sent keeps its copy alive, even if a re-render replaces the cache
+ *  in the meantime.
+ *
+ *  Values are HTML-escaped. Variables not defined render as nothing.
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#ifndef __DIGAME_TEMPLATE_H__
+#define __DIGAME_TEMPLATE_H__
+
+#include <digameDebug.h>
+#include <digameDeflate.h>
+#include <FS.h>
+#include <memory>
+#include <vector>
+
+#define TEMPLATE_MAX_VARIABLES 16
+#define TEMPLATE_MAX_SEGMENTS  48
+#define TEMPLATE_NAME_LENGTH   24
+#define TEMPLATE_VALUE_SIZE    48
+#define TEMPLATE_MAX_SIZE      8192 // Pages are read whole into RAM.
+
+typedef void (*TemplateVariable)(char *buffer, size_t size);
+typedef uint32_t (*TemplateClock)(); // Microseconds, for the render timings.
+
+typedef std::shared_ptr<const std::vector<char>> RenderedPage;
+typedef std::shared_ptr<const std::vector<uint8_t>> GzippedPage;
+
+class TemplatePage
+{
+  public:
+    uint32_t flashReads   = 0; // File reads. Only load() does any.
+    uint32_t renders      = 0; // Requests that rebuilt the page...
+    uint32_t cacheHits    = 0; // ...and those served from the cache.
+    uint32_t compressions = 0; // Renderings gzipped.
+    uint32_t lastRenderUs = 0; // Time in the last render() call, hit or not.
+    uint32_t maxRenderUs  = 0;
+
+    // Define variables before load(), so their slots can be resolved.
+    bool define(const char *name, TemplateVariable variable)
+    {
+        if (variableCount == TEMPLATE_MAX_VARIABLES) return false;
+        strncpy(names[variableCount], name, TEMPLATE_NAME_LENGTH - 1);
+        variables[variableCount++] = variable;
+        return true;
+    }
+
+    //*************************************************************************
+    // Read and parse the page. Returns false if it can't be read or is too
+    // big or complicated to hold.
+    bool load(fs::FS &fileSystem, const char *path, TemplateClock now = nullptr)
+    {
+        clock = now;
+        text.clear();
+        segmentCount = 0;
+        cached.reset();
+        cachedGzip.reset();
+
+        File file = fileSystem.open(path, FILE_READ);
+        if (!file) return false;
+        size_t size = file.size();
+        if (size > TEMPLATE_MAX_SIZE) {
+            file.close();
+            return false;
+        }
+        text.resize(size);
+        size_t got = size ? file.read((uint8_t *)text.data(), size) : 0;
+        file.close();
+        flashReads++;
+        if (got != size) return false;
+
+        return parse();
+    }
+
+    bool loaded() { return segmentCount > 0; }
+
+    //*************************************************************************
+    // The page with current values. Fresh if any of them has changed since
+    // the last call, otherwise the same buffer as last time.
+    RenderedPage render()
+    {
+        uint32_t start = clock ? clock() : 0;
+
+        char values[TEMPLATE_MAX_VARIABLES][TEMPLATE_VALUE_SIZE];
+        bool same = (bool)cached;
+        for (size_t v = 0; v < variableCount; v++) {
+            values[v][0] = 0;
+            if (!used[v]) continue;
+            variables[v](values[v], TEMPLATE_VALUE_SIZE);
+            values[v][TEMPLATE_VALUE_SIZE - 1] = 0;
+            if (same && strcmp(values[v], cachedValues[v])) same = false;
+        }
+
+        if (same) {
+            cacheHits++;
+        } else {
+            std::vector<char> *page = new std::vector<char>();
+            page->reserve(text.size() + 64);
+            for (size_t i = 0; i < segmentCount; i++) {
+                const Segment &s = segments[i];
+                if (s.variable < 0) {
+                    page->insert(page->end(), text.begin() + s.offset, text.begin() + s.offset + s.length);
+                } else {
+                    appendEscaped(*page, values[s.variable]);
+                }
+            }
+            cached.reset(page);
+            cachedGzip.reset();
+            memcpy(cachedValues, values, sizeof(values));
+            cachedHash = 2166136261UL; // FNV-1a over the values in use, for version().
+            for (size_t v = 0; v < variableCount; v++) {
+                if (!used[v]) continue;
+                for (const char *p = values[v];; p++) {
+                    cachedHash = (cachedHash ^ (uint8_t)*p) * 16777619UL;
+                    if (!*p) break;
+                }
+            }
+            renders++;
+        }
+
+        lastRenderUs = clock ? clock() - start : 0;
+        if (lastRenderUs > maxRenderUs) maxRenderUs = lastRenderUs;
+        return cached;
+    }
+
+    // The last render(), gzipped. Null if there's been no render or it
+    // couldn't be compressed.
+    GzippedPage gzipped()
+    {
+        if (!cached || cachedGzip) return cachedGzip;
+
+        std::vector<uint8_t> *packed = new std::vector<uint8_t>();
+        if (GzipDeflater::compress((const uint8_t *)cached->data(), cached->size(), *packed)) {
+            cachedGzip.reset(packed);
+            compressions++;
+        } else {
+            delete packed;
+        }
+        return cachedGzip;
+    }
+
+    // Changes whenever the rendered page does. For ETags.
+    uint32_t version() { return cachedHash ^ textHash; }
+
+  private:
+    struct Segment
+    {
+        uint16_t offset;
+        uint16_t length;
+        int8_t   variable; // -1 for literal text.
+    };
+
+    std::vector<char> text;
+    uint32_t          textHash = 0;
+    Segment           segments[TEMPLATE_MAX_SEGMENTS];
+    size_t            segmentCount = 0;
+    char              names[TEMPLATE_MAX_VARIABLES][TEMPLATE_NAME_LENGTH] = {};
+    TemplateVariable  variables[TEMPLATE_MAX_VARIABLES];
+    bool              used[TEMPLATE_MAX_VARIABLES] = {};
+    size_t            variableCount = 0;
+    TemplateClock     clock = nullptr;
+    RenderedPage      cached;
+    GzippedPage       cachedGzip;
+    char              cachedValues[TEMPLATE_MAX_VARIABLES][TEMPLATE_VALUE_SIZE];
+    uint32_t          cachedHash = 0;
+
+    bool parse()
+    {
+        size_t literalStart = 0;
+        size_t i            = 0;
+        size_t n            = text.size();
+
+        textHash = 2166136261UL;
+        for (char c : text) textHash = (textHash ^ (uint8_t)c) * 16777619UL;
+        for (size_t v = 0; v < variableCount; v++) used[v] = false;
+
+        while (i < n) {
+            if (text[i] != '%') {
+                i++;
+                continue;
+            }
+
+            // %name% -- letters, digits, '.' and '_' between the percents.
+            size_t end = i + 1;
+            while ((end < n) && (end - i <= TEMPLATE_NAME_LENGTH) && isNameChar(text[end])) end++;
+            bool isVariable = (end < n) && (text[end] == '%') && (end > i + 1);
+            bool isPercent  = (end == i + 1) && (end < n) && (text[end] == '%'); // %%
+
+            if (!isVariable && !isPercent) {
+                i++;
+                continue;
+            }
+
+            if (!addSegment(literalStart, i - literalStart + (isPercent ? 1 : 0), -1)) return false;
+            if (isVariable) {
+                int v = lookup(&text[i + 1], end - i - 1);
+                if ((v >= 0) && !addSegment(0, 0, v)) return false; // Unknown ones are dropped.
+            }
+            i            = end + 1;
+            literalStart = i;
+        }
+        return addSegment(literalStart, n - literalStart, -1) && (segmentCount > 0);
+    }
+
+    bool addSegment(size_t offset, size_t length, int variable)
+    {
+        if ((variable < 0) && (length == 0)) return true;
+        if (segmentCount == TEMPLATE_MAX_SEGMENTS) return false;
+        if (variable >= 0) used[variable] = true;
+        segments[segmentCount++] = {(uint16_t)offset, (uint16_t)length, (int8_t)variable};
+        return true;
+    }
+
+    int lookup(const char *name, size_t length)
+    {
+        for (size_t v = 0; v < variableCount; v++) {
+            if ((strlen(names[v]) == length) && !strncmp(names[v], name, length)) return v;
+        }
+        return -1;
+    }
+
+    static bool isNameChar(char c)
+    {
+        return ((c >= 'a') && (c <= 'z')) || ((c >= 'A') && (c <= 'Z')) || ((c >= '0') && (c <= '9')) ||
+               (c == '.') || (c == '_');
+    }
+
+    static void appendEscaped(std::vector<char> &out, const char *value)
+    {
+        for (const char *p = value; *p; p++) {
+            const char *entity = nullptr;
+            switch (*p) {
+            case '&': entity = "&amp;";  break;
+            case '<': entity = "&lt;";   break;
+            case '>': entity = "&gt;";   break;
+            case '"': entity = "&quot;"; break;
+            }
+            if (entity) {
+                out.insert(out.end(), entity, entity + strlen(entity));
+            } else {
+                out.push_back(*p);
+            }
+        }
+    }
+};
+
+#if defined(ESP32)
+#include <ESPAsyncWebServer.h>
+
+//*****************************************************************************
+// Serves a TemplatePage at "/" and its own path, behind a login. The ETag
+// follows the rendered content, so an unchanged page costs a 304. It's
+// sent gzipped to browsers that accept it. Server-Timing carries the
+// render time, for the browser's dev tools.
+class TemplateHandler : public AsyncWebHandler
+{
+  public:
+    TemplatePage page;
+
+    TemplateHandler(const char *pagePath, const char *user = "", const char *password = "")
+        : path(pagePath), userName(user), pass(password) {}
+
+    bool begin(fs::FS &fileSystem)
+    {
+        return page.load(fileSystem, path, []() -> uint32_t { return micros(); });
+    }
+
+    bool canHandle(AsyncWebServerRequest *request) override
+    {
+        if ((request->method() != HTTP_GET) || !page.loaded()) return false;
+        return (request->url() == "/") || (request->url() == path);
+    }
+
+    void handleRequest(AsyncWebServerRequest *request) override
+    {
+        if (userName[0] && !request->authenticate(userName, pass)) return request->requestAuthentication();
+
+        RenderedPage rendered = page.render();
+        GzippedPage  packed;
+        if (request->hasHeader("Accept-Encoding") && (request->header("Accept-Encoding").indexOf("gzip") >= 0)) {
+            packed = page.gzipped();
+        }
+
+        char etag[16], timing[32]; // Each encoding has its own ETag.
+        snprintf(etag, sizeof(etag), "\"t%08x%s\"", (unsigned)page.version(), packed ? "g" : "");
+        snprintf(timing, sizeof(timing), "render;dur=%u.%03u", (unsigned)(page.lastRenderUs / 1000),
+                 (unsigned)(page.lastRenderUs % 1000));
+
+        AsyncWebServerResponse *response;
+        if (request->hasHeader("If-None-Match") && (request->header("If-None-Match") == etag)) {
+            response = request->beginResponse(304);
+        } else if (packed) {
+            response = request->beginResponse("text/html", packed->size(),
+                [packed](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+                    size_t n = packed->size() - index;
+                    if (n > maxLen) n = maxLen;
+                    memcpy(buffer, packed->data() + index, n);
+                    return n;
+                });
+            response->addHeader("Content-Encoding", "gzip");
+        } else {
+            response = request->beginResponse("text/html", rendered->size(),
+                [rendered](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+                    size_t n = rendered->size() - index;
+                    if (n > maxLen) n = maxLen;
+                    memcpy(buffer, rendered->data() + index, n);
+                    return n;
+                });
+        }
+        response->addHeader("Vary", "Accept-Encoding");
+        response->addHeader("ETag", etag);
+        response->addHeader("Cache-Control", "no-cache");
+        response->addHeader("Server-Timing", timing);
+        request->send(response);
+    }
+
+  private:
+    const char *path;
+    const char *userName;
+    const char *pass;
+};
+#endif // ESP32
+
+#endif //__DIGAME_TEMPLATE_H__
@@ -0,0 +1,445 @@
+/* digameTime.h
+ *
+ *  Wall-clock time for the counter: UTC worked out from the monotonic
+ *  microsecond counter, corrected for the crystal's drift.
+ *
+ *  millis() wraps every 49 days and runs fast or slow by up to a hundred
+ *  ppm or so (a few seconds a day). So we never set a clock. We keep a
+ *  mapping from the monotonic counter (esp_timer, 64 bits, never wraps)
+ *  to UTC instead:
+ *
+ *    utc = baseUtc + (mono - baseMono) * (1 + drift)
+ *
+ *  Each sync is a TimeSample: the UTC time at a given monotonic time, and
+ *  how sure of it we are. They come from SNTP when the WiFi link is up, or
+ *  from a host over the control channel (CONTROL_SET_TIME). The last
+ *  TIME_SAMPLES of them are kept. Once they span TIME_RATE_SPAN_US, a
+ *  least-squares line through their offsets gives the drift, and the base
+ *  is taken from the line rather than the newest sample, which smooths out
+ *  network jitter.
+ *
+ *  A sample that disagrees with the mapping by more than TIME_STEP_US is a
+ *  step: a wrong time earlier, or a new source. The old samples are
+ *  dropped and we start again from it, keeping the drift. A less precise
+ *  sample than the last one is ignored if that one is under
+ *  TIME_PREFER_US old, so host syncs over Bluetooth don't undo SNTP,
+ *  unless it's from a more trusted source. Sources are trusted in the
+ *  order SNTP, then host. A step from a less
+ *  trusted source than the one that set the clock is ignored if it would
+ *  move it more than TIME_MAX_STEP_US: a host with a wrong clock can't
+ *  throw out a good time.
+ *
+ *  nowUtcMs() never goes backwards for small corrections. After a sync
+ *  that moves the clock back it holds still until real time catches up,
+ *  so events stay in order. A step back from a source at least as trusted
+ *  as the last one is different: the time we had was wrong, maybe far in
+ *  the future, and holding still for it would freeze every timestamp. So
+ *  nowUtcMs() follows it back, and rewinds counts those.
+ *
+ *  SntpClient asks an NTP server for the time through SntpSocket and turns
+ *  the reply into a TimeSample, allowing for the round trip. On the ESP32,
+ *  SntpTask runs it in its own task (name lookups block) and hands samples
+ *  to the main loop through a queue. TimeService itself is only touched
+ *  from the main loop.
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#ifndef __DIGAME_TIME_H__
+#define __DIGAME_TIME_H__
+
+#include <digameDebug.h>
+
+#define TIME_SAMPLES          8
+#define TIME_RATE_SPAN_US     600000000ULL   // 10 min of samples before drift is estimated.
+#define TIME_MAX_DRIFT_PPB    500000         // 500 ppm. Anything more is a bad fit.
+#define TIME_STEP_US          1000000LL      // Off by more than this and we start over.
+#define TIME_MAX_STEP_US      86400000000LL  // Less trusted sources can't step the clock further.
+#define TIME_PREFER_US        3600000000ULL  // How long a more precise sample beats others.
+#define TIME_EARLIEST_MS      1640995200000ULL // 2022-01-01. Anything before is nonsense.
+
+#define TIME_SOURCE_NONE      0
+#define TIME_SOURCE_SNTP      1
+#define TIME_SOURCE_HOST      2
+
+#define SNTP_PORT             123
+#define SNTP_PACKET_SIZE      48
+#define SNTP_TIMEOUT_US       2000000ULL
+#define SNTP_MAX_DELAY_US     1000000        // Round trips longer than this aren't trusted.
+#define SNTP_BURST            4              // Quick polls after start-up...
+#define SNTP_BURST_INTERVAL_S 16
+#define SNTP_INTERVAL_S       1024           // ...then settle down to this.
+#define SNTP_UNIX_OFFSET_S    2208988800ULL  // 1900 to 1970.
+
+typedef uint64_t (*TimeClock)(); // Monotonic microseconds.
+
+struct TimeSample
+{
+    uint64_t utcUs;         // UTC, microseconds since 1970...
+    uint64_t monoUs;        // ...at this monotonic time.
+    uint32_t uncertaintyUs; // Give or take.
+    uint8_t  source;        // TIME_SOURCE_...
+};
+
+//*****************************************************************************
+class TimeService
+{
+  public:
+    uint32_t syncs          = 0;
+    uint32_t ignored        = 0; // Less precise than a recent sample, or nonsense.
+    uint32_t steps          = 0; // Syncs that moved the clock by more than TIME_STEP_US.
+    uint32_t rewinds        = 0; // Steps back that nowUtcMs() followed.
+    int32_t  driftPpb       = 0; // How fast the counter runs against UTC. + is slow.
+    int64_t  lastErrorUs    = 0; // How far out we were when the last sync came in.
+    uint64_t lastSyncMonoUs = 0;
+    uint8_t  source         = TIME_SOURCE_NONE;
+
+    void begin(TimeClock monotonic) { clock = monotonic; }
+
+    bool valid() const { return source != TIME_SOURCE_NONE; }
+
+    //*************************************************************************
+    // Take a sample into account. Returns false if it was ignored.
+    bool sync(const TimeSample &t)
+    {
+        if (t.utcUs / 1000 < TIME_EARLIEST_MS) {
+            ignored++;
+            return false;
+        }
+        if (valid() && (t.uncertaintyUs > 2 * lastUncertaintyUs + 1000) &&
+            (t.monoUs - lastSyncMonoUs < TIME_PREFER_US) && (trust(t.source) <= trust(source))) {
+            ignored++;
+            return false;
+        }
+
+        int64_t error = valid() ? (int64_t)(t.utcUs - utcUs(t.monoUs)) : 0;
+        bool    step  = (error > TIME_STEP_US) || (error < -TIME_STEP_US);
+        if (step && (trust(t.source) < trust(source)) && ((error > TIME_MAX_STEP_US) || (error < -TIME_MAX_STEP_US))) {
+            ignored++;
+            return false;
+        }
+
+        lastErrorUs = error;
+        if (step) {
+            sampleCount = 0;
+            steps++;
+            if ((error < 0) && (trust(t.source) >= trust(source))) { // The old time was wrong. Don't wait for it.
+                lastNowMs = 0;
+                rewinds++;
+            }
+        }
+
+        samples[(first + sampleCount) % TIME_SAMPLES] = t;
+        if (sampleCount < TIME_SAMPLES) {
+            sampleCount++;
+        } else {
+            first = (first + 1) % TIME_SAMPLES;
+        }
+        fit();
+
+        lastSyncMonoUs    = t.monoUs;
+        lastUncertaintyUs = t.uncertaintyUs;
+        source            = t.source;
+        syncs++;
+        return true;
+    }
+
+    //*************************************************************************
+    // UTC at a monotonic time. Only meaningful once valid().
+    uint64_t utcUs(uint64_t monoUs) const
+    {
+        int64_t elapsed = (int64_t)(monoUs - baseMonoUs);
+        return baseUtcUs + elapsed + elapsed / 1000 * driftPpb / 1000000;
+    }
+
+    // UTC now, in milliseconds. Never less than it returned last time.
+    uint64_t nowUtcMs()
+    {
+        uint64_t now = utcUs(clock()) / 1000;
+        if (now < lastNowMs) return lastNowMs;
+        lastNowMs = now;
+        return now;
+    }
+
+  private:
+    TimeClock  clock = nullptr;
+    TimeSample samples[TIME_SAMPLES];
+    size_t     first             = 0;
+    size_t     sampleCount       = 0;
+    uint32_t   lastUncertaintyUs = 0;
+    uint64_t   baseMonoUs        = 0;
+    uint64_t   baseUtcUs         = 0;
+    uint64_t   lastNowMs         = 0;
+
+    static int trust(uint8_t source)
+    {
+        switch (source) {
+        case TIME_SOURCE_SNTP: return 2;
+        case TIME_SOURCE_HOST: return 1;
+        default:               return 0;
+        }
+    }
+
+    // Work out the mapping from the samples held.
+    void fit()
+    {
+        const TimeSample &newest = samples[(first + sampleCount - 1) % TIME_SAMPLES];
+        const TimeSample &oldest = samples[first];
+
+        baseMonoUs = newest.monoUs;
+        baseUtcUs  = newest.utcUs;
+        if ((sampleCount < 3) || (newest.monoUs - oldest.monoUs < TIME_RATE_SPAN_US)) return;
+
+        // Offsets (utc - mono) against time, both relative to the newest
+        // sample so doubles hold them exactly enough.
+        double sx = 0, sy = 0, sxx = 0, sxy = 0;
+        for (size_t i = 0; i < sampleCount; i++) {
+            const TimeSample &s = samples[(first + i) % TIME_SAMPLES];
+            double x = (double)(int64_t)(s.monoUs - newest.monoUs) / 1e6;                        // s
+            double y = (double)((int64_t)(s.utcUs - newest.utcUs) - (int64_t)(s.monoUs - newest.monoUs)); // us
+            sx += x;
+            sy += y;
+            sxx += x * x;
+            sxy += x * y;
+        }
+        double n     = sampleCount;
+        double slope = (n * sxy - sx * sy) / (n * sxx - sx * sx); // us per s: ppm.
+        double at0   = (sy - slope * sx) / n;                      // The line's offset at the newest sample.
+
+        double ppb = slope * 1000;
+        if (ppb > TIME_MAX_DRIFT_PPB) ppb = TIME_MAX_DRIFT_PPB;
+        if (ppb < -TIME_MAX_DRIFT_PPB) ppb = -TIME_MAX_DRIFT_PPB;
+        driftPpb  = (int32_t)ppb;
+        baseUtcUs = newest.utcUs + (int64_t)at0;
+    }
+};
+
+//*****************************************************************************
+// How SntpClient reaches the server. receive() must not block: it returns
+// the length of a datagram that has arrived, or 0.
+class SntpSocket
+{
+  public:
+    virtual ~SntpSocket() {}
+    virtual bool linkUp() = 0;
+    virtual bool send(const uint8_t *data, size_t length) = 0;
+    virtual int  receive(uint8_t *buffer, size_t size) = 0;
+};
+
+//*****************************************************************************
+class SntpClient
+{
+  public:
+    uint32_t requests = 0;
+    uint32_t replies  = 0;
+    uint32_t timeouts = 0;
+    uint32_t rejected = 0; // Replies that weren't ours, were kiss-o'-death, or too slow.
+
+    void begin(SntpSocket &s, TimeClock monotonic)
+    {
+        socket   = &s;
+        clock    = monotonic;
+        nextUs   = 0;
+        waiting  = false;
+        good     = 0;
+        backoffS = SNTP_BURST_INTERVAL_S;
+    }
+
+    //*************************************************************************
+    // Call often. Returns true when it has a new sample for the TimeService.
+    bool step(TimeSample &sample)
+    {
+        uint64_t now = clock();
+
+        if (!waiting) {
+            if ((now < nextUs) || !socket->linkUp()) return false;
+
+            uint8_t request[SNTP_PACKET_SIZE] = {0};
+            request[0] = 0x23; // Version 4, client.
+            sentUs     = now;
+            putTimestamp(request + 40, sentUs); // Comes back as the originate time: tells us it's ours.
+            while (socket->receive(scratch, sizeof(scratch)) > 0) {} // Anything stale.
+            if (socket->send(request, sizeof(request))) {
+                requests++;
+                waiting = true;
+            } else {
+                retry(now);
+            }
+            return false;
+        }
+
+        int length = socket->receive(scratch, sizeof(scratch));
+        if (length <= 0) {
+            if (now - sentUs > SNTP_TIMEOUT_US) {
+                timeouts++;
+                waiting = false;
+                retry(now);
+            }
+            return false;
+        }
+
+        uint64_t t2, t3;
+        if ((length < SNTP_PACKET_SIZE) || ((scratch[0] & 0x07) != 4) || (scratch[1] == 0) ||
+            (getRaw(scratch + 24) != rawTimestamp(sentUs))) {
+            rejected++;
+            return false; // Keep waiting for the right one.
+        }
+        t2 = getTimestamp(scratch + 32); // Server got it...
+        t3 = getTimestamp(scratch + 40); // ...and answered.
+
+        waiting = false;
+        int64_t delay = (int64_t)(now - sentUs) - (int64_t)(t3 - t2);
+        if (delay < 0) delay = 0;
+        if (delay > SNTP_MAX_DELAY_US) {
+            rejected++;
+            retry(now);
+            return false;
+        }
+
+        sample.utcUs         = t3 + delay / 2;
+        sample.monoUs        = now;
+        sample.uncertaintyUs = delay / 2 + 1000;
+        sample.source        = TIME_SOURCE_SNTP;
+        replies++;
+        good++;
+        backoffS = SNTP_BURST_INTERVAL_S;
+        nextUs   = now + (uint64_t)((good < SNTP_BURST) ? SNTP_BURST_INTERVAL_S : SNTP_INTERVAL_S) * 1000000;
+        return true;
+    }
+
+    // How long until step() has something to do, for a task to sleep.
+    uint32_t waitMs()
+    {
+        if (waiting) return 20;
+        uint64_t now = clock();
+        if (now >= nextUs) return 1000; // Link down, probably.
+        uint64_t ms = (nextUs - now) / 1000;
+        return (ms > 1000) ? 1000 : (uint32_t)ms;
+    }
+
+  private:
+    SntpSocket *socket = nullptr;
+    TimeClock   clock  = nullptr;
+    uint64_t    nextUs = 0;
+    uint64_t    sentUs = 0;
+    bool        waiting  = false;
+    uint32_t    good     = 0;
+    uint32_t    backoffS = SNTP_BURST_INTERVAL_S;
+    uint8_t     scratch[64];
+
+    void retry(uint64_t now)
+    {
+        nextUs = now + (uint64_t)backoffS * 1000000;
+        backoffS *= 2;
+        if (backoffS > SNTP_INTERVAL_S) backoffS = SNTP_INTERVAL_S;
+    }
+
+    // NTP timestamps: seconds since 1900 and a binary fraction, big-endian.
+    static uint64_t rawTimestamp(uint64_t us)
+    {
+        uint64_t seconds = us / 1000000 + SNTP_UNIX_OFFSET_S;
+        uint64_t fraction = ((us % 1000000) << 32) / 1000000;
+        return (seconds << 32) | fraction;
+    }
+
+    static void putTimestamp(uint8_t *p, uint64_t us)
+    {
+        uint64_t raw = rawTimestamp(us);
+        for (int i = 7; i >= 0; i--, raw >>= 8) p[i] = (uint8_t)raw;
+    }
+
+    static uint64_t getRaw(const uint8_t *p)
+    {
+        uint64_t raw = 0;
+        for (int i = 0; i < 8; i++) raw = (raw << 8) | p[i];
+        return raw;
+    }
+
+    static uint64_t getTimestamp(const uint8_t *p) // Back to Unix microseconds.
+    {
+        uint64_t raw = getRaw(p);
+        return ((raw >> 32) - SNTP_UNIX_OFFSET_S) * 1000000 + (((raw & 0xFFFFFFFFULL) * 1000000) >> 32);
+    }
+};
+
+#if defined(ESP32)
+#include <WiFi.h>
+#include <WiFiUdp.h>
+#include <esp_timer.h>
+
+inline uint64_t monotonicMicros() { return (uint64_t)esp_timer_get_time(); }
+
+//*****************************************************************************
+class WiFiSntpSocket : public SntpSocket
+{
+  public:
+    String host;
+
+    bool linkUp() override { return WiFi.status() == WL_CONNECTED; }
+
+    bool send(const uint8_t *data, size_t length) override
+    {
+        if (!bound) bound = udp.begin(0);
+        if (!server && !WiFi.hostByName(host.c_str(), server)) return false; // Blocks; we're in our own task.
+        if (!udp.beginPacket(server, SNTP_PORT)) return false;
+        udp.write(data, length);
+        bool sent = udp.endPacket();
+        if (!sent) server = IPAddress(); // Look it up again next time: pools move.
+        return sent;
+    }
+
+    int receive(uint8_t *buffer, size_t size) override
+    {
+        int length = udp.parsePacket();
+        if (length <= 0) return 0;
+        return udp.read(buffer, size);
+    }
+
+  private:
+    WiFiUDP   udp;
+    IPAddress server;
+    bool      bound = false;
+};
+
+//*****************************************************************************
+// SntpClient in its own task. Samples wait in a queue for poll().
+class SntpTask
+{
+  public:
+    SntpClient client;
+
+    void begin(const String &server)
+    {
+        socket.host = server;
+        samples     = xQueueCreate(2, sizeof(TimeSample));
+        client.begin(socket, monotonicMicros);
+        xTaskCreatePinnedToCore(task, "sntp", 3072, this, 1, nullptr, 0);
+    }
+
+    // From the main loop. True if a sample was applied.
+    bool poll(TimeService &time)
+    {
+        TimeSample sample;
+        bool       applied = false;
+        while (samples && (xQueueReceive(samples, &sample, 0) == pdTRUE)) applied |= time.sync(sample);
+        return applied;
+    }
+
+  private:
+    WiFiSntpSocket socket;
+    QueueHandle_t  samples = nullptr;
+
+    static void task(void *param)
+    {
+        SntpTask  *self = (SntpTask *)param;
+        TimeSample sample;
+
+        while (true) {
+            if (self->client.step(sample)) xQueueSend(self->samples, &sample, 0);
+            vTaskDelay(pdMS_TO_TICKS(self->client.waitMs()));
+        }
+    }
+};
+#endif // ESP32
+
+#endif //__DIGAME_TIME_H__
@@ -0,0 +1,311 @@
+/* digameUploader.h
+ *
+ *  Store-and-forward upload of counting events to the server.
+ *
+ *  Events are already durable in the flash event log, so that's what we
+ *  upload from: the uploader keeps a cursor (the next sequence number to
+ *  send), reads up to UPLOAD_BATCH_EVENTS records from the log and POSTs
+ *  them as one JSON document. The cursor only moves on once the server
+ *  accepts a batch. While the server or the network is down nothing is
+ *  lost -- the log keeps collecting and the backlog goes out when the link
+ *  comes back, oldest first. Events that age out of the log before they
+ *  can be sent are counted in eventsSkipped.
+ *
+ *  Failed posts back off exponentially (with jitter) from
+ *  UPLOAD_BACKOFF_MIN_MS up to UPLOAD_BACKOFF_MAX_MS. A partial batch waits
+ *  up to UPLOAD_LINGER_MS for more events so a burst goes in one request.
+ *
+ *  The cursor is saved to flash every UPLOAD_CURSOR_SAVE_MS, so a reboot
+ *  may resend a few events. Every event carries its sequence number; the
+ *  server can drop repeats.
+ *
+ *  UploadEngine is plain C++ and talks to the network through
+ *  UploadTransport. On the ESP32, Uploader runs it in its own task with an
+ *  HTTPClient transport that keeps the connection open between posts.
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#ifndef __DIGAME_UPLOADER_H__
+#define __DIGAME_UPLOADER_H__
+
+#include <digameDebug.h>
+#include <digameCRC.h>
+#include <digameEventLog.h>
+#include <FS.h>
+
+#define UPLOAD_BATCH_EVENTS    40
+#define UPLOAD_LINGER_MS       2000   // Max wait for a partial batch to fill.
+#define UPLOAD_IDLE_MS         250    // Poll interval with nothing to send.
+#define UPLOAD_BACKOFF_MIN_MS  1000
+#define UPLOAD_BACKOFF_MAX_MS  300000
+#define UPLOAD_CURSOR_SAVE_MS  30000
+#define UPLOAD_CURSOR_FILE     "/upload.cur"
+#define UPLOAD_PREFIX_SIZE     128
+#define UPLOAD_BODY_SIZE       (UPLOAD_PREFIX_SIZE + UPLOAD_BATCH_EVENTS * 96 + 8)
+
+//*****************************************************************************
+// How the engine reaches the server. post() returns the HTTP status code,
+// or zero / negative if no response came back.
+class UploadTransport
+{
+  public:
+    virtual ~UploadTransport() {}
+    virtual bool linkUp() = 0;
+    virtual int  post(const char *body, size_t length) = 0;
+};
+
+typedef uint32_t (*UploadClock)();
+
+class UploadEngine
+{
+  public:
+    uint32_t eventsSent     = 0;
+    uint32_t eventsSkipped  = 0; // Aged out of the log before they could be sent.
+    uint32_t posts          = 0;
+    uint32_t postFailures   = 0;
+    uint32_t failureStreak  = 0; // Failures since the last success.
+    uint32_t lastLatencyMs  = 0; // Duration of the last successful post.
+    uint32_t backoffMs      = 0; // Current retry delay. 0 when healthy.
+    int      lastStatus     = 0;
+
+    //*************************************************************************
+    // Pick up where the last boot left off. fileSystem may be null, in
+    // which case the cursor isn't persisted.
+    void begin(EventLog &eventLog, UploadTransport &link, fs::FS *fileSystem, UploadClock now)
+    {
+        log       = &eventLog;
+        transport = &link;
+        clock     = now;
+
+        position.begin(fileSystem, UPLOAD_CURSOR_FILE, eventLog);
+        if (prefixLength == 0) setDevice("", "");
+    }
+
+    //*************************************************************************
+    // The identifying fields that start every batch.
+    void setDevice(const char *deviceName, const char *deviceMAC)
+    {
+        char name[48], mac[24];
+        jsonEscape(deviceName, name, sizeof(name));
+        jsonEscape(deviceMAC, mac, sizeof(mac));
+        int n = snprintf(prefix, sizeof(prefix), "{\"deviceName\":\"%s\",\"deviceMAC\":\"%s\",\"events\":[",
+                         name, mac);
+        prefixLength = (n > 0) ? ((size_t)n < sizeof(prefix) ? n : sizeof(prefix) - 1) : 0;
+    }
+
+    //*************************************************************************
+    // Do one unit of work: at most one POST. Returns how long to wait, in
+    // ms, before calling again.
+    uint32_t step()
+    {
+        uint32_t now = clock();
+
+        if ((backoffMs > 0) && ((int32_t)(retryAtMs - now) > 0)) return retryAtMs - now;
+        if (!transport->linkUp()) return UPLOAD_IDLE_MS; // Nothing to try. Don't grow the backoff.
+
+        size_t n = log->read(position.seq, batch, UPLOAD_BATCH_EVENTS);
+        if (n == 0) {
+            lingering = false;
+            position.service(now, UPLOAD_CURSOR_SAVE_MS);
+            return UPLOAD_IDLE_MS;
+        }
+
+        if (batch[0].seq > position.seq) { // Older ones have left the log.
+            eventsSkipped += batch[0].seq - position.seq;
+            position.seq   = batch[0].seq;
+        }
+
+        if ((n < UPLOAD_BATCH_EVENTS) && (backoffMs == 0)) { // Give a burst a moment to arrive.
+            if (!lingering) {
+                lingering     = true;
+                lingerStartMs = now;
+            }
+            if (now - lingerStartMs < UPLOAD_LINGER_MS) return UPLOAD_IDLE_MS;
+        }
+
+        size_t length = buildBody(n); // May trim n to what fits.
+        posts++;
+        uint32_t start = clock();
+        lastStatus = transport->post(body, length);
+
+        if (((lastStatus >= 200) && (lastStatus < 300)) || (lastStatus == 303)) {
+            lastLatencyMs = clock() - start;
+            eventsSent   += n;
+            position.seq  = batch[n - 1].seq + 1;
+            failureStreak = 0;
+            backoffMs     = 0;
+            lingering     = false;
+            position.service(clock(), UPLOAD_CURSOR_SAVE_MS);
+            return 0; // There may be more backlog. Go straight on.
+        }
+
+        postFailures++;
+        failureStreak++;
+        backoffMs = (backoffMs == 0) ? UPLOAD_BACKOFF_MIN_MS : backoffMs * 2;
+        if (backoffMs > UPLOAD_BACKOFF_MAX_MS) backoffMs = UPLOAD_BACKOFF_MAX_MS;
+
+        // +/-25% so a fleet coming back from the same outage doesn't retry in step.
+        uint32_t wait = backoffMs - backoffMs / 4 + (uint32_t)(rand() % (backoffMs / 2 + 1));
+        retryAtMs     = clock() + wait;
+        return wait;
+    }
+
+    //*************************************************************************
+    // Events logged but not yet accepted by the server.
+    uint32_t backlog()
+    {
+        uint32_t newest = log ? log->newestSeq() : 0;
+        uint32_t next   = position.seq;
+        return (newest >= next) ? newest - next + 1 : 0;
+    }
+
+    uint32_t cursor() { return position.seq; }
+
+    // Save the cursor now. Call before a deliberate reboot.
+    void saveCursor() { position.save(); }
+
+  private:
+    EventLog        *log          = nullptr;
+    UploadTransport *transport    = nullptr;
+    UploadClock      clock        = nullptr;
+    EventCursor      position;     // Next event to send.
+    uint32_t         retryAtMs    = 0;
+    uint32_t         lingerStartMs = 0;
+    bool             lingering    = false;
+    char             prefix[UPLOAD_PREFIX_SIZE];
+    size_t           prefixLength = 0;
+    EventRecord      batch[UPLOAD_BATCH_EVENTS];
+    char             body[UPLOAD_BODY_SIZE];
+
+    // {"deviceName":"..","deviceMAC":"..","events":[{"seq":..,..},..]}
+    size_t buildBody(size_t &n)
+    {
+        memcpy(body, prefix, prefixLength);
+        size_t length = prefixLength;
+
+        for (size_t i = 0; i < n; i++) {
+            size_t room  = sizeof(body) - length - 4; // Keep space for "," and "]}".
+            int    added = eventToJSON(batch[i], body + length + (i ? 1 : 0), room);
+            if ((added < 0) || ((size_t)added >= room)) { // Doesn't fit. Send it next time.
+                n = i;
+                break;
+            }
+            if (i) body[length++] = ',';
+            length += added;
+        }
+        length += snprintf(body + length, sizeof(body) - length, "]}");
+        return length;
+    }
+
+    // Copy text into a JSON string body, dropping anything that would need escaping.
+    static void jsonEscape(const char *in, char *out, size_t size)
+    {
+        size_t j = 0;
+        for (size_t i = 0; in[i] && (j + 1 < size); i++) {
+            if ((in[i] == '"') || (in[i] == '\\') || ((uint8_t)in[i] < 0x20)) continue;
+            out[j++] = in[i];
+        }
+        out[j] = 0;
+    }
+};
+
+#if defined(ESP32)
+#include <WiFi.h>
+#include <HTTPClient.h>
+
+//*****************************************************************************
+// POSTs over one kept-alive connection. HTTPClient leaves the socket open
+// after end() when reuse is on, and begin() picks it up again for the same
+// host.
+class HttpUploadTransport : public UploadTransport
+{
+  public:
+    String url;
+
+    bool linkUp() override { return WiFi.status() == WL_CONNECTED; }
+
+    int post(const char *body, size_t length) override
+    {
+        http.setReuse(true);
+        http.setConnectTimeout(5000);
+        http.setTimeout(10000);
+        if (!http.begin(client, url)) return -1;
+        http.addHeader("Content-Type", "application/json");
+        int status = http.POST((uint8_t *)body, length);
+        http.end();
+        return status;
+    }
+
+  private:
+    WiFiClient client;
+    HTTPClient http;
+};
+
+//*****************************************************************************
+// Runs the engine in its own task so a slow or dead server never holds up
+// the main loop.
+class Uploader
+{
+  public:
+    UploadEngine engine;
+
+    void begin(EventLog &eventLog, fs::FS *fileSystem, const String &serverURL)
+    {
+        transport.url = serverURL;
+        engine.begin(eventLog, transport, fileSystem, []() -> uint32_t { return millis(); });
+        xTaskCreatePinnedToCore(task, "uploader", 6144, this, 1, nullptr, 0);
+    }
+
+    // Save the place in the log and stop for good, e.g. before the file
+    // system is unmounted. stopped() says when it has.
+    void stop() { stopping = true; }
+    bool stopped() { return halted; }
+
+    // Safe to call from the main loop at any time.
+    void setDevice(const String &deviceName, const String &deviceMAC)
+    {
+        portENTER_CRITICAL(&mux);
+        strncpy(pendingName, deviceName.c_str(), sizeof(pendingName) - 1);
+        strncpy(pendingMAC, deviceMAC.c_str(), sizeof(pendingMAC) - 1);
+        deviceChanged = true;
+        portEXIT_CRITICAL(&mux);
+    }
+
+  private:
+    HttpUploadTransport transport;
+    portMUX_TYPE        mux = portMUX_INITIALIZER_UNLOCKED;
+    char                pendingName[48] = {0};
+    char                pendingMAC[24]  = {0};
+    bool                deviceChanged   = false;
+    volatile bool       stopping        = false;
+    volatile bool       halted          = false;
+
+    static void task(void *param)
+    {
+        Uploader *self = (Uploader *)param;
+
+        while (true) {
+            if (self->stopping) { // Between steps, so nothing is half done.
+                self->engine.saveCursor();
+                self->halted = true;
+                vTaskDelete(nullptr);
+            }
+            if (self->deviceChanged) {
+                char name[48], mac[24];
+                portENTER_CRITICAL(&self->mux);
+                memcpy(name, self->pendingName, sizeof(name));
+                memcpy(mac, self->pendingMAC, sizeof(mac));
+                self->deviceChanged = false;
+                portEXIT_CRITICAL(&self->mux);
+                self->engine.setDevice(name, mac);
+            }
+
+            uint32_t wait = self->engine.step();
+            vTaskDelay(pdMS_TO_TICKS(wait > 0 ? wait : 1));
+        }
+    }
+};
+#endif // ESP32
+
+#endif //__DIGAME_UPLOADER_H__
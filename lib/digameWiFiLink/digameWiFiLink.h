@@ -0,0 +1,211 @@
+/* digameWiFiLink.h
+ *
+ *  Keeps the WiFi station link up without ever waiting on it.
+ *
+ *  WiFiLink is a small state machine driven from the main loop by
+ *  service(), which only looks at flags and the clock and returns at once:
+ *
+ *    DISABLED   -> enable()                       -> CONNECTING
+ *    CONNECTING -> radio reports connected        -> CONNECTED
+ *               -> WIFI_CONNECT_TIMEOUT_MS passes -> BACKOFF
+ *    CONNECTED  -> link lost                      -> CONNECTING (at once)
+ *    BACKOFF    -> retry time reached             -> CONNECTING
+ *
+ *  Each failed attempt doubles the wait, from WIFI_BACKOFF_MIN_MS to
+ *  WIFI_BACKOFF_MAX_MS; a successful connect resets it. Connect latency
+ *  and counts of attempts, failures and drops are kept for health reports.
+ *
+ *  The radio is reached through WiFiRadio, so the logic runs anywhere.
+ *  EspWiFiRadio is the ESP32 one: it starts WiFi.begin() and returns, and
+ *  the WiFi event handler tells the link when the connection comes or goes.
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#ifndef __DIGAME_WIFI_LINK_H__
+#define __DIGAME_WIFI_LINK_H__
+
+#include <stdint.h>
+
+#define WIFI_CONNECT_TIMEOUT_MS 15000
+#define WIFI_BACKOFF_MIN_MS     2000
+#define WIFI_BACKOFF_MAX_MS     120000
+
+enum WiFiLinkState {
+    WIFI_LINK_DISABLED,
+    WIFI_LINK_CONNECTING,
+    WIFI_LINK_CONNECTED,
+    WIFI_LINK_BACKOFF
+};
+
+//*****************************************************************************
+// The radio operations the link needs. None of them may block.
+class WiFiRadio
+{
+  public:
+    virtual ~WiFiRadio() {}
+    virtual void startConnect() = 0; // Begin an attempt. The result arrives later.
+    virtual void stopConnect()  = 0; // Abandon an attempt or drop the link.
+    virtual bool isConnected()  = 0;
+};
+
+class WiFiLink
+{
+  public:
+    uint32_t attempts         = 0;
+    uint32_t connects         = 0;
+    uint32_t failures         = 0; // Attempts that timed out.
+    uint32_t drops            = 0; // Connected links that went away.
+    uint32_t lastConnectMs    = 0; // Latency of the most recent successful attempt.
+    uint32_t maxConnectMs     = 0;
+    uint32_t totalConnectMs   = 0; // For the average: totalConnectMs / connects.
+    uint32_t backoffMs        = 0;
+
+    void begin(WiFiRadio &r, uint32_t nowMs)
+    {
+        radio = &r;
+        enable(nowMs);
+    }
+
+    void enable(uint32_t nowMs)
+    {
+        if (state != WIFI_LINK_DISABLED) return;
+        backoffMs = 0;
+        startAttempt(nowMs);
+    }
+
+    void disable()
+    {
+        if (radio && (state != WIFI_LINK_DISABLED)) radio->stopConnect();
+        state = WIFI_LINK_DISABLED;
+    }
+
+    //*************************************************************************
+    // Radio events. Safe to call from another task: they only set flags.
+    void onConnected()    { connectedEvent = true; }
+    void onDisconnected() { disconnectedEvent = true; }
+
+    //*************************************************************************
+    // Call from the main loop as often as you like. Never waits.
+    void service(uint32_t nowMs)
+    {
+        bool up   = connectedEvent;
+        bool down = disconnectedEvent;
+        connectedEvent    = false;
+        disconnectedEvent = false;
+
+        switch (state) {
+        case WIFI_LINK_CONNECTING:
+            if (up || radio->isConnected()) {
+                lastConnectMs   = nowMs - attemptStartMs;
+                totalConnectMs += lastConnectMs;
+                if (lastConnectMs > maxConnectMs) maxConnectMs = lastConnectMs;
+                connects++;
+                backoffMs      = 0;
+                connectedAtMs  = nowMs;
+                state          = WIFI_LINK_CONNECTED;
+            } else if (nowMs - attemptStartMs >= WIFI_CONNECT_TIMEOUT_MS) {
+                failures++;
+                radio->stopConnect();
+                backoffMs = (backoffMs == 0) ? WIFI_BACKOFF_MIN_MS : backoffMs * 2;
+                if (backoffMs > WIFI_BACKOFF_MAX_MS) backoffMs = WIFI_BACKOFF_MAX_MS;
+                retryAtMs = nowMs + backoffMs;
+                state     = WIFI_LINK_BACKOFF;
+            }
+            break;
+
+        case WIFI_LINK_CONNECTED:
+            if (down || !radio->isConnected()) {
+                drops++;
+                radio->stopConnect();
+                startAttempt(nowMs); // The AP was there a moment ago. Try again straight away.
+            }
+            break;
+
+        case WIFI_LINK_BACKOFF:
+            if ((int32_t)(nowMs - retryAtMs) >= 0) startAttempt(nowMs);
+            break;
+
+        case WIFI_LINK_DISABLED:
+            break;
+        }
+    }
+
+    WiFiLinkState getState() { return state; }
+    bool          connected() { return state == WIFI_LINK_CONNECTED; }
+
+    // How long the link has been up, or 0.
+    uint32_t upTimeMs(uint32_t nowMs) { return connected() ? nowMs - connectedAtMs : 0; }
+
+    static const char *stateName(WiFiLinkState s)
+    {
+        switch (s) {
+        case WIFI_LINK_CONNECTING: return "connecting";
+        case WIFI_LINK_CONNECTED:  return "connected";
+        case WIFI_LINK_BACKOFF:    return "backoff";
+        default:                   return "disabled";
+        }
+    }
+
+  private:
+    WiFiRadio        *radio             = nullptr;
+    WiFiLinkState     state             = WIFI_LINK_DISABLED;
+    uint32_t          attemptStartMs    = 0;
+    uint32_t          retryAtMs         = 0;
+    uint32_t          connectedAtMs     = 0;
+    volatile bool     connectedEvent    = false;
+    volatile bool     disconnectedEvent = false;
+
+    void startAttempt(uint32_t nowMs)
+    {
+        disconnectedEvent = false; // Left over from the link we're replacing.
+        attempts++;
+        attemptStartMs = nowMs;
+        state          = WIFI_LINK_CONNECTING;
+        radio->startConnect();
+    }
+};
+
+#if defined(ESP32)
+#include <WiFi.h>
+
+//*****************************************************************************
+// Station mode on the ESP32's own radio. Leaves any access point alone.
+class EspWiFiRadio : public WiFiRadio
+{
+  public:
+    String ssid;
+    String password;
+    String hostName;
+
+    // Route the station's connect / disconnect events to the link.
+    void attach(WiFiLink &link)
+    {
+        static WiFiLink *target = nullptr;
+        target = &link;
+        WiFi.setAutoReconnect(false); // The link does its own retries, with backoff.
+        WiFi.onEvent([](WiFiEvent_t event, WiFiEventInfo_t info) {
+#if defined(ESP_ARDUINO_VERSION_MAJOR) && (ESP_ARDUINO_VERSION_MAJOR >= 2)
+            if (event == ARDUINO_EVENT_WIFI_STA_GOT_IP)       target->onConnected();
+            if (event == ARDUINO_EVENT_WIFI_STA_DISCONNECTED) target->onDisconnected();
+#else
+            if (event == SYSTEM_EVENT_STA_GOT_IP)             target->onConnected();
+            if (event == SYSTEM_EVENT_STA_DISCONNECTED)       target->onDisconnected();
+#endif
+        });
+    }
+
+    void startConnect() override
+    {
+        String name = hostName;
+        name.replace(" ", "_");
+        WiFi.setHostname(name.c_str());
+        WiFi.begin(ssid.c_str(), password.c_str()); // Returns straight away.
+    }
+
+    void stopConnect() override { WiFi.disconnect(false, false); }
+    bool isConnected() override { return WiFi.status() == WL_CONNECTED; }
+};
+#endif // ESP32
+
+#endif //__DIGAME_WIFI_LINK_H__
@@ -1,4 +1,5 @@
 #include <Arduino.h>
+#include <memory>
 
 /*
     This program uses a pair of TFMini-plus LIDARs to count people boarding /
@@ -34,6 +35,27 @@
 #include <digameFile.h>       // Read/Write Text files.
 #include <digameNetwork_v2.h> // For MAC address functions
 #include <credentials.h>      // network name, pw, etc.
+#include <digameLineInput.h>  // Non-blocking line assembly for the consoles.
+#include <digameCommands.h>   // Table-driven console commands.
+#include <digameControl.h>    // Binary request/response protocol for machine clients.
+#include <digameEventQueue.h> // Events held until a client acknowledges them.
+#include <digameEventLog.h>   // Durable event log on flash.
+#include <digameConfig.h>     // Settings in one CRC-checked binary record.
+#include <digameCheckpoint.h> // Counts saved to flash so they survive a reboot.
+#include <digameCapture.h>    // Raw frame capture to flash for diagnostics.
+#include <digameAggregates.h> // Per-minute/hour/day totals.
+#include <digameUploader.h>   // Batched, store-and-forward upload to the server.
+#include <digameWiFiLink.h>   // Non-blocking WiFi station connect/reconnect.
+#include <digameMQTT.h>       // Events, counts and health to an MQTT broker.
+#include <digameLive.h>       // Live counts and distances for the web page.
+#include <digameRest.h>       // Streams event-log pages for the JSON API.
+#include <digameAssets.h>     // Gzipped web assets with ETags.
+#include <digameTemplate.h>   // index.html, parsed once and rendered from a cache.
+#include <digameMetrics.h>    // Lock-free counters and the /metrics page.
+#include <digameTime.h>       // UTC from SNTP or the host, corrected for drift.
+#include <digameResumableOTA.h> // Chunked firmware updates that survive a dropped link.
+#include <digameSha256.h>     // SHA-256 on the ESP32's engine, for the [h]ash speed test.
+#include <digamePowerMgt.h>   // Slower frames and CPU while the doorway is empty.
 
 #include <BluetoothSerial.h>  // Part of the ESP32 board package. 
                               // By Evandro Copercini - 2018
@@ -51,10 +73,24 @@ DualLIDAR dL;
 
 bool useOTA = true; 
 
+const char *FIRMWARE_VERSION = "1.0";
+
 //****************************************************************************************
 //****************************************************************************************                        
 // Create AsyncWebServer object on port 80
 AsyncWebServer server(80);
+LiveServer     liveServer("/live"); // WebSocket feed for the page's live view.
+WebAssetHandler webAssets(SPIFFS, "admin", "admin");
+TemplateHandler indexPage("/index.html", "admin", "admin");
+ResumableOtaServer resumableOta; // /update/resume, /update/chunk and /update/finish.
+
+struct ConfigChange                 // A settings change from the web API, for the main
+{                                   // loop to apply.
+  uint8_t key;                      // CONFIG_KEY_...
+  float   number;
+  char    text[CONFIG_NAME_LENGTH];
+};
+QueueHandle_t  configChanges = nullptr;
 
 BluetoothSerial btUART; // Create a BlueTooth Serial Port Object
 
@@ -74,6 +110,8 @@ unsigned int inCount  = 0;
 unsigned int outCount = 0;
 
 String deviceName        = "Entrance 1";
+char   webDeviceName[CONFIG_NAME_LENGTH];   // Copy for the web server's task. The loop
+portMUX_TYPE webNameLock = portMUX_INITIALIZER_UNLOCKED; // changes deviceName under it.
 float  distanceThreshold = 160;
 float  smoothingFactor   = 0.95;
 
@@ -81,9 +119,79 @@ bool streamingRawData = false;
 bool menuActive       = false;
 bool clearDataFlag    = false; 
 
+MetricCounter lidarFrames = 0; // Good reads from the sensor pair.
+MetricCounter lidarErrors = 0; // Failed reads.
+
+const uint32_t  LOOP_TIME_BOUNDS_US[] = { 250, 500, 1000, 2000, 5000, 10000, 20000, 50000, 100000, 250000 };
+MetricHistogram loopTime(LOOP_TIME_BOUNDS_US, sizeof(LOOP_TIME_BOUNDS_US) / sizeof(LOOP_TIME_BOUNDS_US[0]));
+
+PowerPolicy powerPolicy; // Steps the frame rate and CPU clock down while nobody comes through.
+
 String jsonPayload;
 String jsonPrefix;  
 
+//****************************************************************************************
+// User input is assembled a byte at a time from each console so that typing never stalls 
+// the counting loop. Commands that need a value leave that console waiting for its next
+// line; the other console carries on as normal.
+// Binary control frames share the same links; the decoder picks them out before the 
+// line assembler sees anything.
+//****************************************************************************************
+const int MAX_INPUT_BYTES_PER_POLL = 64; // Bound the time spent reading input per loop.
+
+struct Console {
+  Stream         &stream;
+  LineAssembler   line;
+  ControlDecoder  control;
+  const Command  *pendingCommand = nullptr; // Command waiting on a value from this console.
+
+  Console(Stream &s) : stream(s) {}
+};
+
+Console        serialConsole(Serial);
+Console        btConsole(btUART);
+
+//****************************************************************************************
+// Every event is queued with a sequence number and pushed to the subscribed client in 
+// batches. Events stay queued until acknowledged and are replayed after a timeout or a 
+// Bluetooth reconnect.
+//****************************************************************************************
+const uint32_t MAX_EVENTS_IN_FLIGHT = 64; // Sent but unacknowledged before we hold off.
+
+EventQueue     eventQueue;
+Console       *eventSubscriber     = nullptr; // Link that asked for events, if any.
+unsigned long  lastEventActivityMs = 0;       // Last batch sent or acknowledgement received.
+bool           btWasConnected      = false;
+
+EventLog       eventLog;          // Every event also goes to flash.
+bool           fileSystemMounted = false;
+volatile bool  fileSystemWanted   = false; // A filesystem upload is waiting for SPIFFS...
+volatile bool  fileSystemReleased = false; // ...and the loop has stopped its writers and unmounted it.
+const uint32_t FS_RELEASE_WAIT_MS = 3000;  // Longest the upload waits for that.
+
+ConfigStore    configStore;       // Backing store for the settings above.
+
+CountCheckpoint countCheckpoint;
+uint16_t       checkpointSeconds = 60; // Worst case counts lost to a brownout...
+uint16_t       checkpointEvents  = 20; // ...traded against flash writes.
+
+FrameCapture   frameCapture;      // Raw frames to /capture.bin. Off until asked for.
+
+Uploader       uploader;          // Sends the event log to serverURL from its own task.
+
+EspWiFiRadio   wifiRadio;
+WiFiLink       wifiLink;          // Brings the station link up and keeps it up.
+
+NetworkConfig  netConfig;         // Filled in from credentials.h.
+MqttPublisher  mqttPublisher;     // Only started if netConfig.mqttBroker is set.
+
+CountAggregates countAggregates;
+uint32_t       minuteOrigin = 0;  // Aggregate minute number at boot. Until the clock is set
+                                  // we carry on from where the last boot left off.
+
+TimeService    timeService;       // UTC for events, frames and aggregates, once synced.
+SntpTask       sntp;              // Syncs it over WiFi.
+
 //****************************************************************************************
 // Overloading print and println to send messages to both serial and bluetooth connections
 // There must be a better way to do this with a #define... 
@@ -97,21 +205,172 @@ void   dualPrint(int i);
 
 
 void   loadDefaults();
+void   saveSettings();
+void   restoreCounts();
+void   checkpointCounts();
+bool   releaseFileSystem();
+void   serviceFileSystemRelease();
+void   restoreAggregates();
+uint32_t aggregateMinute();
+bool     aggregatesWaitForClock();
+void   serviceClock();
+int64_t captureUtcOffset(uint32_t timeMs);
+size_t formatCountsJSON(char *buffer, size_t size);
+size_t formatHealthJSON(char *buffer, size_t size);
+size_t formatConfigJSON(char *buffer, size_t size);
+void   publishDeviceName();
+void   copyDeviceName(char *buffer, size_t size);
 
 void   showSplashScreen();
 void   showMenu();
 
-String getUserInput();
+bool   pollConsole(Console &console);
+void   handleControlFrame(Console &console);
+void   serviceEventDelivery();
 void   scanForUserInput();
+void   processLine(Console &console);
 void   handleEvent(int eventType);
+void   recordEvent(int eventType, unsigned int count);
 
 void   configureWiFi();
 void   configureBluetooth();
 void   configureLIDARs();
 void   configureOTA();
+void   configureRestApi();
+void   configureIndexPage();
+void   serviceRestApi();
 
 void   buildJSONPrefix();
 
+void   applyDeviceName(const char *name);
+void   applyThreshold(float threshold);
+void   applySmoothing(float smoothing);
+void   applyCheckpointSeconds(uint16_t seconds);
+void   applyCheckpointEvents(uint16_t events);
+void   applyPowerLevel(const PowerLevel &level);
+void   serviceHashSpeed();
+
+// Console command handlers
+void   cmdMenuOn(const CommandArg &arg);
+void   cmdMenuOff(const CommandArg &arg);
+void   cmdClearCounts(const CommandArg &arg);
+void   cmdSetThreshold(const CommandArg &arg);
+void   cmdSetCheckpoint(const CommandArg &arg);
+void   cmdSetCheckpointEvents(const CommandArg &arg);
+void   cmdGetCounts(const CommandArg &arg);
+void   cmdHashSpeed(const CommandArg &arg);
+void   cmdSetName(const CommandArg &arg);
+void   cmdTogglePower(const CommandArg &arg);
+void   cmdToggleRaw(const CommandArg &arg);
+void   cmdSetSmoothing(const CommandArg &arg);
+void   cmdReboot(const CommandArg &arg);
+void   cmdSetCapture(const CommandArg &arg);
+void   cmdSetCaptureAfter(const CommandArg &arg);
+
+void   describeName(char *buffer, size_t bufferSize);
+void   describeThreshold(char *buffer, size_t bufferSize);
+void   describeSmoothing(char *buffer, size_t bufferSize);
+void   describePower(char *buffer, size_t bufferSize);
+void   describeRaw(char *buffer, size_t bufferSize);
+void   describeCheckpoint(char *buffer, size_t bufferSize);
+void   describeCheckpointEvents(char *buffer, size_t bufferSize);
+void   describeCapture(char *buffer, size_t bufferSize);
+void   describeCaptureAfter(char *buffer, size_t bufferSize);
+
+bool   parseThreshold(const char *text, CommandArg &arg);
+bool   parseSmoothing(const char *text, CommandArg &arg);
+bool   parseCheckpoint(const char *text, CommandArg &arg);
+bool   parseCheckpointEvents(const char *text, CommandArg &arg);
+bool   parseCaptureMode(const char *text, CommandArg &arg);
+bool   parseCaptureAfter(const char *text, CommandArg &arg);
+
+
+//****************************************************************************************
+// The console commands. Add new commands here -- keep the table sorted by name. The menu
+// is drawn from this table in the same order.
+//****************************************************************************************
+constexpr Command commands[] = {
+//  name  help                     prompt                             parser          handler          describe           flags
+  { "+",  "[+]Menu Active",        nullptr,                           nullptr,        cmdMenuOn,       nullptr,           0             },
+  { "-",  "[-]Menu Inactive",      nullptr,                           nullptr,        cmdMenuOff,      nullptr,           0             },
+  { "a",  "capture [a]fter secs",  " Enter Seconds Kept After a Trigger. ",parseCaptureAfter,cmdSetCaptureAfter,describeCaptureAfter,0   },
+  { "c",  "[c]lear count data",    nullptr,                           nullptr,        cmdClearCounts,  nullptr,           0             },
+  { "d",  "[d]istance threshold",  " Enter New Distance Threshold. ", parseThreshold, cmdSetThreshold, describeThreshold, 0             },
+  { "e",  "checkpoint [e]vents",   " Enter New Checkpoint Event Count. ",parseCheckpointEvents,cmdSetCheckpointEvents,describeCheckpointEvents,0 },
+  { "f",  "[f]rame capture",       " Enter 0=Off 1=Continuous 2=Freeze. ",parseCaptureMode,cmdSetCapture,describeCapture,0           },
+  { "g",  "[g]et count data",      nullptr,                           nullptr,        cmdGetCounts,    nullptr,           COMMAND_QUIET },
+  { "h",  "[h]ash speed",          nullptr,                           nullptr,        cmdHashSpeed,    nullptr,           0             },
+  { "k",  "chec[k]point (secs)",   " Enter New Checkpoint Interval. ",parseCheckpoint,cmdSetCheckpoint,describeCheckpoint,0             },
+  { "n",  "[n]ame",                " Enter New Device Name. ",        parseTextArg,   cmdSetName,      describeName,      0             },
+  { "p",  "[p]ower saving",        nullptr,                           nullptr,        cmdTogglePower,  describePower,     0             },
+  { "r",  "[r]aw data stream",     nullptr,                           nullptr,        cmdToggleRaw,    describeRaw,       0             },
+  { "s",  "[s]moothing factor",    " Enter New Smoothing Factor. ",   parseSmoothing, cmdSetSmoothing, describeSmoothing, 0             },
+  { "x",  "[x]eXit and reboot",    nullptr,                           nullptr,        cmdReboot,       nullptr,           0             },
+};
+
+const size_t NUM_COMMANDS = sizeof(commands) / sizeof(commands[0]);
+static_assert(commandTableSorted(commands, NUM_COMMANDS), "Console command table must be sorted by name");
+
+
+//****************************************************************************************
+// What /metrics reports. Keep a family's entries together; see digameMetrics.h. Values
+// read in place are only ever written by one task. The rest are worked out per scrape.
+//****************************************************************************************
+const Metric metricsTable[] = {
+//  name                                  help                                                type              labels                value: a variable, a function or a histogram
+  { "digame_count_total",                 "People counted, by direction.",                    METRIC_COUNTER,   "direction=\"in\"",   nullptr, []() -> uint32_t { return inCount; } },
+  { "digame_count_total",                 "",                                                 METRIC_COUNTER,   "direction=\"out\"",  nullptr, []() -> uint32_t { return outCount; } },
+  { "digame_lidar_frames_total",          "Good frames read from each sensor.",               METRIC_COUNTER,   "sensor=\"1\"",       &dL.frames[0] },
+  { "digame_lidar_frames_total",          "",                                                 METRIC_COUNTER,   "sensor=\"2\"",       &dL.frames[1] },
+  { "digame_lidar_checksum_errors_total", "Frames that failed their checksum.",               METRIC_COUNTER,   "sensor=\"1\"",       &dL.checksumErrors[0] },
+  { "digame_lidar_checksum_errors_total", "",                                                 METRIC_COUNTER,   "sensor=\"2\"",       &dL.checksumErrors[1] },
+  { "digame_lidar_read_errors_total",     "Other failed reads: no header, timeouts.",         METRIC_COUNTER,   "sensor=\"1\"",       &dL.readErrors[0] },
+  { "digame_lidar_read_errors_total",     "",                                                 METRIC_COUNTER,   "sensor=\"2\"",       &dL.readErrors[1] },
+  { "digame_lidar_frames_missed_total",   "Frames that went by unread, from the gaps.",       METRIC_COUNTER,   "sensor=\"1\"",       &dL.framesMissed[0] },
+  { "digame_lidar_frames_missed_total",   "",                                                 METRIC_COUNTER,   "sensor=\"2\"",       &dL.framesMissed[1] },
+  { "digame_lidar_rate_changes_total",    "Frame rate changes both sensors acknowledged.",    METRIC_COUNTER,   nullptr,              &dL.rateChanges },
+  { "digame_lidar_rate_retries_total",    "Frame rate commands sent again: no reply yet.",    METRIC_COUNTER,   nullptr,              &dL.rateRetries },
+  { "digame_lidar_rate_changes_lost_total","Frame rate changes a sensor never answered.",      METRIC_COUNTER,   nullptr,              &dL.rateChangesLost },
+  { "digame_loop_seconds",                "Time round the main loop.",                        METRIC_HISTOGRAM, nullptr,              nullptr, nullptr, &loopTime },
+  { "digame_uptime_seconds",              "Time since boot.",                                 METRIC_GAUGE,     nullptr,              nullptr, []() -> uint32_t { return millis() / 1000; } },
+  { "digame_heap_free_bytes",             "Free heap.",                                       METRIC_GAUGE,     nullptr,              nullptr, []() -> uint32_t { return ESP.getFreeHeap(); } },
+  { "digame_heap_min_free_bytes",         "Least free heap since boot.",                      METRIC_GAUGE,     nullptr,              nullptr, []() -> uint32_t { return ESP.getMinFreeHeap(); } },
+  { "digame_event_queue_unacked",         "Events sent to the console client and not acked.", METRIC_GAUGE,     nullptr,              nullptr, []() -> uint32_t { return eventQueue.unacked(); } },
+  { "digame_event_queue_dropped_total",   "Unacked events lost to queue overflow.",           METRIC_COUNTER,   nullptr,              &eventQueue.dropped },
+  { "digame_event_log_flushes_total",     "Event log writes to flash.",                       METRIC_COUNTER,   nullptr,              &eventLog.flushes },
+  { "digame_event_log_write_errors_total","Event log writes that failed.",                    METRIC_COUNTER,   nullptr,              &eventLog.writeErrors },
+  { "digame_upload_backlog",              "Logged events not yet uploaded.",                  METRIC_GAUGE,     nullptr,              nullptr, []() -> uint32_t { return uploader.engine.backlog(); } },
+  { "digame_upload_events_total",         "Events uploaded.",                                 METRIC_COUNTER,   nullptr,              &uploader.engine.eventsSent },
+  { "digame_upload_posts_total",          "Upload POSTs, by result.",                         METRIC_COUNTER,   "result=\"ok\"",      nullptr, []() -> uint32_t { return uploader.engine.posts - uploader.engine.postFailures; } },
+  { "digame_upload_posts_total",          "",                                                 METRIC_COUNTER,   "result=\"fail\"",    &uploader.engine.postFailures },
+  { "digame_upload_latency_ms",           "Duration of the last successful upload.",          METRIC_GAUGE,     nullptr,              &uploader.engine.lastLatencyMs },
+  { "digame_mqtt_backlog",                "Logged events not yet published.",                 METRIC_GAUGE,     nullptr,              nullptr, []() -> uint32_t { return mqttPublisher.engine.backlog(); } },
+  { "digame_mqtt_connects_total",         "Connections made to the broker.",                  METRIC_COUNTER,   nullptr,              &mqttPublisher.engine.client.connects },
+  { "digame_mqtt_drops_total",            "Broker connections lost.",                         METRIC_COUNTER,   nullptr,              &mqttPublisher.engine.client.drops },
+  { "digame_wifi_state",                  "0 disabled, 1 connecting, 2 connected, 3 backoff.",METRIC_GAUGE,     nullptr,              nullptr, []() -> uint32_t { return wifiLink.getState(); } },
+  { "digame_wifi_drops_total",            "WiFi station links lost.",                         METRIC_COUNTER,   nullptr,              &wifiLink.drops },
+  { "digame_live_batches_dropped_total",  "Raw batches live clients were too slow for.",      METRIC_COUNTER,   nullptr,              &liveServer.push.batchesDropped },
+  { "digame_time_syncs_total",            "Clock syncs taken, from SNTP or the host.",        METRIC_COUNTER,   nullptr,              &timeService.syncs },
+  { "digame_time_steps_total",            "Syncs that found the clock over a second out.",    METRIC_COUNTER,   nullptr,              &timeService.steps },
+  { "digame_time_rewinds_total",          "Steps back to a more trusted source's time.",      METRIC_COUNTER,   nullptr,              &timeService.rewinds },
+  { "digame_aggregate_held_dropped_total","Counts lost waiting for the clock after a reboot.",METRIC_COUNTER,   nullptr,              &countAggregates.heldDropped },
+  { "digame_ota_frames_missed_total",     "Frames missed while updates were written.",        METRIC_COUNTER,   nullptr,              &AsyncElegantOTA.flash.scheduler.framesMissed },
+  { "digame_ota_flash_ops_total",         "Flash erases and writes for updates.",             METRIC_COUNTER,   "op=\"erase\"",       &AsyncElegantOTA.flash.scheduler.erases },
+  { "digame_ota_flash_ops_total",         "",                                                 METRIC_COUNTER,   "op=\"write\"",       &AsyncElegantOTA.flash.scheduler.writes },
+  { "digame_ota_forced_erases_total",     "Update erases made with someone in view.",         METRIC_COUNTER,   nullptr,              &AsyncElegantOTA.flash.scheduler.forcedErases },
+  { "digame_power_level",                 "0 active, 1 idle, 2 parked.",                      METRIC_GAUGE,     nullptr,              nullptr, []() -> uint32_t { return powerPolicy.levelIndex(); } },
+  { "digame_power_level_seconds_total",   "Time spent at each power level.",                  METRIC_COUNTER,   "level=\"active\"",   &powerPolicy.levelSeconds[0] },
+  { "digame_power_level_seconds_total",   "",                                                 METRIC_COUNTER,   "level=\"idle\"",     &powerPolicy.levelSeconds[1] },
+  { "digame_power_level_seconds_total",   "",                                                 METRIC_COUNTER,   "level=\"parked\"",   &powerPolicy.levelSeconds[2] },
+  { "digame_power_energy_joules_total",   "Energy used, from the levels' estimated draw.",    METRIC_COUNTER,   nullptr,              &powerPolicy.joules },
+  { "digame_power_energy_last_hour_mwh",  "Energy used over the last whole hour.",            METRIC_GAUGE,     nullptr,              &powerPolicy.lastHourMilliwattHours },
+  { "digame_power_wakes_total",           "Returns to full rate from a lower level.",         METRIC_COUNTER,   nullptr,              &powerPolicy.wakes },
+  { "digame_power_wake_seconds",          "Waking frame to the first at full rate.",          METRIC_HISTOGRAM, nullptr,              nullptr, nullptr, &powerPolicy.wakeLatency },
+  { "digame_control_crc_errors_total",    "Control frames with a bad CRC.",                   METRIC_COUNTER,   nullptr,              nullptr, []() -> uint32_t { return serialConsole.control.crcErrors + btConsole.control.crcErrors; } },
+};
+
+const size_t NUM_METRICS = sizeof(metricsTable) / sizeof(metricsTable[0]);
+
 
 //****************************************************************************************                            
 void setup() // - Device initialization
@@ -120,7 +379,16 @@ void setup() // - Device initialization
   Serial.begin(115200);   // Intialize terminal serial port
   delay(1000);            // Give port time to initalize
   
+  timeService.begin(monotonicMicros);
+  
   loadDefaults();
+  if (fileSystemMounted) {
+    eventQueue.setNextSeq(eventLog.begin(SPIFFS)); // Carry on numbering.
+    restoreCounts();
+    if (!frameCapture.begin(SPIFFS)) DEBUG_PRINTLN("    Frame capture unavailable.");
+    frameCapture.setClock(captureUtcOffset);
+  }
+  restoreAggregates();
   showSplashScreen();
   
   DEBUG_PRINTLN("INITIALIZING HARDWARE...");
@@ -146,19 +414,63 @@ void setup() // - Device initialization
 void loop()  // Main 
 //****************************************************************************************
 { 
+  uint32_t loopStartUs = micros();
+  
   scanForUserInput();
+  serviceEventDelivery();
+  serviceFileSystemRelease();
+  eventLog.service(millis());
+  configStore.service(millis());
+  serviceClock();
+  countCheckpoint.service(inCount, outCount, eventQueue.next() - 1, millis());
+  if (!aggregatesWaitForClock()) countAggregates.advance(aggregateMinute());
+  wifiLink.service(millis());
+  countAggregates.service(millis());
+  liveServer.push.counts(inCount, outCount);
+  liveServer.service(millis());
+  serviceRestApi();
+  serviceHashSpeed();
   
   if (clearDataFlag){
     inCount = 0; 
     outCount = 0;
     clearDataFlag = false;    
+    checkpointCounts(); // Otherwise a reboot would bring the old counts back.
+  }
+
+  if ((dL.getFrameRate() < LIDAR_FULL_RATE) && !dL.framesReady()) { // Slowed down: wait for the
+    delay(1);                                                        // next frame, don't spin on it.
+    return;
   }
 
   int16_t dist1, dist2;
+  bool    goodFrame = dL.getRanges(dist1, dist2);
   
-  dL.getRanges(dist1, dist2);
+  if (goodFrame) {
+    lidarFrames++;
+  } else {
+    lidarErrors++;
+  }
   
   state = dL.getVisibility();
+  AsyncElegantOTA.flash.service(goodFrame, state != NEITHER); // An update's flash writes, between frames.
+  frameCapture.service(state != NEITHER, AsyncElegantOTA.flash.scheduler.active()); // And capture's.
+
+  bool busy = (state != NEITHER) ||                       // The raw ranges see someone a frame
+              (dL.getRawVisibility() != NEITHER) ||       // or more before the smoothed ones do.
+              AsyncElegantOTA.flash.scheduler.active();   // Updates want every frame they can get.
+  if (powerPolicy.frame(micros(), busy)) applyPowerLevel(powerPolicy.level());
+
+  if (goodFrame) {
+    int16_t raw1, flux1, raw2, flux2;
+    dL.getRawFrame(raw1, flux1, raw2, flux2);
+    frameCapture.record(millis(), raw1, flux1, raw2, flux2, state);
+    liveServer.push.frame(millis(), raw1, raw2, state);
+    
+    if ((state == BOTH) && (previousState == NEITHER)) { // Appeared on both at once: no
+      frameCapture.trigger();                            // direction, so likely a miscount.
+    }
+  }
   
   if (streamingRawData) {
     dualPrint(dist1);
@@ -181,6 +493,8 @@ void loop()  // Main
   }
 
   previousState = state;
+  
+  loopTime.observe(micros() - loopStartUs);
 }
 
 
@@ -189,6 +503,8 @@ void buildJSONPrefix() // The first part of all of our JSON messages
 //****************************************************************************************                            
 { 
   jsonPrefix = "{\"deviceName\":\"" + deviceName + "\",\"deviceMAC\":\"" + WiFi.macAddress();
+  uploader.setDevice(deviceName, WiFi.macAddress());
+  if (mqttPublisher.isRunning()) mqttPublisher.setDevice(deviceName, getMACAddress());
 }
 
 
@@ -196,6 +512,30 @@ void buildJSONPrefix() // The first part of all of our JSON messages
 void configureWiFi(){
 //****************************************************************************************
   DEBUG_PRINTLN("  WiFi...");
+  
+  // Station for uploads alongside the access point for local setup. The link connects
+  // in the background and retries with backoff; nothing here waits for it.
+  netConfig.hostName   = deviceName;
+  netConfig.ssid       = netSSID;
+  netConfig.password   = netPassword;
+  netConfig.serverURL  = serverURL;
+  netConfig.mqttBroker = mqttBroker;
+  netConfig.ntpServer  = ntpServer;
+
+  WiFi.mode(WIFI_AP_STA);
+  wifiRadio.ssid     = netConfig.ssid;
+  wifiRadio.password = netConfig.password;
+  wifiRadio.hostName = netConfig.hostName;
+  wifiRadio.attach(wifiLink);
+  wifiLink.begin(wifiRadio, millis());
+  if (netConfig.ntpServer.length() > 0) sntp.begin(netConfig.ntpServer);
+
+  if (fileSystemMounted) { // Uploads and MQTT both read from the flash event log.
+    uploader.begin(eventLog, &SPIFFS, netConfig.serverURL);
+    if (netConfig.mqttBroker.length() > 0) {
+      mqttPublisher.begin(eventLog, &SPIFFS, netConfig, formatCountsJSON, formatHealthJSON);
+    }
+  }
 }
 
 
@@ -226,17 +566,40 @@ void configureLIDARs(){
 String processor(const String& var)
 //***************************************************************************************
 {
-  if(var == "config.deviceName") return deviceName;
+  char name[CONFIG_NAME_LENGTH];
+  
+  if(var == "config.deviceName") { copyDeviceName(name, sizeof(name)); return name; }
   return "";
 }
 
 
+//****************************************************************************************
+// Called when powerPolicy changes level. The CPU first, so a wake gets the rest done sooner.
+void applyPowerLevel(const PowerLevel &level){
+//****************************************************************************************
+  setCpuFrequencyMhz(level.cpuMHz);
+
+  #if HARDWARE_PRESENT
+    dL.setFrameRate(level.frameRate); // Doesn't wait: the replies come in with the next frames.
+  #endif
+  AsyncElegantOTA.flash.scheduler.setFramePeriod(1000000UL / level.frameRate);
+
+  DEBUG_PRINT("Power level: ");
+  DEBUG_PRINT(level.name);
+  DEBUG_PRINT(" (");
+  DEBUG_PRINT(level.frameRate);
+  DEBUG_PRINT(" Hz, ");
+  DEBUG_PRINT(level.cpuMHz);
+  DEBUG_PRINTLN(" MHz)");
+}
+
+
 //****************************************************************************************
 void configureOTA(){
 //****************************************************************************************
 
   DEBUG_PRINTLN("  Stand-Alone Mode. Setting AP (Access Point)…");  
-  WiFi.mode(WIFI_AP);
+  WiFi.mode(WIFI_AP_STA); // Keep the station link configureWiFi() started.
   
   String netName = "Counter_" + getShortMACAddress();
   const char* ssid = netName.c_str();
@@ -248,15 +611,25 @@ void configureOTA(){
   
   //delay(3000);  
   
-  server.on("/", HTTP_GET, [](AsyncWebServerRequest *request){
+  configureIndexPage();
+  server.addHandler(&indexPage);
+  server.on("/", HTTP_GET, [](AsyncWebServerRequest *request){ // Only if indexPage didn't load.
     if(!request->authenticate("admin", "admin"))
       return request->requestAuthentication();
       
     request->send(SPIFFS, "/index.html", String(), false, processor);
   
   });
-
-  server.serveStatic("/", SPIFFS, "/"); // sets the base path for the web server
+  webAssets.begin(); // Pre-compressed pages with ETags, from tools/build_web_assets.py.
+  server.addHandler(&webAssets);
+
+  liveServer.begin(server);
+  configureRestApi();
+  server.serveStatic("/", SPIFFS, "/"); // Anything not in the asset manifest.
+  if (fileSystemMounted) {
+    resumableOta.begin(server, SPIFFS, AsyncElegantOTA.flash, "admin", "admin"); // Before /update, which would take its paths.
+  }
+  AsyncElegantOTA.onFilesystemUpload(releaseFileSystem);
   AsyncElegantOTA.begin(&server);   
   server.begin();
 }
@@ -306,7 +679,7 @@ void showSplashScreen(){
   dualPrintln();
   dualPrintln("*******************************************");
   dualPrintln("ParkData Directional LIDAR Sensor");
-  dualPrintln("Version 1.0");
+  dualPrintln(String("Version ") + FIRMWARE_VERSION);
   dualPrintln("");
   dualPrintln("Compiled: " + compileDate + " at " + compileTime); 
   dualPrint("Device Name: ");
@@ -328,14 +701,11 @@ void showMenu()
   if (menuActive){
     showSplashScreen();   
     dualPrintln("MENU: ");
-    dualPrintln("  [+][-]Menu Active");
-    dualPrintln("  [n]ame               (" + deviceName +")");
-    dualPrintln("  [d]istance threshold (" + String(distanceThreshold) + ")");
-    dualPrintln("  [s]moothing factor   (" + String(smoothingFactor) + ")");
-    dualPrintln("  [g]et count data");
-    dualPrintln("  [c]lear count data");
-    dualPrintln("  [r]aw data stream    (" + String(streamingRawData) + ")");
-    dualPrintln("  [x]eXit and reboot");  
+    char line[80];
+    for (size_t i = 0; i < NUM_COMMANDS; i++) {
+      formatCommandHelp(commands[i], line, sizeof(line));
+      dualPrintln(line);
+    }
     dualPrintln();
   }
 }
@@ -344,46 +714,199 @@ void showMenu()
 //****************************************************************************************                            
 void loadDefaults(){
 //****************************************************************************************                            
+  // The values the globals start with are the defaults.
+  ConfigRecord &cfg = configStore.data;
+  memset(&cfg, 0, sizeof(cfg));
+  strncpy(cfg.deviceName, deviceName.c_str(), CONFIG_NAME_LENGTH - 1);
+  cfg.distanceThreshold = distanceThreshold;
+  cfg.smoothingFactor   = smoothingFactor;
+  cfg.checkpointSeconds = checkpointSeconds;
+  cfg.checkpointEvents  = checkpointEvents;
+
   if(!SPIFFS.begin()){
     DEBUG_PRINTLN("    File System Mount Failed");
   } else {
     //DEBUG_PRINTLN("    SPIFFS up!");
-    String temp;
-    
-    temp = readFile(SPIFFS, "/name.txt");
-    if (temp.length() >0) deviceName  = temp;
+    fileSystemMounted = true;
     
-    temp = readFile(SPIFFS, "/smooth.txt");
-    if (temp.length() > 0) smoothingFactor = temp.toFloat();
-    dL.setSmoothingFactor(smoothingFactor);
-    
-    temp = readFile(SPIFFS, "/threshold.txt");
-    if (temp.length() > 0) distanceThreshold = temp.toFloat();
-    dL.setZone(0,distanceThreshold);
+    ConfigSource source = configStore.begin(SPIFFS);
+    if (source == CONFIG_FROM_TEXT)     DEBUG_PRINTLN("    Settings migrated from text files.");
+    if (source == CONFIG_FROM_DEFAULTS) DEBUG_PRINTLN("    No saved settings. Using defaults.");
+
+    deviceName        = cfg.deviceName;
+    distanceThreshold = cfg.distanceThreshold;
+    smoothingFactor   = cfg.smoothingFactor;
+    if (cfg.checkpointSeconds > 0) checkpointSeconds = cfg.checkpointSeconds;
+    if (cfg.checkpointEvents  > 0) checkpointEvents  = cfg.checkpointEvents;
+  }
+  publishDeviceName();
+
+  dL.setSmoothingFactor(smoothingFactor);
+  dL.setZone(0,distanceThreshold);
+  countCheckpoint.intervalMs = checkpointSeconds * 1000UL;
+  countCheckpoint.maxEvents  = checkpointEvents;
+}
+
+
+//****************************************************************************************                            
+void saveSettings(){ // Copy the settings into the config record. The write is coalesced.
+//****************************************************************************************                            
+  ConfigRecord &cfg = configStore.data;
+  
+  strncpy(cfg.deviceName, deviceName.c_str(), CONFIG_NAME_LENGTH - 1);
+  cfg.deviceName[CONFIG_NAME_LENGTH - 1] = 0;
+  cfg.distanceThreshold = distanceThreshold;
+  cfg.smoothingFactor   = smoothingFactor;
+  cfg.checkpointSeconds = checkpointSeconds;
+  cfg.checkpointEvents  = checkpointEvents;
+  
+  configStore.markDirty(millis());
+}
+
+
+//****************************************************************************************                            
+void restoreCounts(){ // Pick up the counts from before the last reboot.
+//****************************************************************************************                            
+  CheckpointRecord cp;
+  
+  if (!countCheckpoint.restore(SPIFFS, cp)) return;
+  
+  inCount  = cp.inCount;
+  outCount = cp.outCount;
+  eventQueue.setNextSeq(cp.lastSeq + 1);
+
+  // Events that made it into the log after the checkpoint carry their running counts. 
+  // Catch up from those.
+  EventRecord records[16];
+  uint32_t    fromSeq = cp.lastSeq + 1;
+  size_t      n;
+  
+  while ((n = eventLog.read(fromSeq, records, 16)) > 0) {
+    for (size_t i = 0; i < n; i++) {
+      if (records[i].type == INBOUND)  inCount  = records[i].count;
+      if (records[i].type == OUTBOUND) outCount = records[i].count;
+    }
+    fromSeq = records[n - 1].seq + 1;
   }
+
+  DEBUG_PRINT("    Restored counts. In: ");
+  DEBUG_PRINT(inCount);
+  DEBUG_PRINT(" Out: ");
+  DEBUG_PRINTLN(outCount);
 }
 
 
+//****************************************************************************************                            
+void checkpointCounts(){ // Save the counts right away.
+//****************************************************************************************                            
+  countCheckpoint.write(inCount, outCount, eventQueue.next() - 1, millis());
+}
+
 
 //****************************************************************************************
-String getUserInput() { // -- No range checking!
+bool releaseFileSystem() // From the web task, before a filesystem upload overwrites SPIFFS.
 //****************************************************************************************
-  String inString;
+{
+  fileSystemWanted = true; // The loop does the rest, between frames.
+  uint32_t started = millis();
+  while (!fileSystemReleased && (millis() - started < FS_RELEASE_WAIT_MS)) vTaskDelay(pdMS_TO_TICKS(10));
+  return fileSystemReleased;
+}
+
+
+//****************************************************************************************
+void serviceFileSystemRelease() // Stop everything that writes SPIFFS, then unmount it.
+//****************************************************************************************
+{
+  if (!fileSystemWanted || fileSystemReleased) return;
+
+  if (fileSystemMounted) {
+    // The uploader and MQTT save their cursors and stop between steps. Until they
+    // have, and nobody is reading the event log, come back next time round.
+    uploader.stop();
+    if (mqttPublisher.isRunning()) mqttPublisher.stop();
+    if (!uploader.stopped() || (mqttPublisher.isRunning() && !mqttPublisher.stopped())) return;
+    if (!frameCapture.end() || !eventLog.end()) return;
+
+    checkpointCounts();
+    countCheckpoint.end();
+    countAggregates.end();
+    configStore.end();
+    fileSystemMounted = false;
+    SPIFFS.end();
+    DEBUG_PRINTLN("File system unmounted for an upload. Restarting after it.");
+  }
+  fileSystemReleased = true; // For good: the counter restarts after the upload.
+}
+
+
+//****************************************************************************************                            
+void restoreAggregates(){ // Bring back the time-bucketed totals.
+//****************************************************************************************                            
+  if (fileSystemMounted && countAggregates.restore(SPIFFS)) {
+    minuteOrigin = countAggregates.newestMinute() + 1;
+  } else {
+    countAggregates.reset(0);
+  }
+}
+
+bool aggregatesWaitForClock(){ // In UTC minutes, but we don't know UTC yet. After a reboot.
+  return (countAggregates.flags() & AGGREGATE_FLAG_UTC) && !timeService.valid();
+}
+
+uint32_t aggregateMinute(){
+  if (timeService.valid() && (countAggregates.flags() & AGGREGATE_FLAG_UTC)) {
+    return timeService.nowUtcMs() / 60000UL;
+  }
+  return minuteOrigin + millis() / 60000UL;
+}
 
-  while (!(Serial.available()) && !(btUART.available())){
-    delay(10);
-    //lightSleepMSec(10);
-    //vTaskDelay(10 / portTICK_PERIOD_MS);
-  }  
 
-  if ( Serial.available() ) inString = Serial.readStringUntil('\n');
-  if ( btUART.available() ) inString = btUART.readStringUntil('\n');
+//****************************************************************************************
+void serviceClock(){ // Apply time syncs. The first one moves the aggregates over to UTC.
+//****************************************************************************************
+  sntp.poll(timeService);
   
-  inString.trim();
-  dualPrint(" You entered: ");
-  dualPrintln(inString);
-  return inString;  
+  if (timeService.valid() && !(countAggregates.flags() & AGGREGATE_FLAG_UTC)) {
+    int64_t shift = (int64_t)(timeService.nowUtcMs() / 60000UL) - aggregateMinute();
+    countAggregates.rebase(shift, countAggregates.flags() | AGGREGATE_FLAG_UTC);
+    DEBUG_PRINTLN("Clock set. Aggregates now in UTC minutes.");
+  }
+  if (timeService.valid() && countAggregates.heldMinutes()) {
+    countAggregates.placeHeld(timeService.nowUtcMs(), millis()); // Counted since the reboot.
+  }
+}
+
 
+//****************************************************************************************
+int64_t captureUtcOffset(uint32_t timeMs){ // For stamping captured frames.
+//****************************************************************************************
+  if (!timeService.valid()) return 0;
+  return (int64_t)timeService.nowUtcMs() - timeMs;
+}
+
+
+//****************************************************************************************
+bool pollConsole(Console &console) // Returns true once a complete text line has arrived.
+                                   // Control frames are answered as they complete.
+//****************************************************************************************
+{
+  int budget = MAX_INPUT_BYTES_PER_POLL;
+
+  while ((budget-- > 0) && console.stream.available()) {
+    uint8_t b = console.stream.read();
+
+    ControlFeedResult result = console.control.feed(b, millis());
+    if (result == CONTROL_FRAME_READY) {
+      handleControlFrame(console);
+      continue;
+    }
+    if (result == CONTROL_CONSUMED) continue;
+
+    if (console.line.feed((char)b)) return true;
+  }
+
+  return false;
 }
 
 
@@ -391,89 +914,821 @@ String getUserInput() { // -- No range checking!
 void scanForUserInput()
 //****************************************************************************************
 {
-  String inString;
-  bool inputReceived=false;
- 
-  inputReceived = false;
-  
-  if (Serial.available()){
-    inString = Serial.readStringUntil('\n');
-    inputReceived = true;
-  }  
-
-  if (btUART.available()){
-    inString = btUART.readStringUntil('\n');
-    inputReceived = true;
-  }
-  
-  if (inputReceived) {  
-    inString.trim();
-   
-     if(inString == "g"){
-      String jsonPayload = jsonPrefix + "\",\"inbound\":\""  + inCount  + "\"" + 
-                                          ",\"outbound\":\"" + outCount + "\"" + "}";
-      dualPrintln(jsonPayload);
+  if (pollConsole(serialConsole)) processLine(serialConsole);
+  if (pollConsole(btConsole))     processLine(btConsole);
+}
+
+
+//****************************************************************************************
+void processLine(Console &console) // Dispatch a command, or hand a value to the command 
+                                   // that asked this console for it.
+//****************************************************************************************
+{
+  CommandArg     arg;
+  const Command *cmd;
+  const char    *line = console.line.line();
+
+  if (console.line.truncated()) { // Don't act on part of what was typed.
+    console.pendingCommand = nullptr;
+    dualPrint(" Line too long (over ");
+    dualPrint(LINE_INPUT_MAX_LENGTH - 1);
+    dualPrintln(" characters). Nothing changed.");
+    return;
+  }
+
+  if (console.pendingCommand) {
+    cmd = console.pendingCommand;
+    console.pendingCommand = nullptr;
+    
+    dualPrint(" You entered: ");
+    dualPrintln(line);
+    
+    if (!cmd->parse(line, arg)) {
+      dualPrintln(" Invalid value. Nothing changed.");
+      if (!streamingRawData) showMenu();
+      return;
+    }
+  } else {
+    cmd = findCommand(commands, NUM_COMMANDS, line);
+    
+    if (cmd == nullptr) {
+      if (!streamingRawData) showMenu();
       return;
     }
 
-    if (inString == "+") {
-      dualPrintln("OK");
-      menuActive = true;
+    if (cmd->prompt) { // Wait for the value on the next line.
+      char value[40] = "";
+      if (cmd->describe) cmd->describe(value, sizeof(value));
+      dualPrintln(String(cmd->prompt) + "(" + value + ")");
+      console.pendingCommand = cmd;
+      return;
     }
+  }
+
+  cmd->handler(arg);
+  
+  if ((!streamingRawData) && !(cmd->flags & COMMAND_QUIET)) showMenu(); 
+}
+
+
+//****************************************************************************************
+// Console command handlers
+//****************************************************************************************
+void cmdMenuOn(const CommandArg &arg){
+  dualPrintln("OK");
+  menuActive = true;
+}
+
+void cmdMenuOff(const CommandArg &arg){
+  dualPrintln("OK");
+  menuActive = false;
+}
+
+void cmdClearCounts(const CommandArg &arg){
+  dualPrintln("OK");
+  clearDataFlag = true;
+}
+
+void cmdGetCounts(const CommandArg &arg){
+  String jsonPayload = jsonPrefix + "\",\"inbound\":\""  + inCount  + "\"" + 
+                                      ",\"outbound\":\"" + outCount + "\"" + "}";
+  dualPrintln(jsonPayload);
+}
+
+void cmdSetName(const CommandArg &arg){
+  applyDeviceName(arg.text);
+  dualPrint(" New Device Name: ");
+  dualPrintln(deviceName);
+}
 
-    if (inString == "-") {
-      dualPrintln("OK");
-      menuActive = false;
+void cmdSetThreshold(const CommandArg &arg){
+  applyThreshold(arg.number);
+  dualPrint(" New distanceThreshold: ");
+  dualPrintln(distanceThreshold);
+}
+
+void cmdSetSmoothing(const CommandArg &arg){
+  applySmoothing(arg.number);
+  dualPrint(" New Smoothing Factor: ");
+  dualPrintln(smoothingFactor);
+}
+
+void cmdSetCheckpoint(const CommandArg &arg){
+  applyCheckpointSeconds((uint16_t)arg.number);
+  dualPrint(" New Checkpoint Interval: ");
+  dualPrintln((int)checkpointSeconds);
+}
+
+void cmdSetCheckpointEvents(const CommandArg &arg){
+  applyCheckpointEvents((uint16_t)arg.number);
+  dualPrint(" New Checkpoint Event Count: ");
+  dualPrintln((int)checkpointEvents);
+}
+
+// /update hashes an upload a chunk at a time as it arrives. How fast each hash goes, by
+// chunk size.
+struct Md5Hash
+{
+  MD5Builder md5;
+  void begin()                                    { md5.begin(); }
+  void update(const uint8_t *data, size_t length) { md5.add((uint8_t *)data, length); }
+  void finish(uint8_t *digest)                    { md5.calculate(); md5.getBytes(digest); } // 16 bytes.
+};
+
+uint32_t clockUs() { return micros(); }
+
+const size_t HASH_CHUNKS[]   = { 64, 256, 1024, 4096 };
+const size_t HASH_TEST_BYTES = 65536; // Per hash and chunk size.
+uint8_t     *hashBuffer      = nullptr; // While [h] is running.
+size_t       hashStep        = 0;
+uint32_t     hashKBps[3];
+
+void cmdHashSpeed(const CommandArg &arg){ // The tests run from the loop: serviceHashSpeed().
+  if (hashBuffer) {
+    dualPrintln(" Already running.");
+    return;
+  }
+  hashBuffer = (uint8_t *)malloc(4096);
+  if (!hashBuffer) {
+    dualPrintln(" Not enough memory.");
+    return;
+  }
+  for (int i = 0; i < 4096; i++) hashBuffer[i] = (uint8_t)(i * 31 + 7);
+  hashStep = 0;
+
+  dualPrintln(" Hash speed, KB/s:");
+  dualPrintln("   chunk  SHA-256 engine  SHA-256 software   MD5");
+}
+
+//****************************************************************************************
+void serviceHashSpeed(){ // One hash at one chunk size per pass, so frames keep coming.
+//****************************************************************************************
+  if (!hashBuffer) return;
+
+  size_t chunk = HASH_CHUNKS[hashStep / 3];
+  switch (hashStep % 3) {
+    case 0: { Sha256     engine;   hashKBps[0] = hashSpeed(engine, hashBuffer, chunk, HASH_TEST_BYTES, clockUs);   break; }
+    case 1: { Sha256Soft software; hashKBps[1] = hashSpeed(software, hashBuffer, chunk, HASH_TEST_BYTES, clockUs); break; }
+    case 2: { Md5Hash    md5;      hashKBps[2] = hashSpeed(md5, hashBuffer, chunk, HASH_TEST_BYTES, clockUs);      break; }
+  }
+
+  if (hashStep % 3 == 2) {
+    char line[80];
+    snprintf(line, sizeof(line), "   %5u  %14u  %16u  %5u", (unsigned)chunk, (unsigned)hashKBps[0],
+             (unsigned)hashKBps[1], (unsigned)hashKBps[2]);
+    dualPrintln(line);
+  }
+  if (++hashStep == 3 * (sizeof(HASH_CHUNKS) / sizeof(HASH_CHUNKS[0]))) {
+    free(hashBuffer);
+    hashBuffer = nullptr;
+  }
+}
+
+void cmdTogglePower(const CommandArg &arg){
+  powerPolicy.setEnabled(!powerPolicy.isEnabled()); // Off: full rate from the next frame.
+}
+
+void cmdToggleRaw(const CommandArg &arg){
+  streamingRawData = (!streamingRawData);
+}
+
+void cmdReboot(const CommandArg &arg){
+  dualPrintln();
+  dualPrintln("Rebooting NOW...");
+  dualPrintln();
+  
+  eventLog.flush();
+  configStore.flush();
+  checkpointCounts();
+  countAggregates.flush();
+  uploader.engine.saveCursor();
+  if (mqttPublisher.isRunning()) mqttPublisher.engine.saveCursor();
+  ESP.restart();  
+}
+
+void cmdSetCapture(const CommandArg &arg){
+  if (!frameCapture.available()) { // No file system, or no room for /capture.bin.
+    dualPrintln(" Frame capture unavailable.");
+    return;
+  }
+  frameCapture.setMode((uint8_t)arg.number);
+  dualPrint(" Frame Capture Mode: ");
+  dualPrintln((int)frameCapture.getMode());
+}
+
+void cmdSetCaptureAfter(const CommandArg &arg){
+  frameCapture.setAfterSeconds((uint16_t)arg.number);
+  dualPrint(" Seconds Kept After a Trigger: ");
+  dualPrintln((int)frameCapture.getAfterSeconds());
+}
+
+void describeName(char *buffer, size_t bufferSize){
+  snprintf(buffer, bufferSize, "%s", deviceName.c_str());
+}
+
+void describeThreshold(char *buffer, size_t bufferSize){
+  snprintf(buffer, bufferSize, "%.2f", distanceThreshold);
+}
+
+void describeSmoothing(char *buffer, size_t bufferSize){
+  snprintf(buffer, bufferSize, "%.2f", smoothingFactor);
+}
+
+void describePower(char *buffer, size_t bufferSize){
+  snprintf(buffer, bufferSize, "%d (%s)", powerPolicy.isEnabled(), powerPolicy.level().name);
+}
+
+void describeRaw(char *buffer, size_t bufferSize){
+  snprintf(buffer, bufferSize, "%d", streamingRawData);
+}
+
+void describeCheckpoint(char *buffer, size_t bufferSize){
+  snprintf(buffer, bufferSize, "%u", checkpointSeconds);
+}
+
+void describeCheckpointEvents(char *buffer, size_t bufferSize){
+  snprintf(buffer, bufferSize, "%u", checkpointEvents);
+}
+
+void describeCapture(char *buffer, size_t bufferSize){
+  snprintf(buffer, bufferSize, "%u%s", frameCapture.getMode(), frameCapture.isFrozen() ? " (frozen)" : "");
+}
+
+void describeCaptureAfter(char *buffer, size_t bufferSize){
+  snprintf(buffer, bufferSize, "%u", frameCapture.getAfterSeconds());
+}
+
+bool parseThreshold(const char *text, CommandArg &arg){ // Centimeters
+  return parseNumberArg(text, arg) && (arg.number > 0);
+}
+
+bool parseSmoothing(const char *text, CommandArg &arg){ // 0 = none, 1 = frozen
+  return parseNumberArg(text, arg) && (arg.number >= 0) && (arg.number < 1);
+}
+
+bool parseCheckpoint(const char *text, CommandArg &arg){ // Seconds
+  return parseNumberArg(text, arg) && (arg.number >= 1) && (arg.number <= 3600);
+}
+
+bool parseCheckpointEvents(const char *text, CommandArg &arg){ // Events
+  return parseNumberArg(text, arg) && (arg.number >= 1) && (arg.number <= 1000);
+}
+
+bool parseCaptureAfter(const char *text, CommandArg &arg){ // Seconds. The buffer caps it anyway.
+  return parseNumberArg(text, arg) && (arg.number >= 1) && (arg.number <= 600);
+}
+
+bool parseCaptureMode(const char *text, CommandArg &arg){ // CAPTURE_OFF .. CAPTURE_FREEZE
+  return parseNumberArg(text, arg) && (arg.number >= CAPTURE_OFF) && (arg.number <= CAPTURE_FREEZE) &&
+         (arg.number == (int)arg.number);
+}
+
+//****************************************************************************************
+// Settings changes. Shared by the console commands and the control protocol.
+//****************************************************************************************
+void applyDeviceName(const char *name){
+  char stored[CONFIG_NAME_LENGTH];
+  
+  strncpy(stored, name, sizeof(stored) - 1); // Keep it to what the config record holds.
+  stored[sizeof(stored) - 1] = 0;
+  deviceName = stored;
+  publishDeviceName();
+  buildJSONPrefix(); // The device name is part of the prefix.
+  saveSettings();
+}
+
+void applyThreshold(float threshold){
+  distanceThreshold = threshold;
+  dL.setZone(0,distanceThreshold);
+  saveSettings();
+}
+
+void applySmoothing(float smoothing){
+  smoothingFactor = smoothing;
+  dL.setSmoothingFactor(smoothingFactor);
+  saveSettings();
+}
+
+void applyCheckpointSeconds(uint16_t seconds){
+  checkpointSeconds          = seconds;
+  countCheckpoint.intervalMs = checkpointSeconds * 1000UL;
+  saveSettings();
+}
+
+void applyCheckpointEvents(uint16_t events){
+  checkpointEvents          = events;
+  countCheckpoint.maxEvents = checkpointEvents;
+  saveSettings();
+}
+
+
+//****************************************************************************************
+uint8_t controlGetConfig(PayloadReader &req, PayloadWriter &resp)
+//****************************************************************************************
+{
+  uint8_t key = req.getU8();
+  if (req.underflowed()) return CONTROL_BAD_REQUEST;
+
+  resp.putU8(key);
+  switch (key) {
+    case CONFIG_KEY_DEVICE_NAME: resp.put(deviceName.c_str(), deviceName.length()); break;
+    case CONFIG_KEY_THRESHOLD:   resp.putFloat(distanceThreshold); break;
+    case CONFIG_KEY_SMOOTHING:   resp.putFloat(smoothingFactor);   break;
+    case CONFIG_KEY_CHECKPOINT:  resp.putFloat(checkpointSeconds); break;
+    case CONFIG_KEY_CHECKPOINT_EVENTS: resp.putFloat(checkpointEvents); break;
+    default:                     return CONTROL_BAD_KEY;
+  }
+  return CONTROL_OK;
+}
+
+
+//****************************************************************************************
+uint8_t controlSetConfig(PayloadReader &req, PayloadWriter &resp)
+//****************************************************************************************
+{
+  uint8_t    key = req.getU8();
+  CommandArg arg;   // Values go through the same checks as the console.
+  char       text[LINE_INPUT_MAX_LENGTH];
+  
+  if (req.underflowed()) return CONTROL_BAD_REQUEST;
+
+  switch (key) {
+    case CONFIG_KEY_DEVICE_NAME: {
+      size_t len = req.remaining();
+      if (len >= sizeof(text)) return CONTROL_BAD_REQUEST;
+      req.get(text, len);
+      text[len] = 0;
+      if (!parseTextArg(text, arg)) return CONTROL_BAD_REQUEST;
+      applyDeviceName(arg.text);
+      break;
     }
-    
-    if (inString == "n") {
-      dualPrintln(" Enter New Device Name. (" + deviceName +")");
-      deviceName = getUserInput();
-      buildJSONPrefix(); // The device name is part of the prefix.
-      dualPrint(" New Device Name: ");
-      dualPrintln(deviceName);
-      writeFile(SPIFFS, "/name.txt", deviceName.c_str());
-    } 
-    
-    if(inString == "d"){
-      dualPrintln(" Enter New Distance Threshold. (" + String(distanceThreshold) +")");
-      distanceThreshold = getUserInput().toFloat();
-      dualPrint(" New distanceThreshold: ");
-      dualPrintln(distanceThreshold);
-      dL.setZone(0,distanceThreshold);
-      writeFile(SPIFFS, "/threshold.txt", String(distanceThreshold).c_str());
-    } 
-    
-    if(inString == "s"){
-      dualPrintln(" Enter New Smoothing Factor. (" + String(smoothingFactor) + ")");
-      smoothingFactor = getUserInput().toFloat();
-      dualPrint(" New Smoothing Factor: ");
-      dualPrintln(smoothingFactor);
-      dL.setSmoothingFactor(smoothingFactor);
-      writeFile(SPIFFS, "/smooth.txt", String(smoothingFactor).c_str());
-    } 
-
-    if(inString == "c"){
-      dualPrintln("OK");
-      clearDataFlag = true;
-    }      
-
-    if(inString == "r"){
-      streamingRawData = (!streamingRawData);
-    } 
-
-    if(inString =="x"){
-      dualPrintln();
-      dualPrintln("Rebooting NOW...");
-      dualPrintln();
-      
-      ESP.restart();  
+    case CONFIG_KEY_THRESHOLD: 
+      arg.number = req.getFloat();
+      if (req.underflowed() || !(arg.number > 0)) return CONTROL_BAD_REQUEST;
+      applyThreshold(arg.number);
+      break;
+    case CONFIG_KEY_SMOOTHING:
+      arg.number = req.getFloat();
+      if (req.underflowed() || !((arg.number >= 0) && (arg.number < 1))) return CONTROL_BAD_REQUEST;
+      applySmoothing(arg.number);
+      break;
+    case CONFIG_KEY_CHECKPOINT:
+      arg.number = req.getFloat();
+      if (req.underflowed() || !((arg.number >= 1) && (arg.number <= 3600))) return CONTROL_BAD_REQUEST;
+      applyCheckpointSeconds((uint16_t)arg.number);
+      break;
+    case CONFIG_KEY_CHECKPOINT_EVENTS:
+      arg.number = req.getFloat();
+      if (req.underflowed() || !((arg.number >= 1) && (arg.number <= 1000))) return CONTROL_BAD_REQUEST;
+      applyCheckpointEvents((uint16_t)arg.number);
+      break;
+    default:
+      return CONTROL_BAD_KEY;
+  }
+  return CONTROL_OK;
+}
+
+
+//****************************************************************************************
+void configureIndexPage(){ // The %variables% index.html can use.
+//****************************************************************************************
+  TemplatePage &page = indexPage.page;
+  
+  page.define("config.deviceName", [](char *b, size_t n){ copyDeviceName(b, n); });
+  page.define("counts.in",         [](char *b, size_t n){ snprintf(b, n, "%u", inCount); });
+  page.define("counts.out",        [](char *b, size_t n){ snprintf(b, n, "%u", outCount); });
+  page.define("firmware.version",  [](char *b, size_t n){ snprintf(b, n, "%s (%s)", FIRMWARE_VERSION, __DATE__); });
+  page.define("device.mac",        [](char *b, size_t n){ snprintf(b, n, "%s", getMACAddress().c_str()); });
+  page.define("health.wifi",       [](char *b, size_t n){ snprintf(b, n, "%s", WiFiLink::stateName(wifiLink.getState())); });
+  page.define("health.uptime",     [](char *b, size_t n){ // Whole minutes, so the page
+    unsigned long minutes = millis() / 60000;                // isn't new on every request.
+    snprintf(b, n, "%lud %02lu:%02lu", minutes / 1440, (minutes / 60) % 24, minutes % 60);
+  });
+  
+  if (!indexPage.begin(SPIFFS)) DEBUG_PRINTLN("    index.html template not loaded.");
+}
+
+
+//****************************************************************************************
+// The JSON API. Handlers run on the web server's task, not the main loop: they only read
+// settings and counts, and hand changes to the loop through configChanges.
+//****************************************************************************************
+void configureRestApi(){
+  configChanges = xQueueCreate(8, sizeof(ConfigChange));
+
+  // Prometheus scrapes. Streamed: see digameMetrics.h.
+  server.on("/metrics", HTTP_GET, [](AsyncWebServerRequest *request){
+    std::shared_ptr<MetricsStream> stream(new MetricsStream(metricsTable, NUM_METRICS));
+    request->send(request->beginChunkedResponse("text/plain; version=0.0.4",
+      [stream](uint8_t *buffer, size_t maxLen, size_t index) -> size_t { return stream->fill(buffer, maxLen); }));
+  });
+
+  server.on("/api/counts", HTTP_GET, [](AsyncWebServerRequest *request){
+    char json[96];
+    formatCountsJSON(json, sizeof(json));
+    request->send(200, "application/json", json);
+  });
+
+  server.on("/api/health", HTTP_GET, [](AsyncWebServerRequest *request){
+    char json[256];
+    formatHealthJSON(json, sizeof(json));
+    request->send(200, "application/json", json);
+  });
+
+  server.on("/api/config", HTTP_GET, [](AsyncWebServerRequest *request){
+    char json[192];
+    formatConfigJSON(json, sizeof(json));
+    request->send(200, "application/json", json);
+  });
+
+  // GET /api/events?from=<seq>&limit=<n>. Streamed: see digameRest.h.
+  server.on("/api/events", HTTP_GET, [](AsyncWebServerRequest *request){
+    uint32_t from  = request->hasParam("from")  ? request->getParam("from")->value().toInt()  : 0;
+    uint32_t limit = request->hasParam("limit") ? request->getParam("limit")->value().toInt() : REST_EVENTS_DEF_LIMIT;
+    std::shared_ptr<RestEventStream> stream(new RestEventStream(eventLog, from, limit));
+    request->send(request->beginChunkedResponse("application/json",
+      [stream](uint8_t *buffer, size_t maxLen, size_t index) -> size_t { return stream->fill(buffer, maxLen); }));
+  });
+
+  // POST /api/config with any of deviceName, threshold, smoothing, checkpointSeconds,
+  // checkpointEvents as form fields. Values get the console's checks; all must pass or nothing changes.
+  server.on("/api/config", HTTP_POST, [](AsyncWebServerRequest *request){
+    if(!request->authenticate("admin", "admin"))
+      return request->requestAuthentication();
+
+    static const struct { const char *field; uint8_t key; CommandParser parser; } fields[] = {
+      { "deviceName",        CONFIG_KEY_DEVICE_NAME,       parseTextArg          },
+      { "threshold",         CONFIG_KEY_THRESHOLD,         parseThreshold        },
+      { "smoothing",         CONFIG_KEY_SMOOTHING,         parseSmoothing        },
+      { "checkpointSeconds", CONFIG_KEY_CHECKPOINT,        parseCheckpoint       },
+      { "checkpointEvents",  CONFIG_KEY_CHECKPOINT_EVENTS, parseCheckpointEvents },
+    };
+    ConfigChange changes[5];
+    size_t       n = 0;
+
+    for (auto &f : fields) {
+      if (!request->hasParam(f.field, true)) continue;
+      String     value = request->getParam(f.field, true)->value();
+      CommandArg arg;
+      if (!f.parser(value.c_str(), arg) || (value.length() >= CONFIG_NAME_LENGTH)) {
+        request->send(400, "application/json", String("{\"error\":\"bad value\",\"field\":\"") + f.field + "\"}");
+        return;
+      }
+      changes[n].key    = f.key;
+      changes[n].number = arg.number;
+      strncpy(changes[n].text, value.c_str(), sizeof(changes[n].text));
+      n++;
     }
-    
-    if (!streamingRawData) showMenu(); 
-  }   
+
+    if (uxQueueSpacesAvailable(configChanges) < n) {
+      request->send(503, "application/json", "{\"error\":\"busy\"}");
+      return;
+    }
+    for (size_t i = 0; i < n; i++) xQueueSend(configChanges, &changes[i], 0);
+    request->send(202, "application/json", String("{\"accepted\":") + n + "}"); // Applied on the next loop pass.
+  });
+}
+
+
+//****************************************************************************************
+void serviceRestApi(){ // Apply settings changes posted to /api/config.
+//****************************************************************************************
+  ConfigChange change;
+  
+  if (!configChanges) return;
+  while (xQueueReceive(configChanges, &change, 0) == pdTRUE) {
+    switch (change.key) {
+      case CONFIG_KEY_DEVICE_NAME: applyDeviceName(change.text);                    break;
+      case CONFIG_KEY_THRESHOLD:   applyThreshold(change.number);                   break;
+      case CONFIG_KEY_SMOOTHING:   applySmoothing(change.number);                   break;
+      case CONFIG_KEY_CHECKPOINT:  applyCheckpointSeconds((uint16_t)change.number); break;
+      case CONFIG_KEY_CHECKPOINT_EVENTS: applyCheckpointEvents((uint16_t)change.number); break;
+    }
+  }
+}
+
+
+//****************************************************************************************
+size_t formatConfigJSON(char *buffer, size_t size) // GET /api/config. On the web server's task.
+//****************************************************************************************
+{
+  char raw[CONFIG_NAME_LENGTH], name[CONFIG_NAME_LENGTH];
+  size_t j = 0;
+  copyDeviceName(raw, sizeof(raw));
+  for (size_t i = 0; raw[i] && (j + 1 < sizeof(name)); i++) {
+    char c = raw[i];
+    if ((c != '"') && (c != '\\') && ((uint8_t)c >= 0x20)) name[j++] = c; // Nothing needing escapes.
+  }
+  name[j] = 0;
+
+  int n = snprintf(buffer, size,
+                   "{\"deviceName\":\"%s\",\"threshold\":%.1f,\"smoothing\":%.3f,\"checkpointSeconds\":%u,"
+                   "\"checkpointEvents\":%u}",
+                   name, distanceThreshold, smoothingFactor, checkpointSeconds, checkpointEvents);
+  return ((n > 0) && ((size_t)n < size)) ? n : 0;
 }
 
+
+//****************************************************************************************
+void publishDeviceName(){ // From the loop, whenever deviceName changes.
+//****************************************************************************************
+  portENTER_CRITICAL(&webNameLock);
+  strncpy(webDeviceName, deviceName.c_str(), sizeof(webDeviceName) - 1);
+  webDeviceName[sizeof(webDeviceName) - 1] = 0;
+  portEXIT_CRITICAL(&webNameLock);
+}
+
+
+//****************************************************************************************
+void copyDeviceName(char *buffer, size_t size){ // Safe from any task.
+//****************************************************************************************
+  portENTER_CRITICAL(&webNameLock);
+  strncpy(buffer, webDeviceName, size - 1);
+  buffer[size - 1] = 0;
+  portEXIT_CRITICAL(&webNameLock);
+}
+
+
+//****************************************************************************************
+size_t formatCountsJSON(char *buffer, size_t size) // Retained on the MQTT counts topic.
+//****************************************************************************************
+{
+  int n = snprintf(buffer, size, "{\"inbound\":%u,\"outbound\":%u}", inCount, outCount);
+  return ((n > 0) && ((size_t)n < size)) ? n : 0;
+}
+
+
+//****************************************************************************************
+size_t formatHealthJSON(char *buffer, size_t size) // Published on the MQTT health topic.
+//****************************************************************************************
+{
+  int n = snprintf(buffer, size,
+                   "{\"uptime\":%lu,\"heap\":%lu,\"lidarFrames\":%lu,\"lidarErrors\":%lu,"
+                   "\"uploadBacklog\":%lu,\"mqttBacklog\":%lu,\"wifi\":\"%s\",\"wifiDrops\":%lu}",
+                   (unsigned long)millis(), (unsigned long)ESP.getFreeHeap(), (unsigned long)lidarFrames,
+                   (unsigned long)lidarErrors, (unsigned long)uploader.engine.backlog(),
+                   (unsigned long)mqttPublisher.engine.backlog(), WiFiLink::stateName(wifiLink.getState()),
+                   (unsigned long)wifiLink.drops);
+  return ((n > 0) && ((size_t)n < size)) ? n : 0;
+}
+
+
+//****************************************************************************************
+uint8_t controlGetHealth(PayloadReader &req, PayloadWriter &resp)
+//****************************************************************************************
+{
+  resp.putU32(millis());
+  resp.putU32(ESP.getFreeHeap());
+  resp.putU32(lidarFrames);
+  resp.putU32(lidarErrors);
+  resp.putU32(serialConsole.control.crcErrors + btConsole.control.crcErrors);
+  resp.putU32(eventQueue.unacked());
+  resp.putU32(eventQueue.dropped);
+  resp.putU32(uploader.engine.backlog());
+  resp.putU32(uploader.engine.postFailures);
+  resp.putU32(wifiLink.getState());
+  resp.putU32(wifiLink.lastConnectMs);
+  resp.putU32(wifiLink.drops);
+  return CONTROL_OK;
+}
+
+
+//****************************************************************************************
+uint8_t controlGetTotals(PayloadReader &req, PayloadWriter &resp) // In/out for a span of minutes.
+//****************************************************************************************
+{
+  uint32_t fromMinute = req.getU32();
+  uint32_t toMinute   = req.getU32();
+  if (req.underflowed() || (toMinute < fromMinute)) return CONTROL_BAD_REQUEST;
+
+  AggregateTotals totals;
+  bool complete = countAggregates.query(fromMinute, toMinute, totals);
+
+  resp.putU8(complete);
+  resp.putU32(totals.in);
+  resp.putU32(totals.out);
+  resp.putU32(aggregateMinute());
+  resp.putU8(countAggregates.flags());
+  return CONTROL_OK;
+}
+
+
+//****************************************************************************************
+uint8_t controlSetTime(PayloadReader &req, PayloadWriter &resp) // From a host with a good clock.
+//****************************************************************************************
+{
+  TimeSample sample;
+  sample.monoUs = monotonicMicros();
+  
+  uint64_t utcMs   = req.getU32();
+  utcMs           |= (uint64_t)req.getU32() << 32;
+  uint16_t plusMinusMs = req.getU16();
+  if (req.underflowed()) return CONTROL_BAD_REQUEST;
+
+  sample.utcUs         = utcMs * 1000;
+  sample.uncertaintyUs = (uint32_t)plusMinusMs * 1000;
+  sample.source        = TIME_SOURCE_HOST;
+
+  bool accepted = timeService.sync(sample);
+  resp.putU8(accepted);
+  resp.putU32((uint32_t)(int32_t)(accepted ? timeService.lastErrorUs / 1000 : 0));
+  return CONTROL_OK;
+}
+
+
+//****************************************************************************************
+uint8_t controlGetTime(PayloadReader &req, PayloadWriter &resp)
+//****************************************************************************************
+{
+  uint64_t utcMs = timeService.valid() ? timeService.nowUtcMs() : 0;
+  
+  resp.putU8(timeService.valid());
+  resp.putU8(timeService.source);
+  resp.putU32((uint32_t)utcMs);
+  resp.putU32((uint32_t)(utcMs >> 32));
+  resp.putU32((uint32_t)timeService.driftPpb);
+  resp.putU32(timeService.syncs);
+  resp.putU32(timeService.valid() ? (uint32_t)((monotonicMicros() - timeService.lastSyncMonoUs) / 1000000) : 0);
+  return CONTROL_OK;
+}
+
+
+//****************************************************************************************
+void putEventRecord(PayloadWriter &out, uint32_t seq, uint64_t timeMs, uint8_t flags, uint8_t type, uint32_t count)
+//****************************************************************************************
+{
+  out.putU32(seq);
+  out.putU32((uint32_t)timeMs);
+  out.putU32((uint32_t)(timeMs >> 32));
+  out.putU8(flags & EVENT_FLAG_UTC);
+  out.putU8(type);
+  out.putU32(count);
+}
+
+
+//****************************************************************************************
+uint8_t controlReadEvents(PayloadReader &req, PayloadWriter &resp) // A page from the log.
+//****************************************************************************************
+{
+  uint32_t fromSeq = req.getU32();
+  uint8_t  maxRecords = req.getU8();
+  if (req.underflowed()) return CONTROL_BAD_REQUEST;
+  if (maxRecords > CONTROL_EVENTS_PER_READ) maxRecords = CONTROL_EVENTS_PER_READ;
+
+  EventRecord records[CONTROL_EVENTS_PER_READ];
+  size_t      n = eventLog.read(fromSeq, records, maxRecords);
+
+  resp.putU32(eventLog.oldestSeq());
+  resp.putU32(eventLog.newestSeq());
+  resp.putU8(n);
+  for (size_t i = 0; i < n; i++) {
+    putEventRecord(resp, records[i].seq, records[i].timeMs, records[i].flags, records[i].type, records[i].count);
+  }
+  return CONTROL_OK;
+}
+
+
+//****************************************************************************************
+uint8_t controlSubscribe(Console &console, PayloadReader &req, PayloadWriter &resp)
+//****************************************************************************************
+{
+  uint32_t resumeSeq = req.getU32(); // First event the client doesn't have. 0 = all.
+  if (req.underflowed()) return CONTROL_BAD_REQUEST;
+
+  if (resumeSeq == 0) {
+    eventQueue.rewind();
+  } else {
+    eventQueue.ack(resumeSeq - 1); // The client already holds everything before this.
+    eventQueue.resumeFrom(resumeSeq);
+  }
+  
+  eventSubscriber     = &console;
+  lastEventActivityMs = millis();
+
+  resp.putU32(eventQueue.oldest());
+  resp.putU32(eventQueue.next());
+  return CONTROL_OK;
+}
+
+
+//****************************************************************************************
+uint8_t controlAckEvents(PayloadReader &req, PayloadWriter &resp)
+//****************************************************************************************
+{
+  uint32_t seq = req.getU32();
+  if (req.underflowed()) return CONTROL_BAD_REQUEST;
+
+  eventQueue.ack(seq);
+  lastEventActivityMs = millis();
+  return CONTROL_OK;
+}
+
+
+//****************************************************************************************
+void serviceEventDelivery() // Push at most one batch of events per call.
+//****************************************************************************************
+{
+  bool btConnected = btUART.hasClient();
+  
+  // A dropped Bluetooth link loses whatever was in flight. Send it again on reconnect.
+  if (btWasConnected && !btConnected && (eventSubscriber == &btConsole)) eventQueue.rewind();
+  btWasConnected = btConnected;
+
+  if (eventSubscriber == nullptr) return;
+  if ((eventSubscriber == &btConsole) && !btConnected) return;
+
+  // Go back N: nothing acknowledged for a while, so assume the batches were lost.
+  if ((eventQueue.inFlight() > 0) && (millis() - lastEventActivityMs > CONTROL_ACK_TIMEOUT_MS)) {
+    eventQueue.rewind();
+  }
+
+  if ((eventQueue.unsent() == 0) || (eventQueue.inFlight() >= MAX_EVENTS_IN_FLIGHT)) return;
+
+  CountEvent batch[CONTROL_EVENTS_PER_BATCH];
+  uint8_t    payload[CONTROL_MAX_PAYLOAD];
+  uint8_t    frame[CONTROL_MAX_FRAME];
+  
+  size_t        n = eventQueue.nextBatch(batch, CONTROL_EVENTS_PER_BATCH);
+  PayloadWriter out(payload, sizeof(payload));
+
+  out.putU8(n);
+  for (size_t i = 0; i < n; i++) {
+    putEventRecord(out, batch[i].seq, batch[i].timeMs, batch[i].flags, batch[i].type, batch[i].count);
+  }
+
+  size_t len = encodeControlFrame(frame, sizeof(frame), 0, CONTROL_EVENT_BATCH, payload, out.length());
+  eventSubscriber->stream.write(frame, len);
+  lastEventActivityMs = millis();
+}
+
+
+//****************************************************************************************
+void handleControlFrame(Console &console) // Answer one request on the link it came from.
+//****************************************************************************************
+{
+  ControlDecoder &request = console.control;
+  uint8_t         respPayload[CONTROL_MAX_PAYLOAD];
+  uint8_t         frame[CONTROL_MAX_FRAME];
+  
+  PayloadReader req(request.payload, request.payloadLen);
+  PayloadWriter resp(respPayload + 1, sizeof(respPayload) - 1); // First byte is the status.
+  uint8_t       status;
+
+  switch (request.opcode) {
+    case CONTROL_PING:
+      status = CONTROL_OK;
+      break;
+    case CONTROL_GET_CONFIG:
+      status = controlGetConfig(req, resp);
+      break;
+    case CONTROL_SET_CONFIG:
+      status = controlSetConfig(req, resp);
+      break;
+    case CONTROL_GET_COUNTS:
+      resp.putU32(inCount);
+      resp.putU32(outCount);
+      status = CONTROL_OK;
+      break;
+    case CONTROL_GET_HEALTH:
+      status = controlGetHealth(req, resp);
+      break;
+    case CONTROL_GET_TOTALS:
+      status = controlGetTotals(req, resp);
+      break;
+    case CONTROL_SET_TIME:
+      status = controlSetTime(req, resp);
+      break;
+    case CONTROL_GET_TIME:
+      status = controlGetTime(req, resp);
+      break;
+    case CONTROL_READ_EVENTS:
+      status = controlReadEvents(req, resp);
+      break;
+    case CONTROL_SUBSCRIBE_EVENTS:
+      status = controlSubscribe(console, req, resp);
+      break;
+    case CONTROL_ACK_EVENTS:
+      status = controlAckEvents(req, resp);
+      break;
+    case CONTROL_UNSUBSCRIBE:
+      if (eventSubscriber == &console) eventSubscriber = nullptr;
+      status = CONTROL_OK;
+      break;
+    default:
+      status = CONTROL_UNKNOWN_OPCODE;
+      break;
+  }
+
+  if (resp.overflowed()) status = CONTROL_FAILED;
+  
+  respPayload[0] = status;
+  size_t len = encodeControlFrame(frame, sizeof(frame), request.requestId,
+                                  request.opcode | CONTROL_RESPONSE_FLAG,
+                                  respPayload, (status == CONTROL_OK) ? resp.length() + 1 : 1);
+  console.stream.write(frame, len);
+}
+
+
 //****************************************************************************************
 void handleEvent(int eventType)
 //****************************************************************************************
@@ -484,12 +1739,14 @@ void handleEvent(int eventType)
   
   if (eventType == INBOUND) {
     inCount += 1;
+    recordEvent(INBOUND, inCount);
     jsonPayload = jsonPayload + "\",\"eventType\":\"inbound" +
                  "\",\"count\":\"" + inCount + "\"" +
                  "}";
   } 
   if (eventType == OUTBOUND) {
     outCount += 1;
+    recordEvent(OUTBOUND, outCount);
     jsonPayload = jsonPayload + "\",\"eventType\":\"outbound" +
                  "\",\"count\":\"" + outCount + "\"" +
                  "}";
@@ -499,3 +1756,27 @@ void handleEvent(int eventType)
   
 }
 
+
+//****************************************************************************************
+void recordEvent(int eventType, unsigned int count) // Queue for delivery and log to flash.
+//****************************************************************************************
+{
+  unsigned long now = millis();
+  uint64_t      timeMs = now;
+  uint8_t       flags  = 0;
+
+  if (timeService.valid()) { // Stamp with the wall clock once there is one.
+    timeMs = timeService.nowUtcMs();
+    flags  = EVENT_FLAG_UTC;
+  }
+
+  uint32_t seq = eventQueue.push(eventType, count, timeMs, flags);
+  eventLog.append(seq, eventType, count, timeMs, flags, now);
+  if (aggregatesWaitForClock()) {
+    countAggregates.hold(eventType, now);
+  } else {
+    countAggregates.add(eventType, aggregateMinute());
+  }
+  countCheckpoint.eventCounted();
+}
+
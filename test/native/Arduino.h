@@ -0,0 +1,108 @@
+/* Arduino.h (native tests)
+ *
+ *  Just enough of the Arduino core for the portable libraries to build on a
+ *  Linux host under [env:native]: String, a quiet Serial and F(). The
+ *  libraries keep their ESP32 code under #if defined(ESP32), so nothing
+ *  else is needed. Not used by the esp32dev build.
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#ifndef __DIGAME_NATIVE_ARDUINO_H__
+#define __DIGAME_NATIVE_ARDUINO_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+#define F(s) (s)
+
+//*****************************************************************************
+class String
+{
+  public:
+    String(const char *s = "") : text(s ? s : "") {}
+    String(const String &s) = default;
+    explicit String(char c) : text(1, c) {}
+    explicit String(int n) : text(std::to_string(n)) {}
+    explicit String(unsigned n) : text(std::to_string(n)) {}
+    explicit String(long n) : text(std::to_string(n)) {}
+    explicit String(unsigned long n) : text(std::to_string(n)) {}
+
+    String &operator=(const String &s) = default;
+
+    const char  *c_str() const { return text.c_str(); }
+    unsigned int length() const { return (unsigned int)text.size(); }
+    bool         reserve(unsigned int size) { text.reserve(size); return true; }
+    char         operator[](unsigned int i) const { return (i < text.size()) ? text[i] : 0; }
+
+    bool concat(const char *s, unsigned int n) { text.append(s, n); return true; }
+    bool concat(const String &s) { text += s.text; return true; }
+    bool concat(char c) { text += c; return true; }
+
+    String &operator+=(const String &s) { text += s.text; return *this; }
+    String &operator+=(const char *s) { text += s; return *this; }
+    String &operator+=(char c) { text += c; return *this; }
+
+    bool operator==(const String &s) const { return text == s.text; }
+    bool operator==(const char *s) const { return text == s; }
+    bool operator!=(const String &s) const { return text != s.text; }
+    bool operator!=(const char *s) const { return text != s; }
+
+    int    indexOf(char c, unsigned int from = 0) const { size_t i = text.find(c, from); return (i == std::string::npos) ? -1 : (int)i; }
+    String substring(unsigned int from, unsigned int to = 0xFFFFFFFF) const
+    {
+        if (from > text.size()) return String();
+        return String(text.substr(from, (to > text.size() ? text.size() : to) - from).c_str());
+    }
+
+    void trim()
+    {
+        size_t start = text.find_first_not_of(" \t\r\n");
+        if (start == std::string::npos) { text.clear(); return; }
+        text = text.substr(start, text.find_last_not_of(" \t\r\n") - start + 1);
+    }
+
+    long  toInt() const { return strtol(text.c_str(), NULL, 10); }
+    float toFloat() const { return (float)atof(text.c_str()); }
+
+  private:
+    std::string text;
+};
+
+inline String operator+(const String &a, const String &b) { String s(a); s += b; return s; }
+inline String operator+(const String &a, const char *b) { String s(a); s += b; return s; }
+inline String operator+(const char *a, const String &b) { String s(a); s += b; return s; }
+
+//*****************************************************************************
+// Swallows the libraries' debug output. Set echo to see it.
+class NativeSerial
+{
+  public:
+    bool echo = false;
+
+    template <typename T> void print(const T &value) { if (echo) out(value); }
+    template <typename T> void println(const T &value) { if (echo) { out(value); fputc('\n', stdout); } }
+    template <typename T> void print(const T &value, int) { print(value); }   // Digits or base: ignored.
+    template <typename T> void println(const T &value, int) { println(value); }
+    void println() { if (echo) fputc('\n', stdout); }
+
+    template <typename... Args> void printf(const char *format, Args... args)
+    {
+        if (echo) ::printf(format, args...);
+    }
+
+  private:
+    void out(const char *s) { fputs(s, stdout); }
+    void out(char *s) { fputs(s, stdout); }
+    void out(const String &s) { fputs(s.c_str(), stdout); }
+    void out(char c) { fputc(c, stdout); }
+    template <typename T> void out(const T &n) { fputs(std::to_string(n).c_str(), stdout); }
+};
+
+static NativeSerial Serial;
+
+#endif //__DIGAME_NATIVE_ARDUINO_H__
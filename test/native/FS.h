@@ -0,0 +1,175 @@
+/* FS.h (native tests)
+ *
+ *  A file system in RAM with the parts of fs::FS and File the libraries
+ *  use, for the [env:native] tests. Each FS keeps its files in a map, so a
+ *  test can look at them, or tear and corrupt them, directly:
+ *
+ *    fs::FS disk;
+ *    disk.files["/counts.jnl"].resize(40); // Power went mid-write.
+ *
+ *  writeLimit makes writes stop short once that many more bytes have gone
+ *  out, the way a write does when the power goes. -1 is no limit.
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#ifndef __DIGAME_NATIVE_FS_H__
+#define __DIGAME_NATIVE_FS_H__
+
+#include <Arduino.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#define FILE_READ   "r"
+#define FILE_WRITE  "w"
+#define FILE_APPEND "a"
+
+namespace fs
+{
+class FS;
+
+//*****************************************************************************
+class File
+{
+  public:
+    File() {}
+
+    operator bool() const { return owner != NULL; }
+
+    int read()
+    {
+        uint8_t b;
+        return (read(&b, 1) == 1) ? b : -1;
+    }
+    size_t read(uint8_t *buffer, size_t length);
+
+    size_t write(uint8_t b) { return write(&b, 1); }
+    size_t write(const uint8_t *buffer, size_t length);
+    size_t print(const char *s) { return write((const uint8_t *)s, strlen(s)); }
+    size_t print(const String &s) { return print(s.c_str()); }
+    size_t println(const String &s) { return print(s) + print("\n"); }
+
+    bool   seek(size_t pos) { if (!owner || pos > size()) return false; at = pos; return true; }
+    size_t position() const { return at; }
+    size_t size() const;
+    int    available() const { return owner ? (int)(size() - at) : 0; }
+    void   flush() {}
+    void   close() { owner = NULL; }
+
+    const char *name() const { return path.c_str(); }
+    bool        isDirectory() const { return directory; }
+    File        openNextFile();
+
+  private:
+    friend class FS;
+
+    FS         *owner     = NULL;
+    std::string path;
+    bool        canRead   = false;
+    bool        canWrite  = false;
+    bool        appending = false;
+    bool        directory = false;
+    size_t      at        = 0;
+    std::vector<std::string> listing; // A directory's files, when opened.
+    size_t      next      = 0;
+
+    std::vector<uint8_t> &data() const;
+};
+
+//*****************************************************************************
+class FS
+{
+  public:
+    std::map<std::string, std::vector<uint8_t>> files;
+    long writeLimit = -1;
+
+    // "r", "r+", "w", "w+", "a" and "a+", as fopen(). "/" opens the directory.
+    File open(const char *path, const char *mode = FILE_READ)
+    {
+        File f;
+        std::string name(path);
+        if (name == "/") {
+            for (auto &entry : files) f.listing.push_back(entry.first);
+            f.owner     = this;
+            f.path      = name;
+            f.directory = true;
+            return f;
+        }
+
+        bool plus = (mode[1] == '+');
+        if (mode[0] == 'r') {
+            if (!files.count(name)) return f;
+        } else if (mode[0] == 'w') {
+            files[name].clear();
+        } else {
+            files[name];
+        }
+
+        f.owner     = this;
+        f.path      = name;
+        f.canRead   = (mode[0] == 'r') || plus;
+        f.canWrite  = (mode[0] != 'r') || plus;
+        f.appending = (mode[0] == 'a');
+        f.at        = f.appending ? files[name].size() : 0;
+        return f;
+    }
+    File open(const String &path, const char *mode = FILE_READ) { return open(path.c_str(), mode); }
+
+    bool exists(const char *path) const { return files.count(path) != 0; }
+    bool exists(const String &path) const { return exists(path.c_str()); }
+    bool remove(const char *path) { return files.erase(path) != 0; }
+    bool remove(const String &path) { return remove(path.c_str()); }
+
+    bool rename(const char *from, const char *to)
+    {
+        if (!files.count(from)) return false;
+        files[to] = files[from];
+        files.erase(from);
+        return true;
+    }
+};
+
+//*****************************************************************************
+inline std::vector<uint8_t> &File::data() const { return owner->files[path]; }
+
+inline size_t File::size() const { return (owner && !directory) ? data().size() : 0; }
+
+inline size_t File::read(uint8_t *buffer, size_t length)
+{
+    if (!owner || !canRead) return 0;
+    std::vector<uint8_t> &d = data();
+    size_t n = (at < d.size()) ? d.size() - at : 0;
+    if (n > length) n = length;
+    if (n) memcpy(buffer, d.data() + at, n);
+    at += n;
+    return n;
+}
+
+inline size_t File::write(const uint8_t *buffer, size_t length)
+{
+    if (!owner || !canWrite) return 0;
+    if ((owner->writeLimit >= 0) && ((long)length > owner->writeLimit)) length = owner->writeLimit;
+    if (owner->writeLimit >= 0) owner->writeLimit -= length;
+
+    std::vector<uint8_t> &d = data();
+    if (appending) at = d.size();
+    if (d.size() < at + length) d.resize(at + length);
+    if (length) memcpy(d.data() + at, buffer, length);
+    at += length;
+    return length;
+}
+
+inline File File::openNextFile()
+{
+    File f;
+    if (!owner || !directory || next >= listing.size()) return f;
+    return owner->open(listing[next++].c_str(), FILE_READ);
+}
+
+} // namespace fs
+
+using fs::File;
+using fs::FS;
+
+#endif //__DIGAME_NATIVE_FS_H__
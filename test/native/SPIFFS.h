@@ -0,0 +1,22 @@
+/* SPIFFS.h (native tests)
+ *
+ *  SPIFFS as the RAM file system in FS.h, for the [env:native] tests.
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#ifndef __DIGAME_NATIVE_SPIFFS_H__
+#define __DIGAME_NATIVE_SPIFFS_H__
+
+#include <FS.h>
+
+class SPIFFSFS : public fs::FS
+{
+  public:
+    bool begin(bool formatOnFail = false) { (void)formatOnFail; return true; }
+    bool format() { files.clear(); return true; }
+};
+
+static SPIFFSFS SPIFFS;
+
+#endif //__DIGAME_NATIVE_SPIFFS_H__
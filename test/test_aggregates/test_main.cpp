@@ -0,0 +1,252 @@
+/* test_aggregates
+ *
+ *  The minute, hour and day buckets, checked against a plain count of the
+ *  same events: random ranges, retention, saving and restoring, rebasing
+ *  onto UTC and events held for the clock.
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#include <unity.h>
+#include <Arduino.h>
+#include <FS.h>
+#include <digameAggregates.h>
+#include <vector>
+
+void setUp(void) {}
+void tearDown(void) {}
+
+static uint32_t noise = 35;
+static uint32_t nextRandom()
+{
+    noise ^= noise << 13;
+    noise ^= noise >> 17;
+    noise ^= noise << 5;
+    return noise;
+}
+
+// Every event by minute, to check the buckets against.
+struct Reference
+{
+    std::vector<uint32_t> in, out;
+
+    void add(uint8_t type, uint32_t minute)
+    {
+        if (minute >= in.size()) {
+            in.resize(minute + 1);
+            out.resize(minute + 1);
+        }
+        (type == 0 ? in : out)[minute]++;
+    }
+
+    AggregateTotals total(uint32_t from, uint32_t to)
+    {
+        AggregateTotals t;
+        for (uint32_t m = from; (m < to) && (m < in.size()); m++) {
+            t.in  += in[m];
+            t.out += out[m];
+        }
+        return t;
+    }
+};
+
+// About three weeks of events, from minute `start`.
+static uint32_t fill(CountAggregates &a, Reference &ref, uint32_t start)
+{
+    uint32_t minute = start;
+    for (int i = 0; i < 60000; i++) {
+        minute += nextRandom() % 2;
+        uint8_t type = nextRandom() % 2;
+        a.add(type, minute);
+        ref.add(type, minute);
+    }
+    return minute;
+}
+
+//*****************************************************************************
+void test_random_ranges_match_a_plain_count(void)
+{
+    CountAggregates a;
+    Reference       ref;
+    a.reset(0);
+    uint32_t newest = fill(a, ref, 1000);
+
+    // Ragged ranges near the newest minute, whole hours in the last two
+    // days, whole days further back, and anything at all.
+    int complete = 0, incomplete = 0;
+    for (int q = 0; q < 5000; q++) {
+        uint32_t from, to;
+        switch (q % 4) {
+            case 0:
+                from = newest - nextRandom() % AGGREGATE_MINUTES;
+                to   = from + nextRandom() % 200;
+                break;
+            case 1:
+                from = (newest / MINUTES_PER_HOUR - nextRandom() % AGGREGATE_HOURS) * MINUTES_PER_HOUR;
+                to   = from + (1 + nextRandom() % 30) * MINUTES_PER_HOUR;
+                break;
+            case 2:
+                from = (newest / MINUTES_PER_DAY - nextRandom() % AGGREGATE_DAYS) * MINUTES_PER_DAY;
+                to   = from + (1 + nextRandom() % 10) * MINUTES_PER_DAY;
+                break;
+            default:
+                from = 1000 + nextRandom() % (newest - 1000 + 60);
+                to   = from + nextRandom() % (3 * MINUTES_PER_DAY);
+                break;
+        }
+        AggregateTotals got;
+        if (!a.query(from, to, got)) {
+            incomplete++;
+            continue;
+        }
+        AggregateTotals want = ref.total(from, to);
+        TEST_ASSERT_EQUAL_UINT32(want.in, got.in);
+        TEST_ASSERT_EQUAL_UINT32(want.out, got.out);
+        complete++;
+    }
+    TEST_ASSERT_GREATER_THAN(3000, complete);
+    TEST_ASSERT_GREATER_THAN(500, incomplete);
+}
+
+void test_rollups_cover_whole_periods(void)
+{
+    CountAggregates a;
+    Reference       ref;
+    a.reset(0);
+    uint32_t newest = fill(a, ref, 10 * MINUTES_PER_DAY);
+
+    uint32_t        lastDay = newest / MINUTES_PER_DAY;
+    AggregateTotals got, want;
+    for (uint32_t day = lastDay - 30; day < lastDay; day++) { // Days only.
+        TEST_ASSERT_TRUE(a.query(day * MINUTES_PER_DAY, (day + 1) * MINUTES_PER_DAY, got));
+        want = ref.total(day * MINUTES_PER_DAY, (day + 1) * MINUTES_PER_DAY);
+        TEST_ASSERT_EQUAL_UINT32(want.in, got.in);
+        TEST_ASSERT_EQUAL_UINT32(want.out, got.out);
+    }
+    uint32_t lastHour = newest / MINUTES_PER_HOUR;
+    for (uint32_t hour = lastHour - 40; hour < lastHour; hour++) { // Hours only.
+        TEST_ASSERT_TRUE(a.query(hour * MINUTES_PER_HOUR, (hour + 1) * MINUTES_PER_HOUR, got));
+        want = ref.total(hour * MINUTES_PER_HOUR, (hour + 1) * MINUTES_PER_HOUR);
+        TEST_ASSERT_EQUAL_UINT32(want.in + want.out, got.in + got.out);
+    }
+}
+
+void test_retention(void)
+{
+    CountAggregates a;
+    a.reset(0);
+    a.add(0, 100);
+    a.add(0, 100 + 3 * MINUTES_PER_HOUR);
+
+    AggregateTotals t;
+    TEST_ASSERT_FALSE(a.query(100, 101, t)); // Minute 100 is only in its hour now.
+    TEST_ASSERT_TRUE(a.query(60, 120, t));   // The hour has it.
+    TEST_ASSERT_EQUAL_UINT32(1, t.in);
+
+    a.advance(100 + 40 * MINUTES_PER_DAY);  // Five weeks on.
+    TEST_ASSERT_FALSE(a.query(0, MINUTES_PER_DAY, t));
+    TEST_ASSERT_EQUAL_UINT32(0, t.in);
+
+    a.add(1, 50); // Older than anything held: not placed.
+    TEST_ASSERT_TRUE(a.query(a.newestMinute() - 10, a.newestMinute() + 10, t));
+    TEST_ASSERT_EQUAL_UINT32(0, t.out);
+}
+
+void test_save_and_restore(void)
+{
+    fs::FS          disk;
+    CountAggregates a;
+    Reference       ref;
+    TEST_ASSERT_FALSE(a.restore(disk));
+    a.reset(0);
+    uint32_t newest = fill(a, ref, 5000);
+    TEST_ASSERT_TRUE(a.save());
+
+    CountAggregates b;
+    TEST_ASSERT_TRUE(b.restore(disk));
+    AggregateTotals ta, tb;
+    a.query(newest - 20 * MINUTES_PER_DAY, newest + 1, ta);
+    b.query(newest - 20 * MINUTES_PER_DAY, newest + 1, tb);
+    TEST_ASSERT_EQUAL_UINT32(ta.in, tb.in);
+    TEST_ASSERT_EQUAL_UINT32(ta.out, tb.out);
+
+    // The next save goes to the other slot. Tear it: the first comes back.
+    a.add(0, newest);
+    disk.writeLimit = 100;
+    TEST_ASSERT_FALSE(a.save());
+    disk.writeLimit = -1;
+    TEST_ASSERT_EQUAL_UINT32(1, a.writeErrors);
+
+    CountAggregates c;
+    TEST_ASSERT_TRUE(c.restore(disk));
+    c.query(newest - 20 * MINUTES_PER_DAY, newest + 1, tb);
+    TEST_ASSERT_EQUAL_UINT32(ta.in, tb.in);
+}
+
+void test_saves_are_rate_limited(void)
+{
+    fs::FS          disk;
+    CountAggregates a;
+    a.restore(disk);
+    for (uint32_t nowMs = 0; nowMs < 3600000UL; nowMs += 1000) {
+        a.add(0, nowMs / 60000);
+        a.service(nowMs);
+    }
+    TEST_ASSERT_EQUAL_UINT32(3600000UL / a.saveIntervalMs - 1, a.saves); // Not at 0: the clock starts there.
+}
+
+void test_rebase_onto_utc(void)
+{
+    CountAggregates a;
+    a.reset(0);
+    for (int i = 0; i < 10; i++) a.add(0, 500);
+    for (int i = 0; i < 4; i++) a.add(1, 530);
+
+    const uint32_t utcMinute = 29000000; // Minute 530 turned out to be this.
+    a.rebase((int64_t)utcMinute - 530, AGGREGATE_FLAG_UTC);
+    TEST_ASSERT_EQUAL(AGGREGATE_FLAG_UTC, a.flags());
+    TEST_ASSERT_EQUAL_UINT32(utcMinute, a.newestMinute());
+
+    AggregateTotals t;
+    TEST_ASSERT_TRUE(a.query(utcMinute - 30, utcMinute - 29, t));
+    TEST_ASSERT_EQUAL_UINT32(10, t.in);
+    TEST_ASSERT_TRUE(a.query(utcMinute - MINUTES_PER_HOUR, utcMinute + 1, t));
+    TEST_ASSERT_EQUAL_UINT32(10, t.in);
+    TEST_ASSERT_EQUAL_UINT32(4, t.out);
+}
+
+void test_held_events_are_placed_when_the_clock_is_set(void)
+{
+    CountAggregates a;
+    a.reset(AGGREGATE_FLAG_UTC);
+    for (int i = 0; i < 5; i++) a.hold(0, 1000 + i);   // Uptime minute 0.
+    for (int i = 0; i < 3; i++) a.hold(1, 125000 + i); // Uptime minute 2.
+    TEST_ASSERT_EQUAL(2, a.heldMinutes());
+
+    const uint32_t utcMinute = 29833333;
+    a.placeHeld((uint64_t)utcMinute * 60000 + 10000, 200000); // Set in uptime minute 3.
+    TEST_ASSERT_EQUAL(0, a.heldMinutes());
+
+    AggregateTotals t;
+    a.query(utcMinute - 3, utcMinute - 2, t);
+    TEST_ASSERT_EQUAL_UINT32(5, t.in);
+    a.query(utcMinute - 1, utcMinute, t);
+    TEST_ASSERT_EQUAL_UINT32(3, t.out);
+
+    for (uint32_t m = 0; m < AGGREGATE_HELD + 10; m++) a.hold(0, m * 60000);
+    TEST_ASSERT_EQUAL(AGGREGATE_HELD, a.heldMinutes());
+    TEST_ASSERT_EQUAL_UINT32(10, a.heldDropped);
+}
+
+int main(int, char **)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_random_ranges_match_a_plain_count);
+    RUN_TEST(test_rollups_cover_whole_periods);
+    RUN_TEST(test_retention);
+    RUN_TEST(test_save_and_restore);
+    RUN_TEST(test_saves_are_rate_limited);
+    RUN_TEST(test_rebase_onto_utc);
+    RUN_TEST(test_held_events_are_placed_when_the_clock_is_set);
+    return UNITY_END();
+}
@@ -0,0 +1,193 @@
+/* test_checkpoint
+ *
+ *  The count checkpoint journal: restore after torn and corrupted writes,
+ *  and how the two settings trade writes against counts that can be lost.
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#include <unity.h>
+#include <Arduino.h>
+#include <FS.h>
+#include <digameCheckpoint.h>
+
+void setUp(void) {}
+void tearDown(void) {}
+
+// Checkpoints 1..n, with in = 2 x generation, out = generation.
+static void writeCheckpoints(fs::FS &disk, uint32_t n)
+{
+    CountCheckpoint c;
+    CheckpointRecord r;
+    c.restore(disk, r);
+    for (uint32_t g = 1; g <= n; g++) TEST_ASSERT_TRUE(c.write(2 * g, g, g, g * 1000));
+}
+
+//*****************************************************************************
+void test_nothing_to_restore(void)
+{
+    fs::FS           disk;
+    CountCheckpoint  c;
+    CheckpointRecord r;
+    TEST_ASSERT_FALSE(c.restore(disk, r));
+
+    disk.files[CHECKPOINT_FILE].assign(100, 0xFF); // Blank slots.
+    TEST_ASSERT_FALSE(c.restore(disk, r));
+}
+
+void test_newest_is_restored(void)
+{
+    fs::FS disk;
+    writeCheckpoints(disk, 20);
+    TEST_ASSERT_EQUAL(CHECKPOINT_SLOTS * CHECKPOINT_SLOT_SIZE, disk.files[CHECKPOINT_FILE].size());
+
+    CountCheckpoint  c;
+    CheckpointRecord r;
+    TEST_ASSERT_TRUE(c.restore(disk, r));
+    TEST_ASSERT_EQUAL_UINT32(20, r.generation);
+    TEST_ASSERT_EQUAL_UINT32(40, r.inCount);
+    TEST_ASSERT_EQUAL_UINT32(20, r.outCount);
+    TEST_ASSERT_EQUAL_UINT32(20, r.lastSeq);
+
+    // The next write carries on the generations.
+    TEST_ASSERT_TRUE(c.write(41, 20, 21, 0));
+    CountCheckpoint again;
+    again.restore(disk, r);
+    TEST_ASSERT_EQUAL_UINT32(21, r.generation);
+    TEST_ASSERT_EQUAL_UINT32(41, r.inCount);
+}
+
+// Power going at any byte of a write leaves the new checkpoint or the one before.
+void test_torn_write_at_every_byte(void)
+{
+    for (long cut = 0; cut <= CHECKPOINT_SLOT_SIZE; cut++) {
+        fs::FS disk;
+        writeCheckpoints(disk, 20);
+
+        CountCheckpoint  c;
+        CheckpointRecord r;
+        c.restore(disk, r);
+        disk.writeLimit = cut;
+        bool written = c.write(999, 998, 21, 0);
+        disk.writeLimit = -1;
+        TEST_ASSERT_EQUAL(cut == CHECKPOINT_SLOT_SIZE, written);
+
+        CountCheckpoint after;
+        TEST_ASSERT_TRUE(after.restore(disk, r));
+        if (cut >= (long)sizeof(CheckpointRecord)) {
+            TEST_ASSERT_EQUAL_UINT32(21, r.generation);
+            TEST_ASSERT_EQUAL_UINT32(999, r.inCount);
+        } else {
+            TEST_ASSERT_EQUAL_UINT32(20, r.generation);
+            TEST_ASSERT_EQUAL_UINT32(40, r.inCount);
+        }
+    }
+}
+
+void test_corrupt_newest_falls_back(void)
+{
+    fs::FS disk;
+    writeCheckpoints(disk, 20);
+    disk.files[CHECKPOINT_FILE][(20 % CHECKPOINT_SLOTS) * CHECKPOINT_SLOT_SIZE + 10] ^= 0xFF;
+
+    CountCheckpoint  c;
+    CheckpointRecord r;
+    TEST_ASSERT_TRUE(c.restore(disk, r));
+    TEST_ASSERT_EQUAL_UINT32(19, r.generation);
+
+    // Generation 20 again, into the damaged slot.
+    c.write(100, 0, 0, 0);
+    CountCheckpoint again;
+    again.restore(disk, r);
+    TEST_ASSERT_EQUAL_UINT32(20, r.generation);
+    TEST_ASSERT_EQUAL_UINT32(100, r.inCount);
+}
+
+void test_truncated_journal(void)
+{
+    fs::FS disk;
+    writeCheckpoints(disk, 6);
+    disk.files[CHECKPOINT_FILE].resize(3 * CHECKPOINT_SLOT_SIZE + 5); // Slots 0-2 whole.
+
+    CountCheckpoint  c;
+    CheckpointRecord r;
+    TEST_ASSERT_TRUE(c.restore(disk, r));
+    TEST_ASSERT_EQUAL_UINT32(2, r.generation);
+}
+
+//*****************************************************************************
+// A day of counting with a brownout at every event: the counts a reboot
+// would lose never pass maxEvents, and idle time writes nothing.
+static uint32_t worstLoss(uint32_t intervalMs, uint32_t maxEvents, uint32_t &writes)
+{
+    fs::FS           disk;
+    CountCheckpoint  c;
+    CheckpointRecord r;
+    c.restore(disk, r);
+    c.intervalMs = intervalMs;
+    c.maxEvents  = maxEvents;
+
+    uint32_t in = 0, out = 0, seq = 0, worst = 0, noise = 99;
+    for (uint32_t nowMs = 0; nowMs < 86400000UL; nowMs += 250) {
+        noise = noise * 1103515245 + 12345;
+        bool rushHour = ((nowMs / 3600000UL) % 8) == 0;
+        if ((noise >> 16) % (rushHour ? 4 : 400) == 0) {
+            if (noise & 0x100) in++; else out++;
+            seq++;
+            c.eventCounted();
+        }
+        c.service(in, out, seq, nowMs);
+
+        const CheckpointRecord &saved = c.lastWritten();
+        uint32_t lost = (in - saved.inCount) + (out - saved.outCount);
+        if (lost > worst) worst = lost;
+    }
+    writes = c.writes;
+    return worst;
+}
+
+void test_settings_trade_writes_for_lost_counts(void)
+{
+    uint32_t oftenWrites, rarelyWrites;
+    uint32_t oftenLoss  = worstLoss(10000, 5, oftenWrites);
+    uint32_t rarelyLoss = worstLoss(600000, 100, rarelyWrites);
+
+    TEST_ASSERT_LESS_OR_EQUAL(5, oftenLoss);
+    TEST_ASSERT_LESS_OR_EQUAL(100, rarelyLoss);
+    TEST_ASSERT_GREATER_THAN(oftenLoss * 5, rarelyLoss);
+    TEST_ASSERT_GREATER_THAN(rarelyWrites * 5, oftenWrites);
+
+    char message[80];
+    snprintf(message, sizeof(message), "10 s/5: %lu writes, 600 s/100: %lu writes in a day",
+             (unsigned long)oftenWrites, (unsigned long)rarelyWrites);
+    TEST_MESSAGE(message);
+}
+
+void test_idle_writes_nothing(void)
+{
+    fs::FS           disk;
+    CountCheckpoint  c;
+    CheckpointRecord r;
+    c.restore(disk, r);
+    c.write(5, 5, 10, 0);
+    for (uint32_t nowMs = 0; nowMs < 3600000UL; nowMs += 1000) c.service(5, 5, 10, nowMs);
+    TEST_ASSERT_EQUAL_UINT32(1, c.writes);
+
+    c.service(6, 5, 11, 3600000UL); // Changed, but not due: the clock restarted while idle.
+    TEST_ASSERT_EQUAL_UINT32(1, c.writes);
+    c.service(6, 5, 11, 3600000UL + c.intervalMs);
+    TEST_ASSERT_EQUAL_UINT32(2, c.writes);
+}
+
+int main(int, char **)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_nothing_to_restore);
+    RUN_TEST(test_newest_is_restored);
+    RUN_TEST(test_torn_write_at_every_byte);
+    RUN_TEST(test_corrupt_newest_falls_back);
+    RUN_TEST(test_truncated_journal);
+    RUN_TEST(test_settings_trade_writes_for_lost_counts);
+    RUN_TEST(test_idle_writes_nothing);
+    return UNITY_END();
+}
@@ -0,0 +1,114 @@
+/* test_commands
+ *
+ *  The command table: sort checking, lookup against a fixed buffer, the
+ *  value parsers and the menu lines.
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#include <unity.h>
+#include <digameCommands.h>
+
+void setUp(void) {}
+void tearDown(void) {}
+
+static int   calls     = 0;
+static float lastValue = 0;
+
+static void onCommand(const CommandArg &arg) { calls++; lastValue = arg.number; }
+static void describeThreshold(char *buffer, size_t bufferSize) { snprintf(buffer, bufferSize, "%.1f", 1500.0); }
+
+// As main.cpp's table: sorted on name, checked when it's compiled.
+constexpr Command commands[] = {
+//    name  help                     prompt           parser          handler    describer          flags
+    { "+",  "[+]Reset counts",       nullptr,         nullptr,        onCommand, nullptr,           COMMAND_QUIET },
+    { "d",  "[d]istance threshold",  "Threshold (mm)", parseNumberArg, onCommand, describeThreshold, 0 },
+    { "g",  "[g]raph",               nullptr,         nullptr,        onCommand, nullptr,           0 },
+    { "n",  "[n]ame",                "New name",      parseTextArg,   onCommand, nullptr,           0 },
+    { "ss", "[ss]ave settings",      nullptr,         nullptr,        onCommand, nullptr,           0 },
+};
+const size_t COMMAND_COUNT = sizeof(commands) / sizeof(commands[0]);
+static_assert(commandTableSorted(commands, COMMAND_COUNT), "Command table must be sorted by name.");
+
+constexpr Command unsorted[] = {
+    { "g", "", nullptr, nullptr, onCommand, nullptr, 0 },
+    { "d", "", nullptr, nullptr, onCommand, nullptr, 0 },
+};
+static_assert(!commandTableSorted(unsorted, 2), "Out-of-order names are caught.");
+static_assert(commandNameCompare("s", "ss") < 0, "A prefix sorts first.");
+
+void test_every_command_is_found(void)
+{
+    for (size_t i = 0; i < COMMAND_COUNT; i++) {
+        char typed[8]; // A fixed buffer, as the line assembler hands over.
+        strncpy(typed, commands[i].name, sizeof(typed));
+        TEST_ASSERT_TRUE(findCommand(commands, COMMAND_COUNT, typed) == &commands[i]);
+    }
+}
+
+void test_unknown_commands_are_not_found(void)
+{
+    TEST_ASSERT_NULL(findCommand(commands, COMMAND_COUNT, "s"));
+    TEST_ASSERT_NULL(findCommand(commands, COMMAND_COUNT, "sss"));
+    TEST_ASSERT_NULL(findCommand(commands, COMMAND_COUNT, ""));
+    TEST_ASSERT_NULL(findCommand(commands, COMMAND_COUNT, "z"));
+    TEST_ASSERT_NULL(findCommand(commands, 0, "d"));
+}
+
+void test_number_parser(void)
+{
+    CommandArg arg;
+    TEST_ASSERT_TRUE(parseNumberArg("1250.5", arg));
+    TEST_ASSERT_FLOAT_WITHIN(0.001, 1250.5, arg.number);
+    TEST_ASSERT_FALSE(parseNumberArg("", arg));
+    TEST_ASSERT_FALSE(parseNumberArg("12mm", arg));
+    TEST_ASSERT_FALSE(parseNumberArg("mm", arg));
+}
+
+void test_text_parser(void)
+{
+    CommandArg arg;
+    TEST_ASSERT_TRUE(parseTextArg("Door 3", arg));
+    TEST_ASSERT_EQUAL_STRING("Door 3", arg.text);
+    TEST_ASSERT_FALSE(parseTextArg("", arg));
+}
+
+void test_dispatch_with_a_value(void)
+{
+    const Command *cmd = findCommand(commands, COMMAND_COUNT, "d");
+    TEST_ASSERT_NOT_NULL(cmd);
+    TEST_ASSERT_NOT_NULL(cmd->prompt);
+
+    CommandArg arg;
+    calls = 0;
+    if (cmd->parse("900", arg)) cmd->handler(arg);
+    TEST_ASSERT_EQUAL(1, calls);
+    TEST_ASSERT_FLOAT_WITHIN(0.001, 900, lastValue);
+    if (cmd->parse("nine hundred", arg)) cmd->handler(arg);
+    TEST_ASSERT_EQUAL(1, calls);
+}
+
+void test_menu_lines(void)
+{
+    char line[80];
+    formatCommandHelp(commands[1], line, sizeof(line));
+    TEST_ASSERT_EQUAL_STRING("  [d]istance threshold (1500.0)", line);
+    formatCommandHelp(commands[2], line, sizeof(line));
+    TEST_ASSERT_EQUAL_STRING("  [g]raph", line);
+
+    char small[10];
+    formatCommandHelp(commands[1], small, sizeof(small)); // Cut short, never overrun.
+    TEST_ASSERT_EQUAL(9, strlen(small));
+}
+
+int main(int, char **)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_every_command_is_found);
+    RUN_TEST(test_unknown_commands_are_not_found);
+    RUN_TEST(test_number_parser);
+    RUN_TEST(test_text_parser);
+    RUN_TEST(test_dispatch_with_a_value);
+    RUN_TEST(test_menu_lines);
+    return UNITY_END();
+}
@@ -0,0 +1,261 @@
+/* test_control
+ *
+ *  The control protocol over a loopback link. The device side is a cut-down
+ *  handleControlFrame(), the client side is built from the same framing, as
+ *  tools/digame_control.py does it. Requests are pipelined, and console text
+ *  and line noise are mixed in with them.
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#include <unity.h>
+#include <string>
+#include <vector>
+#include <digameControl.h>
+
+void setUp(void) {}
+void tearDown(void) {}
+
+//*****************************************************************************
+// The device end: a decoder in front of the console, and a handler.
+struct Device
+{
+    ControlDecoder       decoder;
+    std::string          consoleText; // What the line assembler would have seen.
+    std::vector<uint8_t> sent;        // Responses, in order.
+    uint32_t             inCount  = 12;
+    uint32_t             outCount = 7;
+    char                 name[32] = "Door 1";
+
+    void receive(const std::vector<uint8_t> &bytes, uint32_t nowMs)
+    {
+        for (uint8_t b : bytes) {
+            ControlFeedResult result = decoder.feed(b, nowMs);
+            if (result == CONTROL_FRAME_READY) handle();
+            else if (result == CONTROL_NOT_MINE) consoleText += (char)b;
+        }
+    }
+
+    void handle()
+    {
+        uint8_t respPayload[CONTROL_MAX_PAYLOAD];
+        uint8_t frame[CONTROL_MAX_FRAME];
+
+        PayloadReader req(decoder.payload, decoder.payloadLen);
+        PayloadWriter resp(respPayload + 1, sizeof(respPayload) - 1);
+        uint8_t       status = CONTROL_OK;
+
+        switch (decoder.opcode) {
+            case CONTROL_PING:
+                break;
+            case CONTROL_GET_COUNTS:
+                resp.putU32(inCount);
+                resp.putU32(outCount);
+                break;
+            case CONTROL_GET_CONFIG:
+                if (req.getU8() != CONFIG_KEY_DEVICE_NAME) { status = CONTROL_BAD_KEY; break; }
+                resp.putU8(CONFIG_KEY_DEVICE_NAME);
+                resp.put(name, strlen(name));
+                break;
+            case CONTROL_SET_CONFIG: {
+                if (req.getU8() != CONFIG_KEY_DEVICE_NAME) { status = CONTROL_BAD_KEY; break; }
+                size_t n = req.remaining();
+                if ((n == 0) || (n >= sizeof(name))) { status = CONTROL_BAD_REQUEST; break; }
+                memcpy(name, req.rest(), n);
+                name[n] = 0;
+                break;
+            }
+            default:
+                status = CONTROL_UNKNOWN_OPCODE;
+                break;
+        }
+        if (req.underflowed()) status = CONTROL_BAD_REQUEST;
+
+        respPayload[0] = status;
+        size_t len = encodeControlFrame(frame, sizeof(frame), decoder.requestId, decoder.opcode | CONTROL_RESPONSE_FLAG,
+                                        respPayload, (status == CONTROL_OK) ? resp.length() + 1 : 1);
+        sent.insert(sent.end(), frame, frame + len);
+    }
+};
+
+//*****************************************************************************
+// The client end.
+struct Response
+{
+    uint16_t             requestId;
+    uint8_t              opcode;
+    uint8_t              status;
+    std::vector<uint8_t> payload; // After the status byte.
+};
+
+static std::vector<uint8_t> request(uint16_t id, uint8_t opcode, const void *payload = NULL, size_t length = 0)
+{
+    uint8_t frame[CONTROL_MAX_FRAME];
+    size_t  n = encodeControlFrame(frame, sizeof(frame), id, opcode, (const uint8_t *)payload, length);
+    return std::vector<uint8_t>(frame, frame + n);
+}
+
+static std::vector<Response> responses(const std::vector<uint8_t> &bytes)
+{
+    ControlDecoder        d;
+    std::vector<Response> out;
+    for (uint8_t b : bytes) {
+        if (d.feed(b, 0) != CONTROL_FRAME_READY) continue;
+        Response r;
+        r.requestId = d.requestId;
+        r.opcode    = d.opcode;
+        r.status    = d.payloadLen ? d.payload[0] : 0xFF;
+        if (d.payloadLen > 1) r.payload.assign(d.payload + 1, d.payload + d.payloadLen);
+        out.push_back(r);
+    }
+    return out;
+}
+
+static void append(std::vector<uint8_t> &to, const std::vector<uint8_t> &bytes) { to.insert(to.end(), bytes.begin(), bytes.end()); }
+static void append(std::vector<uint8_t> &to, const char *text) { to.insert(to.end(), text, text + strlen(text)); }
+
+//*****************************************************************************
+void test_pipelined_requests_are_answered_in_order(void)
+{
+    Device               device;
+    std::vector<uint8_t> link;
+    uint8_t              setName[] = { CONFIG_KEY_DEVICE_NAME, 'R', 'e', 'a', 'r' };
+    uint8_t              getName[] = { CONFIG_KEY_DEVICE_NAME };
+
+    append(link, request(100, CONTROL_PING));
+    append(link, request(101, CONTROL_GET_COUNTS));
+    append(link, request(102, CONTROL_SET_CONFIG, setName, sizeof(setName)));
+    append(link, request(103, CONTROL_GET_CONFIG, getName, sizeof(getName)));
+    append(link, request(104, 0x7E));
+    device.receive(link, 0);
+
+    std::vector<Response> r = responses(device.sent);
+    TEST_ASSERT_EQUAL(5, r.size());
+    for (size_t i = 0; i < r.size(); i++) TEST_ASSERT_EQUAL(100 + i, r[i].requestId);
+
+    TEST_ASSERT_EQUAL_HEX8(CONTROL_PING | CONTROL_RESPONSE_FLAG, r[0].opcode);
+    TEST_ASSERT_EQUAL(CONTROL_OK, r[0].status);
+
+    PayloadReader counts(r[1].payload.data(), r[1].payload.size());
+    TEST_ASSERT_EQUAL_UINT32(12, counts.getU32());
+    TEST_ASSERT_EQUAL_UINT32(7, counts.getU32());
+    TEST_ASSERT_FALSE(counts.underflowed());
+
+    TEST_ASSERT_EQUAL(CONTROL_OK, r[2].status);
+    TEST_ASSERT_EQUAL(5, r[3].payload.size());
+    TEST_ASSERT_EQUAL_MEMORY("Rear", r[3].payload.data() + 1, 4);
+    TEST_ASSERT_EQUAL(CONTROL_UNKNOWN_OPCODE, r[4].status);
+}
+
+void test_console_text_passes_through(void)
+{
+    Device               device;
+    std::vector<uint8_t> link;
+
+    append(link, "g\r\n");
+    append(link, request(1, CONTROL_PING));
+    append(link, "n\r\nDoor 2\r\n");
+    append(link, request(2, CONTROL_PING));
+    device.receive(link, 0);
+
+    TEST_ASSERT_EQUAL_STRING("g\r\nn\r\nDoor 2\r\n", device.consoleText.c_str());
+    TEST_ASSERT_EQUAL(2, responses(device.sent).size());
+}
+
+void test_bad_crc_is_dropped_and_the_next_frame_read(void)
+{
+    Device               device;
+    std::vector<uint8_t> bad = request(1, CONTROL_PING);
+    bad[bad.size() - 1] ^= 0x40;
+
+    std::vector<uint8_t> link = bad;
+    append(link, request(2, CONTROL_PING));
+    device.receive(link, 0);
+
+    std::vector<Response> r = responses(device.sent);
+    TEST_ASSERT_EQUAL(1, r.size());
+    TEST_ASSERT_EQUAL(2, r[0].requestId);
+    TEST_ASSERT_EQUAL_UINT32(1, device.decoder.crcErrors);
+}
+
+void test_stalled_frame_times_out(void)
+{
+    Device               device;
+    std::vector<uint8_t> frame = request(1, CONTROL_GET_COUNTS);
+
+    device.receive(std::vector<uint8_t>(frame.begin(), frame.begin() + 4), 1000);
+    TEST_ASSERT_TRUE(device.decoder.inFrame());
+
+    // The rest never comes. Typing after the timeout is console text again.
+    std::vector<uint8_t> typed;
+    append(typed, "?\n");
+    device.receive(typed, 1000 + CONTROL_FRAME_TIMEOUT_MS + 1);
+    TEST_ASSERT_EQUAL_UINT32(1, device.decoder.timeouts);
+    TEST_ASSERT_EQUAL_STRING("?\n", device.consoleText.c_str());
+}
+
+void test_oversize_frame_is_refused(void)
+{
+    Device  device;
+    uint8_t header[] = { CONTROL_SYNC1, CONTROL_SYNC2, 0xFF, 0x7F, 1, 0, CONTROL_PING };
+    device.receive(std::vector<uint8_t>(header, header + sizeof(header)), 0);
+    TEST_ASSERT_EQUAL_UINT32(1, device.decoder.oversizeFrames);
+    TEST_ASSERT_FALSE(device.decoder.inFrame());
+
+    uint8_t big[CONTROL_MAX_PAYLOAD + 1] = {};
+    uint8_t frame[CONTROL_MAX_FRAME + 1];
+    TEST_ASSERT_EQUAL(0, encodeControlFrame(frame, sizeof(frame), 1, CONTROL_PING, big, sizeof(big)));
+}
+
+void test_noise_never_loses_a_request(void)
+{
+    Device               device;
+    std::vector<uint8_t> link;
+    uint32_t             noise = 7;
+
+    for (uint16_t id = 1; id <= 200; id++) {
+        for (int i = 0; i < 5; i++) {
+            noise = noise * 1103515245 + 12345;
+            uint8_t b = (uint8_t)(noise >> 16);
+            if (b == CONTROL_SYNC1) b = ' '; // Noise that can't start a frame.
+            link.push_back(b);
+        }
+        append(link, request(id, CONTROL_PING));
+    }
+    device.receive(link, 0);
+
+    std::vector<Response> r = responses(device.sent);
+    TEST_ASSERT_EQUAL(200, r.size());
+    TEST_ASSERT_EQUAL(200, r.back().requestId);
+}
+
+void test_payload_reader_and_writer_bounds(void)
+{
+    uint8_t       buffer[6];
+    PayloadWriter w(buffer, sizeof(buffer));
+    w.putU32(0x01020304);
+    w.putU16(0xBEEF);
+    TEST_ASSERT_FALSE(w.overflowed());
+    w.putU8(1);
+    TEST_ASSERT_TRUE(w.overflowed());
+    TEST_ASSERT_EQUAL(6, w.length());
+
+    PayloadReader r(buffer, sizeof(buffer));
+    TEST_ASSERT_EQUAL_HEX32(0x01020304, r.getU32());
+    TEST_ASSERT_EQUAL_UINT16(0xBEEF, r.getU16());
+    r.getU8();
+    TEST_ASSERT_TRUE(r.underflowed());
+}
+
+int main(int, char **)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_pipelined_requests_are_answered_in_order);
+    RUN_TEST(test_console_text_passes_through);
+    RUN_TEST(test_bad_crc_is_dropped_and_the_next_frame_read);
+    RUN_TEST(test_stalled_frame_times_out);
+    RUN_TEST(test_oversize_frame_is_refused);
+    RUN_TEST(test_noise_never_loses_a_request);
+    RUN_TEST(test_payload_reader_and_writer_bounds);
+    return UNITY_END();
+}
@@ -0,0 +1,184 @@
+/* test_deflate
+ *
+ *  The page compressor against the firmware decompressor: everything
+ *  GzipDeflater makes must come back byte for byte through GzipInflater,
+ *  whether it's text, runs, incompressible noise, or matches right at the
+ *  edge of the window.
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#include <unity.h>
+#include <digameDeflate.h>
+#include <digameInflate.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+void setUp(void) {}
+void tearDown(void) {}
+
+static bool collect(void *context, const uint8_t *data, size_t length)
+{
+    std::vector<uint8_t> *out = (std::vector<uint8_t> *)context;
+    out->insert(out->end(), data, data + length);
+    return true;
+}
+
+// Compress, check the gzip framing, and inflate again `piece` bytes at a
+// time. Returns the compressed size.
+static size_t roundTrip(const std::vector<uint8_t> &data, size_t piece = 4096)
+{
+    std::vector<uint8_t> packed;
+    TEST_ASSERT_TRUE(GzipDeflater::compress(data.data(), data.size(), packed));
+    TEST_ASSERT_TRUE(GzipInflater::isGzip(packed.data(), packed.size()));
+    TEST_ASSERT_EQUAL_HEX8(8, packed[2]); // Deflate...
+    TEST_ASSERT_EQUAL_HEX8(0, packed[3]); // ...no name or comment.
+
+    uint32_t crc = 0, length = 0;
+    for (int i = 0; i < 4; i++) crc |= (uint32_t)packed[packed.size() - 8 + i] << (8 * i);
+    for (int i = 0; i < 4; i++) length |= (uint32_t)packed[packed.size() - 4 + i] << (8 * i);
+    TEST_ASSERT_EQUAL_HEX32(crc32(data.data(), data.size()), crc);
+    TEST_ASSERT_EQUAL_UINT32(data.size(), length);
+
+    std::vector<uint8_t> out;
+    GzipInflater         inflater(collect, &out);
+    InflateResult        result = INFLATE_MORE;
+    for (size_t at = 0; at < packed.size(); at += piece) {
+        size_t n = (packed.size() - at < piece) ? packed.size() - at : piece;
+        result   = inflater.write(packed.data() + at, n);
+        TEST_ASSERT_NOT_EQUAL(INFLATE_ERROR, result);
+    }
+    TEST_ASSERT_EQUAL(INFLATE_DONE, inflater.finish());
+    TEST_ASSERT_EQUAL_UINT32(data.size(), out.size());
+    TEST_ASSERT_TRUE(out == data);
+    return packed.size();
+}
+
+static std::vector<uint8_t> bytes(const std::string &s) { return std::vector<uint8_t>(s.begin(), s.end()); }
+
+// Something like a page: markup with repeats near and far.
+static std::vector<uint8_t> pageLike(size_t size)
+{
+    static const char *words[] = {"<tr><td>", "</td></tr>\n", "counter", "visitor", " class=\"counts\"",
+                                  "<option value=\"", "\">", "</option>\n", "Digame", " Hz", "&middot;"};
+    std::string s;
+    uint32_t    seed = 12345;
+    while (s.size() < size) {
+        seed = seed * 1103515245 + 12345;
+        s += words[(seed >> 16) % 11];
+        if ((seed >> 8) % 7 == 0) s += std::to_string(seed % 1000);
+    }
+    s.resize(size);
+    return bytes(s);
+}
+
+//*****************************************************************************
+void test_small_inputs(void)
+{
+    roundTrip(std::vector<uint8_t>());
+    roundTrip(bytes("a"));
+    roundTrip(bytes("ab"));
+    roundTrip(bytes("abc"));
+    roundTrip(bytes("abcabc"));   // The shortest match.
+    roundTrip(bytes("aaaaaaaa")); // Distance 1, overlapping its own output.
+    std::vector<uint8_t> all;
+    for (int i = 0; i < 256; i++) all.push_back(i); // Every literal code length.
+    roundTrip(all);
+}
+
+void test_pages_round_trip_and_shrink(void)
+{
+    const size_t sizes[] = {100, 1556, 4000, 8192, 20000, DEFLATE_MAX_INPUT};
+    for (size_t size : sizes) {
+        std::vector<uint8_t> page   = pageLike(size);
+        size_t               packed = roundTrip(page);
+        if (size >= 1000) TEST_ASSERT_LESS_THAN(page.size() / 2, packed);
+    }
+
+    std::vector<uint8_t> page = pageLike(6000);
+    const size_t pieces[] = {1, 3, 64, 1460};
+    for (size_t piece : pieces) roundTrip(page, piece);
+}
+
+// Runs take the longest matches (258); noise takes none, and grows by a
+// little over an eighth (the 9-bit literals) plus the framing.
+void test_runs_and_noise(void)
+{
+    std::vector<uint8_t> zeros(DEFLATE_MAX_INPUT, 0);
+    TEST_ASSERT_LESS_THAN(1000, roundTrip(zeros));
+
+    std::vector<uint8_t> noise(DEFLATE_MAX_INPUT);
+    uint32_t             seed = 1;
+    for (auto &b : noise) b = (seed = seed * 1664525 + 1013904223) >> 24;
+    size_t packed = roundTrip(noise);
+    TEST_ASSERT_LESS_THAN(noise.size() * 9 / 8 + 64, packed);
+}
+
+// A block repeated at exactly the window size can be matched; one a byte
+// further can't, and mustn't be referenced.
+void test_window_edge(void)
+{
+    std::vector<uint8_t> block(300), filler(DEFLATE_WINDOW_SIZE - block.size()), data;
+    uint32_t             seed = 7;
+    for (auto &b : block) b = (seed = seed * 1664525 + 1013904223) >> 24;
+    for (auto &b : filler) b = (seed = seed * 1664525 + 1013904223) >> 24;
+
+    data = block;
+    data.insert(data.end(), filler.begin(), filler.end());
+    data.insert(data.end(), block.begin(), block.end()); // At distance DEFLATE_WINDOW_SIZE.
+    size_t within = roundTrip(data);
+
+    data = block;
+    data.insert(data.end(), filler.begin(), filler.end());
+    data.push_back(0);
+    data.insert(data.end(), block.begin(), block.end()); // One byte too far.
+    size_t beyond = roundTrip(data);
+
+    TEST_ASSERT_GREATER_THAN(within + 250, beyond); // The first got its match, the second didn't.
+}
+
+void test_too_big_is_refused(void)
+{
+    std::vector<uint8_t> big(DEFLATE_MAX_INPUT + 1, 'x'), out;
+    TEST_ASSERT_FALSE(GzipDeflater::compress(big.data(), big.size(), out));
+    TEST_ASSERT_EQUAL_UINT32(0, out.size());
+}
+
+// Compression speed and ratio on the real page, when the test can find it.
+void test_index_html(void)
+{
+    const char *path = getenv("INDEX_HTML") ? getenv("INDEX_HTML") : "data/index.html";
+    FILE       *f    = fopen(path, "rb");
+    if (!f) TEST_IGNORE_MESSAGE("data/index.html not found: run from the project directory, or set INDEX_HTML");
+    std::vector<uint8_t> page;
+    int                  c;
+    while ((c = fgetc(f)) != EOF) page.push_back(c);
+    fclose(f);
+
+    size_t packed = roundTrip(page);
+    auto   start  = std::chrono::steady_clock::now();
+    const int rounds = 200;
+    for (int i = 0; i < rounds; i++) {
+        std::vector<uint8_t> out;
+        GzipDeflater::compress(page.data(), page.size(), out);
+    }
+    double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / rounds;
+
+    char message[120];
+    snprintf(message, sizeof(message), "%s: %u -> %u bytes (%.0f%%), %.1f us per page on this host", path,
+             (unsigned)page.size(), (unsigned)packed, 100.0 * packed / page.size(), us);
+    TEST_MESSAGE(message);
+}
+
+int main(int, char **)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_small_inputs);
+    RUN_TEST(test_pages_round_trip_and_shrink);
+    RUN_TEST(test_runs_and_noise);
+    RUN_TEST(test_window_edge);
+    RUN_TEST(test_too_big_is_refused);
+    RUN_TEST(test_index_html);
+    return UNITY_END();
+}
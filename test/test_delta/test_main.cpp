@@ -0,0 +1,551 @@
+/* test_delta
+ *
+ *  DeltaPatcher against a DeltaTarget in RAM: patches fed in pieces of every
+ *  size rebuild the new image byte for byte, COPY comes out a slice per
+ *  write() as used() and copying() say, and a patch that's cut short or
+ *  reaches outside either image is refused.
+ *
+ *  No firmware can be built on this host, so the images here are made up:
+ *  code-like words with a sprinkling of addresses, and an insertion that
+ *  moves everything after it, as a small code change does. To try two
+ *  real builds, make a patch with tools/make_delta.py and set
+ *  DELTA_OLD_IMAGE, DELTA_NEW_IMAGE and DELTA_PATCH (the .delta.gz).
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#include <unity.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <digameDelta.h>
+#include <digameInflate.h>
+#include <digameSha256.h>
+
+void setUp(void) {}
+void tearDown(void) {}
+
+typedef std::vector<uint8_t> Bytes;
+
+static uint32_t noise = 2022;
+static uint32_t nextRandom()
+{
+    noise ^= noise << 13;
+    noise ^= noise >> 17;
+    noise ^= noise << 5;
+    return noise;
+}
+
+static void sha256(const Bytes &data, uint8_t *digest)
+{
+    Sha256 sha;
+    sha.begin();
+    sha.update(data.data(), data.size());
+    sha.finish(digest);
+}
+
+//*****************************************************************************
+// As OtaDeltaTarget does: check the old image's hash, then take the new one.
+class RamTarget : public DeltaTarget
+{
+  public:
+    Bytes  old;
+    Bytes  made;
+    size_t readSince    = 0; // Old image bytes read since the caller last looked.
+    size_t writeLimit   = (size_t)-1;
+    bool   failRead     = false;
+    bool   begun        = false;
+
+    const char *begin(const DeltaHeader &header) override
+    {
+        uint8_t digest[SHA256_LENGTH];
+        sha256(old, digest);
+        if ((header.oldSize != old.size()) || memcmp(digest, header.oldSha256, sizeof(digest))) {
+            return "Patch is not for the firmware that's running";
+        }
+        memcpy(expected, header.newSha256, sizeof(expected));
+        begun = true;
+        return nullptr;
+    }
+
+    bool readOld(uint32_t offset, uint8_t *buffer, size_t length) override
+    {
+        TEST_ASSERT_TRUE(offset + length <= old.size()); // The patcher checks, not us.
+        if (failRead) return false;
+        memcpy(buffer, old.data() + offset, length);
+        readSince += length;
+        return true;
+    }
+
+    bool write(const uint8_t *data, size_t length) override
+    {
+        if (made.size() + length > writeLimit) return false;
+        made.insert(made.end(), data, data + length);
+        return true;
+    }
+
+    bool verify()
+    {
+        uint8_t digest[SHA256_LENGTH];
+        sha256(made, digest);
+        return memcmp(digest, expected, sizeof(digest)) == 0;
+    }
+
+  private:
+    uint8_t expected[SHA256_LENGTH];
+};
+
+//*****************************************************************************
+// Puts a patch together an operation at a time, as make_delta.py writes one.
+struct PatchBuilder
+{
+    Bytes patch;
+
+    void u8(uint8_t v) { patch.push_back(v); }
+    void u16(uint16_t v) { u8(v); u8(v >> 8); }
+    void u32(uint32_t v) { u16(v); u16(v >> 16); }
+
+    PatchBuilder(const Bytes &old, const Bytes &made, size_t extraHeader = 0)
+    {
+        uint8_t digest[SHA256_LENGTH];
+        u32(DELTA_MAGIC);
+        u16(DELTA_VERSION);
+        u16(sizeof(DeltaHeader) + extraHeader);
+        u32(old.size());
+        u32(made.size());
+        sha256(old, digest);
+        patch.insert(patch.end(), digest, digest + sizeof(digest));
+        sha256(made, digest);
+        patch.insert(patch.end(), digest, digest + sizeof(digest));
+        patch.insert(patch.end(), extraHeader, 0xEE); // A later version's fields.
+    }
+
+    void copy(uint32_t offset, uint32_t length) { u8(DELTA_COPY); u32(offset); u32(length); }
+    void add(const uint8_t *data, uint32_t length)
+    {
+        u8(DELTA_ADD);
+        u32(length);
+        patch.insert(patch.end(), data, data + length);
+    }
+    void diff(const Bytes &old, uint32_t offset, const uint8_t *target, uint32_t length)
+    {
+        u8(DELTA_DIFF);
+        u32(offset);
+        u32(length);
+        for (uint32_t i = 0; i < length; i++) u8(target[i] - old[offset + i]);
+    }
+    void end() { u8(DELTA_END); }
+};
+
+//*****************************************************************************
+// A made-up image: words of code, every few an address into the image.
+static const uint32_t IMAGE_BASE = 0x400D0000;
+
+static Bytes oldImage(size_t size)
+{
+    Bytes image(size);
+    for (size_t i = 0; i + 4 <= size; i += 4) {
+        uint32_t word = (i % 32 == 0) ? IMAGE_BASE + (nextRandom() % size & ~3u) : nextRandom() % 4096;
+        memcpy(&image[i], &word, 4);
+    }
+    return image;
+}
+
+// The same build with insertion bytes added at the given offset: everything
+// after moves, and so do the addresses pointing there.
+static Bytes newImage(const Bytes &old, size_t at, size_t insertion)
+{
+    Bytes image(old.begin(), old.begin() + at);
+    for (size_t i = 0; i < insertion; i++) image.push_back(0xA0 + i);
+    image.insert(image.end(), old.begin() + at, old.end());
+    for (size_t i = 0; i + 4 <= image.size(); i++) {
+        size_t from = (i < at) ? i : i - insertion;
+        if (((i >= at) && (i < at + insertion)) || (from % 32)) continue;
+        uint32_t word;
+        memcpy(&word, &image[i], 4);
+        if (word - IMAGE_BASE >= at) word += insertion;
+        memcpy(&image[i], &word, 4);
+    }
+    return image;
+}
+
+// A patch like make_delta.py's for newImage(): what's before the insertion
+// and what's after as DIFFs, the moved addresses being all that differ.
+static Bytes insertionPatch(const Bytes &old, const Bytes &made, size_t at, size_t insertion)
+{
+    PatchBuilder p(old, made);
+    p.diff(old, 0, &made[0], at);
+    p.add(&made[at], insertion);
+    p.diff(old, at, &made[at + insertion], old.size() - at);
+    p.end();
+    return p.patch;
+}
+
+//*****************************************************************************
+// Feed a patch as AsyncElegantOTA does: each piece until it's used up and
+// any COPY finished. Pieces are given by size(); 0 means the whole patch.
+// Checks the used()/copying() contract and the COPY slice on every call.
+struct Run
+{
+    RamTarget    target;
+    DeltaPatcher patcher;
+    size_t       calls      = 0;
+    size_t       mostRead   = 0; // Of the old image in one write().
+    size_t       emptyCalls = 0; // write() with nothing but a COPY to carry on.
+
+    Run() : patcher(target) {}
+
+    PatchResult feed(const Bytes &patch, size_t (*size)())
+    {
+        PatchResult r = PATCH_MORE;
+        size_t      at = 0;
+
+        while ((at < patch.size()) && (r == PATCH_MORE)) {
+            size_t         piece  = size ? size() : patch.size();
+            size_t         length = (piece < patch.size() - at) ? piece : patch.size() - at;
+            const uint8_t *data   = &patch[at];
+            at += length;
+
+            while (length || patcher.copying()) {
+                target.readSince = 0;
+                r = patcher.write(data, length);
+                calls++;
+                if (!length) emptyCalls++;
+                if (target.readSince > mostRead) mostRead = target.readSince;
+                if (r == PATCH_ERROR) return r;
+
+                // A DIFF reads as much as it's given; a COPY, a slice at most.
+                TEST_ASSERT_TRUE(target.readSince <= DELTA_COPY_SLICE + patcher.used());
+
+                TEST_ASSERT_TRUE(patcher.used() <= length);
+                if (patcher.used() < length) TEST_ASSERT_TRUE(patcher.copying()); // Only a slice stops it early.
+                data   += patcher.used();
+                length -= patcher.used();
+            }
+        }
+        return (r == PATCH_DONE) ? r : patcher.finish();
+    }
+};
+
+static size_t oneByte() { return 1; }
+static size_t randomPiece() { return 1 + nextRandom() % 1500; }
+static size_t randomSmall() { return 1 + nextRandom() % 23; }
+
+static void rebuilds(const Bytes &old, const Bytes &made, const Bytes &patch, size_t (*size)(), Run &run)
+{
+    run.target.old = old;
+    TEST_ASSERT_EQUAL_MESSAGE(PATCH_DONE, run.feed(patch, size), run.patcher.error());
+    TEST_ASSERT_EQUAL_UINT32(made.size(), run.target.made.size());
+    TEST_ASSERT_TRUE(run.target.made == made);
+    TEST_ASSERT_TRUE(run.target.verify());
+    TEST_ASSERT_EQUAL_UINT32(made.size(), run.patcher.outputLength());
+}
+
+//*****************************************************************************
+void test_rebuilds_in_pieces_of_every_size(void)
+{
+    Bytes old   = oldImage(300000);
+    Bytes made  = newImage(old, 100000, 6);
+    Bytes patch = insertionPatch(old, made, 100000, 6);
+
+    size_t (*sizes[])() = { oneByte, randomSmall, randomPiece, nullptr };
+    for (size_t (*size)() : sizes) {
+        Run run;
+        rebuilds(old, made, patch, size, run);
+        TEST_ASSERT_EQUAL_UINT32(old.size(), run.patcher.copiedLength()); // All of it, by COPY or DIFF.
+    }
+
+    // The DIFFs are nearly all zeros: only the moved addresses changed,
+    // a byte or two of each.
+    size_t nonzero = 0;
+    for (size_t i = sizeof(DeltaHeader); i < patch.size(); i++) nonzero += patch[i] != 0;
+    TEST_ASSERT_LESS_THAN(2 * old.size() / 32 + 100, nonzero);
+}
+
+void test_many_operations_and_a_longer_header(void)
+{
+    Bytes old = oldImage(64 * 1024);
+    Bytes made;
+    PatchBuilder *p = nullptr;
+
+    // Shuffle the old image's pieces around, with bytes added between them.
+    std::vector<std::pair<uint32_t, uint32_t> > copies;
+    for (int i = 0; i < 200; i++) {
+        uint32_t offset = nextRandom() % old.size();
+        uint32_t length = nextRandom() % 3000;
+        if (length > old.size() - offset) length = old.size() - offset;
+        copies.push_back(std::make_pair(offset, length));
+    }
+    for (size_t i = 0; i < copies.size(); i++) {
+        made.insert(made.end(), old.begin() + copies[i].first, old.begin() + copies[i].first + copies[i].second);
+        for (size_t k = 0; k < i % 5; k++) made.push_back(i + k);
+    }
+
+    p = new PatchBuilder(old, made, 20);
+    size_t at = 0;
+    for (size_t i = 0; i < copies.size(); i++) {
+        if (i % 3 == 0) p->copy(copies[i].first, copies[i].second);
+        else p->diff(old, copies[i].first, &made[at], copies[i].second);
+        at += copies[i].second;
+        if (i % 5) p->add(&made[at], i % 5);
+        at += i % 5;
+        if (i % 7 == 0) p->copy(0, 0); // Zero-length operations are allowed.
+    }
+    p->end();
+
+    size_t (*sizes[])() = { oneByte, randomPiece, nullptr };
+    for (size_t (*size)() : sizes) {
+        Run run;
+        rebuilds(old, made, p->patch, size, run);
+    }
+    delete p;
+}
+
+//*****************************************************************************
+void test_copy_comes_a_slice_at_a_time(void)
+{
+    Bytes old = oldImage(1000 * 1000);
+    PatchBuilder p(old, old);
+    p.copy(0, old.size());
+    p.end();
+
+    // The whole patch in one piece: one COPY of 1 MB, one slice per call.
+    Run run;
+    rebuilds(old, old, p.patch, nullptr, run);
+    size_t slices = (old.size() + DELTA_COPY_SLICE - 1) / DELTA_COPY_SLICE;
+    TEST_ASSERT_EQUAL_UINT32(slices, run.calls);
+    TEST_ASSERT_EQUAL_UINT32(DELTA_COPY_SLICE, run.mostRead);
+    TEST_ASSERT_EQUAL_UINT32(0, run.emptyCalls); // The END byte was still to come each time.
+
+    // Byte by byte, the COPY starts on the last of its arguments and is
+    // carried on by calls with nothing in them.
+    Run bytes;
+    rebuilds(old, old, p.patch, oneByte, bytes);
+    TEST_ASSERT_EQUAL_UINT32(slices - 1, bytes.emptyCalls);
+}
+
+void test_used_says_where_the_copy_stopped(void)
+{
+    Bytes old = oldImage(3 * DELTA_COPY_SLICE);
+    Bytes made(old.begin(), old.begin() + 2 * DELTA_COPY_SLICE + 100);
+    PatchBuilder p(old, made);
+    p.copy(0, 2 * DELTA_COPY_SLICE);
+    p.add(&made[2 * DELTA_COPY_SLICE], 100);
+    p.end();
+
+    RamTarget    target;
+    DeltaPatcher patcher(target);
+    target.old = old;
+
+    size_t copyEnds = sizeof(DeltaHeader) + 9;
+    TEST_ASSERT_EQUAL(PATCH_MORE, patcher.write(p.patch.data(), p.patch.size()));
+    TEST_ASSERT_EQUAL_UINT32(copyEnds, patcher.used()); // The ADD is left for next time.
+    TEST_ASSERT_TRUE(patcher.copying());
+    TEST_ASSERT_EQUAL_UINT32(DELTA_COPY_SLICE, target.made.size());
+
+    // The COPY's last slice, then the ADD: only copying is held back.
+    target.readSince = 0;
+    TEST_ASSERT_EQUAL(PATCH_DONE, patcher.write(p.patch.data() + copyEnds, p.patch.size() - copyEnds));
+    TEST_ASSERT_EQUAL_UINT32(p.patch.size() - copyEnds, patcher.used());
+    TEST_ASSERT_FALSE(patcher.copying());
+    TEST_ASSERT_EQUAL_UINT32(DELTA_COPY_SLICE, target.readSince);
+    TEST_ASSERT_TRUE(target.made == made);
+}
+
+void test_anything_after_the_end_is_used_up(void)
+{
+    Bytes old = oldImage(4096);
+    PatchBuilder p(old, old);
+    p.copy(0, old.size());
+    p.end();
+    for (int i = 0; i < 50; i++) p.u8(i); // E.g. padding from some other tool.
+
+    Run run; // Its loop would go round for ever if the tail were left unused.
+    rebuilds(old, old, p.patch, randomPiece, run);
+
+    RamTarget    target;
+    DeltaPatcher patcher(target);
+    target.old = old;
+    TEST_ASSERT_EQUAL(PATCH_DONE, patcher.write(p.patch.data(), p.patch.size()));
+    TEST_ASSERT_EQUAL_UINT32(p.patch.size(), patcher.used());
+    TEST_ASSERT_EQUAL(PATCH_DONE, patcher.write(p.patch.data(), 10));
+    TEST_ASSERT_EQUAL_UINT32(10, patcher.used());
+}
+
+//*****************************************************************************
+static std::string refusal(const Bytes &old, const Bytes &patch, size_t *written = nullptr)
+{
+    Run run;
+    run.target.old = old;
+    PatchResult r = run.feed(patch, randomPiece);
+    if (written) *written = run.target.made.size();
+    TEST_ASSERT_EQUAL(PATCH_ERROR, r);
+    TEST_ASSERT_EQUAL(PATCH_ERROR, run.patcher.finish()); // And stays refused.
+    return run.patcher.error();
+}
+
+void test_truncated_patch_is_refused(void)
+{
+    Bytes old   = oldImage(20000);
+    Bytes made  = newImage(old, 5000, 6);
+    Bytes patch = insertionPatch(old, made, 5000, 6);
+
+    // Every place it could stop, but the very end.
+    for (size_t cut = 0; cut < patch.size(); cut += (cut < 200) ? 1 : 97) {
+        Bytes part(patch.begin(), patch.begin() + cut);
+        TEST_ASSERT_EQUAL_STRING("Patch is truncated", refusal(old, part).c_str());
+    }
+    Bytes noEnd(patch.begin(), patch.end() - 1);
+    TEST_ASSERT_EQUAL_STRING("Patch is truncated", refusal(old, noEnd).c_str());
+}
+
+void test_bad_header_is_refused_before_anything_is_written(void)
+{
+    Bytes old  = oldImage(20000);
+    Bytes made = newImage(old, 5000, 6);
+    size_t written = 1;
+
+    Bytes patch = insertionPatch(old, made, 5000, 6);
+    patch[0] ^= 1;
+    TEST_ASSERT_EQUAL_STRING("Not a patch", refusal(old, patch, &written).c_str());
+    TEST_ASSERT_EQUAL_UINT32(0, written);
+
+    patch = insertionPatch(old, made, 5000, 6);
+    patch[4] = DELTA_VERSION + 1;
+    TEST_ASSERT_EQUAL_STRING("Unsupported patch version", refusal(old, patch).c_str());
+
+    patch = insertionPatch(old, made, 5000, 6);
+    patch[6] = sizeof(DeltaHeader) - 1;
+    TEST_ASSERT_EQUAL_STRING("Bad patch header", refusal(old, patch).c_str());
+
+    // Made against some other build.
+    Bytes other = old;
+    other[12345] ^= 0x40;
+    patch = insertionPatch(old, made, 5000, 6);
+    TEST_ASSERT_EQUAL_STRING("Patch is not for the firmware that's running", refusal(other, patch, &written).c_str());
+    TEST_ASSERT_EQUAL_UINT32(0, written);
+}
+
+void test_out_of_range_operations_are_refused(void)
+{
+    Bytes    old  = oldImage(20000);
+    Bytes    made = newImage(old, 5000, 6);
+    uint32_t size = old.size();
+
+    struct { uint8_t op; uint32_t offset, length; const char *why; } cases[] = {
+        { DELTA_COPY, size, 1, "Patch reads past the old image" },
+        { DELTA_COPY, size - 10, 11, "Patch reads past the old image" },
+        { DELTA_COPY, 0xFFFFFFF0u, 0x20, "Patch reads past the old image" }, // Wraps round.
+        { DELTA_DIFF, size - 50, 51, "Patch reads past the old image" },
+        { DELTA_COPY, 0, (uint32_t)made.size() + 1, "Patch makes too big an image" },
+        { DELTA_ADD, 0, (uint32_t)made.size() + 1, "Patch makes too big an image" },
+    };
+    for (auto &c : cases) {
+        PatchBuilder p(old, made);
+        p.copy(0, 100);
+        p.u8(c.op);
+        if (c.op != DELTA_ADD) p.u32(c.offset);
+        p.u32(c.length);
+        p.patch.insert(p.patch.end(), 100, 0); // Whatever might follow.
+        p.end();
+        size_t written = 0;
+        TEST_ASSERT_EQUAL_STRING(c.why, refusal(old, p.patch, &written).c_str());
+        TEST_ASSERT_EQUAL_UINT32(100, written); // Only what came before.
+    }
+
+    PatchBuilder bad(old, made);
+    bad.u8(DELTA_DIFF + 1);
+    TEST_ASSERT_EQUAL_STRING("Bad patch operation", refusal(old, bad.patch).c_str());
+
+    PatchBuilder shortOne(old, made);
+    shortOne.add(&made[0], 10);
+    shortOne.end();
+    TEST_ASSERT_EQUAL_STRING("Patch makes too small an image", refusal(old, shortOne.patch).c_str());
+}
+
+void test_target_failures_stop_it(void)
+{
+    Bytes old   = oldImage(50000);
+    Bytes made  = newImage(old, 20000, 6);
+    Bytes patch = insertionPatch(old, made, 20000, 6);
+
+    Run full;
+    full.target.old        = old;
+    full.target.writeLimit = 30000; // Flash said no.
+    TEST_ASSERT_EQUAL(PATCH_ERROR, full.feed(patch, randomPiece));
+    TEST_ASSERT_EQUAL_STRING("Couldn't write the new image", full.patcher.error());
+
+    Run unreadable;
+    unreadable.target.old      = old;
+    unreadable.target.failRead = true;
+    TEST_ASSERT_EQUAL(PATCH_ERROR, unreadable.feed(patch, nullptr));
+    TEST_ASSERT_EQUAL_STRING("Couldn't read the old image", unreadable.patcher.error());
+    TEST_ASSERT_EQUAL_UINT32(0, unreadable.target.made.size());
+}
+
+//*****************************************************************************
+static bool readWhole(const char *path, Bytes &data)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) return false;
+    uint8_t buffer[4096];
+    size_t  n;
+    while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) data.insert(data.end(), buffer, buffer + n);
+    fclose(f);
+    return true;
+}
+
+static bool collect(void *context, const uint8_t *data, size_t length)
+{
+    Bytes *out = (Bytes *)context;
+    out->insert(out->end(), data, data + length);
+    return true;
+}
+
+void test_real_images(void)
+{
+    const char *oldPath   = getenv("DELTA_OLD_IMAGE");
+    const char *newPath   = getenv("DELTA_NEW_IMAGE");
+    const char *patchPath = getenv("DELTA_PATCH");
+    if (!oldPath || !newPath || !patchPath) {
+        TEST_IGNORE_MESSAGE("Set DELTA_OLD_IMAGE, DELTA_NEW_IMAGE and DELTA_PATCH (from tools/make_delta.py)");
+    }
+
+    Bytes old, made, packed, patch;
+    TEST_ASSERT_TRUE_MESSAGE(readWhole(oldPath, old), oldPath);
+    TEST_ASSERT_TRUE_MESSAGE(readWhole(newPath, made), newPath);
+    TEST_ASSERT_TRUE_MESSAGE(readWhole(patchPath, packed), patchPath);
+
+    if (GzipInflater::isGzip(packed.data(), packed.size())) { // As the /update handler takes it.
+        GzipInflater inflater(collect, &patch);
+        inflater.write(packed.data(), packed.size());
+        TEST_ASSERT_EQUAL_MESSAGE(INFLATE_DONE, inflater.finish(), inflater.error());
+    } else {
+        patch = packed;
+    }
+
+    Run run;
+    rebuilds(old, made, patch, randomPiece, run);
+
+    char message[160];
+    snprintf(message, sizeof(message), "%u byte image from a %u byte upload, %u of it from the old image",
+             (unsigned)made.size(), (unsigned)packed.size(), (unsigned)run.patcher.copiedLength());
+    TEST_MESSAGE(message);
+}
+
+int main(int, char **)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_rebuilds_in_pieces_of_every_size);
+    RUN_TEST(test_many_operations_and_a_longer_header);
+    RUN_TEST(test_copy_comes_a_slice_at_a_time);
+    RUN_TEST(test_used_says_where_the_copy_stopped);
+    RUN_TEST(test_anything_after_the_end_is_used_up);
+    RUN_TEST(test_truncated_patch_is_refused);
+    RUN_TEST(test_bad_header_is_refused_before_anything_is_written);
+    RUN_TEST(test_out_of_range_operations_are_refused);
+    RUN_TEST(test_target_failures_stop_it);
+    RUN_TEST(test_real_images);
+    return UNITY_END();
+}
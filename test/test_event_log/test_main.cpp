@@ -0,0 +1,291 @@
+/* test_event_log
+ *
+ *  The event log on the RAM file system in test/native: batching, rotation
+ *  and the size bound, and recovery after power goes mid-write. Each test
+ *  "reboots" by starting a new EventLog on the same files.
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#include <unity.h>
+#include <Arduino.h>
+#include <FS.h>
+#include <digameEventLog.h>
+
+void setUp(void) {}
+void tearDown(void) {}
+
+// Append events first..last, servicing as the loop would, one every 100 ms.
+static void appendEvents(EventLog &log, uint32_t first, uint32_t last, uint32_t &nowMs)
+{
+    for (uint32_t seq = first; seq <= last; seq++) {
+        log.append(seq, seq & 1, seq, 1650000000000ULL + seq, EVENT_FLAG_UTC, nowMs);
+        log.service(nowMs);
+        nowMs += 100;
+    }
+}
+
+// Every event from..to is there once, in order, and nothing else.
+static void assertReads(EventLog &log, uint32_t from, uint32_t to)
+{
+    EventRecord records[50];
+    uint32_t    expect = from;
+    size_t      n;
+    while ((n = log.read(expect, records, 50)) > 0) {
+        for (size_t i = 0; i < n; i++) {
+            TEST_ASSERT_EQUAL_UINT32(expect, records[i].seq);
+            TEST_ASSERT_EQUAL_UINT32(expect, records[i].count);
+            expect++;
+        }
+    }
+    TEST_ASSERT_EQUAL_UINT32(to + 1, expect);
+}
+
+static std::vector<uint8_t> &newestSegment(fs::FS &disk) { return disk.files.rbegin()->second; }
+
+//*****************************************************************************
+void test_events_are_written_in_batches(void)
+{
+    fs::FS   disk;
+    EventLog log;
+    uint32_t nowMs = 0;
+    TEST_ASSERT_EQUAL_UINT32(1, log.begin(disk));
+
+    appendEvents(log, 1, 160, nowMs);
+    TEST_ASSERT_EQUAL_UINT32(160 / EVENT_LOG_BATCH_EVENTS, log.flushes);
+    TEST_ASSERT_EQUAL(0, log.pendingCount());
+
+    appendEvents(log, 161, 163, nowMs); // Not a full batch: waits for the timer.
+    TEST_ASSERT_EQUAL(3, log.pendingCount());
+    assertReads(log, 1, 163);           // Reads include what's still in RAM.
+    log.service(nowMs + EVENT_LOG_FLUSH_MS);
+    TEST_ASSERT_EQUAL(0, log.pendingCount());
+    TEST_ASSERT_EQUAL(163 * sizeof(EventRecord), newestSegment(disk).size());
+}
+
+void test_reboot_resumes_numbering(void)
+{
+    fs::FS   disk;
+    uint32_t nowMs = 0;
+    {
+        EventLog log;
+        log.begin(disk);
+        appendEvents(log, 1, 500, nowMs);
+        log.flush();
+        TEST_ASSERT_EQUAL(3, log.segmentsInUse());
+    }
+
+    EventLog log;
+    TEST_ASSERT_EQUAL_UINT32(501, log.begin(disk));
+    TEST_ASSERT_EQUAL_UINT32(0, log.tornRecords);
+    TEST_ASSERT_EQUAL_UINT32(1, log.oldestSeq());
+    appendEvents(log, 501, 520, nowMs);
+    assertReads(log, 1, 520);
+    assertReads(log, 333, 520);
+}
+
+void test_power_loss_mid_write_is_recovered(void)
+{
+    fs::FS   disk;
+    uint32_t nowMs = 0;
+    {
+        EventLog log;
+        log.begin(disk);
+        appendEvents(log, 1, 200, nowMs);
+        log.flush();
+    }
+
+    // Power went in the middle of the last record.
+    std::vector<uint8_t> &tail = newestSegment(disk);
+    tail.resize(tail.size() - 7);
+
+    EventLog log;
+    TEST_ASSERT_EQUAL_UINT32(200, log.begin(disk)); // 200 never made it.
+    TEST_ASSERT_EQUAL_UINT32(1, log.tornRecords);
+    size_t segments = log.segmentsInUse();
+
+    // Nothing goes after the torn record: appends start a new segment.
+    appendEvents(log, 200, 240, nowMs);
+    log.flush();
+    TEST_ASSERT_EQUAL(segments, log.segmentsInUse());
+    TEST_ASSERT_EQUAL(41 * sizeof(EventRecord), newestSegment(disk).size());
+    assertReads(log, 1, 240);
+
+    EventLog again;
+    TEST_ASSERT_EQUAL_UINT32(241, again.begin(disk));
+    assertReads(again, 1, 240);
+}
+
+void test_garbage_after_the_last_record_is_recovered(void)
+{
+    fs::FS   disk;
+    uint32_t nowMs = 0;
+    {
+        EventLog log;
+        log.begin(disk);
+        appendEvents(log, 1, 40, nowMs);
+        log.flush();
+    }
+
+    // A record's worth of half-programmed flash.
+    std::vector<uint8_t> &tail = newestSegment(disk);
+    tail.insert(tail.end(), sizeof(EventRecord), 0xFF);
+
+    EventLog log;
+    TEST_ASSERT_EQUAL_UINT32(41, log.begin(disk));
+    TEST_ASSERT_EQUAL_UINT32(1, log.tornRecords);
+    appendEvents(log, 41, 60, nowMs);
+    log.flush();
+    assertReads(log, 1, 60);
+}
+
+void test_short_write_is_retried_in_a_new_segment(void)
+{
+    fs::FS   disk;
+    EventLog log;
+    uint32_t nowMs = 0;
+    log.begin(disk);
+    appendEvents(log, 1, 32, nowMs);
+
+    disk.writeLimit = 30; // The next batch only gets partway.
+    appendEvents(log, 33, 48, nowMs);
+    TEST_ASSERT_EQUAL_UINT32(1, log.writeErrors);
+    TEST_ASSERT_EQUAL(EVENT_LOG_BATCH_EVENTS, log.pendingCount());
+    TEST_ASSERT_EQUAL(2, log.segmentsInUse());
+
+    disk.writeLimit = -1;
+    log.service(nowMs + EVENT_LOG_FLUSH_MS);
+    TEST_ASSERT_EQUAL(0, log.pendingCount());
+    assertReads(log, 1, 48);
+
+    EventLog again;
+    TEST_ASSERT_EQUAL_UINT32(49, again.begin(disk));
+    assertReads(again, 1, 48);
+}
+
+void test_failing_flash_drops_and_counts(void)
+{
+    fs::FS   disk;
+    EventLog log;
+    uint32_t nowMs = 0;
+    log.begin(disk);
+
+    disk.writeLimit = 0;
+    for (uint32_t seq = 1; seq <= EVENT_LOG_BATCH_EVENTS + 5; seq++) log.append(seq, 0, seq, seq, 0, nowMs);
+    TEST_ASSERT_EQUAL_UINT32(5, log.droppedRecords);
+    TEST_ASSERT_EQUAL(EVENT_LOG_BATCH_EVENTS, log.pendingCount());
+}
+
+void test_size_is_bounded(void)
+{
+    fs::FS   disk;
+    EventLog log;
+    uint32_t nowMs = 0;
+    log.begin(disk);
+
+    const uint32_t total = EVENT_LOG_SEGMENT_RECORDS * (EVENT_LOG_MAX_SEGMENTS + 3);
+    appendEvents(log, 1, total, nowMs);
+    log.flush();
+
+    TEST_ASSERT_EQUAL(EVENT_LOG_MAX_SEGMENTS, log.segmentsInUse());
+    TEST_ASSERT_EQUAL(EVENT_LOG_MAX_SEGMENTS, disk.files.size());
+    uint32_t oldest = log.oldestSeq();
+    TEST_ASSERT_GREATER_THAN(1, oldest);
+    assertReads(log, oldest, total);
+}
+
+void test_corrupt_record_stops_only_its_segment(void)
+{
+    fs::FS   disk;
+    EventLog log;
+    uint32_t nowMs = 0;
+    log.begin(disk);
+    appendEvents(log, 1, 400, nowMs);
+    log.flush();
+
+    disk.files.begin()->second[10 * sizeof(EventRecord) + 5] ^= 0x10; // Record 11, in the first segment.
+
+    EventRecord records[20];
+    TEST_ASSERT_EQUAL(10, log.read(1, records, 10));
+    size_t n = log.read(11, records, 20);
+    TEST_ASSERT_EQUAL(20, n);
+    TEST_ASSERT_EQUAL_UINT32(EVENT_LOG_SEGMENT_RECORDS + 1, records[0].seq); // On to the next segment.
+}
+
+void test_cursor_survives_a_reboot(void)
+{
+    fs::FS   disk;
+    EventLog log;
+    uint32_t nowMs = 0;
+    log.begin(disk);
+    appendEvents(log, 1, 50, nowMs);
+
+    EventCursor cursor;
+    cursor.begin(&disk, "/upload.cur", log);
+    TEST_ASSERT_EQUAL_UINT32(1, cursor.seq);
+    cursor.seq = 31;
+    cursor.service(60000, 10000);
+
+    EventCursor restored;
+    restored.begin(&disk, "/upload.cur", log);
+    TEST_ASSERT_EQUAL_UINT32(31, restored.seq);
+
+    disk.files["/upload.cur"][5] ^= 1; // A torn save: start from the oldest.
+    EventCursor torn;
+    torn.begin(&disk, "/upload.cur", log);
+    TEST_ASSERT_EQUAL_UINT32(1, torn.seq);
+}
+
+// Before a filesystem upload: what's buffered is written, then nothing more.
+void test_end_writes_out_and_lets_go(void)
+{
+    fs::FS   disk;
+    EventLog log;
+    uint32_t nowMs = 0;
+    log.begin(disk);
+    appendEvents(log, 1, 163, nowMs);
+    TEST_ASSERT_EQUAL(3, log.pendingCount());
+
+    TEST_ASSERT_TRUE(log.end());
+    TEST_ASSERT_EQUAL(0, log.pendingCount());
+    auto written = disk.files;
+
+    appendEvents(log, 164, 164 + 2 * EVENT_LOG_BATCH_EVENTS, nowMs);
+    log.flush();
+    TEST_ASSERT_TRUE(disk.files == written);
+    TEST_ASSERT_EQUAL_UINT32(EVENT_LOG_BATCH_EVENTS + 1, log.droppedRecords);
+
+    EventLog after; // The restart that follows the upload.
+    TEST_ASSERT_EQUAL_UINT32(164, after.begin(disk));
+    assertReads(after, 1, 163);
+}
+
+void test_json(void)
+{
+    EventRecord r = {};
+    r.seq    = 12;
+    r.type   = 1;
+    r.count  = 40;
+    r.timeMs = 1650000000123ULL;
+    r.flags  = EVENT_FLAG_UTC;
+    char json[128];
+    eventToJSON(r, json, sizeof(json));
+    TEST_ASSERT_EQUAL_STRING("{\"seq\":12,\"time\":1650000000123,\"utc\":1,\"eventType\":\"outbound\",\"count\":40}", json);
+}
+
+int main(int, char **)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_events_are_written_in_batches);
+    RUN_TEST(test_reboot_resumes_numbering);
+    RUN_TEST(test_power_loss_mid_write_is_recovered);
+    RUN_TEST(test_garbage_after_the_last_record_is_recovered);
+    RUN_TEST(test_short_write_is_retried_in_a_new_segment);
+    RUN_TEST(test_failing_flash_drops_and_counts);
+    RUN_TEST(test_size_is_bounded);
+    RUN_TEST(test_corrupt_record_stops_only_its_segment);
+    RUN_TEST(test_cursor_survives_a_reboot);
+    RUN_TEST(test_end_writes_out_and_lets_go);
+    RUN_TEST(test_json);
+    return UNITY_END();
+}
@@ -0,0 +1,205 @@
+/* test_event_queue
+ *
+ *  Reliable event delivery end to end over a simulated lossy link. The
+ *  device side pushes batches as serviceEventDelivery() does, the client
+ *  acknowledges the highest sequence number it holds contiguously, and the
+ *  link loses frames both ways and drops out now and then.
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#include <unity.h>
+#include <vector>
+#include <digameControl.h>
+#include <digameEventQueue.h>
+
+void setUp(void) {}
+void tearDown(void) {}
+
+static const uint32_t MAX_EVENTS_IN_FLIGHT = 64; // As main.cpp.
+static const uint64_t UTC_BASE_MS = 1666051200000ULL; // 2022-10-18, past 32 bits.
+
+static uint32_t noise = 2022;
+static uint32_t nextRandom()
+{
+    noise ^= noise << 13;
+    noise ^= noise >> 17;
+    noise ^= noise << 5;
+    return noise;
+}
+
+//*****************************************************************************
+struct Device
+{
+    EventQueue queue;
+    uint32_t   lastActivityMs = 0;
+    bool       wasConnected   = true;
+
+    // serviceEventDelivery(): one batch per call, or nothing.
+    size_t service(uint32_t nowMs, bool connected, uint8_t *frame)
+    {
+        if (wasConnected && !connected) queue.rewind();
+        wasConnected = connected;
+        if (!connected) return 0;
+
+        if ((queue.inFlight() > 0) && (nowMs - lastActivityMs > CONTROL_ACK_TIMEOUT_MS)) queue.rewind();
+        if ((queue.unsent() == 0) || (queue.inFlight() >= MAX_EVENTS_IN_FLIGHT)) return 0;
+
+        CountEvent    batch[CONTROL_EVENTS_PER_BATCH];
+        uint8_t       payload[CONTROL_MAX_PAYLOAD];
+        size_t        n = queue.nextBatch(batch, CONTROL_EVENTS_PER_BATCH);
+        PayloadWriter out(payload, sizeof(payload));
+        out.putU8(n);
+        for (size_t i = 0; i < n; i++) {
+            out.putU32(batch[i].seq);
+            out.putU32((uint32_t)batch[i].timeMs);
+            out.putU32((uint32_t)(batch[i].timeMs >> 32));
+            out.putU8(batch[i].flags);
+            out.putU8(batch[i].type);
+            out.putU32(batch[i].count);
+        }
+        lastActivityMs = nowMs;
+        return encodeControlFrame(frame, CONTROL_MAX_FRAME, 0, CONTROL_EVENT_BATCH, payload, out.length());
+    }
+
+    void ack(uint32_t seq, uint32_t nowMs)
+    {
+        queue.ack(seq);
+        lastActivityMs = nowMs;
+    }
+};
+
+//*****************************************************************************
+struct Client
+{
+    ControlDecoder        decoder;
+    std::vector<uint32_t> counts; // counts[seq - 1], in order, as received.
+    uint32_t              duplicates = 0;
+
+    uint32_t held() { return counts.size(); } // Highest contiguous seq.
+
+    // Returns true with an ack to send when a batch arrives.
+    bool receive(const uint8_t *frame, size_t length)
+    {
+        bool got = false;
+        for (size_t i = 0; i < length; i++) {
+            if (decoder.feed(frame[i], 0) != CONTROL_FRAME_READY) continue;
+            TEST_ASSERT_EQUAL_HEX8(CONTROL_EVENT_BATCH, decoder.opcode);
+            PayloadReader in(decoder.payload, decoder.payloadLen);
+            uint8_t       n = in.getU8();
+            for (uint8_t k = 0; k < n; k++) {
+                uint32_t seq    = in.getU32();
+                uint64_t timeMs = in.getU32();
+                timeMs         |= (uint64_t)in.getU32() << 32;
+                uint8_t  flags  = in.getU8();
+                in.getU8();
+                uint32_t count = in.getU32();
+                TEST_ASSERT_EQUAL_UINT8(1, flags); // The UTC times arrive whole.
+                TEST_ASSERT_TRUE(timeMs == UTC_BASE_MS + count);
+                if (seq == held() + 1) counts.push_back(count);
+                else duplicates++; // Already held, or past a gap: it'll come again.
+            }
+            TEST_ASSERT_FALSE(in.underflowed());
+            got = true;
+        }
+        return got;
+    }
+};
+
+//*****************************************************************************
+void test_lossy_link_delivers_every_event_in_order(void)
+{
+    Device  device;
+    Client  client;
+    uint8_t frame[CONTROL_MAX_FRAME];
+
+    const uint32_t EVENTS = 3000;
+    uint32_t       pushed = 0, lostFrames = 0, lostAcks = 0, dropouts = 0;
+    bool           connected = true;
+    uint32_t       reconnectAt = 0;
+
+    for (uint32_t nowMs = 0; nowMs < 600000; nowMs += 10) {
+        if ((pushed < EVENTS) && (nextRandom() % 8 == 0)) {
+            pushed++;
+            device.queue.push(pushed & 1, pushed, UTC_BASE_MS + pushed, 1); // The count is the seq, to check against.
+        }
+
+        if (connected && (nextRandom() % 3000 == 0)) { // Walked out of range.
+            connected   = false;
+            reconnectAt = nowMs + 5000;
+            dropouts++;
+        } else if (!connected && (nowMs >= reconnectAt)) {
+            connected = true;
+        }
+
+        size_t len = device.service(nowMs, connected, frame);
+        if (len == 0) continue;
+        if (nextRandom() % 10 == 0) { lostFrames++; continue; }
+        if (!client.receive(frame, len)) continue;
+        if (nextRandom() % 10 == 0) { lostAcks++; continue; }
+        device.ack(client.held(), nowMs);
+    }
+
+    TEST_ASSERT_EQUAL_UINT32(EVENTS, pushed);
+    TEST_ASSERT_EQUAL_UINT32(EVENTS, client.held());
+    for (uint32_t i = 0; i < client.held(); i++) TEST_ASSERT_EQUAL_UINT32(i + 1, client.counts[i]);
+    TEST_ASSERT_EQUAL_UINT32(0, device.queue.dropped);
+    TEST_ASSERT_EQUAL_UINT32(0, device.queue.unacked());
+    TEST_ASSERT_GREATER_THAN(0, lostFrames);
+    TEST_ASSERT_GREATER_THAN(0, lostAcks);
+    TEST_ASSERT_GREATER_THAN(0, dropouts);
+}
+
+// A client that comes back holding events up to 40 asks to resume at 41.
+void test_resume_point(void)
+{
+    EventQueue q;
+    for (uint32_t i = 1; i <= 100; i++) q.push(0, i, i);
+
+    q.ack(40);
+    q.resumeFrom(41);
+    CountEvent batch[CONTROL_EVENTS_PER_BATCH];
+    TEST_ASSERT_EQUAL(CONTROL_EVENTS_PER_BATCH, q.nextBatch(batch, CONTROL_EVENTS_PER_BATCH));
+    TEST_ASSERT_EQUAL_UINT32(41, batch[0].seq);
+    TEST_ASSERT_EQUAL_UINT32(60, q.unacked());
+
+    q.resumeFrom(5); // Already acknowledged: start at the oldest held.
+    q.nextBatch(batch, 1);
+    TEST_ASSERT_EQUAL_UINT32(41, batch[0].seq);
+
+    q.ack(1000); // Can't ack the future.
+    TEST_ASSERT_EQUAL_UINT32(0, q.unacked());
+    TEST_ASSERT_EQUAL_UINT32(101, q.push(0, 0, 0));
+}
+
+void test_full_queue_drops_the_oldest(void)
+{
+    EventQueue q;
+    for (uint32_t i = 1; i <= EVENT_QUEUE_SIZE + 10; i++) q.push(0, i, i);
+    TEST_ASSERT_EQUAL_UINT32(10, q.dropped);
+    TEST_ASSERT_EQUAL_UINT32(11, q.oldest());
+
+    CountEvent batch[4];
+    q.nextBatch(batch, 4);
+    TEST_ASSERT_EQUAL_UINT32(11, batch[0].seq);
+    TEST_ASSERT_EQUAL_UINT32(11, batch[0].count);
+}
+
+void test_numbering_continues_after_a_reboot(void)
+{
+    EventQueue q;
+    q.setNextSeq(5000);
+    TEST_ASSERT_EQUAL_UINT32(5000, q.push(0, 1, 0));
+    q.setNextSeq(9000); // Not empty: ignored.
+    TEST_ASSERT_EQUAL_UINT32(5001, q.next());
+}
+
+int main(int, char **)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_lossy_link_delivers_every_event_in_order);
+    RUN_TEST(test_resume_point);
+    RUN_TEST(test_full_queue_drops_the_oldest);
+    RUN_TEST(test_numbering_continues_after_a_reboot);
+    return UNITY_END();
+}
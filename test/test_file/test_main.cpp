@@ -0,0 +1,195 @@
+/* test_file
+ *
+ *  The streaming readers in digameFile, checked against readFile(), and a
+ *  benchmark of both against the readString() loop readFile() used to have.
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#include <unity.h>
+#include <Arduino.h>
+#include <SPIFFS.h>
+#include <digameDebug.h>
+#include <digameFile.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+static fs::FS disk;
+
+void setUp(void) { disk.files.clear(); }
+void tearDown(void) {}
+
+static void putFile(const char *path, const std::string &contents)
+{
+    disk.files[path].assign(contents.begin(), contents.end());
+}
+
+// What nextLine() should give: split on \n, drop \r, cut to fit.
+static std::vector<std::string> expectedLines(const std::string &text, size_t lineSize)
+{
+    std::vector<std::string> lines;
+    std::string              line;
+    for (size_t i = 0; i < text.size(); i++) {
+        char c = text[i];
+        if (c == '\n') {
+            lines.push_back(line);
+            line.clear();
+        } else if ((c != '\r') && (line.size() + 1 < lineSize)) {
+            line += c;
+        }
+    }
+    if (!text.empty() && (text[text.size() - 1] != '\n')) lines.push_back(line);
+    return lines;
+}
+
+template <size_t CHUNK>
+static std::vector<std::string> readLines(const char *path, size_t lineSize)
+{
+    FileLineReader<CHUNK>    reader;
+    std::vector<std::string> lines;
+    std::vector<char>        line(lineSize);
+    if (!reader.open(disk, path)) return lines;
+    while (reader.nextLine(line.data(), lineSize)) lines.push_back(line.data());
+    reader.close();
+    return lines;
+}
+
+// The loop readFile() had: readString() appends a character at a time.
+static String legacyReadFile(fs::FS &fs, const char *path)
+{
+    String retValue = "";
+    File   file     = fs.open(path);
+    if (!file || file.isDirectory()) return retValue;
+    while (file.available()) {
+        String chunk;
+        int    c;
+        while ((c = file.read()) >= 0) chunk += (char)c;
+        retValue = retValue + chunk;
+    }
+    file.close();
+    return retValue;
+}
+
+//*****************************************************************************
+void test_read_file_is_exact(void)
+{
+    std::string contents("name=Door 3\r\n\0binary\xFF\n", 21);
+    putFile("/a.bin", contents);
+    String got = readFile(disk, "/a.bin");
+    TEST_ASSERT_EQUAL(contents.size(), got.length()); // A NUL doesn't end it.
+    TEST_ASSERT_EQUAL_MEMORY(contents.data(), got.c_str(), contents.size());
+
+    TEST_ASSERT_EQUAL(0, readFile(disk, "/missing.txt").length());
+    TEST_ASSERT_EQUAL(0, readFile(disk, "/").length());
+}
+
+void test_lines_match_at_every_chunk_size(void)
+{
+    std::string text = "first\r\nsecond\n\n  indented\r\n";
+    text += std::string(150, 'L') + "\n";
+    text += "\r\n";
+    text += "no terminator";
+    putFile("/lines.txt", text);
+
+    std::vector<std::string> want = expectedLines(text, 32);
+    TEST_ASSERT_EQUAL(7, want.size());
+    TEST_ASSERT_TRUE(readLines<1>("/lines.txt", 32) == want);
+    TEST_ASSERT_TRUE(readLines<7>("/lines.txt", 32) == want);
+    TEST_ASSERT_TRUE(readLines<64>("/lines.txt", 32) == want);
+    TEST_ASSERT_TRUE(readLines<512>("/lines.txt", 32) == want);
+
+    std::vector<std::string> got = readLines<64>("/lines.txt", 32);
+    TEST_ASSERT_EQUAL(31, got[4].size()); // Cut short, and the rest skipped.
+    TEST_ASSERT_EQUAL_STRING("", got[5].c_str());
+    TEST_ASSERT_EQUAL_STRING("no terminator", got[6].c_str());
+}
+
+void test_empty_and_missing_files(void)
+{
+    putFile("/empty.txt", "");
+    TEST_ASSERT_EQUAL(0, readLines<64>("/empty.txt", 32).size());
+    TEST_ASSERT_EQUAL(0, readLines<64>("/missing.txt", 32).size());
+
+    FileLineReader<> reader;
+    TEST_ASSERT_FALSE(reader.open(disk, "/"));
+}
+
+void test_chunk_reader(void)
+{
+    std::string text;
+    for (int i = 0; i < 1000; i++) text += (char)('a' + i % 26);
+    putFile("/chunks.txt", text);
+
+    FileChunkReader reader;
+    TEST_ASSERT_TRUE(reader.open(disk, "/chunks.txt"));
+    TEST_ASSERT_EQUAL(1000, reader.size());
+
+    uint8_t     buffer[300];
+    std::string back;
+    size_t      n;
+    while ((n = reader.read(buffer, sizeof(buffer))) > 0) back.append((const char *)buffer, n);
+    TEST_ASSERT_TRUE(back == text);
+
+    TEST_ASSERT_TRUE(reader.seek(990));
+    TEST_ASSERT_EQUAL(10, reader.read(buffer, sizeof(buffer)));
+    TEST_ASSERT_EQUAL(1000, reader.position());
+    reader.close();
+    TEST_ASSERT_EQUAL(0, reader.read(buffer, sizeof(buffer)));
+}
+
+//*****************************************************************************
+// A 256 KB log three ways. FileLineReader holds a chunk and a line, not the file.
+void test_benchmark_against_the_old_read_file(void)
+{
+    std::string log;
+    for (int i = 0; log.size() < 256 * 1024; i++) {
+        char line[64];
+        snprintf(line, sizeof(line), "{\"seq\":%d,\"eventType\":\"inbound\",\"count\":%d}\r\n", i, i / 2);
+        log += line;
+    }
+    putFile("/events.log", log);
+
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point t0 = Clock::now();
+    String            legacy = legacyReadFile(disk, "/events.log");
+    Clock::time_point t1 = Clock::now();
+    String            current = readFile(disk, "/events.log");
+    Clock::time_point t2 = Clock::now();
+
+    FileLineReader<> reader;
+    char             line[80];
+    size_t           lines = 0, bytes = 0;
+    reader.open(disk, "/events.log");
+    while (reader.nextLine(line, sizeof(line))) {
+        lines++;
+        bytes += strlen(line) + 2;
+    }
+    reader.close();
+    Clock::time_point t3 = Clock::now();
+
+    TEST_ASSERT_TRUE(legacy == current);
+    TEST_ASSERT_EQUAL(log.size(), current.length());
+    TEST_ASSERT_EQUAL(log.size(), bytes);
+    TEST_ASSERT_EQUAL(expectedLines(log, sizeof(line)).size(), lines);
+
+    using std::chrono::microseconds;
+    char message[160];
+    snprintf(message, sizeof(message),
+             "256 KB: old readFile %ld us, readFile %ld us, FileLineReader (64-byte chunks) %ld us",
+             (long)std::chrono::duration_cast<microseconds>(t1 - t0).count(),
+             (long)std::chrono::duration_cast<microseconds>(t2 - t1).count(),
+             (long)std::chrono::duration_cast<microseconds>(t3 - t2).count());
+    TEST_MESSAGE(message);
+}
+
+int main(int, char **)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_read_file_is_exact);
+    RUN_TEST(test_lines_match_at_every_chunk_size);
+    RUN_TEST(test_empty_and_missing_files);
+    RUN_TEST(test_chunk_reader);
+    RUN_TEST(test_benchmark_against_the_old_read_file);
+    return UNITY_END();
+}
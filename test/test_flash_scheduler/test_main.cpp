@@ -0,0 +1,331 @@
+/* test_flash_scheduler
+ *
+ *  Firmware uploads written by the scheduler while the counter counts, on a
+ *  simulated clock. The LIDAR's frames arrive every 10.02 ms into a UART
+ *  FIFO that holds 14 of them; the loop takes 1 ms a frame; and flash
+ *  erases and writes stop everything for as long as they take. A frame
+ *  that arrives to a full FIFO is lost.
+ *
+ *  The same upload, erased and written sector by sector as it arrives (as
+ *  Update did), is the baseline.
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#include <unity.h>
+#include <Arduino.h>
+#include <digameFlashScheduler.h>
+#include <stdlib.h>
+#include <vector>
+
+static uint64_t simUs = 0;
+static uint32_t simClock() { return (uint32_t)simUs; }
+
+void setUp(void)
+{
+    simUs = 0;
+    srand(1);
+}
+void tearDown(void) {}
+
+#define FRAME_US    10020 // The sensor's clock is a little off.
+#define FIFO_FRAMES 14    // 128-byte FIFO, 9-byte frames.
+#define LOOP_US     1000  // Reading a frame and counting.
+#define IMAGE_SIZE  (1024 * 1024)
+#define PACKET      1436  // Upload bytes per TCP segment.
+
+//*****************************************************************************
+// Flash that stalls the clock, and notices a write to a sector not erased.
+struct SimFlash : public FlashDevice
+{
+    std::vector<uint8_t> memory;
+    std::vector<bool>    erased;
+    uint32_t eraseMinUs = 30000, eraseMaxUs = 60000;
+    uint32_t longestUs  = 0;
+    bool     writeOverUnerased = false;
+    bool     failWrites        = false;
+    struct Counter *counter    = nullptr;
+
+    explicit SimFlash(size_t size) : memory(size, 0), erased(size / FLASH_SECTOR, false) {}
+
+    bool erase(uint32_t offset, uint32_t length) override
+    {
+        for (uint32_t s = offset / FLASH_SECTOR; s < (offset + length + FLASH_SECTOR - 1) / FLASH_SECTOR; s++) {
+            erased[s] = true;
+        }
+        memset(&memory[offset], 0xFF, length);
+        stall(eraseMinUs + rand() % (eraseMaxUs - eraseMinUs));
+        return true;
+    }
+
+    bool write(uint32_t offset, const uint8_t *data, size_t length) override
+    {
+        if (failWrites) return false;
+        for (size_t i = 0; i < length; i++) {
+            if (!erased[(offset + i) / FLASH_SECTOR]) writeOverUnerased = true;
+            memory[offset + i] = data[i];
+        }
+        stall(100 + (uint32_t)((length + 255) / 256) * 700); // About 3 ms a KB.
+        return true;
+    }
+
+    void stall(uint32_t us);
+};
+
+//*****************************************************************************
+// The counter: frames into the FIFO, the loop taking them out.
+struct Counter
+{
+    uint64_t nextFrameUs = 0;
+    int      fifo        = 0;
+    uint64_t lost        = 0;
+    bool     alwaysBusy  = false;
+
+    void arrive()
+    {
+        for (; nextFrameUs <= simUs; nextFrameUs += FRAME_US) {
+            if (fifo < FIFO_FRAMES) fifo++;
+            else lost++;
+        }
+    }
+
+    // Someone in view 0.8 s in every 3.
+    bool busy() const { return alwaysBusy || (simUs % 3000000) < 800000; }
+
+    // One pass of the loop: wait for a frame, read it, count.
+    void loop()
+    {
+        if (fifo == 0) {
+            simUs = nextFrameUs;
+            arrive();
+        }
+        fifo--;
+        simUs += LOOP_US;
+        arrive();
+    }
+};
+
+void SimFlash::stall(uint32_t us)
+{
+    simUs += us;
+    if (counter) counter->arrive();
+    if (us > longestUs) longestUs = us;
+}
+
+static std::vector<uint8_t> randomImage()
+{
+    std::vector<uint8_t> image(IMAGE_SIZE);
+    for (auto &b : image) b = (uint8_t)rand();
+    return image;
+}
+
+//*****************************************************************************
+struct Result
+{
+    double   seconds;
+    uint64_t lost;
+    uint32_t reported;
+    double   flashShare;
+};
+
+// Calibrate for 12 s, then upload the image over a link of linkKBs while
+// the loop runs.
+static Result scheduledUpload(FlashScheduler &s, SimFlash &flash, Counter &counter, const std::vector<uint8_t> &image,
+                              double linkKBs)
+{
+    flash.counter = &counter;
+    while (simUs < 12000000) {
+        counter.loop();
+        s.service(true, counter.busy());
+    }
+
+    uint64_t startUs = simUs, linkUs = simUs, lostBefore = counter.lost;
+    uint32_t flashUsBefore = s.flashUs;
+    double   bytesPerUs = linkKBs * 1024 / 1e6;
+    size_t   sent = 0;
+    s.start(flash, flash.memory.size());
+    while (!s.done()) {
+        while ((sent < image.size()) && (linkUs <= simUs)) { // The web task.
+            size_t n = s.offer(&image[sent], std::min<size_t>(PACKET, image.size() - sent));
+            if (!n) { // Ring full: TCP backs off.
+                linkUs = simUs + 1000;
+                break;
+            }
+            sent   += n;
+            linkUs += (uint64_t)(n / bytesPerUs);
+        }
+        if (sent == image.size()) s.close();
+        counter.loop();
+        s.service(true, counter.busy());
+        TEST_ASSERT_TRUE_MESSAGE(simUs - startUs < 300000000ULL, "Upload stuck");
+    }
+
+    Result r;
+    r.seconds    = (simUs - startUs) / 1e6;
+    r.lost       = counter.lost - lostBefore;
+    r.reported   = s.stop();
+    r.flashShare = (s.flashUs - flashUsBefore) / (r.seconds * 1e6);
+    return r;
+}
+
+//*****************************************************************************
+void test_calibrates_the_frame_period(void)
+{
+    FlashScheduler s(simClock);
+    Counter        counter;
+    TEST_ASSERT_EQUAL_UINT32(FLASH_FRAME_PERIOD_US, s.framePeriodUs());
+    while (simUs < 12000000) {
+        counter.loop();
+        s.service(true, false);
+    }
+    TEST_ASSERT_EQUAL_UINT32(FRAME_US, s.framePeriodUs());
+}
+
+void test_update_costs_no_frames(void)
+{
+    std::vector<uint8_t> image = randomImage();
+    FlashScheduler       s(simClock);
+    SimFlash             flash(1536 * 1024);
+    Counter              counter;
+
+    Result r = scheduledUpload(s, flash, counter, image, 100);
+    TEST_ASSERT_EQUAL_UINT64(0, r.lost);
+    TEST_ASSERT_EQUAL_UINT32(0, r.reported);
+    TEST_ASSERT_FALSE(flash.writeOverUnerased);
+    TEST_ASSERT_TRUE(memcmp(flash.memory.data(), image.data(), image.size()) == 0);
+    TEST_ASSERT_LESS_OR_EQUAL(FLASH_DUTY_PERCENT + 5, (int)(100 * r.flashShare));
+    TEST_ASSERT_EQUAL_UINT32(IMAGE_SIZE / FLASH_SECTOR, s.erases);
+
+    char message[160];
+    snprintf(message, sizeof(message), "1 MB at 100 KB/s: %.1f s, %llu frames lost, flash %.0f%% of the time, %u of %u erases forced",
+             r.seconds, (unsigned long long)r.lost, 100 * r.flashShare, (unsigned)s.forcedErases, (unsigned)s.erases);
+    TEST_MESSAGE(message);
+}
+
+// Update's way: a sector erased and written as soon as its bytes are in,
+// back to back, with the loop shut out until it's done.
+void test_writing_as_it_arrives_loses_frames(void)
+{
+    std::vector<uint8_t> image = randomImage();
+    SimFlash             flash(1536 * 1024);
+    Counter              counter;
+    flash.counter = &counter;
+    while (simUs < 12000000) counter.loop();
+
+    uint64_t startUs = simUs, lostBefore = counter.lost;
+    double   bytesPerUs = 100 * 1024 / 1e6;
+    for (size_t at = 0; at < image.size(); at += FLASH_SECTOR) {
+        uint64_t readyUs = startUs + (uint64_t)((at + FLASH_SECTOR) / bytesPerUs);
+        while (simUs < readyUs) counter.loop();
+        flash.erase(at, FLASH_SECTOR);
+        flash.write(at, &image[at], FLASH_SECTOR);
+    }
+    uint64_t lost = counter.lost - lostBefore;
+    double   seconds = (simUs - startUs) / 1e6;
+    TEST_ASSERT_GREATER_THAN((int)(seconds * 1e6 / FRAME_US / 2), (int)lost); // More than half of them.
+
+    char message[120];
+    snprintf(message, sizeof(message), "The same without the scheduler: %.1f s, %llu of %.0f frames lost", seconds,
+             (unsigned long long)lost, seconds * 1e6 / FRAME_US);
+    TEST_MESSAGE(message);
+}
+
+void test_someone_in_the_doorway_throughout(void)
+{
+    std::vector<uint8_t> image = randomImage();
+    FlashScheduler       s(simClock);
+    SimFlash             flash(1536 * 1024);
+    Counter              counter;
+    counter.alwaysBusy = true;
+
+    Result r = scheduledUpload(s, flash, counter, image, 100);
+    TEST_ASSERT_EQUAL_UINT64(0, r.lost);
+    TEST_ASSERT_EQUAL_UINT32(s.erases, s.forcedErases); // Each waited its longest...
+    TEST_ASSERT_LESS_THAN(IMAGE_SIZE / FLASH_SECTOR * (FLASH_MAX_DEFER_US + 100000) / 1000000, (int)r.seconds); // ...and no more.
+    TEST_ASSERT_TRUE(memcmp(flash.memory.data(), image.data(), image.size()) == 0);
+}
+
+// Erases too long for the FIFO: frames go missing, and stop() says how many.
+void test_slow_flash_misses_are_counted(void)
+{
+    std::vector<uint8_t> image = randomImage();
+    FlashScheduler       s(simClock);
+    SimFlash             flash(1536 * 1024);
+    Counter              counter;
+    flash.eraseMinUs = 200000;
+    flash.eraseMaxUs = 250000;
+
+    Result r = scheduledUpload(s, flash, counter, image, 100);
+    TEST_ASSERT_GREATER_THAN(0, (int)r.lost);
+    TEST_ASSERT_UINT32_WITHIN(2, (uint32_t)r.lost, r.reported);
+    TEST_ASSERT_EQUAL_UINT32(r.reported, s.lastUpdateMissed());
+    TEST_ASSERT_EQUAL_UINT32(r.reported, s.framesMissed);
+}
+
+// Each service() does one piece of work: a sector erase or a slice of writes.
+void test_service_stays_bounded(void)
+{
+    std::vector<uint8_t> image = randomImage();
+    FlashScheduler       s(simClock);
+    SimFlash             flash(1536 * 1024);
+    Counter              counter;
+
+    scheduledUpload(s, flash, counter, image, 1000);
+    TEST_ASSERT_LESS_OR_EQUAL(flash.eraseMaxUs, flash.longestUs);
+    TEST_ASSERT_EQUAL_UINT32(IMAGE_SIZE / FLASH_WRITE_SLICE, s.writes);
+}
+
+// Nobody calling service(): the web task pumps it flat out.
+void test_unattended(void)
+{
+    std::vector<uint8_t> image = randomImage();
+    FlashScheduler       s(simClock);
+    SimFlash             flash(1536 * 1024);
+
+    s.start(flash, flash.memory.size());
+    for (size_t sent = 0; sent < image.size();) {
+        size_t n = s.offer(&image[sent], std::min<size_t>(PACKET, image.size() - sent));
+        sent += n;
+        if (!n) s.pump(true);
+    }
+    s.close();
+    while (!s.done()) TEST_ASSERT_TRUE(s.pump(true));
+    TEST_ASSERT_FALSE(flash.writeOverUnerased);
+    TEST_ASSERT_TRUE(memcmp(flash.memory.data(), image.data(), image.size()) == 0);
+    TEST_ASSERT_EQUAL_UINT32(IMAGE_SIZE, s.written());
+}
+
+void test_errors(void)
+{
+    FlashScheduler s(simClock);
+    SimFlash       flash(64 * 1024);
+    uint8_t        data[PACKET] = {};
+
+    s.start(flash, flash.memory.size());
+    TEST_ASSERT_EQUAL_UINT32(0, s.offer(data, 64 * 1024 + 1));
+    TEST_ASSERT_EQUAL_STRING("Image is bigger than the partition", s.error());
+
+    s.start(flash, flash.memory.size());
+    TEST_ASSERT_NULL(s.error());
+    flash.failWrites = true;
+    s.offer(data, sizeof(data));
+    s.close();
+    for (int i = 0; (i < 10) && !s.error(); i++) s.pump(true);
+    TEST_ASSERT_EQUAL_STRING("Couldn't write to flash", s.error());
+    TEST_ASSERT_FALSE(s.done());
+    TEST_ASSERT_EQUAL_UINT32(0, s.offer(data, sizeof(data)));
+}
+
+int main(int, char **)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_calibrates_the_frame_period);
+    RUN_TEST(test_update_costs_no_frames);
+    RUN_TEST(test_writing_as_it_arrives_loses_frames);
+    RUN_TEST(test_someone_in_the_doorway_throughout);
+    RUN_TEST(test_slow_flash_misses_are_counted);
+    RUN_TEST(test_service_stays_bounded);
+    RUN_TEST(test_unattended);
+    RUN_TEST(test_errors);
+    return UNITY_END();
+}
@@ -0,0 +1,342 @@
+/* test_inflate
+ *
+ *  The streaming decompressor: firmware-like images, gzipped, fed in the
+ *  pieces a web server hands over; a stream with dynamic Huffman codes from
+ *  zlib; broken, truncated and too-far-reaching streams; and throughput.
+ *
+ *  To check a real image, compress it with tools/compress_firmware.py and
+ *  point INFLATE_IMAGE at the .gz. If the .bin is next to it, the output is
+ *  compared with that too:
+ *
+ *    python3 tools/compress_firmware.py .pio/build/esp32dev/firmware.bin
+ *    INFLATE_IMAGE=.pio/build/esp32dev/firmware.bin.gz pio test -e native -f test_inflate
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#include <unity.h>
+#include <digameInflate.h>
+#include <digameDeflate.h>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+void setUp(void) {}
+void tearDown(void) {}
+
+//*****************************************************************************
+struct Output
+{
+    std::vector<uint8_t> data;
+    size_t               calls   = 0;
+    size_t               largest = 0;
+    bool                 refuse  = false;
+};
+
+static bool collect(void *context, const uint8_t *data, size_t length)
+{
+    Output *out = (Output *)context;
+    if (out->refuse) return false;
+    out->data.insert(out->data.end(), data, data + length);
+    out->calls++;
+    if (length > out->largest) out->largest = length;
+    return true;
+}
+
+// Feeds it all in pieces of chunk bytes, or of random sizes up to 1500 for
+// 0. The inflater is 8 KB and more, so it goes on the heap as on the device.
+static InflateResult inflate(const std::vector<uint8_t> &gz, size_t chunk, Output &out, std::string *problem = nullptr,
+                             std::string *comment = nullptr)
+{
+    GzipInflater *z = new GzipInflater(collect, &out);
+    InflateResult r = INFLATE_MORE;
+    for (size_t i = 0; (i < gz.size()) && (r == INFLATE_MORE);) {
+        size_t n = chunk ? chunk : 1 + rand() % 1500;
+        if (n > gz.size() - i) n = gz.size() - i;
+        r = z->write(&gz[i], n);
+        i += n;
+    }
+    if (r == INFLATE_MORE) r = z->finish();
+    if (problem) *problem = z->error() ? z->error() : "";
+    if (comment) *comment = z->comment();
+    delete z;
+    return r;
+}
+
+//*****************************************************************************
+// Something like an ESP32 image: runs of code from a small vocabulary of
+// instructions with the odd random operand, tables of log strings, and
+// padding between sections.
+static std::vector<uint8_t> firmwareLike(size_t size, unsigned seed)
+{
+    static const char *strings[] = { "Connecting to WiFi...", "Beam broken: ", "Writing event log", "HTTP/1.1 200 OK",
+                                     "Content-Type: application/json", "LIDAR frame timeout", "Rebooting" };
+    uint8_t vocabulary[64][3];
+    srand(seed);
+    for (auto &op : vocabulary) for (auto &b : op) b = (uint8_t)rand();
+
+    std::vector<uint8_t> image;
+    while (image.size() < size) {
+        int kind = rand() % 10;
+        if (kind < 7) {
+            for (int i = 0; i < 200; i++) {
+                const uint8_t *op = vocabulary[(rand() % 8) * (rand() % 8)]; // Some are much more common.
+                image.insert(image.end(), op, op + 3);
+                if (rand() % 4 == 0) image.push_back((uint8_t)rand());
+            }
+        } else if (kind < 9) {
+            for (int i = 0; i < 20; i++) {
+                const char *s = strings[rand() % 7];
+                image.insert(image.end(), s, s + strlen(s) + 1);
+            }
+        } else {
+            image.insert(image.end(), 64 + rand() % 512, (rand() % 2) ? 0x00 : 0xFF);
+        }
+    }
+    image.resize(size);
+    return image;
+}
+
+static std::vector<uint8_t> gzip(const std::vector<uint8_t> &data)
+{
+    std::vector<uint8_t> gz;
+    TEST_ASSERT_TRUE(GzipDeflater::compress(data.data(), data.size(), gz));
+    return gz;
+}
+
+static double secondsSince(std::chrono::steady_clock::time_point t0)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+//*****************************************************************************
+void test_firmware_like_image_in_any_pieces(void)
+{
+    std::vector<uint8_t> image = firmwareLike(DEFLATE_MAX_INPUT, 1);
+    std::vector<uint8_t> gz    = gzip(image);
+    TEST_ASSERT_LESS_THAN(image.size() * 3 / 4, gz.size());
+
+    const size_t chunks[] = { 1, 7, 512, 1460, 0, 100000 };
+    for (size_t chunk : chunks) {
+        Output out;
+        TEST_ASSERT_EQUAL(INFLATE_DONE, inflate(gz, chunk, out));
+        TEST_ASSERT_EQUAL_UINT32(image.size(), out.data.size());
+        TEST_ASSERT_TRUE(out.data == image);
+        TEST_ASSERT_LESS_OR_EQUAL(INFLATE_WINDOW_SIZE, out.largest);
+    }
+}
+
+void test_many_images(void)
+{
+    for (unsigned seed = 2; seed < 40; seed++) {
+        std::vector<uint8_t> image = firmwareLike(1 + rand() % DEFLATE_MAX_INPUT, seed);
+        Output out;
+        TEST_ASSERT_EQUAL(INFLATE_DONE, inflate(gzip(image), 0, out));
+        TEST_ASSERT_TRUE(out.data == image);
+    }
+
+    std::vector<uint8_t> empty;
+    Output out;
+    TEST_ASSERT_EQUAL(INFLATE_DONE, inflate(gzip(empty), 1, out));
+    TEST_ASSERT_EQUAL_UINT32(0, out.data.size());
+}
+
+//*****************************************************************************
+// zlib, level 9 with a 13-bit window, over the text below, with a comment
+// in the header as compress_firmware.py writes it. One dynamic block.
+static const uint8_t dynamicStream[] = {
+    0x1F, 0x8B, 0x08, 0x10, 0x00, 0x00, 0x00, 0x00, 0x02, 0xFF, 0x73, 0x68, 0x61, 0x32, 0x35, 0x36,
+    0x3D, 0x78, 0x00, 0x4D, 0xD1, 0x2B, 0x72, 0x05, 0x31, 0x10, 0x43, 0x51, 0xAE, 0xB5, 0x18, 0x58,
+    0xEA, 0x8F, 0xDD, 0xDB, 0x49, 0x85, 0x84, 0xBC, 0xA0, 0xEC, 0x3F, 0x83, 0xA6, 0x04, 0x2F, 0x3A,
+    0x5D, 0xEA, 0xBD, 0x7E, 0x3E, 0x5F, 0xBF, 0x7F, 0x9F, 0xEF, 0xB5, 0xD7, 0x06, 0xDF, 0xE2, 0x62,
+    0x40, 0x6F, 0x6A, 0xA9, 0x11, 0x6F, 0xC6, 0x8A, 0x41, 0xBE, 0x99, 0xAB, 0x84, 0x7A, 0xB3, 0x56,
+    0x17, 0xFA, 0xCD, 0x5E, 0xE7, 0xE2, 0x98, 0x33, 0xC4, 0x35, 0x28, 0x31, 0xE6, 0xF0, 0x80, 0xDB,
+    0xA1, 0xE7, 0x2A, 0x9A, 0x94, 0x01, 0xCA, 0xA8, 0x6A, 0x30, 0xCC, 0xEA, 0x01, 0xD3, 0xB0, 0x2B,
+    0xB0, 0x4C, 0x9B, 0x02, 0xDB, 0xBC, 0x0B, 0x1E, 0xE3, 0x44, 0xF0, 0x1A, 0x17, 0x09, 0x8E, 0x71,
+    0x79, 0xA0, 0xED, 0xDC, 0x86, 0x68, 0xDC, 0x79, 0x56, 0x93, 0x71, 0xB7, 0xA1, 0x30, 0x6E, 0x06,
+    0x4A, 0xF3, 0x28, 0xA8, 0xCC, 0x53, 0x41, 0x6D, 0x5E, 0x5C, 0xE8, 0x98, 0x57, 0x84, 0xAE, 0x79,
+    0x9D, 0xD0, 0x98, 0x77, 0x0E, 0x62, 0xBB, 0xB7, 0x11, 0xF4, 0x39, 0x11, 0x32, 0x8E, 0xCF, 0x57,
+    0xC3, 0x38, 0x0D, 0x22, 0x8D, 0x4B, 0x21, 0xCA, 0xB8, 0x2A, 0x44, 0x1B, 0xD7, 0x17, 0x71, 0x7C,
+    0x4D, 0x22, 0xAE, 0x71, 0x93, 0x88, 0x31, 0xEF, 0xE0, 0x1F, 0xD5, 0x1A, 0xFF, 0xD8, 0x71, 0x02,
+    0x00, 0x00,
+};
+
+void test_dynamic_codes_and_comment(void)
+{
+    std::string text;
+    char        line[40];
+    for (int i = 0; i < 40; i++) {
+        snprintf(line, sizeof(line), "%d,inbound,%d,%d\n", i, i % 7, i * 13 % 100);
+        text += line;
+    }
+
+    std::vector<uint8_t> gz(dynamicStream, dynamicStream + sizeof(dynamicStream));
+    for (size_t chunk = 1; chunk <= gz.size(); chunk++) {
+        Output      out;
+        std::string comment;
+        TEST_ASSERT_EQUAL(INFLATE_DONE, inflate(gz, chunk, out, nullptr, &comment));
+        TEST_ASSERT_EQUAL_STRING("sha256=x", comment.c_str());
+        TEST_ASSERT_EQUAL_STRING(text.c_str(), std::string(out.data.begin(), out.data.end()).c_str());
+    }
+}
+
+//*****************************************************************************
+void test_broken_streams_are_turned_away(void)
+{
+    std::vector<uint8_t> image = firmwareLike(20000, 50);
+    std::vector<uint8_t> gz    = gzip(image);
+    std::string          problem;
+
+    for (size_t cut : { (size_t)0, (size_t)5, (size_t)100, gz.size() / 2, gz.size() - 1 }) {
+        Output out;
+        TEST_ASSERT_EQUAL(INFLATE_ERROR, inflate(std::vector<uint8_t>(gz.begin(), gz.begin() + cut), 64, out, &problem));
+        TEST_ASSERT_EQUAL_STRING("Compressed image is truncated", problem.c_str());
+    }
+
+    std::vector<uint8_t> bad = gz;
+    bad[gz.size() - 8] ^= 1; // The CRC.
+    Output out;
+    TEST_ASSERT_EQUAL(INFLATE_ERROR, inflate(bad, 64, out, &problem));
+    TEST_ASSERT_EQUAL_STRING("CRC of decompressed image doesn't match", problem.c_str());
+
+    bad = gz;
+    bad[gz.size() - 4] ^= 1; // The length.
+    TEST_ASSERT_EQUAL(INFLATE_ERROR, inflate(bad, 64, out, &problem));
+    TEST_ASSERT_EQUAL_STRING("Length of decompressed image doesn't match", problem.c_str());
+
+    bad = image; // Not compressed at all.
+    TEST_ASSERT_EQUAL(INFLATE_ERROR, inflate(bad, 64, out, &problem));
+    TEST_ASSERT_EQUAL_STRING("Not a gzip file", problem.c_str());
+
+    Output refusing;
+    refusing.refuse = true; // The flash write failed.
+    TEST_ASSERT_EQUAL(INFLATE_ERROR, inflate(gz, 64, refusing, &problem));
+    TEST_ASSERT_EQUAL_STRING("Couldn't write decompressed image", problem.c_str());
+}
+
+//*****************************************************************************
+// Writes deflate bits by hand, for a stream GzipDeflater wouldn't make.
+struct BitWriter
+{
+    std::vector<uint8_t> out;
+    uint32_t             bits = 0;
+    unsigned             count = 0;
+
+    void put(uint32_t value, unsigned n)
+    {
+        bits |= value << count;
+        for (count += n; count >= 8; count -= 8, bits >>= 8) out.push_back((uint8_t)bits);
+    }
+    void code(unsigned value, unsigned n) // Huffman codes go most significant bit first.
+    {
+        for (unsigned i = n; i--;) put((value >> i) & 1, 1);
+    }
+    void align()
+    {
+        if (count) put(0, 8 - count);
+    }
+};
+
+void test_reference_beyond_the_window_is_refused(void)
+{
+    const uint16_t length = INFLATE_WINDOW_SIZE + 1000;
+    BitWriter      w;
+    static const uint8_t header[10] = { 0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 0xFF };
+    w.out.assign(header, header + sizeof(header));
+
+    w.put(0, 3); // Stored, not the last block...
+    w.align();
+    w.put(length, 16);
+    w.put((uint16_t)~length, 16);
+    for (uint16_t i = 0; i < length; i++) w.put('a' + i % 26, 8);
+
+    w.put(1, 1); // ...then a fixed block with one match, 3 bytes from all the way back.
+    w.put(1, 2);
+    w.code(1, 7);                      // Length 3.
+    w.code(26, 5);                     // Distances 8193 to 12288...
+    w.put(length - 8193, 12);          // ...this one.
+    w.code(0, 7);                      // End of block.
+    w.align();
+    for (int i = 0; i < 8; i++) w.out.push_back(0); // Never reached.
+
+    Output      out;
+    std::string problem;
+    TEST_ASSERT_EQUAL(INFLATE_ERROR, inflate(w.out, 512, out, &problem));
+    TEST_ASSERT_EQUAL_STRING("Compressed with too big a window", problem.c_str());
+}
+
+//*****************************************************************************
+void test_throughput(void)
+{
+    std::vector<uint8_t> image = firmwareLike(DEFLATE_MAX_INPUT, 60);
+    std::vector<uint8_t> gz    = gzip(image);
+    char                 message[120];
+
+    for (size_t chunk : { (size_t)64, (size_t)1460, (size_t)8192 }) {
+        const int rounds = 20;
+        auto      t0     = std::chrono::steady_clock::now();
+        for (int i = 0; i < rounds; i++) {
+            Output out;
+            out.data.reserve(image.size());
+            TEST_ASSERT_EQUAL(INFLATE_DONE, inflate(gz, chunk, out));
+        }
+        double s = secondsSince(t0);
+        snprintf(message, sizeof(message), "%u-byte pieces: %.1f MB/s out (%u bytes from %u)", (unsigned)chunk,
+                 rounds * image.size() / s / 1e6, (unsigned)image.size(), (unsigned)gz.size());
+        TEST_MESSAGE(message);
+    }
+}
+
+static bool readWhole(const char *path, std::vector<uint8_t> &data)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) return false;
+    uint8_t buffer[4096];
+    size_t  n;
+    while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) data.insert(data.end(), buffer, buffer + n);
+    fclose(f);
+    return true;
+}
+
+void test_real_image(void)
+{
+    const char *path = getenv("INFLATE_IMAGE");
+    if (!path) TEST_IGNORE_MESSAGE("Set INFLATE_IMAGE to a .gz from tools/compress_firmware.py");
+
+    std::vector<uint8_t> gz;
+    TEST_ASSERT_TRUE_MESSAGE(readWhole(path, gz), path);
+
+    Output      out;
+    std::string problem, comment;
+    auto        t0 = std::chrono::steady_clock::now();
+    InflateResult r = inflate(gz, 1460, out, &problem, &comment);
+    double      s  = secondsSince(t0);
+    TEST_ASSERT_EQUAL_MESSAGE(INFLATE_DONE, r, problem.c_str());
+
+    std::string binPath(path);
+    std::vector<uint8_t> image;
+    if ((binPath.size() > 3) && (binPath.compare(binPath.size() - 3, 3, ".gz") == 0) &&
+        readWhole(binPath.substr(0, binPath.size() - 3).c_str(), image)) {
+        TEST_ASSERT_TRUE(out.data == image);
+    }
+
+    char message[160];
+    snprintf(message, sizeof(message), "%u bytes from %u, %.1f MB/s, comment '%s'", (unsigned)out.data.size(),
+             (unsigned)gz.size(), out.data.size() / s / 1e6, comment.c_str());
+    TEST_MESSAGE(message);
+}
+
+int main(int, char **)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_firmware_like_image_in_any_pieces);
+    RUN_TEST(test_many_images);
+    RUN_TEST(test_dynamic_codes_and_comment);
+    RUN_TEST(test_broken_streams_are_turned_away);
+    RUN_TEST(test_reference_beyond_the_window_is_refused);
+    RUN_TEST(test_throughput);
+    RUN_TEST(test_real_image);
+    return UNITY_END();
+}
@@ -0,0 +1,177 @@
+/* test_line_input
+ *
+ *  LineAssembler on its own, then two consoles typed into at once, a few
+ *  bytes per loop pass, the way pollConsole() in main.cpp reads them.
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#include <unity.h>
+#include <string.h>
+#include <string>
+#include <digameLineInput.h>
+
+void setUp(void) {}
+void tearDown(void) {}
+
+//*****************************************************************************
+// Feed a string and keep the last finished line.
+static int feedAll(LineAssembler &a, const char *s, std::string &last)
+{
+    int lines = 0;
+    for (; *s; s++) {
+        if (a.feed(*s)) {
+            last = a.line();
+            lines++;
+        }
+    }
+    return lines;
+}
+
+void test_cr_lf_and_crlf_each_end_one_line(void)
+{
+    LineAssembler a;
+    std::string   last;
+    TEST_ASSERT_EQUAL(1, feedAll(a, "one\r", last));
+    TEST_ASSERT_EQUAL_STRING("one", last.c_str());
+    TEST_ASSERT_EQUAL(1, feedAll(a, "two\n", last));
+    TEST_ASSERT_EQUAL(1, feedAll(a, "three\r\n", last));
+    TEST_ASSERT_EQUAL_STRING("three", last.c_str());
+    TEST_ASSERT_EQUAL(1, feedAll(a, "\n", last)); // A blank line after a CRLF is still a line.
+    TEST_ASSERT_EQUAL_STRING("", last.c_str());
+}
+
+void test_backspace_and_white_space(void)
+{
+    LineAssembler a;
+    std::string   last;
+    feedAll(a, "  ab\bc\x7f" "d \t\n", last);
+    TEST_ASSERT_EQUAL_STRING("ad", last.c_str());
+    TEST_ASSERT_FALSE(a.pending());
+    feedAll(a, "x\x01y", last); // Other control characters are dropped.
+    TEST_ASSERT_TRUE(a.pending());
+    feedAll(a, "\r", last);
+    TEST_ASSERT_EQUAL_STRING("xy", last.c_str());
+}
+
+void test_long_line_is_cut_short(void)
+{
+    LineAssembler a;
+    std::string   typed(200, 'x'), last;
+    typed += '\n';
+    TEST_ASSERT_EQUAL(1, feedAll(a, typed.c_str(), last));
+    TEST_ASSERT_EQUAL(LINE_INPUT_MAX_LENGTH - 1, last.size());
+    TEST_ASSERT_TRUE(a.truncated());
+    feedAll(a, "ok\n", last);
+    TEST_ASSERT_FALSE(a.truncated());
+}
+
+//*****************************************************************************
+// A console as main.cpp keeps one: bytes that have arrived but not been
+// read, the assembler, and a command waiting on its value.
+struct FakeConsole
+{
+    std::string   script;     // Everything the technician will type.
+    size_t        arrived = 0; // How much of it has come in so far.
+    size_t        read    = 0;
+    LineAssembler line;
+    char          pending = 0;
+
+    std::string name;
+    int         threshold = 0;
+};
+
+static const int BYTES_PER_POLL = 64; // MAX_INPUT_BYTES_PER_POLL
+
+static uint32_t noise = 12345;
+static uint32_t nextRandom()
+{
+    noise ^= noise << 13;
+    noise ^= noise >> 17;
+    noise ^= noise << 5;
+    return noise;
+}
+
+// pollConsole(): read what's there, up to the budget, and stop at a line.
+static bool poll(FakeConsole &c, int &bytesRead)
+{
+    int budget = BYTES_PER_POLL;
+    while ((budget-- > 0) && (c.read < c.arrived)) {
+        bytesRead++;
+        if (c.line.feed(c.script[c.read++])) return true;
+    }
+    return false;
+}
+
+// processLine(): "n" and "t" ask for a value on the next line.
+static void process(FakeConsole &c)
+{
+    const char *l = c.line.line();
+    if (c.pending == 'n') {
+        c.name    = l;
+        c.pending = 0;
+    } else if (c.pending == 't') {
+        c.threshold = atoi(l);
+        c.pending   = 0;
+    } else if (!strcmp(l, "n") || !strcmp(l, "t")) {
+        c.pending = l[0];
+    }
+}
+
+void test_interleaved_typing_never_stalls_counting(void)
+{
+    FakeConsole serial, bt;
+    serial.script = "n\r\nDoor 3 ra\bear\r\n";
+    bt.script     = "t\n  250\n";
+
+    const int passes = 1000;
+    int frames = 0, maxBytes = 0;
+    for (int pass = 0; pass < passes; pass++) {
+        // A byte or two now and then on each link, as a person types.
+        if ((nextRandom() % 20 == 0) && (serial.arrived < serial.script.size())) serial.arrived++;
+        if ((nextRandom() % 20 == 0) && (bt.arrived < bt.script.size())) bt.arrived++;
+
+        int bytes = 0;
+        if (poll(serial, bytes)) process(serial);
+        if (poll(bt, bytes)) process(bt);
+        if (bytes > maxBytes) maxBytes = bytes;
+
+        frames++; // The counting step runs every pass, typing or not.
+
+        if (pass == 100) { // Both halfway through something.
+            TEST_ASSERT_TRUE(serial.pending || serial.line.pending());
+            TEST_ASSERT_TRUE(bt.pending || bt.line.pending());
+        }
+    }
+
+    TEST_ASSERT_EQUAL(passes, frames);
+    TEST_ASSERT_LESS_OR_EQUAL(2 * BYTES_PER_POLL, maxBytes);
+    TEST_ASSERT_EQUAL_STRING("Door 3 rear", serial.name.c_str());
+    TEST_ASSERT_EQUAL(250, bt.threshold);
+    TEST_ASSERT_EQUAL(0, serial.pending);
+    TEST_ASSERT_EQUAL(0, bt.pending);
+}
+
+// A paste arriving all at once is read a budget at a time.
+void test_burst_is_read_a_budget_at_a_time(void)
+{
+    FakeConsole c;
+    c.script  = std::string(300, 'z') + "\n";
+    c.arrived = c.script.size();
+
+    int polls = 0, bytes = 0;
+    while (!poll(c, bytes)) polls++;
+    TEST_ASSERT_EQUAL(300 / BYTES_PER_POLL, polls);
+    TEST_ASSERT_TRUE(c.line.truncated());
+}
+
+int main(int, char **)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_cr_lf_and_crlf_each_end_one_line);
+    RUN_TEST(test_backspace_and_white_space);
+    RUN_TEST(test_long_line_is_cut_short);
+    RUN_TEST(test_interleaved_typing_never_stalls_counting);
+    RUN_TEST(test_burst_is_read_a_budget_at_a_time);
+    return UNITY_END();
+}
@@ -0,0 +1,266 @@
+/* test_live
+ *
+ *  Live push against a fake WebSocket whose clients each have a send queue
+ *  we can fill: raw samples decimated to each client's rate, raw batches
+ *  dropped (and reported) while a queue is full, count updates coalesced
+ *  to the latest, and a client that takes nothing for LIVE_STALL_MS cut
+ *  off.
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#include <unity.h>
+#include <digameLive.h>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+void setUp(void) {}
+void tearDown(void) {}
+
+//*****************************************************************************
+// Each client's queue holds `room` messages until the test drains it.
+class FakeSink : public LiveSink
+{
+  public:
+    struct Queue
+    {
+        size_t                   room = 8;
+        std::vector<std::string> waiting;
+        std::vector<std::string> received; // Drained, in order.
+    };
+
+    std::map<uint32_t, Queue> queues;
+    std::set<uint32_t>        closed;
+
+    bool canSend(uint32_t client) override { return queues[client].waiting.size() < queues[client].room; }
+
+    bool send(uint32_t client, const char *text, size_t length) override
+    {
+        TEST_ASSERT_TRUE(canSend(client)); // LivePush always asks first.
+        queues[client].waiting.push_back(std::string(text, length));
+        return true;
+    }
+
+    void close(uint32_t client) override { closed.insert(client); }
+
+    void drain()
+    {
+        for (auto &q : queues) {
+            for (auto &m : q.second.waiting) q.second.received.push_back(m);
+            q.second.waiting.clear();
+        }
+    }
+
+    std::vector<std::string> of(uint32_t client, const char *type)
+    {
+        std::vector<std::string> found;
+        std::string              tag = std::string("\"type\":\"") + type + "\"";
+        for (auto &m : queues[client].received) {
+            if (m.find(tag) != std::string::npos) found.push_back(m);
+        }
+        return found;
+    }
+
+    // The sample times from every raw batch a client got.
+    std::vector<uint32_t> sampleTimes(uint32_t client)
+    {
+        std::vector<uint32_t> times;
+        for (auto &m : of(client, "raw")) {
+            const char *p = strstr(m.c_str(), "\"samples\":[") + 11;
+            while ((p = strchr(p, '['))) times.push_back(strtoul(++p, nullptr, 10));
+        }
+        return times;
+    }
+};
+
+// The main loop: a frame from the sensor every frameMs, service() each pass.
+struct Bench
+{
+    FakeSink sink;
+    LivePush push;
+    uint32_t nowMs = 1000;
+
+    Bench() { push.begin(sink); }
+
+    void run(uint32_t ms, uint32_t frameMs = 10, bool draining = true)
+    {
+        for (uint32_t end = nowMs + ms; nowMs < end; nowMs += frameMs) {
+            push.frame(nowMs, 1200, 1800, 0);
+            push.service(nowMs);
+            if (draining) sink.drain();
+        }
+    }
+};
+
+//*****************************************************************************
+void test_hello_counts_and_rate_requests(void)
+{
+    Bench b;
+    TEST_ASSERT_TRUE(b.push.addClient(1, b.nowMs));
+    b.push.counts(12, 9);
+    b.run(500);
+
+    TEST_ASSERT_EQUAL_UINT32(2, b.sink.queues[1].received.size());
+    TEST_ASSERT_EQUAL_STRING("{\"type\":\"hello\",\"maxRate\":50}", b.sink.queues[1].received[0].c_str());
+    TEST_ASSERT_EQUAL_STRING("{\"type\":\"counts\",\"in\":12,\"out\":9}", b.sink.queues[1].received[1].c_str());
+    TEST_ASSERT_EQUAL_UINT32(0, b.sink.of(1, "raw").size()); // Nothing raw until asked.
+
+    b.push.onMessage(1, "rate 999", 8); // Clamped to LIVE_MAX_RATE_HZ.
+    b.run(1000);
+    TEST_ASSERT_INT_WITHIN(LIVE_BATCH_SAMPLES, LIVE_MAX_RATE_HZ, b.sink.sampleTimes(1).size()); // Less the batch still filling.
+
+    b.push.onMessage(1, "rate 0", 6);
+    size_t before = b.sink.sampleTimes(1).size();
+    b.run(1000);
+    TEST_ASSERT_EQUAL_UINT32(before, b.sink.sampleTimes(1).size());
+
+    b.push.onMessage(1, "bogus", 5);
+    b.push.onMessage(99, "rate 10", 7); // Not a client.
+    TEST_ASSERT_EQUAL_UINT32(1, b.push.clientCount());
+
+    for (uint32_t id = 2; id <= LIVE_MAX_CLIENTS; id++) TEST_ASSERT_TRUE(b.push.addClient(id, b.nowMs));
+    TEST_ASSERT_FALSE(b.push.addClient(100, b.nowMs));
+    b.push.removeClient(3);
+    TEST_ASSERT_TRUE(b.push.addClient(100, b.nowMs));
+}
+
+// Frames at 100 Hz; clients at 10, 25 and 50 Hz each get their own rate,
+// evenly spaced, in batches of at most LIVE_BATCH_SAMPLES.
+void test_decimation(void)
+{
+    Bench b;
+    const int rates[] = {10, 25, 50};
+    for (uint32_t id = 1; id <= 3; id++) {
+        b.push.addClient(id, b.nowMs);
+        char request[12];
+        b.push.onMessage(id, request, snprintf(request, sizeof(request), "rate %d", rates[id - 1]));
+    }
+    b.run(10000);
+
+    for (uint32_t id = 1; id <= 3; id++) {
+        std::vector<uint32_t> times = b.sink.sampleTimes(id);
+        uint32_t              interval = 1000 / rates[id - 1];
+        TEST_ASSERT_INT_WITHIN(LIVE_BATCH_SAMPLES, rates[id - 1] * 10, times.size());
+        for (size_t i = 1; i < times.size(); i++) TEST_ASSERT_EQUAL_UINT32(interval, times[i] - times[i - 1]);
+
+        for (auto &m : b.sink.of(id, "raw")) {
+            size_t samples = 0;
+            for (size_t at = m.find("],["); at != std::string::npos; at = m.find("],[", at + 1)) samples++;
+            TEST_ASSERT_LESS_OR_EQUAL(LIVE_BATCH_SAMPLES, samples + 1);
+            TEST_ASSERT_TRUE(m.find("\"dropped\":0") != std::string::npos);
+        }
+    }
+
+    // A sensor slower than the client asks for: every frame goes, and the
+    // grid doesn't try to catch up.
+    Bench slow;
+    slow.push.addClient(1, slow.nowMs);
+    slow.push.onMessage(1, "rate 50", 7);
+    slow.run(2000, 33);
+    std::vector<uint32_t> times = slow.sink.sampleTimes(1);
+    TEST_ASSERT_INT_WITHIN(LIVE_BATCH_SAMPLES, 2000 / 33, times.size());
+    for (size_t i = 1; i < times.size(); i++) TEST_ASSERT_EQUAL_UINT32(33, times[i] - times[i - 1]);
+}
+
+// A client that stops reading: raw batches are dropped and counted, count
+// updates held back, and once it reads again the next batch says how many
+// it missed and the counts it gets are the latest.
+void test_full_queue_drops_batches_and_holds_counts(void)
+{
+    Bench b;
+    b.push.addClient(1, b.nowMs);
+    b.push.addClient(2, b.nowMs);
+    b.push.onMessage(1, "rate 50", 7);
+    b.push.onMessage(2, "rate 50", 7);
+    b.run(500);
+    size_t countsBefore = b.sink.of(1, "counts").size();
+
+    b.sink.queues[1].room = 0; // Client 1 stops taking messages.
+    for (uint32_t i = 1; i <= 5; i++) {
+        b.push.counts(i, i * 2);
+        b.run(200, 10, false);
+        b.sink.queues[2].received.insert(b.sink.queues[2].received.end(), b.sink.queues[2].waiting.begin(),
+                                         b.sink.queues[2].waiting.end());
+        b.sink.queues[2].waiting.clear();
+    }
+    uint32_t dropped = b.push.batchesDropped;
+    TEST_ASSERT_GREATER_THAN(5, dropped);
+    TEST_ASSERT_EQUAL_UINT32(5, b.sink.of(2, "counts").size() - countsBefore); // The other client isn't held up.
+
+    b.sink.queues[1].room = 8;
+    b.run(200);
+    std::vector<std::string> counts = b.sink.of(1, "counts");
+    TEST_ASSERT_EQUAL_UINT32(countsBefore + 1, counts.size());
+    TEST_ASSERT_EQUAL_STRING("{\"type\":\"counts\",\"in\":5,\"out\":10}", counts.back().c_str());
+
+    std::vector<std::string> raw = b.sink.of(1, "raw");
+    char expected[32];
+    snprintf(expected, sizeof(expected), "\"dropped\":%u", (unsigned)dropped);
+    size_t reported = 0;
+    for (auto &m : raw) reported += (m.find(expected) != std::string::npos) ? 1 : 0;
+    TEST_ASSERT_EQUAL_UINT32(1, reported);
+    TEST_ASSERT_TRUE(raw.back().find("\"dropped\":0") != std::string::npos);
+}
+
+// Blocked for LIVE_STALL_MS and it's closed. Quiet isn't blocked: a client
+// with nothing to be sent stays however long it's idle.
+void test_stalled_client_is_disconnected(void)
+{
+    Bench b;
+    b.push.addClient(1, b.nowMs);
+    b.push.addClient(2, b.nowMs);
+    b.push.onMessage(1, "rate 10", 7);
+    b.run(1000);
+
+    b.sink.queues[1].room = 0;
+    b.run(LIVE_STALL_MS - 200);
+    TEST_ASSERT_EQUAL_UINT32(0, b.sink.closed.size());
+    TEST_ASSERT_EQUAL_UINT32(2, b.push.clientCount());
+
+    b.run(400);
+    TEST_ASSERT_EQUAL_UINT32(1, b.sink.closed.size());
+    TEST_ASSERT_TRUE(b.sink.closed.count(1));
+    TEST_ASSERT_EQUAL_UINT32(1, b.push.clientsDropped);
+    TEST_ASSERT_EQUAL_UINT32(1, b.push.clientCount());
+
+    b.run(60000); // Client 2 asked for nothing raw and the counts never changed.
+    TEST_ASSERT_EQUAL_UINT32(1, b.push.clientCount());
+    TEST_ASSERT_EQUAL_UINT32(1, b.sink.closed.size());
+}
+
+// counts() is called every pass of the loop. Only changes are sent, and
+// however many come between two service() calls, only the last goes.
+void test_counts_coalesce(void)
+{
+    Bench b;
+    b.push.addClient(1, b.nowMs);
+    b.run(100);
+    size_t before = b.sink.of(1, "counts").size();
+
+    for (int pass = 0; pass < 1000; pass++) {
+        b.push.counts(0, 0);
+        b.push.service(b.nowMs++);
+    }
+    TEST_ASSERT_EQUAL_UINT32(before, b.sink.of(1, "counts").size());
+
+    for (uint32_t i = 1; i <= 100; i++) b.push.counts(i, 0);
+    b.push.service(b.nowMs);
+    b.push.service(b.nowMs);
+    b.sink.drain();
+    std::vector<std::string> counts = b.sink.of(1, "counts");
+    TEST_ASSERT_EQUAL_UINT32(before + 1, counts.size());
+    TEST_ASSERT_EQUAL_STRING("{\"type\":\"counts\",\"in\":100,\"out\":0}", counts.back().c_str());
+}
+
+int main(int, char **)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_hello_counts_and_rate_requests);
+    RUN_TEST(test_decimation);
+    RUN_TEST(test_full_queue_drops_batches_and_holds_counts);
+    RUN_TEST(test_stalled_client_is_disconnected);
+    RUN_TEST(test_counts_coalesce);
+    return UNITY_END();
+}
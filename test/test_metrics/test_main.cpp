@@ -0,0 +1,173 @@
+/* test_metrics
+ *
+ *  The /metrics page: the same bytes whatever size of piece the web server
+ *  asks for, Prometheus's text format line by line, and histograms that
+ *  add up when they're read while being written from another thread.
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#include <unity.h>
+#include <Arduino.h>
+#include <digameMetrics.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+void setUp(void) {}
+void tearDown(void) {}
+
+static MetricCounter   frames1 = 81236, frames2 = 81230, errors = 0;
+static const uint32_t  loopBounds[] = {100, 250, 500, 1000, 2500, 5000};
+static MetricHistogram loopTime(loopBounds, 6);
+static MetricHistogram flashTime(loopBounds, 6);
+static uint32_t        heapFree() { return 123456; }
+
+static const Metric table[] = {
+    {"digame_lidar_frames_total", "Good frames read from each sensor.", METRIC_COUNTER, "sensor=\"1\"", &frames1, nullptr, nullptr},
+    {"digame_lidar_frames_total", "", METRIC_COUNTER, "sensor=\"2\"", &frames2, nullptr, nullptr},
+    {"digame_errors_total", "Errors.", METRIC_COUNTER, nullptr, &errors, nullptr, nullptr},
+    {"digame_heap_free_bytes", "Free heap.", METRIC_GAUGE, nullptr, nullptr, heapFree, nullptr},
+    {"digame_loop_seconds", "Main loop pass time.", METRIC_HISTOGRAM, nullptr, nullptr, nullptr, &loopTime},
+    {"digame_flash_seconds", "Flash write time.", METRIC_HISTOGRAM, "op=\"write\"", nullptr, nullptr, &flashTime},
+};
+static const size_t TABLE_SIZE = sizeof(table) / sizeof(table[0]);
+
+static std::string page(size_t piece)
+{
+    MetricsStream stream(table, TABLE_SIZE);
+    std::string   text;
+    uint8_t       buffer[2048];
+    size_t        n;
+    while ((n = stream.fill(buffer, piece)) > 0) {
+        TEST_ASSERT_LESS_OR_EQUAL(piece, n);
+        text.append((const char *)buffer, n);
+    }
+    TEST_ASSERT_EQUAL_UINT32(0, stream.fill(buffer, piece));
+    return text;
+}
+
+//*****************************************************************************
+void test_same_page_whatever_the_piece_size(void)
+{
+    std::string whole = page(2048);
+    const size_t pieces[] = {1, 2, 7, 100, 191, 192, 193, 536, 1436};
+    for (size_t piece : pieces) TEST_ASSERT_EQUAL_STRING(whole.c_str(), page(piece).c_str());
+}
+
+void test_exposition_format(void)
+{
+    loopTime  = MetricHistogram(loopBounds, 6);
+    flashTime = MetricHistogram(loopBounds, 6);
+    const uint32_t samples[] = {50, 100, 101, 700, 700, 4000, 9000};
+    for (uint32_t us : samples) loopTime.observe(us);
+    flashTime.observe(3000);
+
+    TEST_ASSERT_EQUAL_STRING(
+        "# HELP digame_lidar_frames_total Good frames read from each sensor.\n"
+        "# TYPE digame_lidar_frames_total counter\n"
+        "digame_lidar_frames_total{sensor=\"1\"} 81236\n"
+        "digame_lidar_frames_total{sensor=\"2\"} 81230\n"
+        "# HELP digame_errors_total Errors.\n"
+        "# TYPE digame_errors_total counter\n"
+        "digame_errors_total 0\n"
+        "# HELP digame_heap_free_bytes Free heap.\n"
+        "# TYPE digame_heap_free_bytes gauge\n"
+        "digame_heap_free_bytes 123456\n"
+        "# HELP digame_loop_seconds Main loop pass time.\n"
+        "# TYPE digame_loop_seconds histogram\n"
+        "digame_loop_seconds_bucket{le=\"0.0001\"} 2\n" // Bounds are inclusive.
+        "digame_loop_seconds_bucket{le=\"0.00025\"} 3\n"
+        "digame_loop_seconds_bucket{le=\"0.0005\"} 3\n"
+        "digame_loop_seconds_bucket{le=\"0.001\"} 5\n"
+        "digame_loop_seconds_bucket{le=\"0.0025\"} 5\n"
+        "digame_loop_seconds_bucket{le=\"0.005\"} 6\n"
+        "digame_loop_seconds_bucket{le=\"+Inf\"} 7\n"
+        "digame_loop_seconds_sum 0.014651\n"
+        "digame_loop_seconds_count 7\n"
+        "# HELP digame_flash_seconds Flash write time.\n"
+        "# TYPE digame_flash_seconds histogram\n"
+        "digame_flash_seconds_bucket{op=\"write\",le=\"0.0001\"} 0\n"
+        "digame_flash_seconds_bucket{op=\"write\",le=\"0.00025\"} 0\n"
+        "digame_flash_seconds_bucket{op=\"write\",le=\"0.0005\"} 0\n"
+        "digame_flash_seconds_bucket{op=\"write\",le=\"0.001\"} 0\n"
+        "digame_flash_seconds_bucket{op=\"write\",le=\"0.0025\"} 0\n"
+        "digame_flash_seconds_bucket{op=\"write\",le=\"0.005\"} 1\n"
+        "digame_flash_seconds_bucket{op=\"write\",le=\"+Inf\"} 1\n"
+        "digame_flash_seconds_sum{op=\"write\"} 0.003000\n"
+        "digame_flash_seconds_count{op=\"write\"} 1\n",
+        page(1436).c_str());
+}
+
+// Counters are read as they are when their line is written.
+void test_values_are_live(void)
+{
+    std::string before = page(2048);
+    frames1            = frames1 + 1;
+    std::string after  = page(2048);
+    TEST_ASSERT_TRUE(after.find("{sensor=\"1\"} 81237\n") != std::string::npos);
+    TEST_ASSERT_FALSE(before == after);
+    frames1 = 81236;
+
+    Metric empty[1] = {};
+    MetricsStream none(empty, 0);
+    uint8_t b[16];
+    TEST_ASSERT_EQUAL_UINT32(0, none.fill(b, sizeof(b)));
+}
+
+// One thread observing as the counting loop does, another reading as the
+// web server does. Every read must add up, with nothing going backwards,
+// and one that got a clean copy must have its sum in range too.
+void test_histogram_reads_race_writes(void)
+{
+    static const uint32_t bounds[] = {10, 20, 30, 40, 50, 60, 70, 80, 90, 100, 110, 120};
+    MetricHistogram       h(bounds, 12);
+    std::atomic<bool>     stop(false);
+    const uint32_t        writes = 2000000;
+
+    std::thread writer([&]() {
+        for (uint32_t i = 0; i < writes; i++) {
+            h.observe(i % 131);
+            for (volatile int spin = 0; spin < 20; spin++) {} // A little work between observations.
+        }
+        stop = true;
+    });
+
+    uint32_t reads = 0, torn = 0, gaveUp = 0, lastCount = 0;
+    while (!stop) {
+        MetricHistogram::Snapshot s;
+        bool                      clean = h.read(s);
+        uint32_t                  total = 0;
+        for (size_t i = 0; i <= h.size(); i++) total += s.buckets[i];
+        if ((total != s.count) || (s.count < lastCount)) torn++;
+        if (clean && (s.sumUs > (uint64_t)s.count * 130)) torn++; // 130 us was the most observed.
+        gaveUp   += clean ? 0 : 1;
+        lastCount = s.count;
+        reads++;
+    }
+    writer.join();
+
+    MetricHistogram::Snapshot s;
+    TEST_ASSERT_TRUE(h.read(s));
+    TEST_ASSERT_EQUAL_UINT32(writes, s.count);
+    TEST_ASSERT_EQUAL_UINT64((uint64_t)(writes / 131) * (130 * 131 / 2) + (writes % 131) * (writes % 131 - 1) / 2,
+                             s.sumUs);
+
+    char message[120];
+    snprintf(message, sizeof(message), "%u reads during %u writes: %u torn, %u out of tries", (unsigned)reads,
+             (unsigned)writes, (unsigned)torn, (unsigned)gaveUp);
+    TEST_MESSAGE(message);
+    TEST_ASSERT_GREATER_THAN(1000, reads);
+    TEST_ASSERT_EQUAL_UINT32(0, torn);
+}
+
+int main(int, char **)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_same_page_whatever_the_piece_size);
+    RUN_TEST(test_exposition_format);
+    RUN_TEST(test_values_are_live);
+    RUN_TEST(test_histogram_reads_race_writes);
+    return UNITY_END();
+}
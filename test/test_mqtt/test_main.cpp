@@ -0,0 +1,445 @@
+/* test_mqtt
+ *
+ *  The MQTT publisher on a simulated clock, against a broker in the test
+ *  that can refuse connections, hold back or reorder its PUBACKs, and drop
+ *  the connection: QoS 1 resends flagged DUP, the event cursor only moving
+ *  past events acknowledged in order, and the event log standing in as the
+ *  offline queue, across a reboot too.
+ *
+ *  The last test publishes a backlog to a real broker through
+ *  PosixMqttSocket and reports the acknowledged publish rate. It's skipped
+ *  unless one is listening on localhost:1883 (or MQTT_BROKER, host:port):
+ *
+ *    mosquitto -p 1883 &
+ *    pio test -e native -f test_mqtt
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#include <unity.h>
+#include <Arduino.h>
+#include <FS.h>
+#include <digameMQTT.h>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <string>
+#include <vector>
+
+static uint32_t fakeNowMs = 0;
+static uint32_t fakeClock() { return fakeNowMs; }
+
+void setUp(void) { fakeNowMs = 0; }
+void tearDown(void) {}
+
+//*****************************************************************************
+// Takes each packet the client writes (the client writes whole packets) and
+// answers as a broker would, or as a badly behaved one.
+struct FakeBroker : public MqttSocket
+{
+    struct Publish
+    {
+        std::string topic;
+        std::string payload;
+        uint16_t    packetId;
+        bool        dup;
+        bool        retain;
+        int         qos;
+    };
+
+    bool                 up          = true;  // Accepting connections.
+    bool                 autoAck     = true;  // PUBACK each QoS 1 publish at once.
+    bool                 answerPings = true;
+    bool                 open_       = false;
+    std::vector<Publish> published;
+    std::vector<uint16_t> unacked;           // QoS 1 ids not yet acknowledged.
+    std::deque<uint8_t>  toClient;
+    std::string          willTopic, clientId;
+    uint32_t             connects = 0, pings = 0;
+
+    bool open(const char *, uint16_t) override
+    {
+        if (!up) return false;
+        open_ = true;
+        toClient.clear();
+        return true;
+    }
+
+    bool isOpen() override { return open_; }
+
+    void close() override
+    {
+        open_ = false;
+        unacked.clear(); // Clean session: the broker forgets them.
+    }
+
+    int read(uint8_t *data, size_t length) override
+    {
+        if (!open_) return -1;
+        size_t n = 0;
+        while ((n < length) && !toClient.empty()) {
+            data[n++] = toClient.front();
+            toClient.pop_front();
+        }
+        return (int)n;
+    }
+
+    int write(const uint8_t *data, size_t length) override
+    {
+        if (!open_) return -1;
+        size_t at = 1, remaining = 0, shift = 0;
+        do remaining |= (size_t)(data[at] & 0x7F) << shift, shift += 7; while (data[at++] & 0x80);
+        TEST_ASSERT_EQUAL_UINT32(length, at + remaining); // One packet, whole.
+        const uint8_t *body = data + at;
+
+        switch (data[0] & 0xF0) {
+        case MQTT_CONNECT: {
+            TEST_ASSERT_EQUAL_MEMORY("\0\4MQTT\4", body, 7);
+            uint8_t flags = body[7];
+            size_t  p     = 10;
+            clientId      = string(body, p);
+            if (flags & 0x04) willTopic = string(body, p);
+            connects++;
+            reply({ MQTT_CONNACK, 2, 0, 0 });
+            break;
+        }
+        case MQTT_PUBLISH: {
+            Publish m;
+            size_t  p = 0;
+            m.topic    = string(body, p);
+            m.qos      = (data[0] >> 1) & 3;
+            m.dup      = (data[0] & 0x08) != 0;
+            m.retain   = (data[0] & 0x01) != 0;
+            m.packetId = 0;
+            if (m.qos) {
+                m.packetId = (body[p] << 8) | body[p + 1];
+                p += 2;
+            }
+            m.payload.assign((const char *)body + p, remaining - p);
+            published.push_back(m);
+            if (m.qos) {
+                if (autoAck) ack(m.packetId);
+                else unacked.push_back(m.packetId);
+            }
+            break;
+        }
+        case MQTT_PINGREQ:
+            pings++;
+            if (answerPings) reply({ MQTT_PINGRESP, 0 });
+            break;
+        case MQTT_DISCONNECT:
+            open_ = false;
+            break;
+        }
+        return (int)length;
+    }
+
+    void ack(uint16_t id) { reply({ MQTT_PUBACK, 2, (uint8_t)(id >> 8), (uint8_t)id }); }
+
+    void ackHeld(size_t i)
+    {
+        ack(unacked[i]);
+        unacked.erase(unacked.begin() + i);
+    }
+
+    // The events, by seq, in the order they first arrived.
+    std::vector<uint32_t> eventOrder(bool firstOnly = true) const
+    {
+        std::vector<uint32_t> order;
+        for (const Publish &m : published) {
+            if (m.topic.find("/event") == std::string::npos) continue;
+            size_t   at  = m.payload.find("\"seq\":");
+            uint32_t seq = strtoul(m.payload.c_str() + at + 6, nullptr, 10);
+            if (firstOnly && (std::find(order.begin(), order.end(), seq) != order.end())) continue;
+            order.push_back(seq);
+        }
+        return order;
+    }
+
+  private:
+    void reply(std::initializer_list<uint8_t> bytes) { toClient.insert(toClient.end(), bytes.begin(), bytes.end()); }
+
+    static std::string string(const uint8_t *body, size_t &p)
+    {
+        size_t n = (body[p] << 8) | body[p + 1];
+        std::string s((const char *)body + p + 2, n);
+        p += 2 + n;
+        return s;
+    }
+};
+
+static size_t countsJSON(char *buffer, size_t size) { return snprintf(buffer, size, "{\"in\":1,\"out\":2}"); }
+static size_t healthJSON(char *buffer, size_t size) { return snprintf(buffer, size, "{\"up\":1}"); }
+
+// The publisher's task: stepped when it asks to be, every 10 ms at most.
+struct Bench
+{
+    fs::FS     disk;
+    EventLog   log;
+    FakeBroker broker;
+    MqttEngine *engine = nullptr;
+    uint32_t   seq     = 1;
+    uint32_t   dueMs   = 0;
+
+    Bench() { boot(); }
+    ~Bench() { delete engine; }
+
+    void boot() // Power on, or back on.
+    {
+        delete engine;
+        log    = EventLog();
+        seq    = log.begin(disk);
+        engine = new MqttEngine;
+        engine->begin(log, broker, &disk, fakeClock, countsJSON, healthJSON);
+        engine->setServer("broker", 1883, "", "");
+        engine->setDevice("Door 3/rear", "24:0A:C4:00:00:01");
+        dueMs = fakeNowMs;
+    }
+
+    void events(int n)
+    {
+        for (int i = 0; i < n; i++, seq++) log.append(seq, seq & 1, seq, fakeNowMs, 0, fakeNowMs);
+    }
+
+    void run(uint32_t ms)
+    {
+        for (uint32_t end = fakeNowMs + ms; (int32_t)(end - fakeNowMs) > 0; fakeNowMs += 10) {
+            log.service(fakeNowMs);
+            if ((int32_t)(fakeNowMs - dueMs) >= 0) dueMs = fakeNowMs + engine->step(true);
+        }
+    }
+
+    void assertAllDelivered()
+    {
+        std::vector<uint32_t> order = broker.eventOrder();
+        TEST_ASSERT_EQUAL_UINT32(seq - 1, order.size());
+        for (size_t i = 0; i < order.size(); i++) TEST_ASSERT_EQUAL_UINT32(i + 1, order[i]);
+        TEST_ASSERT_EQUAL_UINT32(0, engine->backlog());
+    }
+};
+
+//*****************************************************************************
+void test_connects_and_publishes(void)
+{
+    Bench b;
+    b.events(20);
+    b.run(MQTT_HEALTH_MS + 1000);
+
+    TEST_ASSERT_EQUAL_STRING("digame-240AC4000001", b.broker.clientId.c_str());
+    TEST_ASSERT_EQUAL_STRING("digame/Door_3rear/24:0A:C4:00:00:01/status", b.broker.willTopic.c_str());
+    TEST_ASSERT_TRUE(b.broker.published.size() >= 22);
+    TEST_ASSERT_EQUAL_STRING("digame/Door_3rear/24:0A:C4:00:00:01/status", b.broker.published[0].topic.c_str());
+    TEST_ASSERT_EQUAL_STRING("online", b.broker.published[0].payload.c_str());
+    TEST_ASSERT_TRUE(b.broker.published[0].retain);
+
+    bool countsSeen = false, healthSeen = false;
+    for (const auto &m : b.broker.published) {
+        if (m.topic.find("/counts") != std::string::npos) countsSeen = m.retain && (m.qos == 1);
+        if (m.topic.find("/health") != std::string::npos) healthSeen = (m.qos == 0);
+        if (m.topic.find("/event") != std::string::npos) TEST_ASSERT_EQUAL(1, m.qos);
+    }
+    TEST_ASSERT_TRUE(countsSeen);
+    TEST_ASSERT_TRUE(healthSeen);
+    b.assertAllDelivered();
+    TEST_ASSERT_EQUAL_UINT32(20, b.engine->eventsPublished);
+}
+
+// Unacknowledged when the connection drops: sent again once it's back,
+// with the same packet ids and DUP set.
+void test_resend_with_dup_after_a_drop(void)
+{
+    Bench b;
+    b.run(2000); // Connected; status and counts out of the way.
+    b.broker.autoAck = false;
+    b.events(5);
+    b.run(500);
+    std::vector<FakeBroker::Publish> first;
+    for (const auto &m : b.broker.published) if (m.topic.find("/event") != std::string::npos) first.push_back(m);
+    TEST_ASSERT_EQUAL_UINT32(5, first.size());
+    for (const auto &m : first) TEST_ASSERT_FALSE(m.dup);
+
+    b.broker.close(); // The link goes.
+    b.broker.autoAck = true;
+    size_t before    = b.broker.published.size();
+    b.run(5000);
+
+    TEST_ASSERT_EQUAL_UINT32(1, b.engine->client.drops);
+    TEST_ASSERT_EQUAL_UINT32(2, b.broker.connects);
+    std::vector<FakeBroker::Publish> again;
+    for (size_t i = before; i < b.broker.published.size(); i++) {
+        if (b.broker.published[i].topic.find("/event") != std::string::npos) again.push_back(b.broker.published[i]);
+    }
+    TEST_ASSERT_EQUAL_UINT32(5, again.size());
+    for (size_t i = 0; i < 5; i++) {
+        TEST_ASSERT_TRUE(again[i].dup);
+        TEST_ASSERT_EQUAL_UINT16(first[i].packetId, again[i].packetId);
+        TEST_ASSERT_EQUAL_STRING(first[i].payload.c_str(), again[i].payload.c_str());
+    }
+    TEST_ASSERT_EQUAL_UINT32(5, b.engine->client.resent);
+    b.assertAllDelivered();
+}
+
+// A PUBACK for a later event mustn't move the cursor past an earlier one
+// still waiting: a reboot then would lose it.
+void test_cursor_only_passes_events_acked_in_order(void)
+{
+    Bench b;
+    b.run(2000); // Connected; status and counts out of the way.
+    b.broker.autoAck = false;
+    b.events(5);
+    b.run(500);
+    TEST_ASSERT_EQUAL_UINT32(5, b.broker.unacked.size());
+    TEST_ASSERT_EQUAL_UINT32(2, b.engine->client.oldestTag()); // Event 1, tagged seq + 1.
+
+    b.broker.ackHeld(2); // Event 3.
+    b.broker.ackHeld(2); // Event 4.
+    b.run(100);
+    TEST_ASSERT_EQUAL_UINT32(2, b.engine->client.oldestTag());
+    TEST_ASSERT_EQUAL_UINT32(5, b.engine->backlog()); // The cursor hasn't moved.
+
+    b.broker.ackHeld(0); // Event 1.
+    b.run(100);
+    TEST_ASSERT_EQUAL_UINT32(3, b.engine->client.oldestTag());
+    TEST_ASSERT_EQUAL_UINT32(4, b.engine->backlog()); // Past 1, stopped at 2.
+
+    b.broker.ackHeld(0); // Event 2: 3 and 4 are already in.
+    b.run(100);
+    TEST_ASSERT_EQUAL_UINT32(6, b.engine->client.oldestTag());
+    TEST_ASSERT_EQUAL_UINT32(1, b.engine->backlog());
+
+    b.broker.ackHeld(0);
+    b.run(100);
+    TEST_ASSERT_EQUAL_UINT32(0, b.engine->client.oldestTag());
+    TEST_ASSERT_EQUAL_UINT32(0, b.engine->backlog());
+}
+
+// The broker away for ten minutes: events wait in the log, go out in order
+// once it's back, and a reboot part way through resends only since the
+// last cursor save.
+void test_log_is_the_offline_queue(void)
+{
+    Bench b;
+    b.run(1000);
+    b.broker.up = false;
+    b.broker.close();
+    for (int minute = 0; minute < 10; minute++) {
+        b.events(30);
+        b.run(60000);
+    }
+    TEST_ASSERT_EQUAL_UINT32(300, b.engine->backlog());
+    TEST_ASSERT_GREATER_THAN(3, b.engine->client.connectFailures);
+    TEST_ASSERT_EQUAL_UINT32(0, b.broker.eventOrder().size());
+
+    b.broker.up = true;
+    b.run(MQTT_BACKOFF_MAX_MS + 1000); // The next retry, and the first of it.
+    TEST_ASSERT_GREATER_THAN(0, (int)b.broker.eventOrder().size());
+
+    b.engine->saveCursor();
+    uint32_t savedBacklog = b.engine->backlog();
+    b.log.flush();
+    b.boot();
+    TEST_ASSERT_EQUAL_UINT32(savedBacklog, b.engine->backlog());
+    b.run(20000);
+    b.assertAllDelivered();
+    // Only what was in flight at the reboot goes twice.
+    TEST_ASSERT_LESS_OR_EQUAL(300 + MQTT_QUEUE_SIZE, (int)b.broker.eventOrder(false).size());
+}
+
+// The broker stops answering pings: dropped after the keep-alive.
+void test_silent_broker_is_dropped(void)
+{
+    Bench b;
+    b.run(1000);
+    b.broker.answerPings = false;
+    b.run(MQTT_KEEPALIVE_S * 2000UL);
+    TEST_ASSERT_GREATER_THAN(0, (int)b.broker.pings);
+    TEST_ASSERT_GREATER_THAN(0, (int)b.engine->client.drops);
+}
+
+void test_packet_lengths(void)
+{
+    uint8_t    buffer[400];
+    MqttPacket p(buffer, sizeof(buffer));
+    size_t     length;
+
+    p.start(MQTT_PINGREQ);
+    const uint8_t *out = p.finish(length);
+    TEST_ASSERT_EQUAL_UINT32(2, length);
+    TEST_ASSERT_EQUAL_HEX8(MQTT_PINGREQ, out[0]);
+    TEST_ASSERT_EQUAL_HEX8(0, out[1]);
+
+    p.start(MQTT_PUBLISH);
+    for (int i = 0; i < 200; i++) p.putU8(i);
+    out = p.finish(length);
+    TEST_ASSERT_EQUAL_UINT32(203, length);
+    TEST_ASSERT_EQUAL_HEX8(0xC8, out[1]); // 200 = 0x48 | continue, then 1.
+    TEST_ASSERT_EQUAL_HEX8(0x01, out[2]);
+
+    MqttPacket small(buffer, 20);
+    small.start(MQTT_PUBLISH);
+    small.putString("a topic much too long for it");
+    small.finish(length);
+    TEST_ASSERT_EQUAL_UINT32(0, length);
+}
+
+//*****************************************************************************
+static uint32_t wallClock()
+{
+    using namespace std::chrono;
+    return (uint32_t)duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+void test_against_a_local_broker(void)
+{
+    std::string host = "localhost";
+    uint16_t    port = 1883;
+    if (const char *broker = getenv("MQTT_BROKER")) {
+        host = broker;
+        size_t colon = host.rfind(':');
+        if (colon != std::string::npos) {
+            port = atoi(host.c_str() + colon + 1);
+            host.resize(colon);
+        }
+    }
+    PosixMqttSocket probe;
+    if (!probe.open(host.c_str(), port)) TEST_IGNORE_MESSAGE("No MQTT broker on localhost:1883 (or MQTT_BROKER)");
+    probe.close();
+
+    fs::FS          disk;
+    EventLog        log;
+    PosixMqttSocket socket;
+    MqttEngine      engine;
+    uint32_t        seq = log.begin(disk);
+    const uint32_t  backlog = 2000;
+    for (uint32_t i = 0; i < backlog; i++, seq++) log.append(seq, seq & 1, seq, 0, 0, 0);
+    log.flush();
+
+    engine.begin(log, socket, &disk, wallClock, countsJSON, healthJSON);
+    engine.setServer(host.c_str(), port, "", "");
+    engine.setDevice("bench", "24:0A:C4:00:00:01");
+
+    uint32_t started = wallClock();
+    while ((engine.backlog() > 0) && (wallClock() - started < 30000)) engine.step(true);
+    uint32_t took = wallClock() - started;
+    engine.client.disconnect();
+
+    TEST_ASSERT_EQUAL_UINT32(0, engine.backlog());
+    TEST_ASSERT_EQUAL_UINT32(backlog, engine.eventsPublished);
+    char message[120];
+    snprintf(message, sizeof(message), "%u events acknowledged in %u ms: %.0f publishes/s at QoS 1, %u in flight",
+             (unsigned)backlog, (unsigned)took, backlog * 1000.0 / (took ? took : 1), (unsigned)MQTT_QUEUE_SIZE - 1);
+    TEST_MESSAGE(message);
+}
+
+int main(int, char **)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_connects_and_publishes);
+    RUN_TEST(test_resend_with_dup_after_a_drop);
+    RUN_TEST(test_cursor_only_passes_events_acked_in_order);
+    RUN_TEST(test_log_is_the_offline_queue);
+    RUN_TEST(test_silent_broker_is_dropped);
+    RUN_TEST(test_packet_lengths);
+    RUN_TEST(test_against_a_local_broker);
+    return UNITY_END();
+}
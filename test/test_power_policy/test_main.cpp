@@ -0,0 +1,280 @@
+/* test_power_policy
+ *
+ *  PowerPolicy replayed over whole days: a bus in service from 06:00 to
+ *  22:00 with a stop every few minutes, the same day with rain and
+ *  reflections glinting all day and night, and a weekend in the depot. The
+ *  LIDAR runs at each level's frame rate, and a change of level takes
+ *  APPLY_US to put in place. Each replay reports the energy per hour
+ *  against running flat out, and the wake latency.
+ *
+ *  A frame capture can be replayed too. Decode it with
+ *  tools/decode_capture.py and point POWER_TRACE at the CSV; any frame
+ *  whose state isn't "neither" has someone in view:
+ *
+ *    python3 tools/decode_capture.py capture.bin > capture.csv
+ *    POWER_TRACE=capture.csv pio test -e native -f test_power_policy
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#include <unity.h>
+#include <digamePowerMgt.h>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+void setUp(void) { srand(7); }
+void tearDown(void) {}
+
+#define SECOND_US          1000000ULL
+#define DAY_US             (86400 * SECOND_US)
+#define APPLY_US           3000 // Setting the LIDARs' frame rate and the CPU clock.
+#define FULL_RATE_FRAME_US (1000000 / 100)
+
+// Someone in view, from start until end.
+struct Visit
+{
+    uint64_t startUs, endUs;
+};
+
+static double random01() { return rand() / (RAND_MAX + 1.0); }
+
+static void sortVisits(std::vector<Visit> &visits)
+{
+    std::sort(visits.begin(), visits.end(), [](const Visit &a, const Visit &b) { return a.startUs < b.startUs; });
+}
+
+// Stops 2 to 10 minutes apart; up to 7 people at each, a few seconds apart.
+static std::vector<Visit> busDay()
+{
+    std::vector<Visit> visits;
+    for (uint64_t t = 6 * 3600 * SECOND_US; t < 22 * 3600 * SECOND_US;) {
+        t += (uint64_t)((120 + random01() * 480) * SECOND_US);
+        int people = rand() % 8;
+        for (int i = 0; i < people; i++) {
+            t += (uint64_t)((1 + random01() * 4) * SECOND_US);
+            visits.push_back({ t, t + (uint64_t)((0.3 + random01() * 0.7) * SECOND_US) });
+        }
+        t += 20 * SECOND_US;
+    }
+    return visits;
+}
+
+// Single frames of nothing much, at any hour.
+static void addGlints(std::vector<Visit> &visits, int count)
+{
+    for (int i = 0; i < count; i++) {
+        uint64_t at = (uint64_t)(random01() * DAY_US);
+        visits.push_back({ at, at + 15000 });
+    }
+    sortVisits(visits);
+}
+
+//*****************************************************************************
+struct Report
+{
+    uint32_t arrivals       = 0;
+    uint32_t worstArrivalUs = 0; // Someone arriving to the next full-rate frame.
+    double   milliwattHours = 0; // Per hour, on average.
+    double   flatOut        = 0; // The same, at the top level all the time.
+    uint32_t lastHour       = 0;
+
+    MetricHistogram::Snapshot latency;
+};
+
+// Frames at whatever rate the policy has set, from 00:00 until lengthUs has
+// passed. micros() wraps every 71 minutes, and so does the time given to
+// frame().
+static Report replay(PowerPolicy &policy, const std::vector<Visit> &visits, uint64_t lengthUs)
+{
+    Report   r;
+    uint64_t t      = 0;
+    size_t   next   = 0;
+    bool     inView = false;
+
+    while (true) {
+        while ((next < visits.size()) && (visits[next].endUs <= t)) next++;
+        bool busy = (next < visits.size()) && (visits[next].startUs <= t);
+        if (busy && !inView) { // Someone has arrived. When is the first frame at the full rate?
+            uint32_t delay = (uint32_t)(t - visits[next].startUs);
+            if (policy.levelIndex() != 0) delay += APPLY_US + FULL_RATE_FRAME_US;
+            r.arrivals++;
+            r.worstArrivalUs = std::max(r.worstArrivalUs, delay);
+        }
+        inView = busy;
+
+        bool changed = policy.frame((uint32_t)t, busy);
+        if (t >= lengthUs) break;
+        if (changed) t += APPLY_US;
+        t += SECOND_US / policy.level().frameRate;
+    }
+
+    double hours     = lengthUs / 3600e6;
+    r.milliwattHours = policy.joules / 3.6 / hours;
+    r.flatOut        = policy.level(0).watts * 1000;
+    r.lastHour       = policy.lastHourMilliwattHours;
+    policy.wakeLatency.read(r.latency);
+    return r;
+}
+
+static void print(const char *name, const PowerPolicy &policy, const Report &r)
+{
+    char message[240];
+    snprintf(message, sizeof(message),
+             "%s: %.0f mWh/h (flat out %.0f, %.0f%% saved), last hour %u mWh; %u arrivals, %u wakes, "
+             "mean latency %.1f ms, worst arrival %.0f ms; s at each level %u/%u/%u",
+             name, r.milliwattHours, r.flatOut, 100 * (1 - r.milliwattHours / r.flatOut), (unsigned)r.lastHour,
+             (unsigned)r.arrivals, (unsigned)r.latency.count,
+             r.latency.count ? r.latency.sumUs / 1000.0 / r.latency.count : 0.0, r.worstArrivalUs / 1000.0,
+             (unsigned)policy.levelSeconds[0], (unsigned)policy.levelSeconds[1], (unsigned)policy.levelSeconds[2]);
+    TEST_MESSAGE(message);
+}
+
+// The frame after the one that woke it comes at the full rate, every time.
+static void assertSnapsBack(const Report &r)
+{
+    TEST_ASSERT_EQUAL_UINT64((uint64_t)r.latency.count * (APPLY_US + FULL_RATE_FRAME_US), r.latency.sumUs);
+    uint32_t parkedFrameUs = SECOND_US / POWER_LEVELS[POWER_LEVEL_COUNT - 1].frameRate;
+    TEST_ASSERT_LESS_OR_EQUAL(parkedFrameUs + APPLY_US + FULL_RATE_FRAME_US, r.worstArrivalUs);
+}
+
+//*****************************************************************************
+void test_steps_down_a_level_at_a_time(void)
+{
+    PowerPolicy p;
+    uint32_t    t = 0;
+    for (; t < 30000000; t += 10000) TEST_ASSERT_FALSE(p.frame(t, false));
+    TEST_ASSERT_TRUE(p.frame(t, false)); // 30 s with nobody in view.
+    TEST_ASSERT_EQUAL_STRING("idle", p.level().name);
+
+    for (t += 20000; t < 600000000; t += 20000) TEST_ASSERT_FALSE(p.frame(t, false));
+    TEST_ASSERT_TRUE(p.frame(t, false));
+    TEST_ASSERT_EQUAL_STRING("parked", p.level().name);
+
+    t += 100000;
+    TEST_ASSERT_TRUE(p.frame(t, true)); // Straight back to the top...
+    TEST_ASSERT_EQUAL(0, p.levelIndex());
+    TEST_ASSERT_EQUAL_UINT32(1, p.wakes);
+    t += APPLY_US + FULL_RATE_FRAME_US;
+    TEST_ASSERT_FALSE(p.frame(t, false)); // ...and the next frame is timed.
+
+    MetricHistogram::Snapshot s;
+    p.wakeLatency.read(s);
+    TEST_ASSERT_EQUAL_UINT32(1, s.count);
+    TEST_ASSERT_EQUAL_UINT64(APPLY_US + FULL_RATE_FRAME_US, s.sumUs);
+    TEST_ASSERT_EQUAL_UINT32(30, p.levelSeconds[0]);
+    TEST_ASSERT_EQUAL_UINT32(570, p.levelSeconds[1]);
+}
+
+void test_bus_day(void)
+{
+    PowerPolicy p;
+    Report      r = replay(p, busDay(), DAY_US);
+    print("Bus day", p, r);
+
+    assertSnapsBack(r);
+    TEST_ASSERT_UINT32_WITHIN(2, 86400, p.levelSeconds[0] + p.levelSeconds[1] + p.levelSeconds[2]);
+    TEST_ASSERT_EQUAL_UINT32(1000, r.lastHour); // Parked since 22:00, at 1 W.
+    TEST_ASSERT_LESS_THAN((int)(r.flatOut * 0.85), (int)r.milliwattHours);
+    TEST_ASSERT_GREATER_THAN((int)(POWER_LEVELS[POWER_LEVEL_COUNT - 1].watts * 1000), (int)r.milliwattHours);
+}
+
+// Glints wake it for a moment each, but cost little.
+void test_noisy_day(void)
+{
+    PowerPolicy quiet;
+    Report      clean = replay(quiet, busDay(), DAY_US);
+
+    srand(7);
+    std::vector<Visit> visits = busDay();
+    addGlints(visits, 300);
+    PowerPolicy p;
+    Report      r = replay(p, visits, DAY_US);
+    print("Bus day, with glints", p, r);
+
+    assertSnapsBack(r);
+    TEST_ASSERT_GREATER_THAN(clean.latency.count, r.latency.count);
+    TEST_ASSERT_LESS_THAN((int)(clean.milliwattHours * 1.1), (int)r.milliwattHours);
+}
+
+void test_day_in_the_depot(void)
+{
+    PowerPolicy p;
+    Report      r = replay(p, std::vector<Visit>(), DAY_US);
+    print("Depot", p, r);
+
+    TEST_ASSERT_EQUAL_UINT32(0, r.latency.count);
+    TEST_ASSERT_EQUAL_UINT32(30, p.levelSeconds[0]);
+    TEST_ASSERT_EQUAL_UINT32(570, p.levelSeconds[1]);
+    TEST_ASSERT_UINT32_WITHIN(2, 86400 - 600, p.levelSeconds[2]);
+    TEST_ASSERT_UINT32_WITHIN(5, 1000, (uint32_t)r.milliwattHours);
+}
+
+void test_disabled_runs_flat_out(void)
+{
+    PowerPolicy p;
+    p.setEnabled(false);
+    Report r = replay(p, busDay(), DAY_US);
+
+    TEST_ASSERT_EQUAL_UINT32(0, p.wakes);
+    TEST_ASSERT_UINT32_WITHIN(2, 86400, p.levelSeconds[0]);
+    TEST_ASSERT_UINT32_WITHIN(2, (uint32_t)r.flatOut, (uint32_t)r.milliwattHours);
+    TEST_ASSERT_EQUAL_UINT32((uint32_t)r.flatOut, r.lastHour);
+}
+
+//*****************************************************************************
+// time_ms,dist1,flux1,dist2,flux2,state,trigger,utc_ms
+static bool readCapture(const char *path, std::vector<Visit> &visits, uint64_t &lengthUs)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) return false;
+
+    char     line[200];
+    bool     first = true, inView = false;
+    uint64_t lastMs = 0, timeMs = 0; // From the first frame.
+    while (fgets(line, sizeof(line), f)) {
+        char state[16];
+        unsigned long ms;
+        if (sscanf(line, "%lu,%*d,%*d,%*d,%*d,%15[^,]", &ms, state) != 2) continue; // The heading.
+        if (!first && (ms >= lastMs)) timeMs += ms - lastMs; // Not across a reboot.
+        first  = false;
+        lastMs = ms;
+
+        bool busy = strcmp(state, "neither") != 0;
+        if (busy && !inView) visits.push_back({ timeMs * 1000, 0 });
+        if (busy) visits.back().endUs = timeMs * 1000 + FULL_RATE_FRAME_US;
+        inView = busy;
+    }
+    fclose(f);
+    lengthUs = timeMs * 1000;
+    return !first;
+}
+
+void test_captured_trace(void)
+{
+    const char *path = getenv("POWER_TRACE");
+    if (!path) TEST_IGNORE_MESSAGE("Set POWER_TRACE to a CSV from tools/decode_capture.py");
+
+    std::vector<Visit> visits;
+    uint64_t           lengthUs = 0;
+    TEST_ASSERT_TRUE_MESSAGE(readCapture(path, visits, lengthUs), path);
+
+    PowerPolicy p;
+    Report      r = replay(p, visits, lengthUs);
+    print(path, p, r);
+    assertSnapsBack(r);
+}
+
+int main(int, char **)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_steps_down_a_level_at_a_time);
+    RUN_TEST(test_bus_day);
+    RUN_TEST(test_noisy_day);
+    RUN_TEST(test_day_in_the_depot);
+    RUN_TEST(test_disabled_runs_flat_out);
+    RUN_TEST(test_captured_trace);
+    return UNITY_END();
+}
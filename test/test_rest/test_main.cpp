@@ -0,0 +1,166 @@
+/* test_rest
+ *
+ *  The streamed /api/events document: the same bytes whatever size of
+ *  piece the web server asks for, paging with "next", and the edges of the
+ *  log (events already rotated away, a page asked for past the newest).
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#include <unity.h>
+#include <Arduino.h>
+#include <FS.h>
+#include <digameRest.h>
+#include <string>
+
+void setUp(void) {}
+void tearDown(void) {}
+
+// More events than the log keeps, so the oldest have gone.
+static const uint32_t LOGGED = EVENT_LOG_SEGMENT_RECORDS * (EVENT_LOG_MAX_SEGMENTS + 2);
+
+struct Logged
+{
+    fs::FS   disk;
+    EventLog log;
+
+    Logged()
+    {
+        log.begin(disk);
+        for (uint32_t seq = 1; seq <= LOGGED; seq++) {
+            log.append(seq, seq & 1, seq, 1650000000000ULL + seq * 1000, (seq > 10) ? EVENT_FLAG_UTC : 0, seq * 100);
+            log.service(seq * 100);
+        }
+        log.flush();
+    }
+};
+
+// The whole document, asking for `piece` bytes at a time.
+static std::string stream(EventLog &log, uint32_t from, uint32_t limit, size_t piece)
+{
+    RestEventStream s(log, from, limit);
+    std::string     document;
+    uint8_t         buffer[2048];
+    size_t          n;
+    while ((n = s.fill(buffer, piece)) > 0) {
+        TEST_ASSERT_LESS_OR_EQUAL(piece, n);
+        document.append((const char *)buffer, n);
+    }
+    TEST_ASSERT_EQUAL_UINT32(0, s.fill(buffer, piece)); // Stays done.
+    return document;
+}
+
+static uint32_t field(const std::string &document, const char *name)
+{
+    size_t at = document.find(std::string("\"") + name + "\":");
+    TEST_ASSERT_TRUE(at != std::string::npos);
+    return strtoul(document.c_str() + at + strlen(name) + 3, nullptr, 10);
+}
+
+// The document as it should be, built in one go.
+static std::string expected(EventLog &log, uint32_t from, uint32_t limit)
+{
+    char        piece[128];
+    std::string document;
+    snprintf(piece, sizeof(piece), "{\"from\":%u,\"oldest\":%u,\"newest\":%u,\"events\":[", (unsigned)from,
+             (unsigned)log.oldestSeq(), (unsigned)log.newestSeq());
+    document = piece;
+
+    if (limit > REST_EVENTS_MAX_LIMIT) limit = REST_EVENTS_MAX_LIMIT;
+    uint32_t    next = from;
+    EventRecord r;
+    for (uint32_t i = 0; (i < limit) && (log.read(next, &r, 1) == 1); i++) {
+        eventToJSON(r, piece, sizeof(piece));
+        document += (i ? "," : "") + std::string(piece);
+        next = r.seq + 1;
+    }
+    snprintf(piece, sizeof(piece), "],\"next\":%u}", (unsigned)next);
+    return document + piece;
+}
+
+//*****************************************************************************
+void test_same_document_whatever_the_piece_size(void)
+{
+    Logged         l;
+    uint32_t       from   = l.log.oldestSeq() + 17;
+    std::string    whole  = expected(l.log, from, 250);
+    const size_t   pieces[] = {1, 2, 7, 63, 64, 127, 128, 536, 1436, 2048};
+    for (size_t piece : pieces) TEST_ASSERT_EQUAL_STRING(whole.c_str(), stream(l.log, from, 250, piece).c_str());
+
+    TEST_ASSERT_EQUAL_UINT32(from, field(whole, "from"));
+    TEST_ASSERT_EQUAL_UINT32(from + 250, field(whole, "next"));
+    TEST_ASSERT_EQUAL_UINT32(LOGGED, field(whole, "newest"));
+    TEST_ASSERT_TRUE(whole.find("\"eventType\":\"inbound\"") != std::string::npos);
+    TEST_ASSERT_TRUE(whole.find("\"eventType\":\"outbound\"") != std::string::npos);
+}
+
+// Following "next" from the very start walks every event still kept, once.
+void test_paging_follows_next(void)
+{
+    Logged   l;
+    uint32_t from = 0, seen = 0, pages = 0;
+    for (;;) {
+        std::string page = stream(l.log, from, 300, 1436);
+        uint32_t    next = field(page, "next");
+        uint32_t    expect = (pages == 0) ? l.log.oldestSeq() : from; // The first from is before the oldest.
+        size_t      events = 0;
+        for (size_t at = page.find("{\"seq\":"); at != std::string::npos; at = page.find("{\"seq\":", at + 1)) {
+            TEST_ASSERT_EQUAL_UINT32(expect + events, strtoul(page.c_str() + at + 7, nullptr, 10));
+            events++;
+        }
+        TEST_ASSERT_EQUAL_UINT32(expect + events, next);
+        seen += events;
+        pages++;
+        if (next > field(page, "newest")) break;
+        TEST_ASSERT_EQUAL_UINT32(300, events);
+        from = next;
+    }
+    TEST_ASSERT_GREATER_THAN(1, l.log.oldestSeq()); // Some had rotated away.
+    TEST_ASSERT_EQUAL_UINT32(LOGGED - l.log.oldestSeq() + 1, seen);
+}
+
+void test_limits_and_edges(void)
+{
+    Logged l;
+
+    std::string big = stream(l.log, 0, 100000, 1436); // Clamped to REST_EVENTS_MAX_LIMIT.
+    TEST_ASSERT_EQUAL_STRING(expected(l.log, 0, REST_EVENTS_MAX_LIMIT).c_str(), big.c_str());
+    TEST_ASSERT_EQUAL_UINT32(l.log.oldestSeq() + REST_EVENTS_MAX_LIMIT, field(big, "next"));
+
+    std::string past = stream(l.log, LOGGED + 5, 10, 64); // Nothing yet: asked to come back.
+    TEST_ASSERT_EQUAL_UINT32(LOGGED + 5, field(past, "next"));
+    TEST_ASSERT_TRUE(past.find("\"events\":[]") != std::string::npos);
+
+    std::string none = stream(l.log, l.log.oldestSeq(), 0, 64);
+    TEST_ASSERT_TRUE(none.find("\"events\":[]") != std::string::npos);
+
+    fs::FS   disk; // A new log.
+    EventLog empty;
+    empty.begin(disk);
+    std::string fresh = stream(empty, 0, 10, 1);
+    TEST_ASSERT_EQUAL_STRING(expected(empty, 0, 10).c_str(), fresh.c_str());
+    TEST_ASSERT_TRUE(fresh.find("\"events\":[]") != std::string::npos);
+}
+
+void test_event_json(void)
+{
+    EventRecord r = {};
+    r.seq    = 42;
+    r.type   = 1;
+    r.count  = 7;
+    r.timeMs = 1650000000123ULL;
+    r.flags  = EVENT_FLAG_UTC;
+    char json[128];
+    eventToJSON(r, json, sizeof(json));
+    TEST_ASSERT_EQUAL_STRING("{\"seq\":42,\"time\":1650000000123,\"utc\":1,\"eventType\":\"outbound\",\"count\":7}", json);
+}
+
+int main(int, char **)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_same_document_whatever_the_piece_size);
+    RUN_TEST(test_paging_follows_next);
+    RUN_TEST(test_limits_and_edges);
+    RUN_TEST(test_event_json);
+    return UNITY_END();
+}
@@ -0,0 +1,371 @@
+/* test_resumable_ota
+ *
+ *  Chunked firmware updates through a flaky link: a client that carries on
+ *  from the counter's offset, as tools/ota_resume.py does, against a link
+ *  that drops part way through chunks, flips bits, and a counter that
+ *  reboots. The partition is RAM that behaves like NOR flash, so a write
+ *  over unerased bytes is caught.
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#include <unity.h>
+#include <Arduino.h>
+#include <FS.h>
+#include <digameResumableOTA.h>
+#include <digameSha256.h>
+#include <random>
+#include <vector>
+
+void setUp(void) {}
+void tearDown(void) {}
+
+//*****************************************************************************
+// Bits only go from 1 to 0 until their sector is erased.
+class RamPartition : public OtaPartition
+{
+  public:
+    std::vector<uint8_t> flash = std::vector<uint8_t>(2 << 20, 0xFF);
+    uint32_t             sectorsErased      = 0;
+    uint32_t             writesOverUnerased = 0;
+    bool                 activated          = false;
+    bool                 flushFails         = false; // The loop couldn't finish writing a chunk.
+    uint32_t             partitionId        = 0x210000;
+
+    uint32_t id() override { return partitionId; }
+    uint32_t size() override { return flash.size(); }
+
+    bool erase(uint32_t offset, uint32_t length) override
+    {
+        if ((offset % RESUME_SECTOR_SIZE) || (length % RESUME_SECTOR_SIZE) || (offset + length > flash.size())) {
+            return false;
+        }
+        memset(&flash[offset], 0xFF, length);
+        sectorsErased += length / RESUME_SECTOR_SIZE;
+        return true;
+    }
+
+    bool write(uint32_t offset, const uint8_t *data, size_t length) override
+    {
+        if (offset + length > flash.size()) return false;
+        for (size_t i = 0; i < length; i++) {
+            if ((flash[offset + i] & data[i]) != data[i]) writesOverUnerased++;
+            flash[offset + i] &= data[i];
+        }
+        return true;
+    }
+
+    bool flush() override { return !flushFails; }
+
+    // Reads it all back, as EspOtaPartition does.
+    const char *activate(uint32_t size, const uint8_t *sha256) override
+    {
+        uint8_t digest[SHA256_LENGTH];
+        Sha256  sha;
+        sha.begin();
+        sha.update(flash.data(), size);
+        sha.finish(digest);
+        if (memcmp(digest, sha256, SHA256_LENGTH) != 0) return "SHA-256 of image doesn't match";
+        activated = true;
+        return nullptr;
+    }
+};
+
+static std::vector<uint8_t> randomImage(size_t size, uint32_t seed)
+{
+    std::mt19937         rng(seed);
+    std::vector<uint8_t> image(size);
+    for (auto &b : image) b = (uint8_t)rng();
+    return image;
+}
+
+static void sha256Of(const std::vector<uint8_t> &image, uint8_t *digest)
+{
+    Sha256 sha;
+    sha.begin();
+    sha.update(image.data(), image.size());
+    sha.finish(digest);
+}
+
+//*****************************************************************************
+// The counter, which can be rebooted, and the client's side of the link.
+struct Bench
+{
+    fs::FS        fs;
+    RamPartition  partition;
+    ResumableOta *ota = nullptr;
+    std::mt19937  rng{1};
+
+    double dropRate    = 0; // Chunks the link cuts off part way.
+    double corruptRate = 0; // Chunks with a bit flipped on the way.
+    double rebootRate  = 0; // Chances of a reboot before each chunk.
+
+    uint32_t sent = 0, drops = 0, corrupted = 0, refused = 0, reboots = 0;
+
+    Bench() { boot(); }
+    ~Bench() { delete ota; }
+
+    void boot()
+    {
+        delete ota;
+        ota = new ResumableOta;
+        ota->restore(fs, partition);
+    }
+
+    bool chance(double p) { return std::uniform_real_distribution<>(0, 1)(rng) < p; }
+
+    // POST /update/chunk: the body arrives in TCP-sized pieces.
+    const char *sendChunk(const std::vector<uint8_t> &image, uint32_t offset, uint32_t chunk)
+    {
+        uint32_t             length = std::min<uint32_t>(chunk, image.size() - offset);
+        std::vector<uint8_t> body(image.begin() + offset, image.begin() + offset + length);
+        uint32_t             crc   = crc32(body.data(), length);
+        uint32_t             cutAt = chance(dropRate) ? rng() % length : length;
+        if ((cutAt == length) && chance(corruptRate)) { // Counted only if it all arrives.
+            body[rng() % length] ^= 1 << (rng() % 8);
+            corrupted++;
+        }
+
+        const char *problem = ota->beginChunk(offset, length, crc);
+        if (problem) return problem;
+        for (uint32_t at = 0; at < cutAt;) {
+            uint32_t n = std::min<uint32_t>(1 + rng() % 1460, cutAt - at);
+            if ((problem = ota->writeChunk(&body[at], n))) return problem;
+            at   += n;
+            sent += n;
+        }
+        if (cutAt < length) {
+            drops++;
+            return "Dropped"; // The request never finishes.
+        }
+        return ota->endChunk();
+    }
+
+    // The client: start (or carry on with) the update, then send from
+    // wherever the counter is up to until it has it all.
+    const char *upload(const std::vector<uint8_t> &image, uint32_t chunk)
+    {
+        uint8_t sha[SHA256_LENGTH];
+        sha256Of(image, sha);
+
+        const char *problem = ota->start(image.size(), chunk, sha);
+        if (problem) return problem;
+        while (ota->offset() < image.size()) {
+            if (chance(rebootRate)) {
+                uint32_t before = ota->offset();
+                boot();
+                reboots++;
+                TEST_ASSERT_EQUAL_UINT32(before, ota->offset());
+                if ((problem = ota->start(image.size(), chunk, sha))) return problem;
+            }
+            problem = sendChunk(image, ota->offset(), chunk);
+            if (problem && strcmp(problem, "Dropped")) refused++;
+        }
+        return ota->finish();
+    }
+};
+
+//*****************************************************************************
+void test_clean_upload(void)
+{
+    Bench                b;
+    std::vector<uint8_t> image = randomImage(1000000, 1);
+
+    TEST_ASSERT_NULL(b.upload(image, 16384));
+    TEST_ASSERT_TRUE(b.partition.activated);
+    TEST_ASSERT_EQUAL_UINT32(image.size(), b.sent);
+    TEST_ASSERT_EQUAL_UINT32((image.size() + 4095) / 4096, b.partition.sectorsErased);
+    TEST_ASSERT_EQUAL_UINT32(62, b.ota->chunksWritten); // 61 whole and a short one.
+    TEST_ASSERT_FALSE(b.ota->active());
+}
+
+void test_interrupted_uploads_complete(void)
+{
+    char message[160];
+    for (uint32_t seed = 1; seed <= 10; seed++) {
+        Bench b;
+        b.rng.seed(seed);
+        b.dropRate    = 0.2;
+        b.corruptRate = 0.05;
+        b.rebootRate  = 0.02;
+        std::vector<uint8_t> image = randomImage(900000 + seed * 37111, seed);
+
+        TEST_ASSERT_NULL(b.upload(image, 16384));
+        TEST_ASSERT_TRUE(b.partition.activated);
+        TEST_ASSERT_EQUAL_UINT32(0, b.partition.writesOverUnerased);
+        TEST_ASSERT_TRUE(memcmp(b.partition.flash.data(), image.data(), image.size()) == 0);
+        TEST_ASSERT_EQUAL_UINT32(b.corrupted, b.refused);    // Every bad chunk was caught...
+        TEST_ASSERT_LESS_THAN(image.size() * 3 / 2, b.sent); // ...and only chunks are resent.
+
+        if (seed == 1) {
+            snprintf(message, sizeof(message), "%u bytes, %.2fx sent with %u drops, %u bad chunks, %u reboots",
+                     (unsigned)image.size(), (double)b.sent / image.size(), (unsigned)b.drops,
+                     (unsigned)b.corrupted, (unsigned)b.reboots);
+            TEST_MESSAGE(message);
+        }
+    }
+}
+
+void test_reboot_carries_on_only_with_the_same_image(void)
+{
+    Bench                b;
+    std::vector<uint8_t> image = randomImage(200000, 2);
+    uint8_t              sha[SHA256_LENGTH];
+    sha256Of(image, sha);
+
+    TEST_ASSERT_NULL(b.ota->start(image.size(), 16384, sha));
+    for (int i = 0; i < 5; i++) TEST_ASSERT_NULL(b.sendChunk(image, b.ota->offset(), 16384));
+    b.boot();
+    TEST_ASSERT_TRUE(b.ota->active());
+    TEST_ASSERT_EQUAL_UINT32(5 * 16384, b.ota->offset());
+
+    TEST_ASSERT_NULL(b.ota->start(image.size(), 16384, sha)); // Same image: carry on.
+    TEST_ASSERT_EQUAL_UINT32(5 * 16384, b.ota->offset());
+
+    TEST_ASSERT_NULL(b.ota->start(image.size(), 32768, sha)); // Another chunk size: start over.
+    TEST_ASSERT_EQUAL_UINT32(0, b.ota->offset());
+
+    sha[0] ^= 1; // Another image.
+    TEST_ASSERT_NULL(b.ota->start(image.size(), 32768, sha));
+    TEST_ASSERT_EQUAL_UINT32(0, b.ota->offset());
+
+    // Booted into the other partition, so the journal is for where we run now.
+    for (int i = 0; i < 2; i++) TEST_ASSERT_NULL(b.sendChunk(image, b.ota->offset(), 32768));
+    b.partition.partitionId = 0x10000;
+    b.boot();
+    TEST_ASSERT_FALSE(b.ota->active());
+}
+
+void test_chunks_out_of_turn_are_refused(void)
+{
+    Bench                b;
+    std::vector<uint8_t> image = randomImage(40000, 3);
+    uint8_t              sha[SHA256_LENGTH];
+    sha256Of(image, sha);
+
+    TEST_ASSERT_EQUAL_STRING("No update under way", b.ota->beginChunk(0, 16384, 0));
+    TEST_ASSERT_NOT_NULL(b.ota->start(image.size(), 5000, sha));
+    TEST_ASSERT_NOT_NULL(b.ota->start(image.size(), 2 * RESUME_MAX_CHUNK, sha));
+    TEST_ASSERT_EQUAL_STRING("Image doesn't fit", b.ota->start(b.partition.size() + 1, 16384, sha));
+    TEST_ASSERT_NULL(b.ota->start(image.size(), 16384, sha));
+
+    TEST_ASSERT_EQUAL_STRING("Not the next chunk", b.ota->beginChunk(16384, 16384, 0));
+    TEST_ASSERT_EQUAL_STRING("Wrong chunk length", b.ota->beginChunk(0, 4096, 0));
+    TEST_ASSERT_EQUAL_STRING("The image isn't all here", b.ota->finish());
+
+    TEST_ASSERT_NULL(b.ota->beginChunk(0, 16384, crc32(image.data(), 16384)));
+    TEST_ASSERT_NULL(b.ota->writeChunk(image.data(), 10000));
+    TEST_ASSERT_EQUAL_STRING("Chunk is short", b.ota->endChunk());
+    TEST_ASSERT_EQUAL_STRING("No chunk under way", b.ota->writeChunk(image.data(), 1));
+
+    TEST_ASSERT_NULL(b.ota->beginChunk(0, 16384, 0));
+    TEST_ASSERT_EQUAL_STRING("Chunk is longer than it said", b.ota->writeChunk(image.data(), 16385));
+    TEST_ASSERT_EQUAL_UINT32(0, b.ota->offset());
+    TEST_ASSERT_EQUAL_UINT32(5, b.ota->chunksRejected);
+
+    TEST_ASSERT_NULL(b.sendChunk(image, 0, 16384)); // The same chunk, again: its sectors are erased first.
+    TEST_ASSERT_NULL(b.sendChunk(image, 16384, 16384));
+    TEST_ASSERT_NULL(b.sendChunk(image, 32768, 16384)); // The short last one.
+    TEST_ASSERT_NULL(b.ota->finish());
+    TEST_ASSERT_EQUAL_UINT32(0, b.partition.writesOverUnerased);
+}
+
+void test_bad_image_has_to_be_sent_again(void)
+{
+    Bench                b;
+    std::vector<uint8_t> image = randomImage(50000, 4);
+    uint8_t              sha[SHA256_LENGTH];
+    sha256Of(image, sha);
+
+    TEST_ASSERT_NULL(b.ota->start(image.size(), 16384, sha));
+    for (uint32_t at = 0; at < image.size(); at += 16384) TEST_ASSERT_NULL(b.sendChunk(image, at, 16384));
+    b.partition.flash[1234] ^= 0x10; // Flash that didn't keep what it was given.
+    TEST_ASSERT_EQUAL_STRING("SHA-256 of image doesn't match", b.ota->finish());
+    TEST_ASSERT_TRUE(b.ota->active());
+    TEST_ASSERT_EQUAL_UINT32(0, b.ota->offset());
+
+    b.boot();
+    TEST_ASSERT_EQUAL_UINT32(0, b.ota->offset());
+    TEST_ASSERT_NULL(b.upload(image, 16384));
+    TEST_ASSERT_TRUE(b.partition.activated);
+}
+
+// A chunk that arrived whole but didn't make it to flash doesn't count.
+void test_chunk_not_written_has_to_be_sent_again(void)
+{
+    Bench                b;
+    std::vector<uint8_t> image = randomImage(40000, 6);
+    uint8_t              sha[SHA256_LENGTH];
+    sha256Of(image, sha);
+
+    TEST_ASSERT_NULL(b.ota->start(image.size(), 16384, sha));
+    TEST_ASSERT_NULL(b.sendChunk(image, 0, 16384));
+    b.partition.flushFails = true;
+    TEST_ASSERT_EQUAL_STRING("Couldn't write flash", b.sendChunk(image, 16384, 16384));
+    TEST_ASSERT_EQUAL_UINT32(16384, b.ota->offset());
+    TEST_ASSERT_EQUAL_UINT32(1, b.ota->chunksRejected);
+
+    b.partition.flushFails = false;
+    TEST_ASSERT_NULL(b.upload(image, 16384));
+    TEST_ASSERT_TRUE(b.partition.activated);
+}
+
+//*****************************************************************************
+// Power lost while the journal was being written: the offset goes back to
+// the last one saved whole. Once the record itself is down, only the
+// slot's padding is missing, and the new offset stands.
+void test_torn_journal_write(void)
+{
+    std::vector<uint8_t> image = randomImage(100000, 5);
+    uint8_t              sha[SHA256_LENGTH];
+    sha256Of(image, sha);
+
+    for (long tearAt = 0; tearAt < RESUME_SLOT_SIZE; tearAt += 3) {
+        Bench b;
+        TEST_ASSERT_NULL(b.ota->start(image.size(), 16384, sha));
+        for (int i = 0; i < 3; i++) TEST_ASSERT_NULL(b.sendChunk(image, b.ota->offset(), 16384));
+
+        b.fs.writeLimit = tearAt;
+        TEST_ASSERT_EQUAL_STRING("Couldn't save progress", b.sendChunk(image, b.ota->offset(), 16384));
+        b.fs.writeLimit = -1;
+        b.boot();
+        TEST_ASSERT_EQUAL_UINT32((tearAt < (long)sizeof(ResumeRecord)) ? 3 * 16384 : 4 * 16384, b.ota->offset());
+
+        TEST_ASSERT_NULL(b.upload(image, 16384));
+        TEST_ASSERT_TRUE(b.partition.activated);
+    }
+}
+
+void test_status(void)
+{
+    Bench                b;
+    std::vector<uint8_t> image = randomImage(100000, 6);
+    uint8_t              sha[SHA256_LENGTH];
+    char                 hex[65], expected[200], json[200];
+    sha256Of(image, sha);
+    sha256ToHex(sha, hex);
+
+    b.ota->status(json, sizeof(json));
+    TEST_ASSERT_EQUAL_STRING("{\"active\":false}", json);
+
+    TEST_ASSERT_NULL(b.ota->start(image.size(), 32768, sha));
+    TEST_ASSERT_NULL(b.sendChunk(image, 0, 32768));
+    b.ota->status(json, sizeof(json));
+    snprintf(expected, sizeof(expected), "{\"active\":true,\"size\":100000,\"chunk\":32768,\"offset\":32768,\"sha256\":\"%s\"}",
+             hex);
+    TEST_ASSERT_EQUAL_STRING(expected, json);
+}
+
+int main(int, char **)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_clean_upload);
+    RUN_TEST(test_interrupted_uploads_complete);
+    RUN_TEST(test_reboot_carries_on_only_with_the_same_image);
+    RUN_TEST(test_chunks_out_of_turn_are_refused);
+    RUN_TEST(test_bad_image_has_to_be_sent_again);
+    RUN_TEST(test_chunk_not_written_has_to_be_sent_again);
+    RUN_TEST(test_torn_journal_write);
+    RUN_TEST(test_status);
+    return UNITY_END();
+}
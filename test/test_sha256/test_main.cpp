@@ -0,0 +1,179 @@
+/* test_sha256
+ *
+ *  The software SHA-256 that stands in for the ESP32's SHA engine: the
+ *  FIPS 180-4 examples, messages either side of the padding boundaries,
+ *  the same digest however the data is split, the hex helpers, and its
+ *  speed at each upload chunk size through hashSpeed().
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#include <unity.h>
+#include <digameSha256.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+void setUp(void) {}
+void tearDown(void) {}
+
+static std::string hexOf(const uint8_t *data, size_t length)
+{
+    uint8_t digest[SHA256_LENGTH];
+    char    hex[2 * SHA256_LENGTH + 1];
+    Sha256  sha;
+    sha.begin();
+    sha.update(data, length);
+    sha.finish(digest);
+    sha256ToHex(digest, hex);
+    return hex;
+}
+
+static std::string hexOf(const char *text) { return hexOf((const uint8_t *)text, strlen(text)); }
+
+// (i * 7 + 3) & 0xFF, so a shift is a different message.
+static std::vector<uint8_t> pattern(size_t length)
+{
+    std::vector<uint8_t> data(length);
+    for (size_t i = 0; i < length; i++) data[i] = (uint8_t)(i * 7 + 3);
+    return data;
+}
+
+//*****************************************************************************
+void test_fips_examples(void)
+{
+    TEST_ASSERT_EQUAL_STRING("e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855", hexOf("").c_str());
+    TEST_ASSERT_EQUAL_STRING("ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad", hexOf("abc").c_str());
+    TEST_ASSERT_EQUAL_STRING("248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1",
+                             hexOf("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq").c_str());
+    TEST_ASSERT_EQUAL_STRING("cf5b16a778af8380036ce59e7b0492370b249b11e8f07a51afac45037afee9d1",
+                             hexOf("abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmnhijklmnoijklmnopjklmnopqklmnopq"
+                                   "rlmnopqrsmnopqrstnopqrstu").c_str());
+
+    std::vector<uint8_t> million(1000000, 'a');
+    TEST_ASSERT_EQUAL_STRING("cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0",
+                             hexOf(million.data(), million.size()).c_str());
+}
+
+// Python's hashlib over pattern(). 55 and 56 bytes either side of the
+// length fitting in the last block, 63 to 65 either side of a whole block.
+void test_padding_boundaries(void)
+{
+    static const struct {
+        size_t      length;
+        const char *hex;
+    } expected[] = {
+        {   55, "e7313d333c272e639f790978283f9eb392e843d0f29b7016828bb1daa4aac70b" },
+        {   56, "4324d65f3c103567f5589c710bc08f8523f929a9272e3af36fc968e52abc6c27" },
+        {   57, "35df609437dcfea3279283ab79fd554e2bf78f8f7ae2de532d8ee300b09e8f73" },
+        {   63, "81c80242132f230c3bd41b3e63bbcff16107339549214a99614ff26664625055" },
+        {   64, "39e3d7b6b5d075d37d053ad89b24b41bef4f3c29760c84447cab3f3be1882241" },
+        {   65, "aacca6ff74fdbb296d165a45cecfa04e5127bc008770fbbdd48006f2d2fae95e" },
+        {  119, "9ce7368e4daf32341631b492e80359dc9f594b48453cd0dd5bf0b19279cc177e" },
+        {  120, "7836b787757e95e58b3ca5aec90b1b004e8deba1e50e9675af9cabf1a13a04b5" },
+        {  127, "a8d23e75d936f303d248888d9b165ee543f4cbafcad3c9dd2a79bd84faa11d07" },
+        {  128, "d2742f1f4ac6bb7ca2b239ee18402ba8b3f9f8e652d2a72973c2b9ba11c08cf6" },
+        { 1000, "1e9bc38cbf860b9ec31918b065f9b52476c549a782e0e7990bed8ce3868d2371" },
+    };
+    for (const auto &e : expected) {
+        std::vector<uint8_t> data = pattern(e.length);
+        TEST_ASSERT_EQUAL_STRING(e.hex, hexOf(data.data(), data.size()).c_str());
+    }
+}
+
+// An upload arrives in whatever pieces TCP makes of it.
+void test_any_split_gives_the_same_digest(void)
+{
+    std::vector<uint8_t> data  = pattern(1000);
+    std::string          whole = hexOf(data.data(), data.size());
+
+    for (size_t piece = 1; piece <= 200; piece++) {
+        uint8_t digest[SHA256_LENGTH];
+        char    hex[2 * SHA256_LENGTH + 1];
+        Sha256  sha;
+        sha.begin();
+        for (size_t at = 0; at < data.size(); at += piece) {
+            sha.update(&data[at], std::min(piece, data.size() - at));
+            if (at % 3 == 0) sha.update(&data[at], 0);
+        }
+        sha.finish(digest);
+        sha256ToHex(digest, hex);
+        TEST_ASSERT_EQUAL_STRING(whole.c_str(), hex);
+    }
+}
+
+void test_begin_starts_over(void)
+{
+    uint8_t a[SHA256_LENGTH], b[SHA256_LENGTH];
+    Sha256  sha;
+    sha.begin();
+    sha.update((const uint8_t *)"abandoned", 9);
+    sha.begin();
+    sha.update((const uint8_t *)"abc", 3);
+    sha.finish(a);
+
+    sha.begin(); // And again after a finish.
+    sha.update((const uint8_t *)"abc", 3);
+    sha.finish(b);
+    TEST_ASSERT_EQUAL_MEMORY(a, b, SHA256_LENGTH);
+
+    char hex[2 * SHA256_LENGTH + 1];
+    sha256ToHex(a, hex);
+    TEST_ASSERT_EQUAL_STRING("ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad", hex);
+}
+
+void test_hex_helpers(void)
+{
+    uint8_t digest[SHA256_LENGTH];
+    Sha256  sha;
+    sha.begin();
+    sha.update((const uint8_t *)"abc", 3);
+    sha.finish(digest);
+
+    TEST_ASSERT_TRUE(sha256MatchesHex(digest, "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"));
+    TEST_ASSERT_TRUE(sha256MatchesHex(digest, "BA7816BF8F01CFEA414140DE5DAE2223B00361A396177A9CB410FF61F20015AD"));
+    TEST_ASSERT_FALSE(sha256MatchesHex(digest, "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ae"));
+    TEST_ASSERT_FALSE(sha256MatchesHex(digest, "ba7816bf8f01cfea"));
+    TEST_ASSERT_FALSE(sha256MatchesHex(digest, ""));
+}
+
+//*****************************************************************************
+static uint32_t hostMicros()
+{
+    using namespace std::chrono;
+    return (uint32_t)duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+// As the [h] command does on the counter. There's no engine here, so it's
+// the software hash's cost per chunk size; small pieces only cost the
+// copying into a part-filled block.
+void test_throughput_by_chunk_size(void)
+{
+    const size_t         total = 8 << 20;
+    std::vector<uint8_t> buffer(16384, 0x5A);
+    char                 message[80];
+    uint32_t             slowest = 0xFFFFFFFF, fastest = 0;
+
+    for (size_t chunk : { (size_t)64, (size_t)256, (size_t)1024, (size_t)4096, (size_t)16384 }) {
+        Sha256   sha;
+        uint32_t kbs = hashSpeed(sha, buffer.data(), chunk, total, hostMicros);
+        if (kbs < slowest) slowest = kbs;
+        if (kbs > fastest) fastest = kbs;
+        snprintf(message, sizeof(message), "%5u-byte chunks: %u KB/s", (unsigned)chunk, (unsigned)kbs);
+        TEST_MESSAGE(message);
+    }
+    TEST_ASSERT_GREATER_THAN(0, (int)slowest);
+    TEST_ASSERT_LESS_THAN((int)slowest * 3, (int)fastest); // Chunk size hardly matters.
+}
+
+int main(int, char **)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_fips_examples);
+    RUN_TEST(test_padding_boundaries);
+    RUN_TEST(test_any_split_gives_the_same_digest);
+    RUN_TEST(test_begin_starts_over);
+    RUN_TEST(test_hex_helpers);
+    RUN_TEST(test_throughput_by_chunk_size);
+    return UNITY_END();
+}
@@ -0,0 +1,293 @@
+/* test_template
+ *
+ *  The cached page templates: parsing %name% and %%, escaping values,
+ *  serving unchanged pages from the cache, gzipped copies, and the loads
+ *  it refuses.
+ *
+ *  The last test is the benchmark behind the cache. It serves the real
+ *  index.html both ways: read from the file system and filled in on every
+ *  request, as AsyncWebServer's template processor does, and from
+ *  TemplatePage. It reports file reads and time per request.
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#include <unity.h>
+#include <Arduino.h>
+#include <FS.h>
+#include <digameTemplate.h>
+#include <digameInflate.h>
+#include <chrono>
+#include <string>
+
+static std::string name, count;
+static int         nameCalls, countCalls, unusedCalls;
+
+static void nameVariable(char *b, size_t n) { nameCalls++; snprintf(b, n, "%s", name.c_str()); }
+static void countVariable(char *b, size_t n) { countCalls++; snprintf(b, n, "%s", count.c_str()); }
+static void unusedVariable(char *b, size_t n) { unusedCalls++; snprintf(b, n, "never"); }
+
+void setUp(void)
+{
+    name      = "Entrance 1";
+    count     = "0";
+    nameCalls = countCalls = unusedCalls = 0;
+}
+void tearDown(void) {}
+
+static std::string text(const RenderedPage &page) { return std::string(page->begin(), page->end()); }
+
+// A page with name, count and unused defined, loaded from `source`.
+struct Page
+{
+    fs::FS       disk;
+    TemplatePage page;
+    bool         ok;
+
+    Page(const std::string &source)
+    {
+        disk.files["/p.html"].assign(source.begin(), source.end());
+        page.define("name", nameVariable);
+        page.define("counts.in", countVariable);
+        page.define("unused", unusedVariable);
+        ok = page.load(disk, "/p.html");
+    }
+};
+
+//*****************************************************************************
+void test_parsing(void)
+{
+    Page p("<h1>%name%</h1><p>%counts.in% in, 100%% sure, %nope% gone</p>");
+    TEST_ASSERT_TRUE(p.ok);
+    TEST_ASSERT_EQUAL_STRING("<h1>Entrance 1</h1><p>0 in, 100% sure,  gone</p>", text(p.page.render()).c_str());
+
+    // Not variables: a lone %, an unterminated one, a space inside, and a
+    // name longer than TEMPLATE_NAME_LENGTH.
+    std::string longName(TEMPLATE_NAME_LENGTH + 1, 'x');
+    std::string source = "50% off %name %na me% %" + longName + "% end %";
+    Page q(source);
+    TEST_ASSERT_TRUE(q.ok);
+    TEST_ASSERT_EQUAL_STRING(source.c_str(), text(q.page.render()).c_str());
+
+    Page edges("%name%%counts.in%%%");
+    TEST_ASSERT_EQUAL_STRING("Entrance 10%", text(edges.page.render()).c_str());
+
+    Page r("%name%");
+    TEST_ASSERT_EQUAL_STRING("Entrance 1", text(r.page.render()).c_str());
+}
+
+void test_values_are_escaped(void)
+{
+    Page p("<em title=\"%name%\">%name%</em>");
+    name = "<b>\"Tom & Jerry\"</b>";
+    TEST_ASSERT_EQUAL_STRING("<em title=\"&lt;b&gt;&quot;Tom &amp; Jerry&quot;&lt;/b&gt;\">"
+                             "&lt;b&gt;&quot;Tom &amp; Jerry&quot;&lt;/b&gt;</em>",
+                             text(p.page.render()).c_str());
+
+    name = std::string(TEMPLATE_VALUE_SIZE + 20, 'n'); // Cut to fit the value buffer.
+    TEST_ASSERT_EQUAL_UINT32(2 * (TEMPLATE_VALUE_SIZE - 1) + 18, p.page.render()->size());
+}
+
+// Unchanged values: the same buffer and the same version. A change: a new
+// buffer, while one still held (a response being sent) stays as it was.
+void test_cache_hits(void)
+{
+    Page p("<p>%name%: %counts.in%</p>");
+    RenderedPage first   = p.page.render();
+    uint32_t     version = p.page.version();
+    for (int i = 0; i < 10; i++) TEST_ASSERT_TRUE(p.page.render() == first);
+    TEST_ASSERT_EQUAL_UINT32(1, p.page.renders);
+    TEST_ASSERT_EQUAL_UINT32(10, p.page.cacheHits);
+    TEST_ASSERT_EQUAL_UINT32(version, p.page.version());
+    TEST_ASSERT_EQUAL(11, countCalls);
+    TEST_ASSERT_EQUAL(0, unusedCalls); // Defined but not on the page: never evaluated.
+
+    count = "1";
+    RenderedPage second = p.page.render();
+    TEST_ASSERT_FALSE(second == first);
+    TEST_ASSERT_EQUAL_STRING("<p>Entrance 1: 0</p>", text(first).c_str());
+    TEST_ASSERT_EQUAL_STRING("<p>Entrance 1: 1</p>", text(second).c_str());
+    TEST_ASSERT_NOT_EQUAL(version, p.page.version());
+    TEST_ASSERT_EQUAL_UINT32(2, p.page.renders);
+
+    count = "0"; // Back again: rebuilt, and the same version as before.
+    p.page.render();
+    TEST_ASSERT_EQUAL_UINT32(version, p.page.version());
+    TEST_ASSERT_EQUAL_UINT32(1, p.page.flashReads);
+
+    // Values that only differ past where a hash would look the same are
+    // still told apart: they're compared whole.
+    name = "Entrance 1a";
+    TEST_ASSERT_EQUAL_STRING("<p>Entrance 1a: 0</p>", text(p.page.render()).c_str());
+}
+
+static bool collect(void *context, const uint8_t *data, size_t length)
+{
+    ((std::string *)context)->append((const char *)data, length);
+    return true;
+}
+
+// Gzipped once per rendering, and it inflates to that rendering.
+void test_gzipped_copy(void)
+{
+    TEST_ASSERT_TRUE(!Page("%name%").page.gzipped()); // Nothing rendered yet.
+
+    std::string source;
+    for (int i = 0; i < 20; i++) source += "<tr><td>%name%</td><td>%counts.in%</td></tr>\n";
+    Page p(source);
+
+    RenderedPage rendered = p.page.render();
+    GzippedPage  packed   = p.page.gzipped();
+    TEST_ASSERT_TRUE((bool)packed);
+    TEST_ASSERT_TRUE(p.page.gzipped() == packed);
+    p.page.render();
+    TEST_ASSERT_TRUE(p.page.gzipped() == packed); // A cache hit keeps it.
+    TEST_ASSERT_EQUAL_UINT32(1, p.page.compressions);
+    TEST_ASSERT_LESS_THAN(rendered->size() / 3, packed->size());
+
+    std::string   out;
+    GzipInflater  inflater(collect, &out);
+    TEST_ASSERT_EQUAL(INFLATE_DONE, inflater.write(packed->data(), packed->size()));
+    TEST_ASSERT_EQUAL_STRING(text(rendered).c_str(), out.c_str());
+
+    count = "5";
+    p.page.render();
+    TEST_ASSERT_FALSE(p.page.gzipped() == packed);
+    TEST_ASSERT_EQUAL_UINT32(2, p.page.compressions);
+}
+
+void test_loads_refused(void)
+{
+    fs::FS       disk;
+    TemplatePage page;
+    TEST_ASSERT_FALSE(page.load(disk, "/missing.html"));
+    TEST_ASSERT_FALSE(page.loaded());
+
+    disk.files["/big.html"].assign(TEMPLATE_MAX_SIZE + 1, 'x');
+    TEST_ASSERT_FALSE(page.load(disk, "/big.html"));
+
+    disk.files["/empty.html"];
+    TEST_ASSERT_FALSE(page.load(disk, "/empty.html"));
+
+    page.define("v", nameVariable);
+    std::string busy;
+    for (int i = 0; i < TEMPLATE_MAX_SEGMENTS; i++) busy += "x%v%"; // Twice the segments it holds.
+    disk.files["/busy.html"].assign(busy.begin(), busy.end());
+    TEST_ASSERT_FALSE(page.load(disk, "/busy.html"));
+
+    for (int i = 0; i < TEMPLATE_MAX_VARIABLES - 1; i++) TEST_ASSERT_TRUE(page.define("w", nameVariable));
+    TEST_ASSERT_FALSE(page.define("one.too.many", nameVariable));
+}
+
+//*****************************************************************************
+// index.html the old way: opened, read and filled in on every request, with
+// a processor called for each %name%.
+static uint32_t fileReads;
+
+static std::string processor(const std::string &var)
+{
+    if (var == "config.deviceName") { char b[48]; nameVariable(b, sizeof(b)); return b; }
+    if ((var == "counts.in") || (var == "counts.out")) { char b[48]; countVariable(b, sizeof(b)); return b; }
+    if (var == "firmware.version") return "1.0 (Oct 18 2022)";
+    if (var == "device.mac") return "24:0A:C4:00:00:01";
+    if (var == "health.uptime") return "0d 01:23";
+    if (var == "health.wifi") return "CONNECTED";
+    return "";
+}
+
+static std::string processorRender(fs::FS &disk, const char *path)
+{
+    File        file = disk.open(path, FILE_READ);
+    std::string raw(file.size(), 0), out;
+    fileReads++;
+    file.read((uint8_t *)&raw[0], raw.size());
+    file.close();
+
+    for (size_t i = 0; i < raw.size(); i++) {
+        size_t end;
+        if ((raw[i] == '%') && ((end = raw.find('%', i + 1)) != std::string::npos) &&
+            (end - i - 1 <= 32) && (raw.find_first_of(" \n<>\"", i + 1) > end)) {
+            out += (end == i + 1) ? "%" : processor(raw.substr(i + 1, end - i - 1));
+            i = end;
+        } else {
+            out += raw[i];
+        }
+    }
+    return out;
+}
+
+// Values for the template, matching processor().
+static void versionVariable(char *b, size_t n) { snprintf(b, n, "1.0 (Oct 18 2022)"); }
+static void macVariable(char *b, size_t n) { snprintf(b, n, "24:0A:C4:00:00:01"); }
+static void uptimeVariable(char *b, size_t n) { snprintf(b, n, "0d 01:23"); }
+static void wifiVariable(char *b, size_t n) { snprintf(b, n, "CONNECTED"); }
+
+static uint32_t hostMicros()
+{
+    using namespace std::chrono;
+    return (uint32_t)duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+void test_render_benchmark(void)
+{
+    const char *path = getenv("INDEX_HTML") ? getenv("INDEX_HTML") : "data/index.html";
+    FILE       *f    = fopen(path, "rb");
+    if (!f) TEST_IGNORE_MESSAGE("data/index.html not found: run from the project directory, or set INDEX_HTML");
+    fs::FS disk;
+    int    c;
+    while ((c = fgetc(f)) != EOF) disk.files["/index.html"].push_back(c);
+    fclose(f);
+
+    TemplatePage page;
+    page.define("config.deviceName", nameVariable);
+    page.define("counts.in", countVariable);
+    page.define("counts.out", countVariable);
+    page.define("firmware.version", versionVariable);
+    page.define("device.mac", macVariable);
+    page.define("health.uptime", uptimeVariable);
+    page.define("health.wifi", wifiVariable);
+    TEST_ASSERT_TRUE(page.load(disk, "/index.html", hostMicros));
+
+    const int requests = 100000; // The counts change every 10th.
+    fileReads = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < requests; i++) {
+        count = std::to_string(i / 10);
+        std::string out = processorRender(disk, "/index.html");
+        if (i == 0) TEST_ASSERT_EQUAL_STRING(out.c_str(), text(page.render()).c_str()); // Same page either way.
+    }
+    double oldUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+    start = std::chrono::steady_clock::now();
+    size_t bytes = 0;
+    for (int i = 0; i < requests; i++) {
+        count = std::to_string(i / 10);
+        bytes += page.render()->size();
+    }
+    double newUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    TEST_ASSERT_GREATER_THAN(0, (int)bytes);
+
+    TEST_ASSERT_EQUAL_UINT32(requests, fileReads);
+    TEST_ASSERT_EQUAL_UINT32(1, page.flashReads);
+    TEST_ASSERT_INT_WITHIN(2, requests / 10, page.renders);
+
+    char message[200];
+    snprintf(message, sizeof(message),
+             "%d requests: processor %u file reads, %.2f us each; cached %u read, %.2f us each, %u%% hits, "
+             "slowest %u us",
+             requests, (unsigned)fileReads, oldUs / requests, (unsigned)page.flashReads, newUs / requests,
+             (unsigned)(100ULL * page.cacheHits / (page.cacheHits + page.renders)), (unsigned)page.maxRenderUs);
+    TEST_MESSAGE(message);
+}
+
+int main(int, char **)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_parsing);
+    RUN_TEST(test_values_are_escaped);
+    RUN_TEST(test_cache_hits);
+    RUN_TEST(test_gzipped_copy);
+    RUN_TEST(test_loads_refused);
+    RUN_TEST(test_render_benchmark);
+    return UNITY_END();
+}
@@ -0,0 +1,379 @@
+/* test_time
+ *
+ *  The UTC clock: drift fitted from samples, steps and rewinds, which
+ *  sources may override which, and SntpClient against a simulated NTP
+ *  server across a network with jitter and loss, on a counter that runs
+ *  fast.
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#include <unity.h>
+#include <Arduino.h>
+#include <digameTime.h>
+#include <deque>
+#include <vector>
+
+static const uint64_t EPOCH_US = 1666051200000000ULL; // 2022-10-18 00:00 UTC.
+static const uint64_t MINUTE   = 60000000ULL;
+static const uint64_t HOUR     = 60 * MINUTE;
+
+// The world: true time since the test began, and a counter that gains
+// ratePpm on it.
+static uint64_t trueUs;
+static double   ratePpm;
+
+static uint64_t monoAt(uint64_t t) { return 5000000 + t + (uint64_t)((double)t * ratePpm / 1e6); }
+static uint64_t monoNow() { return monoAt(trueUs); }
+static uint64_t utcAt(uint64_t t) { return EPOCH_US + t; }
+
+void setUp(void)
+{
+    trueUs  = 0;
+    ratePpm = 0;
+}
+void tearDown(void) {}
+
+static TimeSample sample(uint64_t atTrueUs, int64_t offsetUs = 0, uint32_t uncertaintyUs = 20000,
+                         uint8_t source = TIME_SOURCE_SNTP)
+{
+    return { utcAt(atTrueUs) + offsetUs, monoAt(atTrueUs), uncertaintyUs, source };
+}
+
+static int64_t errorUs(TimeService &time, uint64_t t) { return (int64_t)(time.utcUs(monoAt(t)) - utcAt(t)); }
+
+//*****************************************************************************
+void test_first_sync_and_nonsense(void)
+{
+    TimeService time;
+    time.begin(monoNow);
+    TEST_ASSERT_FALSE(time.valid());
+
+    TimeSample early = sample(0);
+    early.utcUs      = (TIME_EARLIEST_MS - 1000) * 1000; // 2021: an unset RTC somewhere.
+    TEST_ASSERT_FALSE(time.sync(early));
+    TEST_ASSERT_FALSE(time.valid());
+    TEST_ASSERT_EQUAL_UINT32(1, time.ignored);
+
+    TEST_ASSERT_TRUE(time.sync(sample(0)));
+    TEST_ASSERT_TRUE(time.valid());
+    TEST_ASSERT_EQUAL_UINT8(TIME_SOURCE_SNTP, time.source);
+    trueUs = 1234567;
+    TEST_ASSERT_EQUAL_UINT64(utcAt(trueUs) / 1000, time.nowUtcMs());
+    TEST_ASSERT_EQUAL_UINT32(0, time.steps);
+}
+
+// A counter 40 ppm fast, synced every 100 s: once the samples span
+// TIME_RATE_SPAN_US the drift is fitted, and an hour later with no syncs
+// the clock is still right.
+void test_drift_fit(void)
+{
+    ratePpm = 40;
+    TimeService time;
+    time.begin(monoNow);
+
+    for (trueUs = 0; trueUs < TIME_RATE_SPAN_US; trueUs += 100000000ULL) time.sync(sample(trueUs));
+    TEST_ASSERT_EQUAL_INT32(0, time.driftPpb); // Not yet spanned.
+    time.sync(sample(trueUs));
+    TEST_ASSERT_INT_WITHIN(100, -40000, time.driftPpb); // + is slow; this one's fast.
+    TEST_ASSERT_INT_WITHIN(100, 0, errorUs(time, trueUs + HOUR));
+
+    // Unfitted, the same hour would be 144 ms ahead.
+    TimeService naive;
+    naive.begin(monoNow);
+    naive.sync(sample(trueUs));
+    TEST_ASSERT_INT_WITHIN(1000, 144000, errorUs(naive, trueUs + HOUR));
+
+    // Anything past TIME_MAX_DRIFT_PPB is clamped: a bad fit, not a crystal.
+    ratePpm = -2000;
+    TimeService wild;
+    wild.begin(monoNow);
+    for (trueUs = 0; trueUs <= TIME_RATE_SPAN_US + 100000000ULL; trueUs += 100000000ULL) wild.sync(sample(trueUs));
+    TEST_ASSERT_EQUAL_INT32(TIME_MAX_DRIFT_PPB, wild.driftPpb);
+}
+
+// Samples 30 ms either side of the truth at random: the line through
+// them does better than any one sample.
+void test_fit_smooths_jitter(void)
+{
+    ratePpm = -25;
+    TimeService time;
+    time.begin(monoNow);
+    uint32_t seed = 99;
+    int64_t  worstSample = 0, worstClock = 0;
+    for (trueUs = 0; trueUs < 4 * HOUR; trueUs += 1024000000ULL) {
+        seed          = seed * 1103515245 + 12345;
+        int64_t noise = (int64_t)((seed >> 8) % 60001) - 30000;
+        time.sync(sample(trueUs, noise, 30000));
+        if (time.driftPpb != 0) {
+            int64_t e = errorUs(time, trueUs);
+            if (llabs(e) > worstClock) worstClock = llabs(e);
+            if (llabs(noise) > worstSample) worstSample = llabs(noise);
+        }
+    }
+    TEST_ASSERT_INT_WITHIN(5000, 25000, time.driftPpb);
+    TEST_ASSERT_LESS_THAN((int)worstSample, (int)worstClock);
+}
+
+// Off by more than TIME_STEP_US: start again from the new sample, keeping
+// the drift. Small corrections back hold the clock still instead.
+void test_steps_and_holding_still(void)
+{
+    ratePpm = 40;
+    TimeService time;
+    time.begin(monoNow);
+    for (trueUs = 0; trueUs <= TIME_RATE_SPAN_US; trueUs += 100000000ULL) time.sync(sample(trueUs));
+    trueUs += MINUTE;
+    uint64_t before = time.nowUtcMs();
+    TEST_ASSERT_TRUE(time.sync(sample(trueUs, -500000))); // Half a second back: not a step.
+    TEST_ASSERT_EQUAL_UINT32(0, time.steps);
+    // The line through the samples takes part of it: the outlier is one of
+    // several. The clock holds still for however far back that puts it...
+    int64_t back = (int64_t)before - (int64_t)(time.utcUs(monoNow()) / 1000);
+    TEST_ASSERT_GREATER_THAN(50, back);
+    TEST_ASSERT_LESS_THAN(500, back);
+    TEST_ASSERT_EQUAL_UINT64(before, time.nowUtcMs());
+    trueUs += (back - 10) * 1000;
+    TEST_ASSERT_EQUAL_UINT64(before, time.nowUtcMs());
+    trueUs += 20000;
+    TEST_ASSERT_TRUE(time.nowUtcMs() > before); // ...until real time catches up.
+    int32_t drift = time.driftPpb;
+
+    TEST_ASSERT_TRUE(time.sync(sample(trueUs, 5000000))); // Five seconds forward: a step.
+    TEST_ASSERT_EQUAL_UINT32(1, time.steps);
+    TEST_ASSERT_EQUAL_UINT32(0, time.rewinds);
+    TEST_ASSERT_EQUAL_INT32(drift, time.driftPpb);
+    TEST_ASSERT_INT_WITHIN(1000000, 5000000, time.lastErrorUs);
+    TEST_ASSERT_EQUAL_UINT64((utcAt(trueUs) + 5000000) / 1000, time.nowUtcMs());
+}
+
+// A step back from a source at least as trusted: the old time was wrong.
+// nowUtcMs() follows it back rather than freezing timestamps for a day.
+void test_rewind(void)
+{
+    TimeService time;
+    time.begin(monoNow);
+    time.sync(sample(0, 86400000000LL, 20000, TIME_SOURCE_HOST)); // A host a day fast.
+    trueUs = MINUTE;
+    uint64_t wrong = time.nowUtcMs();
+
+    trueUs += 1000;
+    TEST_ASSERT_TRUE(time.sync(sample(trueUs))); // SNTP puts it right.
+    TEST_ASSERT_EQUAL_UINT32(1, time.steps);
+    TEST_ASSERT_EQUAL_UINT32(1, time.rewinds);
+    TEST_ASSERT_EQUAL_UINT64(utcAt(trueUs) / 1000, time.nowUtcMs());
+    TEST_ASSERT_TRUE(time.nowUtcMs() < wrong);
+    TEST_ASSERT_EQUAL_UINT8(TIME_SOURCE_SNTP, time.source);
+}
+
+// Who can override whom.
+void test_trust(void)
+{
+    TimeService time;
+    time.begin(monoNow);
+    TEST_ASSERT_TRUE(time.sync(sample(0, 0, 5000))); // SNTP, good to 5 ms.
+
+    // A host sync over Bluetooth, much less precise and within
+    // TIME_PREFER_US of it: ignored.
+    trueUs = MINUTE;
+    TEST_ASSERT_FALSE(time.sync(sample(trueUs, 200000, 500000, TIME_SOURCE_HOST)));
+    TEST_ASSERT_EQUAL_UINT32(1, time.ignored);
+
+    // As precise: taken, a small correction.
+    TEST_ASSERT_TRUE(time.sync(sample(trueUs, 2000, 5000, TIME_SOURCE_HOST)));
+    TEST_ASSERT_EQUAL_UINT8(TIME_SOURCE_HOST, time.source);
+
+    // A host a week out can't step a clock SNTP set...
+    TimeService sntpSet;
+    sntpSet.begin(monoNow);
+    sntpSet.sync(sample(trueUs));
+    TEST_ASSERT_FALSE(sntpSet.sync(sample(trueUs + 1000, 7 * 86400000000LL, 20000, TIME_SOURCE_HOST)));
+    TEST_ASSERT_EQUAL_UINT32(0, sntpSet.steps);
+    // ...but can step it by less than TIME_MAX_STEP_US, without rewinding.
+    TEST_ASSERT_TRUE(sntpSet.sync(sample(trueUs + 2000, -10000000, 20000, TIME_SOURCE_HOST)));
+    TEST_ASSERT_EQUAL_UINT32(1, sntpSet.steps);
+    TEST_ASSERT_EQUAL_UINT32(0, sntpSet.rewinds);
+
+    // A less precise sample is fine once the precise one is old.
+    TimeService aged;
+    aged.begin(monoNow);
+    aged.sync(sample(0, 0, 5000));
+    TEST_ASSERT_FALSE(aged.sync(sample(TIME_PREFER_US - 1000, 0, 400000)));
+    TEST_ASSERT_TRUE(aged.sync(sample(TIME_PREFER_US + 1000, 0, 400000)));
+}
+
+//*****************************************************************************
+// An NTP server at the end of a network: each way takes 5 to 60 ms, with
+// lossPercent of datagrams lost. The server's clock is right.
+class FakeNtpNetwork : public SntpSocket
+{
+  public:
+    bool     up          = true;
+    int      lossPercent = 0;
+    uint8_t  stratum     = 2;
+    bool     wrongOrigin = false;
+    uint64_t extraDelayUs = 0;
+    uint32_t seed        = 1;
+
+    bool linkUp() override { return up; }
+
+    bool send(const uint8_t *data, size_t length) override
+    {
+        TEST_ASSERT_EQUAL_UINT32(SNTP_PACKET_SIZE, length);
+        TEST_ASSERT_EQUAL_HEX8(0x23, data[0]);
+        if (lost()) return true;
+
+        uint64_t arrives = trueUs + delay() + extraDelayUs;
+        Reply    r;
+        memset(r.packet, 0, sizeof(r.packet));
+        r.packet[0] = 0x24; // Version 4, server.
+        r.packet[1] = stratum;
+        memcpy(r.packet + 24, data + 40, 8); // Their transmit time is our originate.
+        if (wrongOrigin) r.packet[31] ^= 1;
+        put(r.packet + 32, utcAt(arrives));
+        put(r.packet + 40, utcAt(arrives + 300)); // 300 us to answer.
+        r.atUs = arrives + 300 + delay();
+        if (!lost()) replies.push_back(r);
+        return true;
+    }
+
+    int receive(uint8_t *buffer, size_t size) override
+    {
+        if (replies.empty() || (replies.front().atUs > trueUs)) return 0;
+        size_t n = (size < SNTP_PACKET_SIZE) ? size : SNTP_PACKET_SIZE;
+        memcpy(buffer, replies.front().packet, n);
+        replies.pop_front();
+        return n;
+    }
+
+  private:
+    struct Reply
+    {
+        uint64_t atUs;
+        uint8_t  packet[SNTP_PACKET_SIZE];
+    };
+    std::deque<Reply> replies;
+
+    uint32_t random() { return (seed = seed * 1103515245 + 12345) >> 8; }
+    uint64_t delay() { return 5000 + random() % 55000; }
+    bool     lost() { return (int)(random() % 100) < lossPercent; }
+
+    static void put(uint8_t *p, uint64_t utcUs)
+    {
+        uint64_t raw = ((utcUs / 1000000 + SNTP_UNIX_OFFSET_S) << 32) | (((utcUs % 1000000) << 32) / 1000000);
+        for (int i = 7; i >= 0; i--, raw >>= 8) p[i] = (uint8_t)raw;
+    }
+};
+
+// SntpTask's loop, on simulated time: step, apply any sample, sleep for
+// waitMs(). Tracks the worst clock error once it's valid.
+struct Bench
+{
+    FakeNtpNetwork net;
+    SntpClient     client;
+    TimeService    time;
+    int64_t        worstUs = 0;
+
+    Bench()
+    {
+        client.begin(net, monoNow);
+        time.begin(monoNow);
+    }
+
+    void run(uint64_t forUs, uint64_t measureAfterUs = 0)
+    {
+        for (uint64_t end = trueUs + forUs; trueUs < end;) {
+            TimeSample s;
+            if (client.step(s)) time.sync(s);
+            if (time.valid() && (trueUs >= measureAfterUs)) {
+                int64_t e = llabs(errorUs(time, trueUs));
+                if (e > worstUs) worstUs = e;
+            }
+            uint32_t ms = client.waitMs();
+            trueUs += ms ? (uint64_t)ms * 1000 : 1000; // A tick, however short the delay.
+        }
+    }
+};
+
+// Six hours on a counter 60 ppm slow. Round trips of 10 to 120 ms put
+// each sample up to 55 ms out; the fitted clock does better and holds
+// it between polls 17 minutes apart.
+void test_sntp_with_drift_and_jitter(void)
+{
+    ratePpm = -60;
+    Bench b;
+    b.run(6 * HOUR, 3 * HOUR);
+
+    TEST_ASSERT_GREATER_OR_EQUAL(SNTP_BURST + 6 * 3600 / SNTP_INTERVAL_S - 2, (int)b.client.replies);
+    TEST_ASSERT_EQUAL_UINT32(0, b.client.timeouts);
+    TEST_ASSERT_EQUAL_UINT32(0, b.time.steps);
+    TEST_ASSERT_INT_WITHIN(5000, 60000, b.time.driftPpb);
+    TEST_ASSERT_LESS_THAN(40000, (int)b.worstUs);
+
+    char message[100];
+    snprintf(message, sizeof(message), "%u polls, drift %d ppb (true 60000), worst error %d us over the last 3 h",
+             (unsigned)b.client.requests, (int)b.time.driftPpb, (int)b.worstUs);
+    TEST_MESSAGE(message);
+}
+
+// Lost datagrams time out and are retried, backing off; it gets there.
+void test_sntp_loss_and_link_down(void)
+{
+    Bench b;
+    b.net.up = false;
+    b.run(10 * MINUTE);
+    TEST_ASSERT_EQUAL_UINT32(0, b.client.requests);
+    TEST_ASSERT_FALSE(b.time.valid());
+
+    b.net.up          = true;
+    b.net.lossPercent = 40;
+    b.run(2 * HOUR);
+    TEST_ASSERT_TRUE(b.time.valid());
+    TEST_ASSERT_GREATER_THAN(0, (int)b.client.timeouts);
+    TEST_ASSERT_EQUAL_UINT32(b.client.requests, b.client.replies + b.client.timeouts);
+    TEST_ASSERT_LESS_THAN(100000, (int)llabs(errorUs(b.time, trueUs)));
+
+    uint32_t before = b.client.requests; // Backed off, not hammering.
+    b.net.lossPercent = 100;
+    b.run(HOUR);
+    TEST_ASSERT_LESS_OR_EQUAL(10, (int)(b.client.requests - before));
+}
+
+// Replies that aren't to our request, kiss-o'-death, or too slow to trust
+// don't become samples.
+void test_sntp_rejects(void)
+{
+    Bench b;
+    b.net.wrongOrigin = true;
+    b.run(5 * MINUTE);
+    TEST_ASSERT_GREATER_THAN(0, (int)b.client.rejected);
+    TEST_ASSERT_EQUAL_UINT32(0, b.client.replies);
+
+    Bench kiss;
+    kiss.net.stratum = 0;
+    kiss.run(5 * MINUTE);
+    TEST_ASSERT_GREATER_THAN(0, (int)kiss.client.rejected);
+    TEST_ASSERT_FALSE(kiss.time.valid());
+
+    Bench slow;
+    slow.net.extraDelayUs = SNTP_MAX_DELAY_US + 100000; // Still within SNTP_TIMEOUT_US.
+    slow.run(5 * MINUTE);
+    TEST_ASSERT_GREATER_THAN(0, (int)slow.client.rejected);
+    TEST_ASSERT_EQUAL_UINT32(0, slow.client.timeouts);
+    TEST_ASSERT_FALSE(slow.time.valid());
+}
+
+int main(int, char **)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_first_sync_and_nonsense);
+    RUN_TEST(test_drift_fit);
+    RUN_TEST(test_fit_smooths_jitter);
+    RUN_TEST(test_steps_and_holding_still);
+    RUN_TEST(test_rewind);
+    RUN_TEST(test_trust);
+    RUN_TEST(test_sntp_with_drift_and_jitter);
+    RUN_TEST(test_sntp_loss_and_link_down);
+    RUN_TEST(test_sntp_rejects);
+    return UNITY_END();
+}
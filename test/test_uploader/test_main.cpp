@@ -0,0 +1,368 @@
+/* test_uploader
+ *
+ *  The upload engine on a simulated clock, against a fake server that can
+ *  go down: the backlog after an outage, backoff, lingering for a burst,
+ *  the cursor across a reboot and events that age out of the log.
+ *
+ *  The last test posts a backlog to tools/upload_stub_server.py over a
+ *  real socket and reports events/second. It's skipped unless the server
+ *  is running (on 8080, or UPLOAD_STUB_PORT):
+ *
+ *    python3 tools/upload_stub_server.py --port 8080 &
+ *    pio test -e native -f test_uploader
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#include <unity.h>
+#include <Arduino.h>
+#include <FS.h>
+#include <digameUploader.h>
+#include <chrono>
+#include <set>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static uint32_t fakeNowMs = 0;
+static uint32_t fakeClock() { return fakeNowMs; }
+
+void setUp(void) { fakeNowMs = 0; }
+void tearDown(void) {}
+
+//*****************************************************************************
+// Takes the events out of each body, as the stub server does.
+struct FakeServer : public UploadTransport
+{
+    bool                  up        = true;
+    bool                  linked    = true;
+    uint32_t              latencyMs = 40;
+    std::set<uint32_t>    seen;
+    std::vector<uint32_t> order;      // First time each seq arrived.
+    uint32_t              duplicates = 0;
+    uint32_t              posts      = 0;
+    size_t                largest    = 0;
+
+    bool linkUp() override { return linked; }
+
+    int post(const char *body, size_t length) override
+    {
+        fakeNowMs += latencyMs;
+        TEST_ASSERT_EQUAL(strlen(body), length);
+        if (!up) return 503;
+
+        posts++;
+        size_t      events = 0;
+        const char *p      = body;
+        while ((p = strstr(p, "\"seq\":")) != NULL) {
+            uint32_t seq = strtoul(p + 6, NULL, 10);
+            if (seen.insert(seq).second) order.push_back(seq);
+            else duplicates++;
+            events++;
+            p += 6;
+        }
+        if (events > largest) largest = events;
+        return 200;
+    }
+};
+
+// The main loop: `perSecond` events, serviced every 10 ms, with the engine
+// stepped when it asked to be.
+struct Bench
+{
+    fs::FS       disk;
+    EventLog     log;
+    FakeServer   server;
+    UploadEngine engine;
+    uint32_t     seq   = 1;
+    uint32_t     dueMs = 0;
+    uint32_t     owed  = 0; // Hundredths of an event.
+
+    void begin()
+    {
+        seq = log.begin(disk);
+        engine.begin(log, server, &disk, fakeClock);
+        engine.setDevice("Door \"3\"", "24:0A:C4:00:00:01");
+    }
+
+    void run(uint32_t ms, uint32_t perSecond)
+    {
+        uint32_t end = fakeNowMs + ms;
+        while ((int32_t)(end - fakeNowMs) > 0) {
+            owed += perSecond;
+            while (owed >= 100) {
+                log.append(seq, seq & 1, seq, fakeNowMs, 0, fakeNowMs);
+                seq++;
+                owed -= 100;
+            }
+            log.service(fakeNowMs);
+            if ((int32_t)(fakeNowMs - dueMs) >= 0) dueMs = fakeNowMs + engine.step();
+            fakeNowMs += 10;
+        }
+    }
+
+    void assertAllDelivered()
+    {
+        TEST_ASSERT_EQUAL(seq - 1, server.order.size());
+        for (size_t i = 0; i < server.order.size(); i++) TEST_ASSERT_EQUAL_UINT32(i + 1, server.order[i]);
+    }
+};
+
+//*****************************************************************************
+void test_backlog_drains_after_an_outage(void)
+{
+    Bench b;
+    b.begin();
+    b.run(10000, 5);
+    uint32_t postsBefore = b.server.posts;
+
+    b.server.up = false; // Two minutes down.
+    b.run(120000, 5);
+    uint32_t backlog = b.engine.backlog();
+    TEST_ASSERT_GREATER_THAN(4, b.engine.postFailures);
+    TEST_ASSERT_GREATER_THAN(500, backlog);
+    TEST_ASSERT_LESS_OR_EQUAL(UPLOAD_BACKOFF_MAX_MS, b.engine.backoffMs);
+    // Backing off: far fewer tries than there were posts while it was up.
+    TEST_ASSERT_LESS_THAN(12, b.engine.postFailures);
+
+    b.server.up = true;
+    uint32_t upAt = fakeNowMs;
+    while ((b.engine.backlog() > 0) && (fakeNowMs - upAt < 600000)) b.run(100, 5);
+    uint32_t drainMs = fakeNowMs - upAt;
+
+    b.run(5000, 0);
+    b.log.flush();
+    b.run(5000, 0);
+    b.assertAllDelivered();
+    TEST_ASSERT_EQUAL_UINT32(0, b.server.duplicates);
+    TEST_ASSERT_EQUAL(UPLOAD_BATCH_EVENTS, b.server.largest);
+    TEST_ASSERT_EQUAL_UINT32(0, b.engine.failureStreak);
+    TEST_ASSERT_GREATER_THAN(postsBefore, b.server.posts);
+
+    char message[100];
+    snprintf(message, sizeof(message), "%lu-event backlog cleared %lu ms after the server came back",
+             (unsigned long)backlog, (unsigned long)drainMs);
+    TEST_MESSAGE(message);
+}
+
+void test_backoff_doubles_to_the_cap(void)
+{
+    Bench b;
+    b.begin();
+    b.server.up = false;
+    while (b.engine.postFailures == 0) b.run(10, 50);
+
+    uint32_t last = b.engine.backoffMs;
+    TEST_ASSERT_EQUAL_UINT32(UPLOAD_BACKOFF_MIN_MS, last);
+    while (b.engine.backoffMs < UPLOAD_BACKOFF_MAX_MS) {
+        uint32_t failures = b.engine.postFailures;
+        while (b.engine.postFailures == failures) b.run(1000, 1);
+        TEST_ASSERT_TRUE((b.engine.backoffMs == 2 * last) || (b.engine.backoffMs == UPLOAD_BACKOFF_MAX_MS));
+        last = b.engine.backoffMs;
+    }
+
+    // No link: no posts, and the backoff isn't grown for it.
+    b.server.linked = false;
+    uint32_t failures = b.engine.postFailures;
+    b.run(2 * UPLOAD_BACKOFF_MAX_MS, 1);
+    TEST_ASSERT_EQUAL_UINT32(failures, b.engine.postFailures);
+}
+
+void test_a_burst_goes_in_one_post(void)
+{
+    Bench b;
+    b.begin();
+    b.run(5000, 0);
+
+    for (int i = 0; i < 25; i++) { // One at a time, over a second.
+        b.log.append(b.seq, 0, b.seq, fakeNowMs, 0, fakeNowMs);
+        b.seq++;
+        b.run(40, 0);
+    }
+    b.log.flush();
+    b.run(UPLOAD_LINGER_MS + 500, 0);
+    TEST_ASSERT_EQUAL_UINT32(1, b.server.posts);
+    b.assertAllDelivered();
+}
+
+void test_reboot_resends_only_since_the_last_cursor_save(void)
+{
+    Bench b;
+    b.begin();
+    b.run(120000, 10);
+    b.log.flush();
+
+    // Reboot: a new log and engine on the same files. The cursor file is
+    // at most UPLOAD_CURSOR_SAVE_MS behind.
+    EventLog     log;
+    UploadEngine engine;
+    uint32_t     next = log.begin(b.disk);
+    TEST_ASSERT_EQUAL_UINT32(b.seq, next);
+    engine.begin(log, b.server, &b.disk, fakeClock);
+    TEST_ASSERT_LESS_OR_EQUAL(10 * UPLOAD_CURSOR_SAVE_MS / 1000 + UPLOAD_BATCH_EVENTS, engine.backlog());
+
+    for (int i = 0; i < 200; i++) {
+        fakeNowMs += 100;
+        engine.step();
+    }
+    TEST_ASSERT_EQUAL_UINT32(0, engine.backlog());
+    TEST_ASSERT_EQUAL(b.seq - 1, b.server.order.size());
+    TEST_ASSERT_LESS_OR_EQUAL(10 * UPLOAD_CURSOR_SAVE_MS / 1000 + UPLOAD_BATCH_EVENTS, b.server.duplicates);
+}
+
+void test_events_that_age_out_are_counted(void)
+{
+    Bench b;
+    b.begin();
+    b.server.up = false;
+    // More than the log holds, while the server is down.
+    uint32_t total = EVENT_LOG_SEGMENT_RECORDS * (EVENT_LOG_MAX_SEGMENTS + 2);
+    b.run(total * 10, 100);
+    b.log.flush();
+
+    b.server.up = true;
+    while (b.engine.backlog() > 0) b.run(1000, 0);
+    TEST_ASSERT_GREATER_THAN(0, b.engine.eventsSkipped);
+    TEST_ASSERT_EQUAL(b.seq - 1, b.engine.eventsSkipped + b.server.order.size());
+}
+
+void test_body_is_json(void)
+{
+    Bench b;
+    b.begin();
+    b.log.append(1, 0, 7, 1650000000000ULL, EVENT_FLAG_UTC, 0);
+    b.log.flush();
+
+    struct Capture : public UploadTransport
+    {
+        std::string body;
+        bool        linkUp() override { return true; }
+        int         post(const char *text, size_t length) override { body.assign(text, length); return 200; }
+    } capture;
+
+    UploadEngine engine;
+    engine.begin(b.log, capture, NULL, fakeClock);
+    engine.setDevice("Door \"3\"\n", "24:0A");
+    engine.step();
+    fakeNowMs += UPLOAD_LINGER_MS;
+    engine.step();
+    TEST_ASSERT_EQUAL_STRING("{\"deviceName\":\"Door 3\",\"deviceMAC\":\"24:0A\",\"events\":["
+                             "{\"seq\":1,\"time\":1650000000000,\"utc\":1,\"eventType\":\"inbound\",\"count\":7}]}",
+                             capture.body.c_str());
+}
+
+//*****************************************************************************
+// HTTP/1.1 POSTs over one kept-alive socket, as HttpUploadTransport does.
+struct SocketTransport : public UploadTransport
+{
+    int      port;
+    int      fd       = -1;
+    uint32_t connects = 0;
+
+    explicit SocketTransport(int p) : port(p) {}
+    ~SocketTransport() { if (fd >= 0) close(fd); }
+
+    bool connectToServer()
+    {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address = {};
+        address.sin_family      = AF_INET;
+        address.sin_port        = htons(port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (connect(fd, (sockaddr *)&address, sizeof(address)) != 0) {
+            close(fd);
+            fd = -1;
+            return false;
+        }
+        connects++;
+        return true;
+    }
+
+    bool linkUp() override { return true; }
+
+    int post(const char *body, size_t length) override
+    {
+        for (int attempt = 0; attempt < 2; attempt++) { // Once more if the server closed it.
+            if ((fd < 0) && !connectToServer()) return -1;
+            char header[160];
+            int  n = snprintf(header, sizeof(header),
+                              "POST / HTTP/1.1\r\nHost: localhost\r\nContent-Type: application/json\r\n"
+                              "Content-Length: %u\r\n\r\n", (unsigned)length);
+            char    reply[512];
+            ssize_t got;
+            if ((send(fd, header, n, MSG_NOSIGNAL) != n) ||
+                (send(fd, body, length, MSG_NOSIGNAL) != (ssize_t)length) ||
+                ((got = recv(fd, reply, sizeof(reply) - 1, 0)) <= 0)) {
+                close(fd);
+                fd = -1;
+                continue;
+            }
+            reply[got] = 0;
+            int status = 0;
+            sscanf(reply, "HTTP/1.%*d %d", &status);
+            return status;
+        }
+        return -1;
+    }
+};
+
+static uint32_t wallClock()
+{
+    using namespace std::chrono;
+    return (uint32_t)duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+void test_against_the_stub_server(void)
+{
+    const char     *portText = getenv("UPLOAD_STUB_PORT");
+    SocketTransport link(portText ? atoi(portText) : 8080);
+    if (!link.connectToServer()) TEST_IGNORE_MESSAGE("tools/upload_stub_server.py isn't running");
+
+    fs::FS       disk;
+    EventLog     log;
+    UploadEngine engine;
+    uint32_t     seq = log.begin(disk);
+    engine.begin(log, link, NULL, wallClock);
+    engine.setDevice("native test", "00:00:00:00:00:00");
+
+    // A backlog of 2000 events, as after an outage, sent as fast as the
+    // server takes them.
+    const uint32_t generated = 2000;
+    for (uint32_t i = 0; i < generated; i++, seq++) log.append(seq, seq & 1, seq, i, 0, 0);
+    log.flush();
+
+    uint32_t start = wallClock(), dueMs = start;
+    while ((engine.backlog() > 0) && (wallClock() - start < 60000)) {
+        uint32_t now = wallClock();
+        if ((int32_t)(now - dueMs) >= 0) dueMs = now + engine.step();
+        else std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    uint32_t elapsed = wallClock() - start + 1;
+
+    TEST_ASSERT_EQUAL_UINT32(0, engine.backlog());
+    TEST_ASSERT_EQUAL_UINT32(generated, engine.eventsSent);
+    char message[160];
+    snprintf(message, sizeof(message), "%lu events in %lu posts over %lu connection(s), %.0f events/s, last post %lu ms",
+             (unsigned long)engine.eventsSent, (unsigned long)engine.posts, (unsigned long)link.connects,
+             engine.eventsSent * 1000.0 / elapsed, (unsigned long)engine.lastLatencyMs);
+    TEST_MESSAGE(message);
+}
+
+int main(int, char **)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_backlog_drains_after_an_outage);
+    RUN_TEST(test_backoff_doubles_to_the_cap);
+    RUN_TEST(test_a_burst_goes_in_one_post);
+    RUN_TEST(test_reboot_resends_only_since_the_last_cursor_save);
+    RUN_TEST(test_events_that_age_out_are_counted);
+    RUN_TEST(test_body_is_json);
+    RUN_TEST(test_against_the_stub_server);
+    return UNITY_END();
+}
@@ -0,0 +1,173 @@
+/* test_wifi_link
+ *
+ *  The WiFi link state machine against a fake radio: an access point that
+ *  comes and goes, takes a while to associate, and can report through the
+ *  event callbacks or only when asked.
+ *
+ *  Copyright 2022, Digame Systems. All rights reserved.
+ */
+
+#include <unity.h>
+#include <digameWiFiLink.h>
+
+void setUp(void) {}
+void tearDown(void) {}
+
+//*****************************************************************************
+// Connects associateMs after startConnect(), if the access point is there.
+class FakeRadio : public WiFiRadio
+{
+  public:
+    bool     apUp        = false;
+    uint32_t associateMs = 3000;
+    uint32_t nowMs       = 0;
+    uint32_t starts      = 0;
+    uint32_t stops       = 0;
+
+    void startConnect() override { trying = true; startedMs = nowMs; starts++; }
+    void stopConnect() override { trying = false; stops++; }
+    bool isConnected() override { return apUp && trying && (nowMs - startedMs >= associateMs); }
+
+  private:
+    bool     trying    = false;
+    uint32_t startedMs = 0;
+};
+
+struct Bench
+{
+    FakeRadio radio;
+    WiFiLink  link;
+
+    // The main loop, every 10 ms.
+    void run(uint32_t untilMs)
+    {
+        for (; radio.nowMs < untilMs; radio.nowMs += 10) link.service(radio.nowMs);
+    }
+};
+
+//*****************************************************************************
+void test_connects_and_times_the_attempt(void)
+{
+    Bench b;
+    b.radio.apUp = true;
+    b.link.begin(b.radio, 0);
+    TEST_ASSERT_EQUAL(WIFI_LINK_CONNECTING, b.link.getState());
+
+    b.run(2990);
+    TEST_ASSERT_FALSE(b.link.connected());
+    b.run(3100);
+    TEST_ASSERT_TRUE(b.link.connected());
+    TEST_ASSERT_EQUAL_UINT32(3000, b.link.lastConnectMs);
+    TEST_ASSERT_EQUAL_UINT32(1, b.link.attempts);
+    TEST_ASSERT_EQUAL_UINT32(1, b.link.connects);
+    TEST_ASSERT_EQUAL_UINT32(100, b.link.upTimeMs(3100));
+}
+
+void test_no_access_point_backs_off_to_the_cap(void)
+{
+    Bench b;
+    b.link.begin(b.radio, 0);
+
+    uint32_t expected = WIFI_BACKOFF_MIN_MS;
+    for (int i = 0; i < 10; i++) {
+        uint32_t failures = b.link.failures;
+        while (b.link.failures == failures) b.run(b.radio.nowMs + 10);
+        TEST_ASSERT_EQUAL(WIFI_LINK_BACKOFF, b.link.getState());
+        TEST_ASSERT_EQUAL_UINT32(expected, b.link.backoffMs);
+        TEST_ASSERT_EQUAL_UINT32(b.radio.starts, b.radio.stops); // Every attempt was abandoned.
+
+        uint32_t failedAt = b.radio.nowMs;
+        while (b.link.getState() == WIFI_LINK_BACKOFF) b.run(b.radio.nowMs + 10);
+        TEST_ASSERT_UINT32_WITHIN(10, expected, b.radio.nowMs - failedAt);
+
+        expected = (2 * expected > WIFI_BACKOFF_MAX_MS) ? WIFI_BACKOFF_MAX_MS : 2 * expected;
+    }
+    TEST_ASSERT_EQUAL_UINT32(WIFI_BACKOFF_MAX_MS, b.link.backoffMs);
+}
+
+void test_access_point_returns(void)
+{
+    Bench b;
+    b.link.begin(b.radio, 0);
+    b.run(200000);
+    TEST_ASSERT_GREATER_THAN(3, b.link.failures);
+
+    b.radio.apUp = true;
+    b.run(200000 + WIFI_BACKOFF_MAX_MS + WIFI_CONNECT_TIMEOUT_MS + 1000);
+    TEST_ASSERT_TRUE(b.link.connected());
+    TEST_ASSERT_EQUAL_UINT32(0, b.link.backoffMs); // Reset by the connect.
+}
+
+void test_drop_reconnects_at_once(void)
+{
+    Bench b;
+    b.radio.apUp = true;
+    b.link.begin(b.radio, 0);
+    b.run(5000);
+    TEST_ASSERT_TRUE(b.link.connected());
+
+    b.link.onDisconnected(); // The event handler, from the WiFi task.
+    b.radio.apUp = false;
+    b.run(5010);
+    TEST_ASSERT_EQUAL(WIFI_LINK_CONNECTING, b.link.getState());
+    TEST_ASSERT_EQUAL_UINT32(1, b.link.drops);
+    TEST_ASSERT_EQUAL_UINT32(2, b.link.attempts);
+
+    b.radio.apUp = true;
+    b.run(9000);
+    TEST_ASSERT_TRUE(b.link.connected());
+    TEST_ASSERT_EQUAL_UINT32(2, b.link.connects);
+    TEST_ASSERT_EQUAL_UINT32(0, b.link.failures);
+}
+
+void test_connected_event_is_taken_at_once(void)
+{
+    Bench b;
+    b.radio.associateMs = 60000; // isConnected() would say no for a long time...
+    b.link.begin(b.radio, 0);
+    b.run(1000);
+    b.link.onConnected();         // ...but the event says yes.
+    b.run(1010);
+    TEST_ASSERT_TRUE(b.link.connected());
+    TEST_ASSERT_EQUAL_UINT32(1000, b.link.lastConnectMs);
+}
+
+void test_stale_disconnect_is_ignored(void)
+{
+    Bench b;
+    b.radio.apUp = true;
+    b.link.begin(b.radio, 0);
+    b.link.onDisconnected(); // From before this attempt began.
+    b.link.disable();
+    b.link.enable(0);
+    b.run(4000);
+    TEST_ASSERT_TRUE(b.link.connected());
+    TEST_ASSERT_EQUAL_UINT32(0, b.link.drops);
+}
+
+void test_disable_stops_everything(void)
+{
+    Bench b;
+    b.link.begin(b.radio, 0);
+    b.run(1000);
+    b.link.disable();
+    uint32_t starts = b.radio.starts;
+    b.radio.apUp = true;
+    b.run(300000);
+    TEST_ASSERT_EQUAL(WIFI_LINK_DISABLED, b.link.getState());
+    TEST_ASSERT_EQUAL_UINT32(starts, b.radio.starts);
+    TEST_ASSERT_EQUAL_STRING("disabled", WiFiLink::stateName(b.link.getState()));
+}
+
+int main(int, char **)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_connects_and_times_the_attempt);
+    RUN_TEST(test_no_access_point_backs_off_to_the_cap);
+    RUN_TEST(test_access_point_returns);
+    RUN_TEST(test_drop_reconnects_at_once);
+    RUN_TEST(test_connected_event_is_taken_at_once);
+    RUN_TEST(test_stale_disconnect_is_ignored);
+    RUN_TEST(test_disable_stops_everything);
+    return UNITY_END();
+}
@@ -0,0 +1,89 @@
+#!/usr/bin/env python3
+"""
+build_web_assets.py
+
+Builds the file system image contents from data/. Web assets are gzipped
+when that makes them smaller, and each one is given a content hash for its
+ETag. The results go to the image directory with a manifest, assets.txt,
+which lib/digameAssets serves from. Files that aren't web assets, like
+the old settings files, are copied unchanged, as are HTML pages with
+%variable% placeholders: those are rendered, and gzipped, on the device
+(lib/digameTemplate).
+
+It runs as a PlatformIO pre-script, so `pio run -t buildfs` / `uploadfs`
+always packs fresh output (platformio.ini points data_dir at it). It can
+also be run by hand:
+
+    python3 tools/build_web_assets.py [source dir] [output dir]
+
+Output is deterministic: the same inputs give byte-identical files and
+ETags, so browsers only refetch what actually changed.
+
+Copyright 2022, Digame Systems. All rights reserved.
+"""
+
+import gzip
+import hashlib
+import os
+import re
+import shutil
+import sys
+
+WEB_ASSETS = (".html", ".css", ".js", ".json", ".ico", ".png", ".svg")
+MIN_SAVING = 0.10  # Keep the original unless gzip saves at least this much.
+MAX_NAME = 31      # SPIFFS object names, including the leading "/".
+PLACEHOLDER = re.compile(rb"%[A-Za-z0-9_.]+%")
+
+
+def build(source, output):
+    os.makedirs(output, exist_ok=True)
+    for name in os.listdir(output):  # Nothing left over from renamed or deleted assets.
+        path = os.path.join(output, name)
+        if os.path.isfile(path):
+            os.remove(path)
+
+    manifest = ["# path etag gzipped -- generated by tools/build_web_assets.py"]
+    total_in = total_out = 0
+
+    for name in sorted(os.listdir(source)):
+        path = os.path.join(source, name)
+        if not os.path.isfile(path) or name.startswith("."):
+            continue
+        with open(path, "rb") as f:
+            content = f.read()
+        template = name.lower().endswith(".html") and PLACEHOLDER.search(content)
+        if template or not name.lower().endswith(WEB_ASSETS):
+            shutil.copyfile(path, os.path.join(output, name))
+            if template:
+                print("  %-28s %7d    (template)" % (name, len(content)))
+            continue
+        etag = hashlib.sha256(content).hexdigest()[:16]
+        packed = gzip.compress(content, compresslevel=9, mtime=0)
+        use_gzip = len(packed) <= len(content) * (1 - MIN_SAVING)
+        stored = name + ".gz" if use_gzip else name
+
+        if len(stored) + 1 > MAX_NAME:
+            raise SystemExit("%s: name too long for SPIFFS" % stored)
+
+        with open(os.path.join(output, stored), "wb") as f:
+            f.write(packed if use_gzip else content)
+        manifest.append("/%s %s %d" % (name, etag, use_gzip))
+
+        size = len(packed) if use_gzip else len(content)
+        total_in += len(content)
+        total_out += size
+        print("  %-28s %7d -> %7d  %s" % (name, len(content), size, etag))
+
+    with open(os.path.join(output, "assets.txt"), "w") as f:
+        f.write("\n".join(manifest) + "\n")
+    print("  Web assets: %d -> %d bytes" % (total_in, total_out))
+
+
+try:  # Run by PlatformIO?
+    Import("env")  # noqa: F821
+    build(os.path.join(env["PROJECT_DIR"], "data"), env.subst("$PROJECT_DATA_DIR"))  # noqa: F821
+except NameError:
+    if __name__ == "__main__":
+        here = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+        build(sys.argv[1] if len(sys.argv) > 1 else os.path.join(here, "data"),
+              sys.argv[2] if len(sys.argv) > 2 else os.path.join(here, ".pio", "data"))
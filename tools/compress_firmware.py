@@ -0,0 +1,97 @@
+#!/usr/bin/env python3
+"""
+compress_firmware.py
+
+Compresses a firmware (or file system) image for the counter's /update
+page, so less of it has to cross the soft-AP link:
+
+    python3 tools/compress_firmware.py .pio/build/esp32dev/firmware.bin
+    python3 tools/compress_firmware.py firmware.bin --upload 192.168.4.1
+
+This writes firmware.bin.gz next to the image. Pick that on the /update
+page like the .bin, or give --upload to send it from here. The counter
+decompresses it as it arrives (lib/digameInflate).
+
+The counter keeps only an 8 KB window of history, so this compresses with
+no more than that. A .gz from the gzip command may refer further back and
+will be turned away. The image's SHA-256 goes in the gzip comment, and the
+counter checks the decompressed image against it before switching over.
+
+Standard library only. Copyright 2022, Digame Systems. All rights reserved.
+"""
+
+import argparse
+import hashlib
+import struct
+import sys
+import time
+import urllib.error
+import urllib.request
+import uuid
+import zlib
+
+WINDOW_BITS = 13  # Must not exceed INFLATE_WINDOW_BITS in digameInflate.h.
+
+
+def compress(image):
+    """The image as a gzip file the counter can decompress."""
+    comment = b"sha256=" + hashlib.sha256(image).hexdigest().encode()
+    header = struct.pack("<BBBBIBB", 0x1F, 0x8B, 8, 0x10, int(time.time()), 2, 255) + comment + b"\0"  # FCOMMENT.
+    deflate = zlib.compressobj(9, zlib.DEFLATED, -WINDOW_BITS, 9)
+    body = deflate.compress(image) + deflate.flush()
+    return header + body + struct.pack("<II", zlib.crc32(image), len(image) & 0xFFFFFFFF)
+
+
+def upload(host, compressed, kind):
+    """POST it the way the /update page does. Returns the counter's answer.
+
+    The SHA-256 is checked on the counter's SHA engine. The MD5 is for
+    firmware from before that, which only knows MD5."""
+    boundary = uuid.uuid4().hex
+    fields = {"MD5": hashlib.md5(compressed).hexdigest(), "SHA256": hashlib.sha256(compressed).hexdigest()}
+    body = (
+        b"".join(("--%s\r\nContent-Disposition: form-data; name=\"%s\"\r\n\r\n%s\r\n" % (boundary, name, value)).encode()
+                 for name, value in fields.items())
+        + ("--%s\r\nContent-Disposition: form-data; name=\"%s\"; filename=\"%s\"\r\n"
+           "Content-Type: application/octet-stream\r\n\r\n" % (boundary, kind, kind)).encode()
+        + compressed
+        + ("\r\n--%s--\r\n" % boundary).encode()
+    )
+    request = urllib.request.Request("http://%s/update" % host, data=body, method="POST",
+                                     headers={"Content-Type": "multipart/form-data; boundary=" + boundary})
+    started = time.monotonic()
+    try:
+        with urllib.request.urlopen(request, timeout=120) as response:
+            answer = "%d %s" % (response.status, response.read().decode(errors="replace"))
+    except urllib.error.HTTPError as e:
+        answer = "%d %s" % (e.code, e.read().decode(errors="replace"))
+    return answer, time.monotonic() - started
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(description="Compress a firmware image for the counter's /update page.")
+    parser.add_argument("image")
+    parser.add_argument("--output", help="default: IMAGE.gz")
+    parser.add_argument("--upload", metavar="HOST", help="send it to the counter at HOST")
+    parser.add_argument("--filesystem", action="store_true", help="it's a file system image, not firmware")
+    args = parser.parse_args(argv[1:])
+
+    with open(args.image, "rb") as f:
+        image = f.read()
+    compressed = compress(image)
+    output = args.output or args.image + ".gz"
+    with open(output, "wb") as f:
+        f.write(compressed)
+
+    print("%s: %d -> %d bytes (%.1f%%)" % (output, len(image), len(compressed), 100.0 * len(compressed) / len(image)))
+    print("SHA-256 of image: %s" % hashlib.sha256(image).hexdigest())
+
+    if args.upload:
+        answer, took = upload(args.upload, compressed, "filesystem" if args.filesystem else "firmware")
+        print("Upload: %s in %.1f s (%.0f KB/s compressed)" % (answer, took, len(compressed) / took / 1024))
+        return 0 if answer.startswith("200") else 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
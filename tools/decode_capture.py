@@ -0,0 +1,87 @@
+#!/usr/bin/env python3
+"""
+decode_capture.py
+
+Turns a raw frame capture (lib/digameCapture) into CSV, oldest frame first.
+Fetch the file from the counter's web server, then decode it:
+
+    curl -o capture.bin http://<counter-ip>/capture.bin
+    python3 tools/decode_capture.py capture.bin > capture.csv
+
+Blocks that were never written or fail their CRC (e.g. one being written
+as the file was downloaded) are skipped and reported on stderr.
+
+Version 2 files also give each frame's UTC time (utc_ms), when the
+counter's clock was set. Version 1 files leave that column empty.
+
+Copyright 2022, Digame Systems. All rights reserved.
+"""
+
+import struct
+import sys
+import zlib
+
+CAPTURE_MAGIC = 0x50414344  # "DCAP"
+BLOCK_MAGIC = 0xB10C
+FLAG_TRIGGER = 0x01
+
+FILE_HEADER = struct.Struct("<IHHHHHHI")
+BLOCK_HEADERS = {1: struct.Struct("<HHII"), 2: struct.Struct("<HHIIq")}
+FRAME = struct.Struct("<IhhhhBB")
+
+STATES = {0: "neither", 1: "sensor1", 2: "sensor2", 3: "both"}
+
+
+def decode(data):
+    """Returns (frames, bad_blocks). Each frame is a tuple of
+    (time_ms, dist1, flux1, dist2, flux2, state, flags, utc_ms); utc_ms is
+    None when it isn't known."""
+    magic, version, header_size, block_size, block_count, frame_size, _, crc = FILE_HEADER.unpack_from(data)
+    if magic != CAPTURE_MAGIC or crc != zlib.crc32(data[: FILE_HEADER.size - 4]):
+        raise ValueError("not a capture file")
+    if version not in BLOCK_HEADERS or frame_size != FRAME.size:
+        raise ValueError("unsupported capture version %d" % version)
+    block_header = BLOCK_HEADERS[version]
+
+    blocks = []
+    bad = 0
+    for i in range(block_count):
+        offset = header_size + i * block_size
+        if offset + block_header.size > len(data):
+            break
+        bmagic, frames, block_seq, bcrc, *rest = block_header.unpack_from(data, offset)
+        if bmagic != BLOCK_MAGIC:
+            continue  # Never written.
+        body = data[offset + block_header.size : offset + block_header.size + frames * FRAME.size]
+        if len(body) != frames * FRAME.size or bcrc != zlib.crc32(body):
+            bad += 1
+            continue
+        blocks.append((block_seq, rest[0] if rest else 0, body))
+
+    blocks.sort()
+    frames = []
+    for _, utc_offset, body in blocks:
+        frames.extend(f + (f[0] + utc_offset if utc_offset else None,) for f in FRAME.iter_unpack(body))
+    return frames, bad
+
+
+def main(argv):
+    if len(argv) != 2:
+        print(__doc__.strip())
+        return 2
+
+    with open(argv[1], "rb") as f:
+        frames, bad = decode(f.read())
+
+    print("time_ms,dist1,flux1,dist2,flux2,state,trigger,utc_ms")
+    for time_ms, dist1, flux1, dist2, flux2, state, flags, utc_ms in frames:
+        print("%d,%d,%d,%d,%d,%s,%d,%s" % (time_ms, dist1, flux1, dist2, flux2, STATES.get(state, state),
+                                           1 if flags & FLAG_TRIGGER else 0, "" if utc_ms is None else utc_ms))
+
+    sys.stderr.write("%d frames" % len(frames))
+    sys.stderr.write(", %d bad blocks skipped\n" % bad if bad else "\n")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -0,0 +1,377 @@
+#!/usr/bin/env python3
+"""
+digame_control.py
+
+Host-side client for the binary control protocol (lib/digameControl).
+Talks to a counter over its USB serial port or a Bluetooth RFCOMM device
+(e.g. /dev/rfcomm0). Requests are pipelined: submit() returns a request ID
+straight away and responses are matched back up as they arrive.
+
+    python3 tools/digame_control.py /dev/rfcomm0 counts
+    python3 tools/digame_control.py /dev/ttyUSB0 set threshold 150
+    python3 tools/digame_control.py /dev/rfcomm0 events [resume seq]
+    python3 tools/digame_control.py /dev/rfcomm0 log [from seq]
+    python3 tools/digame_control.py /dev/rfcomm0 totals [span minutes] [step minutes]
+    python3 tools/digame_control.py /dev/rfcomm0 time
+    python3 tools/digame_control.py /dev/rfcomm0 settime
+
+settime gives the counter this computer's clock, allowing for half the
+link's round trip, for when it has no SNTP server to reach. Keep the
+host's own clock synced (e.g. chrony) or this does more harm than good.
+
+Text from the menu and event messages can share the link; anything that
+isn't a valid frame is skipped.
+
+Copyright 2022, Digame Systems. All rights reserved.
+"""
+
+import binascii
+import os
+import select
+import struct
+import sys
+import termios
+import time
+import tty
+
+SYNC = b"\xa5\x5a"
+MAX_PAYLOAD = 240
+RESPONSE_FLAG = 0x80
+
+PING = 0x01
+GET_CONFIG = 0x02
+SET_CONFIG = 0x03
+GET_COUNTS = 0x04
+READ_EVENTS = 0x05
+GET_HEALTH = 0x06
+GET_TOTALS = 0x07
+SET_TIME = 0x08
+GET_TIME = 0x09
+SUBSCRIBE_EVENTS = 0x10
+ACK_EVENTS = 0x11
+UNSUBSCRIBE = 0x12
+EVENT_BATCH = 0x90
+
+EVENT_TYPES = {0: "inbound", 1: "outbound"}
+EVENT_UTC = 0x01  # Event flag: time_ms is UTC, not uptime.
+
+STATUS_NAMES = {
+    0: "OK",
+    1: "UNKNOWN_OPCODE",
+    2: "BAD_REQUEST",
+    3: "UNSUPPORTED",
+    4: "BAD_KEY",
+    5: "FAILED",
+}
+
+CONFIG_KEYS = {"name": 1, "threshold": 2, "smoothing": 3, "checkpoint": 4, "checkpoint_events": 5}
+
+TIME_SOURCES = {0: "none", 1: "sntp", 2: "host"}
+
+
+def crc16(data, crc=0xFFFF):
+    """CRC-16/CCITT-FALSE, matching crc16() on the device."""
+    return binascii.crc_hqx(data, crc)
+
+
+def encode_frame(request_id, opcode, payload=b""):
+    if len(payload) > MAX_PAYLOAD:
+        raise ValueError("payload too long")
+    body = struct.pack("<HHB", len(payload), request_id, opcode) + payload
+    return SYNC + body + struct.pack("<H", crc16(body))
+
+
+class ControlError(Exception):
+    def __init__(self, status):
+        super().__init__(STATUS_NAMES.get(status, "status %d" % status))
+        self.status = status
+
+
+class FrameParser:
+    """Pulls complete, CRC-checked frames out of an arbitrary byte stream."""
+
+    def __init__(self):
+        self.buffer = bytearray()
+        self.crc_errors = 0
+
+    def feed(self, data):
+        self.buffer += data
+        frames = []
+        while True:
+            start = self.buffer.find(SYNC)
+            if start < 0:
+                # Keep a trailing 0xA5 in case the 0x5A is still in flight.
+                del self.buffer[: max(0, len(self.buffer) - 1)]
+                return frames
+            del self.buffer[:start]
+            if len(self.buffer) < 9:
+                return frames
+            length, request_id, opcode = struct.unpack_from("<HHB", self.buffer, 2)
+            if length > MAX_PAYLOAD:
+                del self.buffer[:1]
+                continue
+            total = 9 + length
+            if len(self.buffer) < total:
+                return frames
+            body = bytes(self.buffer[2 : 7 + length])
+            (crc,) = struct.unpack_from("<H", self.buffer, 7 + length)
+            if crc != crc16(body):
+                self.crc_errors += 1
+                del self.buffer[:1]
+                continue
+            frames.append((request_id, opcode, body[5:]))
+            del self.buffer[:total]
+
+
+class SerialLink:
+    """Minimal raw-mode tty wrapper so we don't need pyserial."""
+
+    def __init__(self, path):
+        self.fd = os.open(path, os.O_RDWR | os.O_NOCTTY)
+        if os.isatty(self.fd):
+            attrs = termios.tcgetattr(self.fd)
+            attrs[4] = attrs[5] = termios.B115200
+            termios.tcsetattr(self.fd, termios.TCSANOW, attrs)
+            tty.setraw(self.fd)
+
+    def write(self, data):
+        os.write(self.fd, data)
+
+    def read(self, timeout):
+        ready, _, _ = select.select([self.fd], [], [], timeout)
+        return os.read(self.fd, 4096) if ready else b""
+
+    def close(self):
+        os.close(self.fd)
+
+
+class ControlClient:
+    """Pipelined client. Any object with write(bytes) and read(timeout) works
+    as a link, which makes it easy to run against a loopback."""
+
+    def __init__(self, link):
+        self.link = link
+        self.parser = FrameParser()
+        self.next_id = 1
+        self.responses = {}
+        self.unsolicited = []  # Frames pushed by the device (request ID 0).
+
+    def submit(self, opcode, payload=b""):
+        request_id = self.next_id
+        self.next_id = self.next_id % 0xFFFF + 1  # ID 0 is reserved for device pushes.
+        self.link.write(encode_frame(request_id, opcode, payload))
+        return request_id
+
+    def poll(self, timeout=0.0):
+        for request_id, opcode, payload in self.parser.feed(self.link.read(timeout)):
+            if request_id == 0:
+                self.unsolicited.append((opcode, payload))
+            else:
+                self.responses[request_id] = (opcode, payload)
+
+    def wait(self, request_id, timeout=2.0):
+        """Returns the response payload after the status byte. Raises
+        ControlError for a non-OK status and TimeoutError if nothing arrives."""
+        deadline = time.monotonic() + timeout
+        while request_id not in self.responses:
+            remaining = deadline - time.monotonic()
+            if remaining <= 0:
+                raise TimeoutError("no response to request %d" % request_id)
+            self.poll(min(remaining, 0.1))
+        _, payload = self.responses.pop(request_id)
+        if not payload or payload[0] != 0:
+            raise ControlError(payload[0] if payload else 5)
+        return payload[1:]
+
+    def call(self, opcode, payload=b"", timeout=2.0):
+        return self.wait(self.submit(opcode, payload), timeout)
+
+    # Convenience wrappers -------------------------------------------------
+
+    def ping(self):
+        self.call(PING)
+
+    def get_counts(self):
+        inbound, outbound = struct.unpack("<II", self.call(GET_COUNTS))
+        return inbound, outbound
+
+    def get_config(self, key):
+        data = self.call(GET_CONFIG, bytes([CONFIG_KEYS[key]]))[1:]
+        return data.decode() if key == "name" else struct.unpack("<f", data)[0]
+
+    def set_config(self, key, value):
+        if key == "name":
+            value = str(value).encode()
+        else:
+            value = struct.pack("<f", float(value))
+        self.call(SET_CONFIG, bytes([CONFIG_KEYS[key]]) + value)
+
+    def get_health(self):
+        fields = ("uptime_ms", "free_heap", "lidar_frames", "lidar_errors", "control_crc_errors",
+                  "events_unacked", "events_dropped", "upload_backlog", "upload_failures",
+                  "wifi_state", "wifi_connect_ms", "wifi_drops")
+        return dict(zip(fields, struct.unpack_from("<12I", self.call(GET_HEALTH))))
+
+    def get_totals(self, from_minute, to_minute):
+        """In/out counts for minutes [from_minute, to_minute). Returns a dict;
+        complete is False if part of the range is older than the device keeps."""
+        fields = ("complete", "inbound", "outbound", "now_minute", "flags")
+        reply = self.call(GET_TOTALS, struct.pack("<II", from_minute, to_minute))
+        return dict(zip(fields, struct.unpack_from("<BIIIB", reply)))
+
+    def set_time(self):
+        """Sends our UTC time. The best of a few pings says how long the trip
+        takes; half of it is added on and given as the uncertainty. Returns
+        (accepted, how far out the counter was in ms)."""
+        round_trip = min(self._ping_time() for _ in range(5))
+        utc_ms = int((time.time() + round_trip / 2) * 1000)
+        plus_minus_ms = min(int(round_trip * 500) + 1, 0xFFFF)
+        reply = self.call(SET_TIME, struct.pack("<QH", utc_ms, plus_minus_ms))
+        accepted, error_ms = struct.unpack_from("<Bi", reply)
+        return bool(accepted), error_ms
+
+    def get_time(self):
+        fields = ("valid", "source", "utc_ms", "drift_ppb", "syncs", "sync_age_s")
+        reply = dict(zip(fields, struct.unpack_from("<BBQiII", self.call(GET_TIME))))
+        reply["source"] = TIME_SOURCES.get(reply["source"], reply["source"])
+        return reply
+
+    def _ping_time(self):
+        started = time.monotonic()
+        self.ping()
+        return time.monotonic() - started
+
+
+def read_events(client, from_seq, max_records=12):
+    """One page from the device's flash event log. Returns (oldest, newest,
+    events); fetch the next page from the last seq + 1."""
+    reply = client.call(READ_EVENTS, struct.pack("<IB", from_seq, max_records))
+    oldest, newest = struct.unpack_from("<II", reply)
+    return oldest, newest, decode_event_batch(reply[8:])
+
+
+def decode_event_batch(payload):
+    """Returns a list of (seq, time_ms, flags, type, count) tuples. With
+    flags & EVENT_UTC, time_ms is UTC; otherwise it is the device's uptime."""
+    (n,) = struct.unpack_from("<B", payload)
+    return [struct.unpack_from("<IQBBI", payload, 1 + 18 * i) for i in range(n)]
+
+
+def format_event(event):
+    seq, time_ms, flags, kind, count = event
+    if flags & EVENT_UTC:
+        when = time.strftime("%Y-%m-%d %H:%M:%S", time.gmtime(time_ms // 1000)) + ".%03d" % (time_ms % 1000)
+    else:
+        when = "up %.3f s" % (time_ms / 1000.0)
+    return "%8d %-23s %-8s %d" % (seq, when, EVENT_TYPES.get(kind, kind), count)
+
+
+class EventReceiver:
+    """Reliable, in-order event stream on top of ControlClient.
+
+    Remembers the next sequence number it expects, so a new instance can be
+    handed resume_seq from a previous session. Duplicates are dropped, a gap
+    triggers a resubscribe from the first missing event, and every batch is
+    acknowledged up to the last event delivered in order."""
+
+    def __init__(self, client, resume_seq=0):
+        self.client = client
+        self.expected = resume_seq
+
+    def subscribe(self):
+        reply = self.client.call(SUBSCRIBE_EVENTS, struct.pack("<I", self.expected))
+        oldest, _next = struct.unpack("<II", reply)
+        if self.expected == 0 or self.expected < oldest:
+            self.expected = oldest  # Anything older is gone for good.
+
+    def poll(self, timeout=0.1):
+        """Returns newly delivered events, in order and without duplicates."""
+        self.client.poll(timeout)
+        delivered = []
+        resubscribe = False
+        for opcode, payload in self.client.unsolicited:
+            if opcode != EVENT_BATCH:
+                continue
+            for event in decode_event_batch(payload):
+                if event[0] == self.expected:
+                    delivered.append(event)
+                    self.expected += 1
+                elif event[0] > self.expected:
+                    resubscribe = True  # Lost a batch. Ask again from the gap.
+        self.client.unsolicited.clear()
+
+        if delivered:
+            self.client.submit(ACK_EVENTS, struct.pack("<I", self.expected - 1))
+        if resubscribe:
+            self.client.submit(SUBSCRIBE_EVENTS, struct.pack("<I", self.expected))
+        self.client.responses.clear()  # Nobody waits on ack / resubscribe replies.
+        return delivered
+
+
+def main(argv):
+    if len(argv) < 3:
+        print(__doc__.strip())
+        return 2
+
+    client = ControlClient(SerialLink(argv[1]))
+    command = argv[2]
+
+    if command == "ping":
+        client.ping()
+        print("OK")
+    elif command == "counts":
+        print("inbound %d outbound %d" % client.get_counts())
+    elif command == "get":
+        print(client.get_config(argv[3]))
+    elif command == "set":
+        client.set_config(argv[3], argv[4])
+        print("OK")
+    elif command == "log":
+        seq = int(argv[3]) if len(argv) > 3 else 0
+        while True:
+            oldest, newest, events = read_events(client, seq)
+            for event in events:
+                print(format_event(event))
+            seq = events[-1][0] if events else seq
+            if not events or seq >= newest:
+                break
+            seq += 1
+    elif command == "events":
+        receiver = EventReceiver(client, int(argv[3]) if len(argv) > 3 else 0)
+        receiver.subscribe()
+        while True:
+            for event in receiver.poll(0.5):
+                print(format_event(event))
+                sys.stdout.flush()
+    elif command == "totals":
+        span = int(argv[3]) if len(argv) > 3 else 60
+        step = int(argv[4]) if len(argv) > 4 else span
+        now = client.get_totals(0, 0)["now_minute"] + 1  # Up to and including this minute.
+        start = max(0, now - span)
+        requests = [(t, client.submit(GET_TOTALS, struct.pack("<II", t, min(t + step, now))))
+                    for t in range(start, now, step)]
+        for t, request_id in requests:
+            complete, inbound, outbound, _, _ = struct.unpack_from("<BIIIB", client.wait(request_id))
+            print("%10d %8d %8d%s" % (t, inbound, outbound, "" if complete else "  (partial)"))
+    elif command == "time":
+        before = time.time()
+        reply = client.get_time()
+        host_ms = (before + time.time()) / 2 * 1000
+        for name, value in reply.items():
+            print("%-20s %s" % (name, value))
+        if reply["valid"]:
+            print("%-20s %+.0f ms" % ("vs this host", reply["utc_ms"] - host_ms))
+    elif command == "settime":
+        accepted, error_ms = client.set_time()
+        print(("Set. The counter was %+d ms out." % -error_ms) if accepted else "Ignored: it has a better source.")
+    elif command == "health":
+        for name, value in client.get_health().items():
+            print("%-20s %d" % (name, value))
+    else:
+        print("Unknown command: " + command)
+        return 2
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -0,0 +1,143 @@
+#!/usr/bin/env python3
+"""
+live_client.py
+
+Test client for the counter's live WebSocket feed (lib/digameLive). Asks for
+raw distances at a given rate and reports what actually arrives: samples
+per second, batches per second, batches the counter dropped, and count
+updates. Standard library only.
+
+    python3 tools/live_client.py [--host 192.168.4.1] [--rate 10] [--seconds 30]
+                                 [--slow SECONDS]
+
+--slow makes this client a bad one: it stops reading for SECONDS at a time,
+so you can check the counter drops data for it (and keeps counting) rather
+than waiting. Run a second, well-behaved client alongside to see it isn't
+affected.
+
+Copyright 2022, Digame Systems. All rights reserved.
+"""
+
+import argparse
+import base64
+import json
+import os
+import socket
+import struct
+import sys
+import time
+
+
+def connect(host, port, path):
+    sock = socket.create_connection((host, port), timeout=5)
+    key = base64.b64encode(os.urandom(16)).decode()
+    sock.sendall(("GET %s HTTP/1.1\r\nHost: %s\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                  "Sec-WebSocket-Key: %s\r\nSec-WebSocket-Version: 13\r\n\r\n" % (path, host, key)).encode())
+    response = b""
+    while b"\r\n\r\n" not in response:
+        chunk = sock.recv(1024)
+        if not chunk:
+            raise ConnectionError("closed during handshake")
+        response += chunk
+    if b" 101 " not in response.split(b"\r\n")[0]:
+        raise ConnectionError(response.split(b"\r\n")[0].decode(errors="replace"))
+    return sock, response.split(b"\r\n\r\n", 1)[1]
+
+
+def send_text(sock, text):
+    data = text.encode()
+    mask = os.urandom(4)
+    header = bytes([0x81, 0x80 | len(data)]) + mask  # Client frames are masked. Ours are short.
+    sock.sendall(header + bytes(b ^ mask[i % 4] for i, b in enumerate(data)))
+
+
+class Reader:
+    def __init__(self, sock, buffered):
+        self.sock = sock
+        self.buffer = buffered
+
+    def take(self, n):
+        while len(self.buffer) < n:
+            chunk = self.sock.recv(4096)
+            if not chunk:
+                raise ConnectionError("closed")
+            self.buffer += chunk
+        data, self.buffer = self.buffer[:n], self.buffer[n:]
+        return data
+
+    def message(self):
+        """Returns (opcode, payload) for the next complete frame."""
+        first, second = self.take(2)
+        length = second & 0x7F
+        if length == 126:
+            length = struct.unpack(">H", self.take(2))[0]
+        elif length == 127:
+            length = struct.unpack(">Q", self.take(8))[0]
+        return first & 0x0F, self.take(length)
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(description="Watch the counter's live feed.")
+    parser.add_argument("--host", default="192.168.4.1")
+    parser.add_argument("--port", type=int, default=80)
+    parser.add_argument("--rate", type=int, default=10, help="raw distance rate to ask for, Hz")
+    parser.add_argument("--seconds", type=float, default=30)
+    parser.add_argument("--interval", type=float, default=5.0, help="seconds between reports")
+    parser.add_argument("--slow", type=float, default=0, help="stall this long between reads")
+    args = parser.parse_args(argv[1:])
+
+    sock, leftover = connect(args.host, args.port, "/live")
+    if args.slow:  # Keep the kernel from soaking up what we don't read.
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 2048)
+    sock.settimeout(1.0)
+    send_text(sock, "rate %d" % args.rate)
+    reader = Reader(sock, leftover)
+
+    started = last_report = time.monotonic()
+    samples = batches = dropped = counts = 0
+    last_sample_ms = None
+    gaps = []
+
+    while time.monotonic() - started < args.seconds:
+        now = time.monotonic()
+        if now - last_report >= args.interval:
+            elapsed = now - last_report
+            print("%6.1f s  %6.1f samples/s  %5.1f batches/s  dropped %d  count updates %d  "
+                  "longest gap %d ms" % (now - started, samples / elapsed, batches / elapsed, dropped,
+                                          counts, max(gaps) if gaps else 0))
+            sys.stdout.flush()
+            samples = batches = counts = 0
+            gaps = []
+            last_report = now
+            if args.slow:
+                time.sleep(args.slow)
+
+        try:
+            opcode, payload = reader.message()
+        except socket.timeout:
+            continue
+        if opcode == 8:
+            print("Counter closed the connection.")
+            return 1
+        if opcode != 1:
+            continue
+
+        msg = json.loads(payload)
+        if msg["type"] == "hello":
+            print("Connected. Counter allows up to %d Hz." % msg["maxRate"])
+        elif msg["type"] == "counts":
+            counts += 1
+            print("        in %d  out %d" % (msg["in"], msg["out"]))
+        elif msg["type"] == "raw":
+            batches += 1
+            samples += len(msg["samples"])
+            dropped += msg["dropped"]
+            for s in msg["samples"]:
+                if last_sample_ms is not None:
+                    gaps.append(s[0] - last_sample_ms)
+                last_sample_ms = s[0]
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -0,0 +1,181 @@
+#!/usr/bin/env python3
+"""
+make_delta.py
+
+Makes a patch that turns one firmware build into another, for the
+counter's /update page (lib/digameDelta). Keep the .bin of every build
+you put on a counter; the patch has to be made against the one running.
+
+    python3 tools/make_delta.py old/firmware.bin new/firmware.bin
+    python3 tools/make_delta.py old.bin new.bin --upload 192.168.4.1
+
+This writes new.bin.delta.gz next to the new image. Pick it on the
+/update page like a .bin, or give --upload to send it from here. The
+counter refuses a patch made against some other build before writing
+anything, and checks the SHA-256 of what it built before switching over.
+
+The patch is checked here first, by applying it to the old image. It is
+gzipped with tools/compress_firmware.py. Both sizes are printed, with the
+upload time saved at --link-kbps.
+
+Standard library only. Copyright 2022, Digame Systems. All rights reserved.
+"""
+
+import argparse
+import hashlib
+import struct
+import sys
+import time
+
+from compress_firmware import compress, upload
+
+DELTA_MAGIC = 0x4C444744  # "DGDL"
+DELTA_VERSION = 1
+HEADER = struct.Struct("<IHHII32s32s")
+OP_END, OP_ADD, OP_COPY, OP_DIFF = 0, 1, 2, 3
+
+SEED = 16         # Bytes that must match exactly to start a match...
+STRIDE = 4        # ...looked up at every STRIDE'th offset of the old image.
+GIVE_UP = 32      # A DIFF stops when it's this far past its best.
+
+
+def match_length(a, i, b, j):
+    """How many bytes from a[i] and b[j] on are the same."""
+    n, limit, step = 0, min(len(a) - i, len(b) - j), 4096
+    while n < limit:
+        s = min(step, limit - n)
+        if a[i + n : i + n + s] == b[j + n : j + n + s]:
+            n += s
+            step = min(step * 2, 65536)
+        elif s == 1:
+            break
+        else:
+            step = max(1, s // 8)
+    return n
+
+
+def diff_length(new, i, old, j):
+    """How far a DIFF from new[i]/old[j] is worth taking, bsdiff-style: as
+    long as more bytes match than don't."""
+    best = score = best_score = k = 0
+    limit = min(len(new) - i, len(old) - j)
+    while k < limit:
+        score += 1 if new[i + k] == old[j + k] else -1
+        k += 1
+        if score > best_score:
+            best, best_score = k, score
+        elif score < best_score - GIVE_UP:
+            break
+    return best
+
+
+def operations(old, new):
+    """[(op, offset, data or length)] building new from old."""
+    seeds = {}
+    for j in range(0, len(old) - SEED, STRIDE):
+        seeds.setdefault(old[j : j + SEED], j)
+
+    ops = []
+    i = added = 0  # added: where the bytes not yet covered start.
+    while i <= len(new) - SEED:
+        j = seeds.get(new[i : i + SEED])
+        if j is None:
+            i += 1
+            continue
+        length = match_length(new, i, old, j)
+        while i > added and j > 0 and new[i - 1] == old[j - 1]:
+            i, j, length = i - 1, j - 1, length + 1
+        if added < i:
+            ops.append((OP_ADD, 0, new[added:i]))
+        ops.append((OP_COPY, j, length))
+        i, j = i + length, j + length
+
+        length = diff_length(new, i, old, j)
+        if length:
+            ops.append((OP_DIFF, j, bytes((new[i + k] - old[j + k]) & 0xFF for k in range(length))))
+            i += length
+        added = i
+
+    if added < len(new):
+        ops.append((OP_ADD, 0, new[added:]))
+    return ops
+
+
+def encode(old, new, ops):
+    out = bytearray(HEADER.pack(DELTA_MAGIC, DELTA_VERSION, HEADER.size, len(old), len(new),
+                                hashlib.sha256(old).digest(), hashlib.sha256(new).digest()))
+    for op, offset, data in ops:
+        if op == OP_ADD:
+            out += struct.pack("<BI", op, len(data)) + data
+        elif op == OP_COPY:
+            out += struct.pack("<BII", op, offset, data)
+        else:
+            out += struct.pack("<BII", op, offset, len(data)) + data
+    out += bytes([OP_END])
+    return bytes(out)
+
+
+def apply(old, patch):
+    """What the counter does, to check the patch before it's sent."""
+    _, _, header_size, old_size, new_size, old_sha, new_sha = HEADER.unpack_from(patch)
+    assert old_size == len(old) and old_sha == hashlib.sha256(old).digest()
+    new, at = bytearray(), header_size
+    while patch[at] != OP_END:
+        op = patch[at]
+        if op == OP_ADD:
+            (length,) = struct.unpack_from("<I", patch, at + 1)
+            new += patch[at + 5 : at + 5 + length]
+            at += 5 + length
+            continue
+        offset, length = struct.unpack_from("<II", patch, at + 1)
+        at += 9
+        if op == OP_COPY:
+            new += old[offset : offset + length]
+        else:
+            new += bytes((a + b) & 0xFF for a, b in zip(old[offset : offset + length], patch[at : at + length]))
+            at += length
+    assert len(new) == new_size and hashlib.sha256(new).digest() == new_sha
+    return bytes(new)
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(description="Make a firmware patch for the counter's /update page.")
+    parser.add_argument("old", help="the image the counter is running")
+    parser.add_argument("new")
+    parser.add_argument("--output", help="default: NEW.delta.gz")
+    parser.add_argument("--upload", metavar="HOST", help="send it to the counter at HOST")
+    parser.add_argument("--link-kbps", type=float, default=400, help="for the time saved (default 400)")
+    args = parser.parse_args(argv[1:])
+
+    with open(args.old, "rb") as f:
+        old = f.read()
+    with open(args.new, "rb") as f:
+        new = f.read()
+
+    started = time.monotonic()
+    ops = operations(old, new)
+    patch = encode(old, new, ops)
+    if apply(old, patch) != new:
+        raise SystemExit("patch doesn't rebuild the new image")
+    compressed = compress(patch)
+    full = len(compress(new))
+    output = args.output or args.new + ".delta.gz"
+    with open(output, "wb") as f:
+        f.write(compressed)
+
+    counts = [sum(1 for op in ops if op[0] == kind) for kind in (OP_COPY, OP_DIFF, OP_ADD)]
+    print("%s: %d bytes in %.1f s (%d COPY, %d DIFF, %d ADD)" % (output, len(compressed), time.monotonic() - started,
+                                                                  *counts))
+    seconds = lambda size: size * 8 / (args.link_kbps * 1000)
+    print("Full image gzipped: %d bytes. Patch is %.1f%% of that: %.1f s instead of %.1f s at %g kbit/s." % (
+        full, 100.0 * len(compressed) / full, seconds(len(compressed)), seconds(full), args.link_kbps))
+
+    if args.upload:
+        answer, took = upload(args.upload, compressed, "firmware")
+        print("Upload: %s in %.1f s" % (answer, took))
+        return 0 if answer.startswith("200") else 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
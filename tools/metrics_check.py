@@ -0,0 +1,136 @@
+#!/usr/bin/env python3
+"""
+metrics_check.py
+
+Scrapes the counter's /metrics page (lib/digameMetrics) twice, checks it
+is well-formed Prometheus text, and prints what changed in between: frames
+per second from each sensor, checksum and read error rates, and loop time
+percentiles worked out from the histogram. Standard library only.
+
+    python3 tools/metrics_check.py [--host 192.168.4.1] [--interval 10]
+
+Exits non-zero if the page is malformed: samples without a TYPE, a
+histogram whose buckets go down or don't add up to its count, or counters
+that went backwards between the two scrapes.
+
+Copyright 2022, Digame Systems. All rights reserved.
+"""
+
+import argparse
+import re
+import sys
+import time
+import urllib.request
+
+SAMPLE = re.compile(r'^([a-zA-Z_:][a-zA-Z0-9_:]*)(\{[^}]*\})? (\S+)$')
+
+
+def scrape(url):
+    started = time.monotonic()
+    with urllib.request.urlopen(url, timeout=10) as response:
+        text = response.read().decode()
+    return text, time.monotonic() - started
+
+
+def parse(text, problems):
+    """Returns ({(name, labels): value}, {family: type})."""
+    samples, types = {}, {}
+    for line in text.splitlines():
+        if line.startswith("# TYPE "):
+            _, _, family, kind = line.split(" ", 3)
+            types[family] = kind
+            continue
+        if not line or line.startswith("#"):
+            continue
+        match = SAMPLE.match(line)
+        if not match:
+            problems.append("bad line: %r" % line)
+            continue
+        name, labels, value = match.group(1), match.group(2) or "", float(match.group(3))
+        family = re.sub(r"_(bucket|sum|count)$", "", name) if name not in types else name
+        if family not in types:
+            problems.append("no TYPE for %s" % name)
+        samples[(name, labels)] = value
+    return samples, types
+
+
+def buckets(samples, family):
+    """[(upper bound, cumulative count)] for a histogram, smallest first."""
+    found = []
+    for (name, labels), value in samples.items():
+        if name == family + "_bucket":
+            le = re.search(r'le="([^"]+)"', labels).group(1)
+            found.append((float("inf") if le == "+Inf" else float(le), value))
+    return sorted(found)
+
+
+def check_histograms(samples, types, problems):
+    for family, kind in types.items():
+        if kind != "histogram":
+            continue
+        counts = [c for _, c in buckets(samples, family)]
+        if any(b < a for a, b in zip(counts, counts[1:])):
+            problems.append("%s buckets go down" % family)
+        if not counts or counts[-1] != samples.get((family + "_count", ""), -1):
+            problems.append("%s +Inf bucket doesn't match its count" % family)
+
+
+def percentile(before, after, family, q):
+    """Upper bound of the bucket holding the q'th quantile of what was observed between scrapes."""
+    b0, b1 = dict(buckets(before, family)), buckets(after, family)
+    total = b1[-1][1] - b0.get(float("inf"), 0) if b1 else 0
+    if total <= 0:
+        return None
+    for bound, count in b1:
+        if count - b0.get(bound, 0) >= q * total:
+            return bound
+    return float("inf")
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(description="Check the counter's /metrics page.")
+    parser.add_argument("--host", default="192.168.4.1")
+    parser.add_argument("--port", type=int, default=80)
+    parser.add_argument("--interval", type=float, default=10, help="seconds between the two scrapes")
+    args = parser.parse_args(argv[1:])
+    url = "http://%s:%d/metrics" % (args.host, args.port)
+
+    problems = []
+    text, took = scrape(url)
+    first, types = parse(text, problems)
+    check_histograms(first, types, problems)
+    print("Scraped %d bytes, %d samples in %.0f ms." % (len(text), len(first), took * 1000))
+
+    time.sleep(args.interval)
+    text, _ = scrape(url)
+    second, types = parse(text, problems)
+    check_histograms(second, types, problems)
+
+    for key, value in second.items():
+        if types.get(key[0]) == "counter" and value < first.get(key, 0):
+            problems.append("%s%s went backwards" % key)
+
+    def rate(name, labels):
+        return (second.get((name, labels), 0) - first.get((name, labels), 0)) / args.interval
+
+    for sensor in ("1", "2"):
+        labels = '{sensor="%s"}' % sensor
+        print("Sensor %s: %6.1f frames/s  %5.2f checksum errors/s  %5.2f read errors/s  %5.2f missed/s" % (
+            sensor, rate("digame_lidar_frames_total", labels),
+            rate("digame_lidar_checksum_errors_total", labels), rate("digame_lidar_read_errors_total", labels),
+            rate("digame_lidar_frames_missed_total", labels)))
+
+    loops = rate("digame_loop_seconds_count", "")
+    if loops:
+        p50, p99 = (percentile(first, second, "digame_loop_seconds", q) for q in (0.5, 0.99))
+        mean = rate("digame_loop_seconds_sum", "") / loops
+        print("Loop: %.0f/s, mean %.2f ms, p50 <= %g ms, p99 <= %g ms" % (loops, mean * 1000, p50 * 1000, p99 * 1000))
+
+    for problem in problems:
+        print("PROBLEM: " + problem)
+    print("PASS" if not problems else "FAIL")
+    return 1 if problems else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -0,0 +1,154 @@
+#!/usr/bin/env python3
+"""
+mqtt_bench.py
+
+Watches what counters publish to an MQTT broker (lib/digameMQTT) and
+reports the event rate, gaps in the sequence numbers and repeats, per
+device. Talks plain MQTT 3.1.1 over a socket, so it needs nothing beyond
+the Python standard library -- just a broker, e.g. mosquitto:
+
+    mosquitto -v &
+    python3 tools/mqtt_bench.py [--host localhost] [--port 1883] [--interval 5]
+
+Set mqttBroker in include/credentials.h to the broker's address. Stop the
+broker for a while and start it again to watch the backlog drain: the
+counters keep logging while it's away and send everything once it's back,
+so gaps should stay at zero. A few repeats after a reconnect are expected
+(QoS 1 is at-least-once).
+
+Copyright 2022, Digame Systems. All rights reserved.
+"""
+
+import argparse
+import json
+import socket
+import struct
+import sys
+import time
+
+CONNECT, CONNACK, PUBLISH, SUBSCRIBE, SUBACK, PINGREQ, PINGRESP = 1, 2, 3, 8, 9, 12, 13
+
+
+def encode_length(n):
+    out = bytearray()
+    while True:
+        digit = n % 128
+        n //= 128
+        out.append(digit | (0x80 if n else 0))
+        if not n:
+            return bytes(out)
+
+
+def mqtt_string(s):
+    data = s.encode()
+    return struct.pack(">H", len(data)) + data
+
+
+def packet(kind, flags, body):
+    return bytes([(kind << 4) | flags]) + encode_length(len(body)) + body
+
+
+def read_packet(sock):
+    """Returns (first byte, body), or None if the broker closed the connection."""
+    first = sock.recv(1)
+    if not first:
+        return None
+    length, shift = 0, 0
+    while True:
+        b = sock.recv(1)
+        if not b:
+            return None
+        length |= (b[0] & 0x7F) << shift
+        shift += 7
+        if not b[0] & 0x80:
+            break
+    body = b""
+    while len(body) < length:
+        chunk = sock.recv(length - len(body))
+        if not chunk:
+            return None
+        body += chunk
+    return first[0], body
+
+
+class Device:
+    def __init__(self):
+        self.next_seq = None
+        self.events = 0
+        self.window = 0
+        self.gaps = 0
+        self.repeats = 0
+        self.counts = None
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(description="Measure what counters publish over MQTT.")
+    parser.add_argument("--host", default="localhost")
+    parser.add_argument("--port", type=int, default=1883)
+    parser.add_argument("--topic", default="digame/#", help="subscription filter")
+    parser.add_argument("--interval", type=float, default=5.0, help="seconds between reports")
+    args = parser.parse_args(argv[1:])
+
+    sock = socket.create_connection((args.host, args.port))
+    sock.sendall(packet(CONNECT, 0, mqtt_string("MQTT") + bytes([4, 0x02]) + struct.pack(">H", 60) +
+                        mqtt_string("digame-bench-%d" % int(time.time()))))
+    reply = read_packet(sock)
+    if not reply or reply[0] >> 4 != CONNACK or reply[1][1] != 0:
+        print("Broker refused the connection.")
+        return 1
+    sock.sendall(packet(SUBSCRIBE, 0x02, struct.pack(">H", 1) + mqtt_string(args.topic) + b"\x00"))
+    sock.settimeout(1.0)
+
+    devices = {}
+    started = last_report = last_ping = time.monotonic()
+
+    while True:
+        now = time.monotonic()
+        if now - last_ping > 30:
+            sock.sendall(packet(PINGREQ, 0, b""))
+            last_ping = now
+        if now - last_report >= args.interval:
+            elapsed = now - last_report
+            last_report = now
+            for name, d in sorted(devices.items()):
+                print("%7.1f s  %-40s %8.1f events/s  total %d  gaps %d  repeats %d  counts %s" %
+                      (now - started, name, d.window / elapsed, d.events, d.gaps, d.repeats, d.counts))
+                d.window = 0
+            sys.stdout.flush()
+
+        try:
+            received = read_packet(sock)
+        except socket.timeout:
+            continue
+        if received is None:
+            print("Broker closed the connection.")
+            return 1
+
+        first, body = received
+        if first >> 4 != PUBLISH:
+            continue
+        topic_length = struct.unpack(">H", body[:2])[0]
+        topic = body[2:2 + topic_length].decode(errors="replace")
+        payload = body[2 + topic_length + (2 if first & 0x06 else 0):]
+
+        device, _, leaf = topic.rpartition("/")
+        d = devices.setdefault(device, Device())
+
+        if leaf == "event":
+            seq = json.loads(payload)["seq"]
+            if d.next_seq is not None and seq < d.next_seq:
+                d.repeats += 1
+                continue
+            if d.next_seq is not None and seq > d.next_seq:
+                d.gaps += seq - d.next_seq
+            d.next_seq = seq + 1
+            d.events += 1
+            d.window += 1
+        elif leaf == "counts":
+            d.counts = payload.decode(errors="replace")
+        elif leaf == "status":
+            print("%7.1f s  %s is %s" % (now - started, device, payload.decode(errors="replace")))
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
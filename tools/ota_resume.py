@@ -0,0 +1,169 @@
+#!/usr/bin/env python3
+"""
+ota_resume.py
+
+Sends a firmware image to the counter in chunks that survive the link
+dropping (lib/digameResumableOTA). After a drop it asks the counter how far
+it got and carries on from there. If the counter rebooted in between, the
+same image still carries on where it left off.
+
+    python3 tools/ota_resume.py .pio/build/esp32dev/firmware.bin [--host 192.168.4.1]
+
+The image has to be the plain .bin. Each chunk goes with its CRC-32, and
+the counter checks the whole image's SHA-256 before booting it.
+
+To try the resuming out, --interrupt cuts that fraction of chunks off part
+way through, as a dropped link would. --corrupt flips a bit in that
+fraction of chunks, which the counter should refuse. The upload should
+still finish and boot. The summary says how much had to be sent again.
+
+Standard library only. Copyright 2022, Digame Systems. All rights reserved.
+"""
+
+import argparse
+import base64
+import hashlib
+import http.client
+import json
+import random
+import sys
+import time
+import urllib.parse
+import zlib
+
+
+class Counter:
+    def __init__(self, host, port, user, password, timeout):
+        self.host, self.port, self.timeout = host, port, timeout
+        self.auth = "Basic " + base64.b64encode(("%s:%s" % (user, password)).encode()).decode()
+
+    def connect(self):
+        return http.client.HTTPConnection(self.host, self.port, timeout=self.timeout)
+
+    def request(self, method, path, body=None, content_type=None):
+        """(status, state) for one request."""
+        headers = {"Authorization": self.auth}
+        if content_type:
+            headers["Content-Type"] = content_type
+        connection = self.connect()
+        try:
+            connection.request(method, path, body=body, headers=headers)
+            response = connection.getresponse()
+            text = response.read().decode(errors="replace")
+        finally:
+            connection.close()
+        try:
+            return response.status, json.loads(text)
+        except ValueError:
+            return response.status, {"error": text.strip()}
+
+    def start(self, size, chunk, sha256):
+        form = urllib.parse.urlencode({"size": size, "chunk": chunk, "sha256": sha256})
+        return self.request("POST", "/update/resume", form, "application/x-www-form-urlencoded")
+
+    def send_chunk(self, offset, data, crc):
+        return self.request("POST", "/update/chunk?offset=%d&crc=%08x" % (offset, crc), data,
+                            "application/octet-stream")
+
+    def cut_off(self, offset, data, crc):
+        """Start sending a chunk and hang up part way, like a dropped link."""
+        connection = self.connect()
+        connection.putrequest("POST", "/update/chunk?offset=%d&crc=%08x" % (offset, crc))
+        connection.putheader("Authorization", self.auth)
+        connection.putheader("Content-Type", "application/octet-stream")
+        connection.putheader("Content-Length", str(len(data)))
+        connection.endheaders()
+        part = random.randrange(len(data))
+        connection.send(data[:part])
+        connection.close()
+        return part
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(description="Resumable chunked firmware update for the counter.")
+    parser.add_argument("image")
+    parser.add_argument("--host", default="192.168.4.1")
+    parser.add_argument("--port", type=int, default=80)
+    parser.add_argument("--user", default="admin")
+    parser.add_argument("--password", default="admin")
+    parser.add_argument("--chunk", type=int, default=16384, help="bytes, a multiple of 4096 up to 65536")
+    parser.add_argument("--timeout", type=float, default=20)
+    parser.add_argument("--give-up", type=float, default=600, help="seconds without progress before giving up")
+    parser.add_argument("--interrupt", type=float, default=0, help="fraction of chunks to cut off part way")
+    parser.add_argument("--corrupt", type=float, default=0, help="fraction of chunks to send with a bit flipped")
+    parser.add_argument("--no-finish", action="store_true", help="leave it uploaded but not booted")
+    args = parser.parse_args(argv[1:])
+
+    with open(args.image, "rb") as f:
+        image = f.read()
+    counter = Counter(args.host, args.port, args.user, args.password, args.timeout)
+    sha256 = hashlib.sha256(image).hexdigest()
+
+    started = time.monotonic()
+    sent = cut = corrupted = refused = drops = failures = 0
+    offset, last_progress, started_session = None, time.monotonic(), False
+
+    while offset is None or offset < len(image):
+        if time.monotonic() - last_progress > args.give_up:
+            print("No progress for %.0f s. Run it again to carry on." % args.give_up)
+            return 1
+        try:
+            if offset is None:  # Find out where it's up to, starting the update if need be.
+                status, state = counter.start(len(image), args.chunk, sha256)
+                if status != 200:
+                    print("Counter refused the update: %s" % state.get("error"))
+                    return 1
+                offset = state["offset"]
+                if not started_session:
+                    print("%s at %d of %d bytes" % ("Carrying on" if offset else "Starting", offset, len(image)))
+                    started_session = True
+                continue
+
+            data = image[offset : offset + args.chunk]
+            crc = zlib.crc32(data)
+            if random.random() < args.interrupt:
+                sent += counter.cut_off(offset, data, crc)
+                cut += 1
+                offset = None  # Ask again, as after a real drop.
+                continue
+            if random.random() < args.corrupt:
+                flipped = bytearray(data)
+                flipped[random.randrange(len(flipped))] ^= 1 << random.randrange(8)
+                data = bytes(flipped)
+                corrupted += 1
+
+            status, state = counter.send_chunk(offset, data, crc)
+            sent += len(data)
+            if status != 200:
+                refused += 1
+                print("  chunk at %d refused: %s" % (offset, state.get("error")))
+            if state.get("offset", offset) > offset:
+                last_progress, failures = time.monotonic(), 0
+            offset = state["offset"] if state.get("active") else None
+            sys.stdout.write("\r  %d%%" % (100 * (offset or 0) // len(image)))
+            sys.stdout.flush()
+        except (OSError, http.client.HTTPException) as e:
+            drops += 1
+            failures += 1
+            print("\n  link trouble (%s), carrying on" % e)
+            time.sleep(min(2 ** failures, 15))
+            offset = None
+
+    took = time.monotonic() - started
+    print("\rSent %d bytes for a %d byte image (%.2fx) in %.1f s, %.0f KB/s." % (
+        sent, len(image), sent / len(image), took, len(image) / took / 1024))
+    print("%d cut off, %d corrupted, %d refused, %d link drops." % (cut, corrupted, refused, drops))
+
+    if args.no_finish:
+        print("Not finishing (--no-finish). Run again without it to boot the new image.")
+        return 0
+    status, state = counter.request("POST", "/update/finish")
+    if status != 200:
+        print("Finish failed: %s" % state.get("error"))
+        return 1
+    print("Image checked. The counter is restarting into it.")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
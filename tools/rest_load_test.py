@@ -0,0 +1,155 @@
+#!/usr/bin/env python3
+"""
+rest_load_test.py
+
+Load test for the counter's JSON API (/api/counts, /api/events,
+/api/config, /api/health). Several threads request the endpoints as fast
+as they can for a while. Then the test checks that the counter kept up:
+
+  - The LIDAR frame rate under load is compared with the rate before it.
+    A web server holding up the main loop would show up here.
+  - Every event logged during the test is read back, page by page. The
+    sequence numbers must have no gaps, and each direction's running count
+    must go up by exactly one per event.
+  - The counts from /api/counts must match the newest events.
+
+Walk through the counter while it runs (or use a test jig) so there are
+events to check. --expect N also checks exactly N events were logged.
+Standard library only.
+
+    python3 tools/rest_load_test.py [--host 192.168.4.1] [--threads 4] [--seconds 60] [--expect N]
+
+Copyright 2022, Digame Systems. All rights reserved.
+"""
+
+import argparse
+import http.client
+import json
+import sys
+import threading
+import time
+
+ENDPOINTS = ["/api/counts", "/api/health", "/api/config", "/api/events?limit=50"]
+
+
+def get(host, port, path, connection=None):
+    connection = connection or http.client.HTTPConnection(host, port, timeout=10)
+    connection.request("GET", path)
+    response = connection.getresponse()
+    body = response.read()
+    if response.status != 200:
+        raise RuntimeError("%s: HTTP %d" % (path, response.status))
+    return json.loads(body), connection
+
+
+def read_events(host, port, start):
+    """All events from seq `start` on, following the pages."""
+    events, seq = [], start
+    while True:
+        page, _ = get(host, port, "/api/events?from=%d&limit=200" % seq)
+        events += page["events"]
+        if not page["events"] or page["next"] > page["newest"]:
+            return events, page
+        seq = page["next"]
+
+
+def frame_rate(host, port, seconds):
+    first, _ = get(host, port, "/api/health")
+    time.sleep(seconds)
+    last, _ = get(host, port, "/api/health")
+    return (last["lidarFrames"] - first["lidarFrames"]) * 1000.0 / max(1, last["uptime"] - first["uptime"])
+
+
+class Worker(threading.Thread):
+    def __init__(self, host, port, deadline, index):
+        super().__init__(daemon=True)
+        self.host, self.port, self.deadline, self.index = host, port, deadline, index
+        self.latencies = []
+        self.errors = 0
+
+    def run(self):
+        connection = None
+        i = self.index
+        while time.monotonic() < self.deadline:
+            path = ENDPOINTS[i % len(ENDPOINTS)]
+            i += 1
+            started = time.monotonic()
+            try:
+                _, connection = get(self.host, self.port, path, connection)
+                self.latencies.append(time.monotonic() - started)
+            except (OSError, RuntimeError, ValueError, http.client.HTTPException):
+                self.errors += 1
+                connection = None
+                time.sleep(0.1)
+
+
+def check_events(events, counts):
+    problems = []
+    last = {}
+    for previous, event in zip(events, events[1:]):
+        if event["seq"] != previous["seq"] + 1:
+            problems.append("gap: seq %d follows %d" % (event["seq"], previous["seq"]))
+    for event in events:
+        kind = event["eventType"]
+        if kind in last and event["count"] != last[kind] + 1:
+            problems.append("%s count went %d -> %d at seq %d" % (kind, last[kind], event["count"], event["seq"]))
+        last[kind] = event["count"]
+    for kind in ("inbound", "outbound"):
+        if kind in last and counts[kind] != last[kind]:
+            problems.append("/api/counts says %s %d, newest event says %d" % (kind, counts[kind], last[kind]))
+    return problems
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(description="Load test the counter's JSON API.")
+    parser.add_argument("--host", default="192.168.4.1")
+    parser.add_argument("--port", type=int, default=80)
+    parser.add_argument("--threads", type=int, default=4)
+    parser.add_argument("--seconds", type=float, default=60)
+    parser.add_argument("--expect", type=int, help="number of events that should be logged during the test")
+    args = parser.parse_args(argv[1:])
+
+    _, page = read_events(args.host, args.port, 1 << 31)
+    start_seq = page["newest"] + 1
+    idle_rate = frame_rate(args.host, args.port, 3)
+    print("Idle: %.1f frames/s. Events from seq %d." % (idle_rate, start_seq))
+
+    deadline = time.monotonic() + args.seconds
+    workers = [Worker(args.host, args.port, deadline, i) for i in range(args.threads)]
+    for w in workers:
+        w.start()
+    time.sleep(min(5, args.seconds / 2))
+    load_rate = frame_rate(args.host, args.port, min(5, args.seconds / 4))
+    for w in workers:
+        w.join()
+
+    latencies = sorted(l for w in workers for l in w.latencies)
+    errors = sum(w.errors for w in workers)
+    if latencies:
+        print("%d requests, %.1f/s, %d errors. Latency p50 %.0f ms, p99 %.0f ms, max %.0f ms." %
+              (len(latencies), len(latencies) / args.seconds, errors, 1000 * latencies[len(latencies) // 2],
+               1000 * latencies[int(len(latencies) * 0.99)], 1000 * latencies[-1]))
+    print("Under load: %.1f frames/s (%.0f%% of idle)." % (load_rate, 100 * load_rate / max(idle_rate, 0.001)))
+
+    time.sleep(6)  # Let the log flush what arrived at the end.
+    for attempt in range(3):  # Someone walking through between the reads isn't a failure.
+        events, _ = read_events(args.host, args.port, start_seq)
+        counts, _ = get(args.host, args.port, "/api/counts")
+        problems = check_events(events, counts)
+        if not problems:
+            break
+        time.sleep(6)
+    if args.expect is not None and len(events) != args.expect:
+        problems.append("%d events logged, expected %d" % (len(events), args.expect))
+
+    print("%d events logged during the test. Counts now in %d, out %d." %
+          (len(events), counts["inbound"], counts["outbound"]))
+    for p in problems:
+        print("FAIL: " + p)
+    if not problems:
+        print("PASS")
+    return 1 if problems else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -0,0 +1,97 @@
+#!/usr/bin/env python3
+"""
+sntp_server.py
+
+A stand-in time server for testing the counter's clock (lib/digameTime).
+Answers SNTP requests from this computer's clock, optionally made worse:
+
+    python3 tools/sntp_server.py [--port 123] [--drift-ppm 0] [--offset 0]
+                                 [--jitter-ms 0] [--drop 0]
+
+--drift-ppm makes the time served run fast (or, negative, slow) by that
+much. To the counter that looks the same as its own crystal being off, so
+you can check it learns the drift: after its first ten minutes or so,
+`digame_control.py ... time` should show drift_ppb near -1000 times the
+value given here, and event times should track the served clock between
+syncs. --offset starts the served clock that many seconds away from ours,
+which should show up as a step. --jitter-ms holds each reply back by a
+random time up to that long, and --drop ignores that fraction of
+requests, to exercise the round-trip allowance and the retries.
+
+Point the counter at it with ntpServer in include/credentials.h. Port 123
+needs root; the counter always asks on 123.
+
+Standard library only. Copyright 2022, Digame Systems. All rights reserved.
+"""
+
+import argparse
+import random
+import socket
+import struct
+import sys
+import threading
+import time
+
+NTP_UNIX_OFFSET = 2208988800
+
+
+def to_ntp(t):
+    seconds = int(t)
+    return ((seconds + NTP_UNIX_OFFSET) << 32) | int((t - seconds) * (1 << 32))
+
+
+class ServedClock:
+    def __init__(self, drift_ppm, offset):
+        self.start = time.time()
+        self.drift = drift_ppm * 1e-6
+        self.offset = offset
+
+    def now(self):
+        t = time.time()
+        return t + self.offset + (t - self.start) * self.drift
+
+
+def reply(request, received, clock):
+    transmit = struct.unpack_from(">Q", request, 40)[0]  # Becomes the originate time.
+    header = struct.pack(">BBbbII4s", 0x24, 2, 4, -20, 0, 0, b"LOCL")  # v4, server, stratum 2.
+    return header + struct.pack(">QQQQ", to_ntp(received), transmit, to_ntp(received), to_ntp(clock.now()))
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(description="Stand-in SNTP server with adjustable faults.")
+    parser.add_argument("--port", type=int, default=123)
+    parser.add_argument("--drift-ppm", type=float, default=0)
+    parser.add_argument("--offset", type=float, default=0, help="seconds")
+    parser.add_argument("--jitter-ms", type=float, default=0)
+    parser.add_argument("--drop", type=float, default=0, help="fraction of requests to ignore")
+    args = parser.parse_args(argv[1:])
+
+    clock = ServedClock(args.drift_ppm, args.offset)
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind(("", args.port))
+    print("Serving on UDP %d: drift %+g ppm, offset %+g s, jitter %g ms, drop %g" % (
+        args.port, args.drift_ppm, args.offset, args.jitter_ms, args.drop))
+    sys.stdout.flush()
+
+    def answer(data, address, received):
+        time.sleep(random.uniform(0, args.jitter_ms / 1000))
+        sock.sendto(reply(data, received, clock), address)
+
+    while True:
+        data, address = sock.recvfrom(512)
+        received = clock.now()
+        if len(data) < 48 or (data[0] & 0x07) != 3:
+            continue
+        if random.random() < args.drop:
+            print("%s: dropped" % address[0])
+            continue
+        print("%s: %.3f" % (address[0], received))
+        sys.stdout.flush()
+        if args.jitter_ms:
+            threading.Thread(target=answer, args=(data, address, received), daemon=True).start()
+        else:
+            answer(data, address, received)
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -0,0 +1,117 @@
+#!/usr/bin/env python3
+"""
+upload_stub_server.py
+
+Stand-in for the event server, for checking the uploader (lib/digameUploader)
+on a bench. Accepts the batched JSON POSTs, drops repeated sequence numbers,
+reports events/second and, optionally, simulates an outage so you can watch
+the backlog drain afterwards.
+
+    python3 tools/upload_stub_server.py [--port 8080] [--outage START DURATION]
+
+Point the counter's serverURL at http://<this host>:<port>/. During the
+outage window (seconds after startup) every POST gets a 503. Once it ends,
+the server reports how long the backlog took to drain, i.e. until a post
+arrives that isn't a full batch.
+
+Copyright 2022, Digame Systems. All rights reserved.
+"""
+
+import argparse
+import json
+import sys
+import threading
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+
+class Stats:
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.seen = set()
+        self.events = 0
+        self.duplicates = 0
+        self.posts = 0
+        self.rejected = 0
+        self.window_events = 0
+        self.largest_batch = 0
+        self.started = time.monotonic()
+        self.outage_end = None
+        self.recovered = False
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"  # Keep-alive, like the real server.
+    stats = None
+    outage = None
+
+    def do_POST(self):
+        body = self.rfile.read(int(self.headers.get("Content-Length", 0)))
+        stats = self.stats
+        elapsed = time.monotonic() - stats.started
+
+        if self.outage and self.outage[0] <= elapsed < self.outage[0] + self.outage[1]:
+            with stats.lock:
+                stats.rejected += 1
+            self.reply(503)
+            return
+
+        try:
+            events = json.loads(body)["events"]
+        except (ValueError, KeyError):
+            self.reply(400)
+            return
+
+        with stats.lock:
+            stats.posts += 1
+            for event in events:
+                key = (self.client_address[0], event["seq"])
+                if key in stats.seen:
+                    stats.duplicates += 1
+                else:
+                    stats.seen.add(key)
+                    stats.events += 1
+                    stats.window_events += 1
+            stats.largest_batch = max(stats.largest_batch, len(events))
+            if (self.outage and not stats.recovered and elapsed >= sum(self.outage) and
+                    len(events) < stats.largest_batch):
+                stats.recovered = True
+                print("Backlog cleared %.1f s after the outage ended." % (elapsed - sum(self.outage)))
+        self.reply(200)
+
+    def reply(self, code):
+        self.send_response(code)
+        self.send_header("Content-Length", "0")
+        self.end_headers()
+
+    def log_message(self, *args):
+        pass
+
+
+def report(stats, interval):
+    while True:
+        time.sleep(interval)
+        with stats.lock:
+            rate = stats.window_events / interval
+            stats.window_events = 0
+            print("%7.1f s  %8.1f events/s  total %d  posts %d  rejected %d  duplicates %d" %
+                  (time.monotonic() - stats.started, rate, stats.events, stats.posts, stats.rejected,
+                   stats.duplicates))
+        sys.stdout.flush()
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(description="Stub server for the event uploader.")
+    parser.add_argument("--port", type=int, default=8080)
+    parser.add_argument("--outage", nargs=2, type=float, metavar=("START", "DURATION"))
+    parser.add_argument("--interval", type=float, default=5.0, help="seconds between reports")
+    args = parser.parse_args(argv[1:])
+
+    Handler.stats = Stats()
+    Handler.outage = args.outage
+    threading.Thread(target=report, args=(Handler.stats, args.interval), daemon=True).start()
+    ThreadingHTTPServer(("", args.port), Handler).serve_forever()
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))